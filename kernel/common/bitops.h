@@ -52,6 +52,12 @@ static inline int ctzl(unsigned long x)
 	return x == 0 ? sizeof(x) * BITS_PER_BYTE : __builtin_ctzl(x);
 }
 
+/* return the number of zero bits above the highest set bit */
+static inline int clzl(unsigned long x)
+{
+	return x == 0 ? sizeof(x) * BITS_PER_BYTE : __builtin_clzl(x);
+}
+
 static inline int find_next_bit_helper(unsigned long *p, unsigned long size,
 				       unsigned long start, int invert)
 {
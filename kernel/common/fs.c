@@ -30,10 +30,15 @@ int sys_fs_load_cpio(u64 vaddr)
 		return -ENOMEM;
 	}
 	len = ROUND_UP(binary_cpio_bin_size, PAGE_SIZE);
-	pmo_init(cpio_pmo, PMO_DATA, len, 0);
+	ret = pmo_init(cpio_pmo, PMO_DATA, len, 0);
+	if (ret < 0) {
+		obj_free(cpio_pmo);
+		return ret;
+	}
 
 	cpio_pmo_cap = cap_alloc(current_process, cpio_pmo, 0);
 	if (cpio_pmo_cap < 0) {
+		pmo_deinit(cpio_pmo);
 		obj_free(cpio_pmo);
 		return -ENOMEM;
 	}
@@ -41,8 +46,7 @@ int sys_fs_load_cpio(u64 vaddr)
 	vmspace = obj_get(current_process, VMSPACE_OBJ_ID, TYPE_VMSPACE);
 
 	ret = vmspace_map_range(vmspace, vaddr, len, VMR_READ, cpio_pmo);
-	memcpy((void *)phys_to_virt(cpio_pmo->start),
-	       &binary_cpio_bin_start, binary_cpio_bin_size);
+	pmo_write(cpio_pmo, 0, &binary_cpio_bin_start, binary_cpio_bin_size);
 
 	obj_put(vmspace);
 	return ret;
@@ -24,3 +24,6 @@ void kfree(void *ptr);
 /* return vaddr of (1 << order) continous free physical pages */
 void *get_pages(int order);
 void free_pages(void *addr);
+
+/* migrate movable pages to rebuild free chunks of @order */
+u64 compact_memory(u64 order);
@@ -14,34 +14,44 @@
 #include <common/kprint.h>
 #include <common/lock.h>
 #include <common/macro.h>
+#include <common/percpu.h>
 #include <common/smp.h>
 #include <common/sync.h>
 #include <common/types.h>
 
-struct lock big_kernel_lock;
+struct mcs_lock big_kernel_lock;
+/*
+ * Whether each CPU holds the big kernel lock is in its per-CPU area. The
+ * scheduling paths run without it, so returning to the user mode only
+ * releases it if taken.
+ */
 
+#ifdef LOCKSTAT
+int __lock_init(struct lock *lock, struct lock_class *class) {
+#else
 int lock_init(struct lock *lock) {
+#endif
     BUG_ON(!lock);
     /* Initialize ticket lock */
     lock->owner = 0;
     lock->next = 0;
+#ifdef LOCKSTAT
+    lockstat_init(&lock->stat, class);
+#endif
     return 0;
 }
 
-/**
- * Lock the ticket lock
- * This function will block until the lock is held
- */
-void lock(struct lock *lock) {
+static inline void ticket_lock(struct lock *lock) {
     u32 lockval = 0, newval = 0, ret = 0;
 
-    BUG_ON(!lock);
-
     /**
      * The following asm code means:
      *
      * lock->next = fetch_and_add(1);
-     * while(lock->next != lock->owner);
+     * while(lock->next != lock->owner) wfe;
+     *
+     * The exclusive load of owner arms the monitor of the CPU, so the store
+     * of the unlock wakes the wfe up.
      */
     asm volatile(
         "       prfm    pstl1strm, %3\n"
@@ -49,22 +59,23 @@ void lock(struct lock *lock) {
         "       add     %w1, %w0, #0x1\n"
         "       stxr    %w2, %w1, %3\n"
         "       cbnz    %w2, 1b\n"
-        "2:     ldar    %w2, %4\n"
+        "       ldar    %w2, %4\n"
+        "       cmp     %w0, %w2\n"
+        "       b.eq    3f\n"
+        "       sevl\n"
+        "2:     wfe\n"
+        "       ldaxr   %w2, %4\n"
         "       cmp     %w0, %w2\n"
         "       b.ne    2b\n"
+        "3:\n"
         : "=&r"(lockval), "=&r"(newval), "=&r"(ret), "+Q"(lock->next)
         : "Q"(lock->owner)
         : "memory");
 }
 
-/**
- * Try to lock the ticket lock
- * Return 0 if succeed, -1 otherwise
- */
-int try_lock(struct lock *lock) {
+static inline int ticket_try_lock(struct lock *lock) {
     u32 lockval = 0, newval = 0, ret = 0, ownerval = 0;
 
-    BUG_ON(!lock);
     asm volatile(
         "       prfm    pstl1strm, %4\n"
         "       ldaxr   %w0, %4\n"
@@ -86,11 +97,50 @@ int try_lock(struct lock *lock) {
     return ret;
 }
 
+/**
+ * Lock the ticket lock
+ * This function will block until the lock is held
+ */
+void lock(struct lock *lock) {
+#ifdef LOCKSTAT
+    u64 start;
+    bool contended;
+#endif
+
+    BUG_ON(!lock);
+#ifdef LOCKSTAT
+    start = lockstat_now();
+    contended = ticket_try_lock(lock) != 0;
+    if (contended) ticket_lock(lock);
+    lockstat_acquired(&lock->stat, start, contended);
+#else
+    ticket_lock(lock);
+#endif
+}
+
+/**
+ * Try to lock the ticket lock
+ * Return 0 if succeed, -1 otherwise
+ */
+int try_lock(struct lock *lock) {
+    int ret;
+
+    BUG_ON(!lock);
+    ret = ticket_try_lock(lock);
+#ifdef LOCKSTAT
+    if (ret == 0) lockstat_acquired(&lock->stat, lockstat_now(), false);
+#endif
+    return ret;
+}
+
 /**
  * Unlock the ticket lock
  */
 void unlock(struct lock *lock) {
     BUG_ON(!lock);
+#ifdef LOCKSTAT
+    lockstat_released(&lock->stat);
+#endif
     asm volatile("dmb ish");
 
     /**
@@ -111,12 +161,197 @@ int is_locked(struct lock *lock) {
     return lock->owner < lock->next ? 1 : 0;
 }
 
+/*
+ * Wait with wfe until *ptr != val and return the new value, with acquire
+ * semantics. The exclusive load arms the monitor of the CPU: a store to the
+ * location from another CPU clears it, which wakes the wfe up.
+ */
+static inline u32 wait_while_equal_32(volatile u32 *ptr, u32 val) {
+    u32 cur;
+
+    asm volatile(
+        "       sevl\n"
+        "1:     wfe\n"
+        "       ldaxr   %w0, %1\n"
+        "       cmp     %w0, %w2\n"
+        "       b.eq    1b\n"
+        : "=&r"(cur)
+        : "Q"(*ptr), "r"(val)
+        : "memory");
+    return cur;
+}
+
+static inline void store_release_32(volatile u32 *ptr, u32 val) {
+    asm volatile("stlr %w1, %0" : "=Q"(*ptr) : "r"(val) : "memory");
+}
+
+/*
+ * A node is only used while its CPU waits for a lock, and the kernel runs
+ * with the interrupts masked, so a CPU waits for one lock at a time and
+ * needs one node.
+ */
+struct mcs_node {
+    /* CPU id + 1 of the next waiter, 0 if none yet */
+    volatile u32 next;
+    /* set until the previous waiter hands the head of the queue over */
+    volatile u32 wait;
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct mcs_node mcs_nodes[PLAT_CPU_NUM];
+
+#ifdef LOCKSTAT
+int __mcs_lock_init(struct mcs_lock *lock, struct lock_class *class) {
+#else
+int mcs_lock_init(struct mcs_lock *lock) {
+#endif
+    BUG_ON(!lock);
+    lock->locked = 0;
+    lock->tail = 0;
+#ifdef LOCKSTAT
+    lockstat_init(&lock->stat, class);
+#endif
+    return 0;
+}
+
+/*
+ * The waiter at the head of the queue spins on locked, all the other ones on
+ * their own node. Once it holds the lock, the head hands the head of the
+ * queue over to the next waiter, so the node is free again when
+ * mcs_lock returns.
+ */
+void mcs_lock(struct mcs_lock *lock) {
+    u32 cpu = smp_get_cpu_id();
+    struct mcs_node *node = &mcs_nodes[cpu];
+    u32 prev, next;
+#ifdef LOCKSTAT
+    u64 start = lockstat_now();
+#endif
+
+    BUG_ON(!lock);
+    /* fast path: nobody holds or waits for the lock */
+    if (lock->tail == 0 &&
+        atomic_compare_exchange_32(&lock->locked, 0, 1) == 0) {
+        COMPILER_BARRIER();
+#ifdef LOCKSTAT
+        lockstat_acquired(&lock->stat, start, false);
+#endif
+        return;
+    }
+
+    node->next = 0;
+    node->wait = 1;
+    /* the exchange has release semantics: the node is ready before */
+    prev = atomic_exchange_32(&lock->tail, cpu + 1);
+    if (prev) {
+        mcs_nodes[prev - 1].next = cpu + 1;
+        wait_while_equal_32(&node->wait, 1);
+    }
+
+    while (atomic_compare_exchange_32(&lock->locked, 0, 1) != 0)
+        wait_while_equal_32(&lock->locked, 1);
+
+    if (atomic_compare_exchange_32(&lock->tail, cpu + 1, 0) != cpu + 1) {
+        /* a waiter is queued behind: it may still be linking itself */
+        next = wait_while_equal_32(&node->next, 0);
+        store_release_32(&mcs_nodes[next - 1].wait, 0);
+    }
+    COMPILER_BARRIER();
+#ifdef LOCKSTAT
+    lockstat_acquired(&lock->stat, start, true);
+#endif
+}
+
+/* Return 0 if succeed, -1 otherwise */
+int mcs_try_lock(struct mcs_lock *lock) {
+    BUG_ON(!lock);
+    if (lock->tail != 0 ||
+        atomic_compare_exchange_32(&lock->locked, 0, 1) != 0)
+        return -1;
+    COMPILER_BARRIER();
+#ifdef LOCKSTAT
+    lockstat_acquired(&lock->stat, lockstat_now(), false);
+#endif
+    return 0;
+}
+
+void mcs_unlock(struct mcs_lock *lock) {
+    BUG_ON(!lock);
+#ifdef LOCKSTAT
+    lockstat_released(&lock->stat);
+#endif
+    store_release_32(&lock->locked, 0);
+}
+
+int mcs_is_locked(struct mcs_lock *lock) {
+    return lock->locked ? 1 : 0;
+}
+
+int rwlock_init(struct rwlock *rwlock) {
+    BUG_ON(!rwlock);
+    rwlock->cnt = 0;
+    return 0;
+}
+
+void read_lock(struct rwlock *rwlock) {
+    u32 cnt;
+
+    BUG_ON(!rwlock);
+    for (;;) {
+        cnt = rwlock->cnt;
+        if (cnt & (RW_WRITER | RW_WRITER_WAITING)) {
+            wait_while_equal_32(&rwlock->cnt, cnt);
+            continue;
+        }
+        if (atomic_compare_exchange_32(&rwlock->cnt, cnt, cnt + 1) == cnt)
+            break;
+    }
+    COMPILER_BARRIER();
+}
+
+void read_unlock(struct rwlock *rwlock) {
+    BUG_ON(!rwlock);
+    COMPILER_BARRIER();
+    atomic_fetch_sub_32(&rwlock->cnt, 1);
+}
+
+/*
+ * A writer first announces itself with RW_WRITER_WAITING, then waits for
+ * the readers to drain. Several waiting writers share the bit: the one which
+ * gets the lock clears it and the other ones set it again.
+ */
+void write_lock(struct rwlock *rwlock) {
+    u32 cnt;
+
+    BUG_ON(!rwlock);
+    for (;;) {
+        cnt = rwlock->cnt;
+        if ((cnt & ~RW_WRITER_WAITING) == 0) {
+            if (atomic_compare_exchange_32(&rwlock->cnt, cnt, RW_WRITER) ==
+                cnt)
+                break;
+            continue;
+        }
+        if (!(cnt & RW_WRITER_WAITING)) {
+            atomic_compare_exchange_32(&rwlock->cnt, cnt,
+                                       cnt | RW_WRITER_WAITING);
+            continue;
+        }
+        wait_while_equal_32(&rwlock->cnt, cnt);
+    }
+    COMPILER_BARRIER();
+}
+
+void write_unlock(struct rwlock *rwlock) {
+    BUG_ON(!rwlock);
+    store_release_32(&rwlock->cnt, 0);
+}
+
 /**
  * 	Lab4
  * 	Initialization of the big kernel lock
  */
 void kernel_lock_init(void) {
-    lock_init(&big_kernel_lock);
+    mcs_lock_init(&big_kernel_lock);
 }
 
 /**
@@ -124,7 +359,8 @@ void kernel_lock_init(void) {
  * 	Acquire the big kernel lock
  */
 void lock_kernel(void) {
-    lock(&big_kernel_lock);
+    mcs_lock(&big_kernel_lock);
+    this_cpu_write(kernel_lock_held, true);
 }
 
 /**
@@ -132,5 +368,22 @@ void lock_kernel(void) {
  * 	Release the big kernel lock
  */
 void unlock_kernel(void) {
-    unlock(&big_kernel_lock);
+    this_cpu_write(kernel_lock_held, false);
+    mcs_unlock(&big_kernel_lock);
+}
+
+/*
+ * Take the big kernel lock on a path which may already hold it, such as a
+ * page fault, which can come from the user mode or from a syscall.
+ */
+void lock_kernel_if_not_held(void) {
+    if (!this_cpu_read(kernel_lock_held)) lock_kernel();
+}
+
+/*
+ * Release the big kernel lock on the way back to the user mode, if the
+ * exception handler took it.
+ */
+void unlock_kernel_if_held(void) {
+    if (this_cpu_read(kernel_lock_held)) unlock_kernel();
 }
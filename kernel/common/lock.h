@@ -13,6 +13,7 @@
 #pragma once
 
 #include <common/types.h>
+#include <common/lockstat.h>
 
 struct lock {
 	volatile u32 owner;
@@ -20,16 +21,96 @@ struct lock {
 
 	volatile u32 next;
 	char pad1[pad_to_cache_line(sizeof(u32))];
+#ifdef LOCKSTAT
+	struct lockstat stat;
+#endif
 } __attribute__ ((aligned(CACHELINE_SZ)));
 
+#ifdef LOCKSTAT
+/* Each place initializing locks defines the class of its locks */
+int __lock_init(struct lock *lock, struct lock_class *class);
+#define lock_init(lock) ({						\
+	DEFINE_LOCK_CLASS(__lock_class, lock);				\
+	__lock_init(lock, &__lock_class);				\
+})
+#else
 int lock_init(struct lock *lock);
+#endif
 void lock(struct lock *lock);
 int try_lock(struct lock *lock);
 void unlock(struct lock *lock);
 int is_locked(struct lock *lock);
 
-/* Global locks */
-extern struct lock big_kernel_lock;
+/*
+ * Queued spinlock: the waiters queue up through per-CPU MCS nodes and each
+ * one spins on its own node, so an unlock only touches the cache line of the
+ * next waiter instead of the ones of all the waiters.
+ */
+struct mcs_lock {
+	volatile u32 locked;
+	/* CPU id + 1 of the last waiter, 0 if none */
+	volatile u32 tail;
+#ifdef LOCKSTAT
+	struct lockstat stat;
+#endif
+} __attribute__ ((aligned(CACHELINE_SZ)));
+
+#ifdef LOCKSTAT
+int __mcs_lock_init(struct mcs_lock *lock, struct lock_class *class);
+#define mcs_lock_init(lock) ({						\
+	DEFINE_LOCK_CLASS(__lock_class, lock);				\
+	__mcs_lock_init(lock, &__lock_class);				\
+})
+#else
+int mcs_lock_init(struct mcs_lock *lock);
+#endif
+void mcs_lock(struct mcs_lock *lock);
+int mcs_try_lock(struct mcs_lock *lock);
+void mcs_unlock(struct mcs_lock *lock);
+int mcs_is_locked(struct mcs_lock *lock);
+
+/*
+ * Reader-writer spinlock. A waiting writer keeps new readers out, so that
+ * the writers are not starved by a stream of readers.
+ */
+#define RW_WRITER		(1U << 31)
+#define RW_WRITER_WAITING	(1U << 30)
+
+struct rwlock {
+	/* RW_WRITER, RW_WRITER_WAITING and the number of readers */
+	volatile u32 cnt;
+} __attribute__ ((aligned(CACHELINE_SZ)));
+
+int rwlock_init(struct rwlock *rwlock);
+void read_lock(struct rwlock *rwlock);
+void read_unlock(struct rwlock *rwlock);
+void write_lock(struct rwlock *rwlock);
+void write_unlock(struct rwlock *rwlock);
+
+/*
+ * Global locks
+ *
+ * The big kernel lock is being replaced by the locks of the structures.
+ * User page faults, FP/SIMD traps, register IPC and the syscalls listed in
+ * syscall_lock_free run without it and only take:
+ *
+ *	vmspace->vmspace_lock	vmregion list and page table of a vmspace
+ *	pmo->pmo_lock		radix of an anonymous PMO, its mapping list
+ *	slot_table->table_guard	slots and bitmaps of a process
+ *	conn->ownership		an IPC connection, held during a call
+ *	slabs_locks[order]	one slab class
+ *	pool->buddy_lock	free lists and page metadata
+ *
+ * in this order, each one being optional. Compaction goes against it with
+ * try_lock only. The lists of the copies of an object, process and thread
+ * lifetime and all other syscalls are still under the big kernel lock.
+ *
+ * The capability lookups and find_vmr_for_va take no lock at all: the slots,
+ * the objects and the vmregions are freed through call_rcu (common/rcu.h).
+ */
+extern struct mcs_lock big_kernel_lock;
 void kernel_lock_init(void);
 void lock_kernel(void);
 void unlock_kernel(void);
+void lock_kernel_if_not_held(void);
+void unlock_kernel_if_held(void);
@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Lock contention statistics
+ *
+ * The statistics of a class are kept per CPU and only written by that CPU,
+ * so the instrumentation does not add cache line transfers of its own. The
+ * classes are pushed on a lock-free list when their first lock is
+ * initialized, as the instrumented locks cannot protect it.
+ */
+#include <common/errno.h>
+#include <common/kmalloc.h>
+#include <common/lockstat.h>
+#include <common/macro.h>
+#include <common/smp.h>
+#include <common/sync.h>
+#include <common/uaccess.h>
+#include <common/util.h>
+#include <exception/timer.h>
+
+#ifdef LOCKSTAT
+
+static struct lock_class *lock_classes;
+/* The locks which are never initialized, such as zeroed static ones */
+DEFINE_LOCK_CLASS(other_class, other);
+
+static void lock_class_register(struct lock_class *class) {
+    struct lock_class *head;
+
+    if (atomic_compare_exchange_32(&class->registered, 0, 1) != 0) return;
+    do {
+        head = lock_classes;
+        class->next = head;
+    } while ((struct lock_class *)atomic_compare_exchange_64(
+                 (u64 *)&lock_classes, (u64)head, (u64)class) != head);
+}
+
+void lockstat_init(struct lockstat *ls, struct lock_class *class) {
+    lock_class_register(class);
+    ls->class = class;
+    ls->acquired_at = 0;
+}
+
+u64 lockstat_now(void) {
+    return timer_now();
+}
+
+/* Called by the new holder of the lock, which waited since `wait_start` */
+void lockstat_acquired(struct lockstat *ls, u64 wait_start, bool contended) {
+    struct lock_class *class = ls->class;
+    struct lock_class_stat *stat;
+    u64 now = timer_now(), wait = now - wait_start;
+
+    if (!class) {
+        class = &other_class;
+        lock_class_register(class);
+    }
+    stat = &class->stat[smp_get_cpu_id()];
+    stat->nr_acquired++;
+    if (contended) {
+        stat->nr_contended++;
+        stat->wait_time += wait;
+        stat->max_wait = MAX(stat->max_wait, wait);
+    }
+    ls->acquired_at = now;
+}
+
+/* Called by the holder, before it releases the lock */
+void lockstat_released(struct lockstat *ls) {
+    struct lock_class *class = ls->class ? ls->class : &other_class;
+    struct lock_class_stat *stat = &class->stat[smp_get_cpu_id()];
+    u64 hold = timer_now() - ls->acquired_at;
+
+    stat->hold_time += hold;
+    stat->max_hold = MAX(stat->max_hold, hold);
+}
+
+static void lock_class_sum(struct lock_class *class,
+                           struct lock_class_info *info) {
+    struct lock_class_stat *stat;
+    u32 cpu, i;
+
+    memset(info, 0, sizeof(*info));
+    for (i = 0; i < LOCKSTAT_NAME_LEN - 1 && class->name[i]; i++)
+        info->name[i] = class->name[i];
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        stat = &class->stat[cpu];
+        info->nr_acquired += stat->nr_acquired;
+        info->nr_contended += stat->nr_contended;
+        info->wait_time += stat->wait_time;
+        info->max_wait = MAX(info->max_wait, stat->max_wait);
+        info->hold_time += stat->hold_time;
+        info->max_hold = MAX(info->max_hold, stat->max_hold);
+    }
+}
+
+/*
+ * Copy the statistics of as many classes as fit, the ones which waited the
+ * longest first, into the struct lock_stat_info of `len` bytes at `buf`.
+ * Then clear the statistics if `flags` has LOCKSTAT_RESET. Return the number
+ * of classes, which may be more than the ones copied.
+ */
+int sys_get_lock_stat(u64 buf, u64 len, u64 flags) {
+    struct lock_stat_info *info;
+    struct lock_class_info *all, **sorted, *tmp;
+    struct lock_class *head, *class;
+    u64 size, max_nr;
+    u32 nr = 0, i, j;
+    int r;
+
+    if (len < sizeof(*info)) return -EINVAL;
+    max_nr = (len - sizeof(*info)) / sizeof(struct lock_class_info);
+
+    /* the list only grows at its head */
+    head = lock_classes;
+    for (class = head; class; class = class->next) nr++;
+    all = kmalloc(MAX(nr, 1) * (sizeof(*all) + sizeof(*sorted)));
+    if (!all) return -ENOMEM;
+    sorted = (struct lock_class_info **)(all + nr);
+    for (i = 0, class = head; i < nr; i++, class = class->next) {
+        lock_class_sum(class, &all[i]);
+        tmp = &all[i];
+        for (j = i; j > 0 && sorted[j - 1]->wait_time < tmp->wait_time; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = tmp;
+    }
+
+    max_nr = MIN(max_nr, nr);
+    size = sizeof(*info) + max_nr * sizeof(struct lock_class_info);
+    info = kmalloc(size);
+    if (!info) {
+        kfree(all);
+        return -ENOMEM;
+    }
+    info->freq = timer_freq;
+    info->nr_classes = nr;
+    info->pad = 0;
+    for (i = 0; i < max_nr; i++)
+        memcpy((char *)&info->classes[i], (char *)sorted[i],
+               sizeof(struct lock_class_info));
+    kfree(all);
+
+    r = copy_to_user((char *)buf, (char *)info, size);
+    kfree(info);
+    if (r < 0) return r;
+
+    if (flags & LOCKSTAT_RESET) {
+        /* racing with the other CPUs only loses a few samples */
+        for (class = lock_classes; class; class = class->next)
+            memset(class->stat, 0, sizeof(class->stat));
+    }
+    return nr;
+}
+
+#else
+
+int sys_get_lock_stat(u64 buf, u64 len, u64 flags) {
+    return -ENOSYS;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/types.h>
+
+/*
+ * Lock contention statistics, built with -DLOCKSTAT=1 only.
+ *
+ * The locks initialized at the same place of the code form a class, named
+ * after the lock expression given to lock_init. A class counts, on each CPU,
+ * the acquisitions, the contended ones, and the time spent waiting for and
+ * holding its locks, in counts of the generic timer. The locks which are
+ * never initialized fall in the "other" class.
+ */
+
+#define LOCKSTAT_NAME_LEN	48
+
+/* Flags of sys_get_lock_stat */
+#define LOCKSTAT_RESET		(1 << 0)
+
+/* An entry of sys_get_lock_stat, times are in counts of the generic timer */
+struct lock_class_info {
+	char name[LOCKSTAT_NAME_LEN];
+	u64 nr_acquired;
+	u64 nr_contended;
+	u64 wait_time;
+	u64 max_wait;
+	u64 hold_time;
+	u64 max_hold;
+};
+
+struct lock_stat_info {
+	/* frequency of the generic timer */
+	u64 freq;
+	/* number of classes, which may be more than the ones returned */
+	u32 nr_classes;
+	u32 pad;
+	/* the most contended classes first */
+	struct lock_class_info classes[];
+};
+
+#ifdef LOCKSTAT
+
+#include <common/machine.h>
+
+struct lock_class_stat {
+	u64 nr_acquired;
+	u64 nr_contended;
+	u64 wait_time;
+	u64 max_wait;
+	u64 hold_time;
+	u64 max_hold;
+} __attribute__ ((aligned(CACHELINE_SZ)));
+
+struct lock_class {
+	const char *name;
+	/* in the list of the classes, once one of its locks is initialized */
+	struct lock_class *next;
+	u32 registered;
+	struct lock_class_stat stat[PLAT_CPU_NUM];
+};
+
+/* Embedded in the instrumented locks */
+struct lockstat {
+	struct lock_class *class;
+	/* when the current holder got the lock */
+	u64 acquired_at;
+};
+
+#define DEFINE_LOCK_CLASS(var, lock) \
+	static struct lock_class var = { .name = #lock }
+
+void lockstat_init(struct lockstat *ls, struct lock_class *class);
+u64 lockstat_now(void);
+void lockstat_acquired(struct lockstat *ls, u64 wait_start, bool contended);
+void lockstat_released(struct lockstat *ls);
+
+#endif
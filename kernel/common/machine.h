@@ -24,6 +24,28 @@
 #define CORE2_TIMER_IRQCNTL	(IMER_IRQCNTL_BASE + 0x8)
 #define CORE3_TIMER_IRQCNTL	(IMER_IRQCNTL_BASE + 0xc)
 #define INT_SRC_TIMER3		0x008
+#define INT_SRC_MBOX0		0x010
+
+// Core mailboxes interrupt control registers
+#define MBOX_IRQCNTL_BASE	(KBASE + 0x40000050)
+#define CORE0_MBOX_IRQCNTL	(MBOX_IRQCNTL_BASE + 0x0)
+#define CORE1_MBOX_IRQCNTL	(MBOX_IRQCNTL_BASE + 0x4)
+#define CORE2_MBOX_IRQCNTL	(MBOX_IRQCNTL_BASE + 0x8)
+#define CORE3_MBOX_IRQCNTL	(MBOX_IRQCNTL_BASE + 0xc)
+#define MBOX0_IRQ_ENABLE	0x1
+
+// Mailbox 0 of each core: writing sets bits, writing the read-clear
+// register clears them
+#define MBOX_SET_BASE		(KBASE + 0x40000080)
+#define CORE0_MBOX0_SET		(MBOX_SET_BASE + 0x00)
+#define CORE1_MBOX0_SET		(MBOX_SET_BASE + 0x10)
+#define CORE2_MBOX0_SET		(MBOX_SET_BASE + 0x20)
+#define CORE3_MBOX0_SET		(MBOX_SET_BASE + 0x30)
+#define MBOX_RDCLR_BASE		(KBASE + 0x400000c0)
+#define CORE0_MBOX0_RDCLR	(MBOX_RDCLR_BASE + 0x00)
+#define CORE1_MBOX0_RDCLR	(MBOX_RDCLR_BASE + 0x10)
+#define CORE2_MBOX0_RDCLR	(MBOX_RDCLR_BASE + 0x20)
+#define CORE3_MBOX0_RDCLR	(MBOX_RDCLR_BASE + 0x30)
 
 // IRQ & FIQ source registers
 #define IRQ_BASE	(KBASE + 0x40000060)
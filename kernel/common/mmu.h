@@ -27,6 +27,7 @@ int unmap_range_in_pgtbl(vaddr_t *pgtbl, vaddr_t va, size_t len);
 int map_range_in_pgtbl_2m(vaddr_t *pgtbl, vaddr_t va, paddr_t pa, size_t len,
                           vmr_prop_t flags);
 
+int query_in_pgtbl(vaddr_t *pgtbl, vaddr_t va, paddr_t *pa, pte_t **entry);
 int query_in_pgtbl_level(vaddr_t *pgtbl, vaddr_t va, paddr_t *pa, pte_t **entry,
                          u32 level);
 #ifndef KBASE
@@ -38,4 +39,10 @@ int query_in_pgtbl_level(vaddr_t *pgtbl, vaddr_t va, paddr_t *pa, pte_t **entry,
 #define phys_to_virt(x) ((vaddr_t)((paddr_t)(x) + KBASE))
 #define virt_to_phys(x) ((paddr_t)((vaddr_t)(x)-KBASE))
 
+#else
+
+/* The host unit tests use their memory at its "physical" address */
+#define phys_to_virt(x) ((vaddr_t)(x))
+#define virt_to_phys(x) ((paddr_t)(x))
+
 #endif
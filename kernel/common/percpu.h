@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/machine.h>
+#include <common/types.h>
+
+struct thread;
+struct fpsimd_state;
+
+/*
+ * The per-CPU area holds the state which a CPU reads on most kernel entries
+ * and the others seldom touch, in cache lines of its own. TPIDR_EL1 points
+ * at the area of the current CPU once percpu_init ran.
+ */
+struct per_cpu {
+	u32 cpu_id;
+	/* the big kernel lock is held by this CPU */
+	volatile bool kernel_lock_held;
+	/* EL0 may use the FP/SIMD registers, which are fpsimd_owner's */
+	bool fpsimd_enabled;
+	struct fpsimd_state *fpsimd_owner;
+	struct thread *curr_thread;
+	struct thread *idle_thread;
+	/*
+	 * The ready threads in the queues of the policy, under their lock, read
+	 * with curr_thread by the load balancer of the other CPUs
+	 */
+	u32 nr_ready;
+	/* ticks since the last periodic load balancing */
+	u32 balance_ticks;
+} __attribute__ ((aligned(CACHELINE_SZ)));
+
+extern struct per_cpu per_cpu_areas[PLAT_CPU_NUM];
+
+void percpu_init(u32 cpu_id);
+
+static inline struct per_cpu *this_cpu(void)
+{
+	struct per_cpu *area;
+
+	asm volatile ("mrs %0, tpidr_el1":"=r" (area));
+	return area;
+}
+
+#define this_cpu_read(field)		(this_cpu()->field)
+#define this_cpu_write(field, val)	(this_cpu()->field = (val))
+/* The field of another CPU, which may change under the reader */
+#define per_cpu(cpu, field)		(per_cpu_areas[cpu].field)
+
+/* The CPU runs its idle thread, and has no tick */
+static inline bool cpu_is_idle(u32 cpu)
+{
+	return per_cpu(cpu, curr_thread) == per_cpu(cpu, idle_thread);
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#include <common/rbtree.h>
+
+/* NULL leaves are black */
+static inline bool is_red(struct rb_node *node)
+{
+	return node && node->red;
+}
+
+/* Make `new` take the place of `old` below the parent of `old` */
+static void rb_replace_child(struct rb_node *old, struct rb_node *new,
+			     struct rb_root *root)
+{
+	struct rb_node *parent = old->parent;
+
+	if (!parent)
+		root->node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+	if (new)
+		new->parent = parent;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *right = node->right;
+
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+	rb_replace_child(node, right, root);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *left = node->left;
+
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+	rb_replace_child(node, left, root);
+	left->right = node;
+	node->parent = left;
+}
+
+/* Restore the red-black properties after linking the red `node` */
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while ((parent = node->parent) && parent->red) {
+		/* a red node is never the root, so gparent exists */
+		gparent = parent->parent;
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (is_red(uncle)) {
+				parent->red = uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rb_rotate_left(parent, root);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rb_rotate_right(gparent, root);
+		} else {
+			uncle = gparent->left;
+			if (is_red(uncle)) {
+				parent->red = uncle->red = false;
+				gparent->red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rb_rotate_right(parent, root);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->red = false;
+			gparent->red = true;
+			rb_rotate_left(gparent, root);
+		}
+	}
+	root->node->red = false;
+}
+
+/*
+ * Fix the extra black of `node` (maybe NULL) below `parent`, after a black
+ * node was removed there
+ */
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+			   struct rb_root *root)
+{
+	struct rb_node *sibling;
+
+	while (node != root->node && !is_red(node)) {
+		if (node == parent->left) {
+			sibling = parent->right;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rb_rotate_left(parent, root);
+				sibling = parent->right;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->right)) {
+				sibling->left->red = false;
+				sibling->red = true;
+				rb_rotate_right(sibling, root);
+				sibling = parent->right;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->right->red = false;
+			rb_rotate_left(parent, root);
+		} else {
+			sibling = parent->left;
+			if (sibling->red) {
+				sibling->red = false;
+				parent->red = true;
+				rb_rotate_right(parent, root);
+				sibling = parent->left;
+			}
+			if (!is_red(sibling->left) && !is_red(sibling->right)) {
+				sibling->red = true;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (!is_red(sibling->left)) {
+				sibling->right->red = false;
+				sibling->red = true;
+				rb_rotate_left(sibling, root);
+				sibling = parent->left;
+			}
+			sibling->red = parent->red;
+			parent->red = false;
+			sibling->left->red = false;
+			rb_rotate_right(parent, root);
+		}
+		node = root->node;
+	}
+	if (node)
+		node->red = false;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *child, *parent, *next;
+	bool removed_red;
+
+	if (!node->left || !node->right) {
+		/* node has at most one child, which takes its place */
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		removed_red = node->red;
+		rb_replace_child(node, child, root);
+	} else {
+		/* the successor of node has no left child: move it to node */
+		next = node->right;
+		while (next->left)
+			next = next->left;
+		child = next->right;
+		removed_red = next->red;
+		if (next->parent == node) {
+			parent = next;
+		} else {
+			parent = next->parent;
+			rb_replace_child(next, child, root);
+			next->right = node->right;
+			next->right->parent = next;
+		}
+		rb_replace_child(node, next, root);
+		next->left = node->left;
+		next->left->parent = next;
+		next->red = node->red;
+	}
+	if (!removed_red)
+		rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(struct rb_root *root)
+{
+	struct rb_node *node = root->node;
+
+	if (!node)
+		return NULL;
+	while (node->left)
+		node = node->left;
+	return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return node;
+	}
+	while ((parent = node->parent) && node == parent->right)
+		node = parent;
+	return parent;
+}
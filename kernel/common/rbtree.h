@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/types.h>
+#include <common/macro.h>
+
+/*
+ * Intrusive red-black tree. Like list_head, the node is embedded in the
+ * element and the user walks down the tree to find where to link a new
+ * node, then rebalances it with rb_insert_color:
+ *
+ *	link = &root->node;
+ *	while (*link) {
+ *		parent = *link;
+ *		link = key < rb_entry(parent, ...)->key ?
+ *		    &parent->left : &parent->right;
+ *	}
+ *	rb_link_node(node, parent, link);
+ *	rb_insert_color(node, root);
+ */
+struct rb_node {
+	struct rb_node *parent;
+	struct rb_node *left;
+	struct rb_node *right;
+	bool red;
+};
+
+struct rb_root {
+	struct rb_node *node;
+};
+
+#define rb_entry(ptr, type, field) container_of(ptr, type, field)
+
+static inline void init_rb_root(struct rb_root *root)
+{
+	root->node = NULL;
+}
+
+static inline bool rb_empty(struct rb_root *root)
+{
+	return root->node == NULL;
+}
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->red = true;
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Grace periods
+ *
+ * Each call_rcu starts a grace period of its own, numbered by rcu_gp_num. At
+ * a quiescent state, a CPU records the last number it saw, so the grace
+ * periods up to the smallest number recorded by the CPUs are over. An idle
+ * CPU holds no reference and does not count.
+ *
+ * The callbacks are queued on the CPU calling call_rcu, in the order of
+ * their grace periods, and run at its next quiescent state after theirs is
+ * over. The ones of a CPU which goes idle wait until it runs a thread again.
+ */
+#include <common/machine.h>
+#include <common/macro.h>
+#include <common/percpu.h>
+#include <common/rcu.h>
+#include <common/smp.h>
+#include <common/sync.h>
+
+struct rcu_cpu {
+    /* the last grace period started before its last quiescent state */
+    volatile u64 seen;
+    struct rcu_head *head;
+    struct rcu_head **tail;
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct rcu_cpu rcu_cpus[PLAT_CPU_NUM];
+static u64 rcu_gp_num;
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    struct rcu_cpu *rc = &rcu_cpus[smp_get_cpu_id()];
+
+    head->func = func;
+    head->next = NULL;
+    /* the element is unlinked before the grace period starts */
+    smp_mb();
+    head->gp = atomic_fetch_add_64(&rcu_gp_num, 1) + 1;
+    if (!rc->tail) rc->tail = &rc->head;
+    *rc->tail = head;
+    rc->tail = &head->next;
+}
+
+/* The last grace period which is over */
+static u64 rcu_completed_gp(void) {
+    u64 done = rcu_gp_num;
+    u32 cpu;
+
+    smp_mb();
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        if (!per_cpu(cpu, curr_thread) || cpu_is_idle(cpu)) continue;
+        done = MIN(done, rcu_cpus[cpu].seen);
+    }
+    return done;
+}
+
+/*
+ * Called on each context switch, once the next thread is current: the
+ * references of the previous one are dropped.
+ */
+void rcu_quiescent(void) {
+    struct rcu_cpu *rc = &rcu_cpus[smp_get_cpu_id()];
+    struct rcu_head *head;
+    u64 done;
+
+    smp_mb();
+    rc->seen = rcu_gp_num;
+    if (!rc->head) return;
+
+    done = rcu_completed_gp();
+    while ((head = rc->head) && head->gp <= done) {
+        rc->head = head->next;
+        if (!rc->head) rc->tail = &rc->head;
+        head->func(head);
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/list.h>
+#include <common/sync.h>
+#include <common/types.h>
+
+/*
+ * Read-copy-update for the read-mostly kernel structures.
+ *
+ * The kernel runs with the interrupts masked and is never preempted, so a
+ * CPU holds no reference found under rcu_read_lock once it switches threads:
+ * a context switch is a quiescent state. An updater unlinks an element, then
+ * hands it to call_rcu, which frees it after every CPU went through a
+ * quiescent state or was idle. The readers thus never take a lock, and the
+ * updaters still serialize with each other by their own locks.
+ */
+
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+	/* the grace period to wait for */
+	u64 gp;
+};
+
+/* Only mark the read side: it must not switch threads */
+static inline void rcu_read_lock(void)
+{
+	COMPILER_BARRIER();
+}
+
+static inline void rcu_read_unlock(void)
+{
+	COMPILER_BARRIER();
+}
+
+/* Read a pointer published by rcu_assign_pointer once */
+#define rcu_dereference(p)	(*(typeof(p) volatile *)&(p))
+
+/* Publish `v`, whose fields are initialized, to the readers */
+#define rcu_assign_pointer(p, v) ({ \
+	smp_wmb(); \
+	*(typeof(p) volatile *)&(p) = (v); \
+})
+
+/*
+ * list_del keeps the next pointer of the removed node, so the readers on it
+ * go on with the list, and for_each_in_list_rcu can walk it.
+ */
+static inline void list_add_rcu(struct list_head *new, struct list_head *head)
+{
+	new->next = head->next;
+	new->prev = head;
+	rcu_assign_pointer(head->next, new);
+	new->next->prev = new;
+}
+
+#define for_each_in_list_rcu(elem, type, field, head) \
+	for (elem = container_of(rcu_dereference((head)->next), type, field); \
+	     &((elem)->field) != (head); \
+	     elem = container_of(rcu_dereference(((elem)->field).next), \
+				 type, field))
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_quiescent(void);
@@ -16,6 +16,8 @@
 #include <common/types.h>
 #include <common/vars.h>
 
+struct per_cpu per_cpu_areas[PLAT_CPU_NUM];
+
 volatile char cpu_status[PLAT_CPU_NUM] = {cpu_hang, cpu_hang, cpu_hang,
                                           cpu_hang};
 
@@ -45,9 +47,13 @@ void enable_smp_cores(void *addr) {
     kinfo("All %d CPUs are active\n", PLAT_CPU_NUM);
 }
 
-u32 smp_get_cpu_id(void) {
-    u64 cpuid = 0;
+/*
+ * Point TPIDR_EL1, which held the logical cpuid, at the per-CPU area. Run
+ * first on each CPU: smp_get_cpu_id reads the area.
+ */
+void percpu_init(u32 cpu_id) {
+    struct per_cpu *area = &per_cpu_areas[cpu_id];
 
-    asm volatile("mrs %0, tpidr_el1" : "=r"(cpuid));
-    return (u32)cpuid;
+    area->cpu_id = cpu_id;
+    asm volatile("msr tpidr_el1, %0" : : "r"(area) : "memory");
 }
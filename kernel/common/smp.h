@@ -14,6 +14,7 @@
 
 #include <common/vars.h>
 #include <common/machine.h>
+#include <common/percpu.h>
 #include <common/types.h>
 
 enum cpu_state {
@@ -25,4 +26,8 @@ enum cpu_state {
 extern volatile char cpu_status[PLAT_CPU_NUM];
 
 void enable_smp_cores(void *addr);
-u32 smp_get_cpu_id(void);
+
+static inline u32 smp_get_cpu_id(void)
+{
+	return this_cpu_read(cpu_id);
+}
@@ -74,6 +74,19 @@ static inline s64 atomic_exchange_64(s64 * ptr, s64 exchange)
 	return oldval;
 }
 
+static inline u32 atomic_exchange_32(volatile u32 * ptr, u32 exchange)
+{
+	u32 oldval;
+	s32 ret;
+	asm volatile ("1: ldaxr   %w0, %2\n"
+		      "   stlxr   %w1, %w3, %2\n"
+		      "   cbnz    %w1, 1b\n"
+		      "2:":"=&r" (oldval), "=&r"(ret), "+Q"(*ptr)
+		      :"r"(exchange)
+		      :"memory");
+	return oldval;
+}
+
 #define __atomic_fetch_op(ptr, val, len, width, op)			\
 ({									\
 	u##len oldval, newval;						\
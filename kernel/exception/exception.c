@@ -12,6 +12,7 @@
 
 #include "exception.h"
 
+#include <common/errno.h>
 #include <common/kprint.h>
 #include <common/lock.h>
 #include <common/smp.h>
@@ -22,6 +23,7 @@
 #include <sched/sched.h>
 
 #include "esr.h"
+#include "fpsimd.h"
 #include "timer.h"
 
 u8 irq_handle_type[MAX_IRQ_NUM];
@@ -34,6 +36,7 @@ void exception_init_per_cpu(void) {
      * scheduling
      */
     timer_init();
+    fpsimd_init_per_cpu();
 
     /**
      * Lab3: Your code here
@@ -50,16 +53,20 @@ void exception_init(void) {
 }
 
 void handle_entry_c(int type, u64 esr, u64 address) {
+    /* ec: exception class */
+    u32 esr_ec = GET_ESR_EL1_EC(esr);
+
     /**
      * Lab4
-     * Acquire the big kernel lock, if the exception is not from kernel
+     * Acquire the big kernel lock, if the exception is not from kernel.
+     * User page faults and FP/SIMD traps only touch their own vmspace or
+     * thread, under the locks of those.
      */
     kdebug("error type = %d\n", type);
-    if (type > ERROR_EL1h) {
+    if (type > ERROR_EL1h && esr_ec != ESR_EL1_EC_DABT_LEL &&
+        esr_ec != ESR_EL1_EC_ENFP) {
         lock_kernel();
     }
-    /* ec: exception class */
-    u32 esr_ec = GET_ESR_EL1_EC(esr);
 
     kdebug("Interrupt type: %d, ESR: 0x%lx, Fault address: 0x%lx, EC 0b%b\n",
            type, esr, address, esr_ec);
@@ -80,6 +87,12 @@ void handle_entry_c(int type, u64 esr, u64 address) {
         case ESR_EL1_EC_DABT_CEL:
             do_page_fault(esr, address);
             break;
+        case ESR_EL1_EC_ENFP:
+            if (fpsimd_trap() < 0) {
+                lock_kernel();
+                sys_exit(-ENOMEM);
+            }
+            break;
         default:
             kdebug("Unsupported Exception ESR %lx\n", esr);
             kdebug("Please implement esr_ec=%b\n", esr_ec);
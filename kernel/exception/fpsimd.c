@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Lazy FP/SIMD switching
+ *
+ * The kernel is built with -mgeneral-regs-only, so the FP/SIMD registers of
+ * a CPU only change in EL0. They hold the state of the owner of the CPU, the
+ * thread which last loaded them there. Only the owner may access them from
+ * EL0: any other thread traps on its first FP/SIMD instruction, then loads
+ * its state, which is allocated at its very first use, and becomes the
+ * owner. A thread which never uses FP/SIMD costs nothing.
+ *
+ * A thread may resume on another CPU, so the registers it could access are
+ * saved when it is switched out. If it comes back to the same CPU before
+ * anyone else loaded theirs there, it finds them in place and does not trap.
+ */
+#include "fpsimd.h"
+
+#include <common/errno.h>
+#include <common/kmalloc.h>
+#include <common/percpu.h>
+#include <common/smp.h>
+#include <process/thread.h>
+#include <sched/sched.h>
+
+/*
+ * The per-CPU area holds the state in the registers of each CPU, valid if
+ * its `cpu` is still this CPU, in fpsimd_owner, and whether the current
+ * thread may access them in fpsimd_enabled.
+ */
+
+/*
+ * EL1 never traps. The write is synchronized by the eret to the thread, and
+ * the kernel itself does not use the registers in between.
+ */
+static void fpsimd_set_el0_access(bool enable) {
+    u64 cpacr = enable ? CPACR_EL1_FPEN_NO_TRAP : CPACR_EL1_FPEN_EL0_TRAP;
+
+    asm volatile("msr cpacr_el1, %0" ::"r"(cpacr));
+    this_cpu_write(fpsimd_enabled, enable);
+}
+
+void fpsimd_init_per_cpu(void) {
+    this_cpu_write(fpsimd_owner, NULL);
+    fpsimd_set_el0_access(false);
+}
+
+/* Called by switch_to_thread before `next` runs on the current CPU */
+void fpsimd_switch(struct thread *prev, struct thread *next) {
+    u32 cpu = smp_get_cpu_id();
+    struct fpsimd_state *state = next->fpsimd;
+    bool enable;
+
+    if (prev == next) return;
+    /* prev owns the registers and may have changed them */
+    if (this_cpu_read(fpsimd_enabled) && prev && prev->fpsimd)
+        fpsimd_save_regs(prev->fpsimd);
+
+    enable =
+        state && this_cpu_read(fpsimd_owner) == state && state->cpu == cpu;
+    if (enable != this_cpu_read(fpsimd_enabled)) fpsimd_set_el0_access(enable);
+}
+
+/*
+ * Handle the trap of the first FP/SIMD instruction of the current thread
+ * since it was switched in. The instruction is executed again on return.
+ */
+int fpsimd_trap(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *thread = current_thread;
+    struct fpsimd_state *state = thread->fpsimd;
+
+    if (!state) {
+        /* the registers of a new thread are all zero */
+        state = kzalloc(sizeof(*state));
+        if (!state) return -ENOMEM;
+        state->cpu = -1;
+        thread->fpsimd = state;
+    }
+    /* the previous owner saved its registers when it was switched out */
+    fpsimd_load_regs(state);
+    state->cpu = cpu;
+    this_cpu_write(fpsimd_owner, state);
+    fpsimd_set_el0_access(true);
+    return 0;
+}
+
+void fpsimd_release(struct thread *thread) {
+    struct fpsimd_state *state = thread->fpsimd;
+    u32 cpu;
+
+    if (!state) return;
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++)
+        if (per_cpu(cpu, fpsimd_owner) == state)
+            per_cpu(cpu, fpsimd_owner) = NULL;
+    thread->fpsimd = NULL;
+    kfree(state);
+}
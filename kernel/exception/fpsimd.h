@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/types.h>
+
+struct thread;
+
+/* CPACR_EL1.FPEN: trap the FP/SIMD accesses of EL0 only, or of none */
+#define CPACR_EL1_FPEN_SHIFT	20
+#define CPACR_EL1_FPEN_EL0_TRAP	(0b01UL << CPACR_EL1_FPEN_SHIFT)
+#define CPACR_EL1_FPEN_NO_TRAP	(0b11UL << CPACR_EL1_FPEN_SHIFT)
+
+/*
+ * FP/SIMD registers of a thread, allocated when it first uses them. The
+ * layout is the one of fpsimd_save_regs and fpsimd_load_regs.
+ */
+struct fpsimd_state {
+	u64 vregs[64];	// q0-q31
+	u32 fpsr;
+	u32 fpcr;
+	s32 cpu;	// CPU whose registers were last loaded from here, or -1
+} __attribute__((aligned(16)));
+
+/* assembly helper functions */
+void fpsimd_save_regs(struct fpsimd_state *state);
+void fpsimd_load_regs(struct fpsimd_state *state);
+
+void fpsimd_init_per_cpu(void);
+void fpsimd_switch(struct thread *prev, struct thread *next);
+int fpsimd_trap(void);
+void fpsimd_release(struct thread *thread);
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Inter-processor interrupts through the raspi3 core mailboxes
+ *
+ * An IPI sets the bit of its type in the mailbox 0 of the target core, which
+ * raises an IRQ there until the bits are cleared by the handler. Several IPIs
+ * of the same type sent before the target handles them are merged.
+ *
+ * TLB invalidations need no IPI: flush_tlb broadcasts them in the inner
+ * shareable domain and its dsb waits for every core to complete them.
+ */
+#include <common/kprint.h>
+#include <common/machine.h>
+#include <common/smp.h>
+#include <common/sync.h>
+#include <common/tools.h>
+#include <common/types.h>
+#include <exception/ipi.h>
+
+#define IPI_MASK(type) (1U << (type))
+
+static u64 core_mbox_irqcntl[PLAT_CPU_NUM] = {
+    CORE0_MBOX_IRQCNTL, CORE1_MBOX_IRQCNTL, CORE2_MBOX_IRQCNTL,
+    CORE3_MBOX_IRQCNTL};
+static u64 core_mbox_set[PLAT_CPU_NUM] = {CORE0_MBOX0_SET, CORE1_MBOX0_SET,
+                                          CORE2_MBOX0_SET, CORE3_MBOX0_SET};
+static u64 core_mbox_rdclr[PLAT_CPU_NUM] = {
+    CORE0_MBOX0_RDCLR, CORE1_MBOX0_RDCLR, CORE2_MBOX0_RDCLR,
+    CORE3_MBOX0_RDCLR};
+
+/*
+ * Called by each CPU right before it starts scheduling. IPIs sent to it
+ * earlier stay in its mailbox and are taken then.
+ */
+void ipi_init_per_cpu(void) {
+    put32(core_mbox_irqcntl[smp_get_cpu_id()], MBOX0_IRQ_ENABLE);
+}
+
+void ipi_send(u32 cpu, enum ipi_type type) {
+    BUG_ON(cpu >= PLAT_CPU_NUM || type >= IPI_TYPE_NR);
+    /* the data of the message is visible before the interrupt */
+    dsb(ishst);
+    put32(core_mbox_set[cpu], IPI_MASK(type));
+}
+
+void handle_ipi_irq(void) {
+    u32 cpu = smp_get_cpu_id();
+    u32 pending;
+
+    pending = get32(core_mbox_rdclr[cpu]);
+    if (!pending) return;
+    put32(core_mbox_rdclr[cpu], pending);
+    dsb(ish);
+    /* IPI_RESCHED: handle_irq calls sched() on the way out */
+}
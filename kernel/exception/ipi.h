@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+#pragma once
+
+#include <common/types.h>
+
+/* Each message type is one bit of the mailbox 0 of the target core */
+enum ipi_type {
+	/* run the scheduler when returning from the interrupt */
+	IPI_RESCHED = 0,
+	IPI_TYPE_NR,
+};
+
+void ipi_init_per_cpu(void);
+void handle_ipi_irq(void);
+
+void ipi_send(u32 cpu, enum ipi_type type);
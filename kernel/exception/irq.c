@@ -20,6 +20,7 @@
 #include <common/types.h>
 #include <common/uart.h>
 #include <exception/exception.h>
+#include <exception/ipi.h>
 #include <exception/irq.h>
 #include <exception/timer.h>
 
@@ -29,15 +30,10 @@ u64 core_irq_source[PLAT_CPU_NUM] = {CORE0_IRQ, CORE1_IRQ, CORE2_IRQ,
 
 void handle_irq(int type) {
     /**
-     * Lab4
-     * Acquire the big kernel lock, if :
-     *	The irq is not from the kernel
-     * 	The thread being interrupted is an idle thread.
+     * The timer irq, the IPIs and the rescheduling only touch per-CPU data
+     * and the run queues, which are protected by their own locks, so the
+     * big kernel lock is not taken here.
      */
-    if (type > ERROR_EL1h || (current_thread && current_thread->thread_ctx &&
-                              current_thread->thread_ctx->type == TYPE_IDLE)) {
-        lock_kernel();
-    }
     plat_handle_irq();
 
     /**
@@ -61,6 +57,9 @@ void plat_handle_irq(void) {
         case INT_SRC_TIMER3:
             handle_timer_irq();
             break;
+        case INT_SRC_MBOX0:
+            handle_ipi_irq();
+            break;
         default:
             kinfo("Unsupported IRQ %d\n", irq);
     }
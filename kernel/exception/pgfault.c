@@ -13,7 +13,9 @@
 #include <common/errno.h>
 #include <common/kmalloc.h>
 #include <common/kprint.h>
+#include <common/lock.h>
 #include <common/macro.h>
+#include <common/rcu.h>
 #include <common/mm.h>
 #include <common/types.h>
 #include <common/util.h>
@@ -46,6 +48,8 @@ void do_page_fault(u64 esr, u64 fault_ins_addr) {
             ret = handle_trans_fault(current_thread->vmspace, fault_addr);
             if (ret != 0) {
                 kinfo("pgfault at 0x%p failed, inst 0x%p\n", fault_addr, fault_ins_addr);
+                /* faults from user mode are handled without the lock */
+                lock_kernel_if_not_held();
                 sys_exit(ret);
             }
             break;
@@ -60,6 +64,9 @@ void do_page_fault(u64 esr, u64 fault_ins_addr) {
 int handle_trans_fault(struct vmspace *vmspace, vaddr_t fault_addr) {
     struct vmregion *vmr;
     struct pmobject *pmo;
+    u64 index;
+    paddr_t pa;
+    int err;
 
     /*
      * Lab3: your code here
@@ -77,16 +84,50 @@ int handle_trans_fault(struct vmspace *vmspace, vaddr_t fault_addr) {
      * are recorded in a radix tree for easy management. Such code
      * has been omitted in our lab for simplification.
      */
+    /*
+     * The vmregion and the page are looked up without the vmspace lock, so
+     * the faults of the threads sharing a vmspace allocate in parallel. Both
+     * are checked again under the locks before the page is mapped, as an
+     * unmap or a migration may have raced with the lookup.
+     */
+    fault_addr = ROUND_DOWN(fault_addr, PAGE_SIZE);
+retry:
+    rcu_read_lock();
     vmr = find_vmr_for_va(vmspace, fault_addr);
-    if (!vmr) return -ENOMAPPING;
+    if (!vmr) goto out_fail;
     pmo = vmr->pmo;
     if (pmo->type != PMO_ANONYM) {
-        return -ENOMAPPING;
+        goto out_fail;
+    }
+    /*
+     * The pages of a PMO are recorded in its radix tree, so a page shared
+     * by several mappings (or migrated by compaction) is found again here.
+     */
+    index = (fault_addr - vmr->start) / PAGE_SIZE;
+    lock(&pmo->pmo_lock);
+    pa = get_page_from_pmo(pmo, index);
+    if (pa == 0) pa = pmo_alloc_anon_page(pmo, index);
+    unlock(&pmo->pmo_lock);
+    if (pa == 0) goto out_fail;
+
+    lock(&vmspace->vmspace_lock);
+    lock(&pmo->pmo_lock);
+    if (find_vmr_for_va(vmspace, fault_addr) != vmr ||
+        get_page_from_pmo(pmo, index) != pa) {
+        unlock(&pmo->pmo_lock);
+        unlock(&vmspace->vmspace_lock);
+        rcu_read_unlock();
+        goto retry;
     }
-    vaddr_t va = (vaddr_t)get_pages(0);  // allocate a page, order = 0
-    int err = map_range_in_pgtbl(vmspace->pgtbl, fault_addr, virt_to_phys(va),
-                                 PAGE_SIZE, vmr->perm);
+    err = map_range_in_pgtbl(vmspace->pgtbl, fault_addr, pa, PAGE_SIZE,
+                             vmr->perm);
+    unlock(&pmo->pmo_lock);
+    unlock(&vmspace->vmspace_lock);
+    rcu_read_unlock();
     if (err) return -ENOMAPPING;
     // kdebug("handle_trans_fault: add=%lx, err=%lx\n", fault_addr, err);
     return 0;
+out_fail:
+    rcu_read_unlock();
+    return -ENOMAPPING;
 }
@@ -11,6 +11,7 @@
  */
 
 #include <common/kprint.h>
+#include <common/lock.h>
 #include <common/machine.h>
 #include <common/smp.h>
 #include <common/tools.h>
@@ -20,7 +21,11 @@
 #include <process/thread.h>
 #include <sched/sched.h>
 
-u64 cntv_tval;
+/* CNTKCTL_EL1: EL0 may read the virtual counter, to time itself */
+#define CNTKCTL_EL1_EL0VCTEN	(1 << 1)
+
+/* Frequency of the generic timer, in Hz */
+u64 timer_freq;
 
 /* Per core IRQ SOURCE MMIO address */
 u64 core_timer_irqcntl[PLAT_CPU_NUM] = {
@@ -28,44 +33,39 @@ u64 core_timer_irqcntl[PLAT_CPU_NUM] = {
 	CORE3_TIMER_IRQCNTL
 };
 
-void timer_init(void)
-{
-	u64 cur_freq = 0;
-	u64 cur_cnt = 0;
-	u64 count_down = 0;
-	u64 timer_ctl = 0;
-	u32 cpuid = smp_get_cpu_id();
-
-	/* Since QEMU only emulate the generic timer, we use the generic timer
-	 * here */
-	asm volatile ("mrs %0, cntpct_el0":"=r" (cur_cnt));
-	kdebug("timer init cntpct_el0 = %lu\n", cur_cnt);
-	asm volatile ("mrs %0, cntfrq_el0":"=r" (cur_freq));
-	kdebug("timer init cntfrq_el0 = %lu\n", cur_freq);
+/*
+ * Per-CPU one-shot timer queue, ordered by expiry. The hardware timer of a
+ * CPU is only programmed for the first event of its queue, and disabled
+ * when the queue is empty.
+ */
+struct timer_queue {
+	struct list_head events;
+	struct lock lock;
+	/* The scheduler tick of the CPU, stopped while the CPU is idle */
+	struct timer_event sched_tick;
+	/* The event whose handler runs, outside the lock, or NULL */
+	struct timer_event *volatile running;
+} __attribute__ ((aligned(CACHELINE_SZ)));
 
-	/* Calculate the tv */
-	cntv_tval = (cur_freq * TICK_MS / 1000);
-	kdebug("CPU freq %lu, set timer %lu\n", cur_freq, cntv_tval);
+static struct timer_queue timer_queues[PLAT_CPU_NUM];
 
-	/* set the timervalue here */
-	asm volatile ("msr cntv_tval_el0, %0"::"r" (cntv_tval));
-	asm volatile ("mrs %0, cntv_tval_el0":"=r" (count_down));
-	kdebug("timer init cntv_tval_el0 = %lu\n", count_down);
+u64 timer_now(void)
+{
+	u64 cnt;
 
-	put32(core_timer_irqcntl[cpuid], INT_SRC_TIMER3);
+	asm volatile ("isb\n mrs %0, cntvct_el0":"=r" (cnt));
+	return cnt;
+}
 
-	/* Set the control register */
-	timer_ctl = 0 << 1 | 1;	/* IMASK = 0 ENABLE = 1 */
-	asm volatile ("msr cntv_ctl_el0, %0"::"r" (timer_ctl));
-	asm volatile ("mrs %0, cntv_ctl_el0":"=r" (timer_ctl));
-	kdebug("timer init cntv_ctl_el0 = %lu\n", timer_ctl);
-	/* enable interrupt controller */
-	return;
+u64 timer_us_to_cnt(u64 us)
+{
+	return timer_freq / 1000000 * us + timer_freq % 1000000 * us / 1000000;
 }
 
-void plat_handle_timer_irq(void)
+u64 timer_cnt_to_us(u64 cnt)
 {
-	asm volatile ("msr cntv_tval_el0, %0"::"r" (cntv_tval));
+	return cnt / timer_freq * 1000000 + cnt % timer_freq * 1000000 /
+	    timer_freq;
 }
 
 void plat_disable_timer(void)
@@ -77,14 +77,179 @@ void plat_disable_timer(void)
 
 void plat_enable_timer(void)
 {
-	u64 timer_ctl = 0x1;
+	u64 timer_ctl = 0x1;	/* IMASK = 0 ENABLE = 1 */
 
-	asm volatile ("msr cntv_tval_el0, %0"::"r" (cntv_tval));
 	asm volatile ("msr cntv_ctl_el0, %0"::"r" (timer_ctl));
 }
 
-void handle_timer_irq(void)
+/* Program the timer of this CPU for its first event. Queue lock held. */
+static void timer_program(struct timer_queue *tq)
+{
+	struct timer_event *first;
+	u64 now, delta;
+
+	if (list_empty(&tq->events)) {
+		plat_disable_timer();
+		return;
+	}
+	first = list_entry(tq->events.next, struct timer_event, node);
+	now = timer_now();
+	delta = first->expire > now ? first->expire - now : 0;
+	/* cntv_tval_el0 is a signed 32-bit down counter */
+	if (delta > 0x7fffffffUL)
+		delta = 0x7fffffffUL;
+	asm volatile ("msr cntv_tval_el0, %0"::"r" (delta));
+	plat_enable_timer();
+}
+
+void timer_event_init(struct timer_event *event,
+		      void (*handler) (struct timer_event *))
+{
+	init_list_head(&event->node);
+	event->handler = handler;
+	event->expire = 0;
+	event->cpuid = 0;
+	event->pending = false;
+}
+
+/*
+ * Arm `event` on the current CPU to expire at `expire` (in timer counts).
+ * A pending event is moved to its new expiry.
+ */
+void timer_add(struct timer_event *event, u64 expire)
+{
+	struct timer_queue *tq;
+	struct timer_event *pos;
+
+	timer_del(event);
+
+	event->cpuid = smp_get_cpu_id();
+	event->expire = expire;
+	tq = &timer_queues[event->cpuid];
+
+	lock(&tq->lock);
+	for_each_in_list(pos, struct timer_event, node, &tq->events) {
+		if (pos->expire > expire)
+			break;
+	}
+	/* insert before pos, which may be the list head */
+	list_append(&event->node, &pos->node);
+	event->pending = true;
+	if (tq->events.next == &event->node)
+		timer_program(tq);
+	unlock(&tq->lock);
+}
+
+/*
+ * Disarm `event`, which may be pending on another CPU. That CPU may then
+ * take one spurious interrupt, which finds nothing to do.
+ */
+void timer_del(struct timer_event *event)
+{
+	struct timer_queue *tq;
+
+	if (!event->pending)
+		return;
+	tq = &timer_queues[event->cpuid];
+	lock(&tq->lock);
+	if (event->pending) {
+		list_del(&event->node);
+		event->pending = false;
+	}
+	unlock(&tq->lock);
+}
+
+/*
+ * Disarm `event` and wait for its handler to return if it runs on another
+ * CPU, so that the event can be freed then. The caller must not hold a lock
+ * which the handler takes. On the CPU of the event, the handler can only
+ * run below the caller, which does not wait for it.
+ */
+void timer_del_sync(struct timer_event *event)
+{
+	struct timer_queue *tq;
+	u32 cpuid = event->cpuid;
+
+	tq = &timer_queues[cpuid];
+	/* the handler is marked running in the section which dequeues it */
+	lock(&tq->lock);
+	if (event->pending) {
+		list_del(&event->node);
+		event->pending = false;
+	}
+	unlock(&tq->lock);
+	if (cpuid == smp_get_cpu_id())
+		return;
+	while (tq->running == event) ;
+}
+
+static void sched_tick_handler(struct timer_event *event)
 {
-	plat_handle_timer_irq();
 	sched_handle_timer_irq();
+	timer_add(event, timer_now() + timer_us_to_cnt(TICK_US));
+}
+
+/*
+ * The scheduler tick runs every TICK_US while the CPU runs a thread, and
+ * stops when it switches to its idle thread: the CPU is woken up by an IPI
+ * when a thread is enqueued on it, or by its own timer events.
+ */
+void sched_tick_update(bool idle)
+{
+	struct timer_event *tick = &timer_queues[smp_get_cpu_id()].sched_tick;
+
+	if (idle)
+		timer_del(tick);
+	else if (!tick->pending)
+		timer_add(tick, timer_now() + timer_us_to_cnt(TICK_US));
+}
+
+void timer_init(void)
+{
+	u64 cur_freq = 0;
+	u64 cur_cnt = 0;
+	u32 cpuid = smp_get_cpu_id();
+
+	/* Since QEMU only emulate the generic timer, we use the generic timer
+	 * here */
+	asm volatile ("mrs %0, cntpct_el0":"=r" (cur_cnt));
+	kdebug("timer init cntpct_el0 = %lu\n", cur_cnt);
+	asm volatile ("mrs %0, cntfrq_el0":"=r" (cur_freq));
+	kdebug("timer init cntfrq_el0 = %lu\n", cur_freq);
+	timer_freq = cur_freq;
+	asm volatile ("msr cntkctl_el1, %0"::"r" ((u64) CNTKCTL_EL1_EL0VCTEN));
+
+	init_list_head(&timer_queues[cpuid].events);
+	lock_init(&timer_queues[cpuid].lock);
+	timer_event_init(&timer_queues[cpuid].sched_tick, sched_tick_handler);
+	timer_wheel_init();
+
+	put32(core_timer_irqcntl[cpuid], INT_SRC_TIMER3);
+
+	/* No event yet: the timer is enabled by the first timer_add */
+	plat_disable_timer();
+}
+
+/* Run the expired events of this CPU and program the next one */
+void handle_timer_irq(void)
+{
+	struct timer_queue *tq = &timer_queues[smp_get_cpu_id()];
+	struct timer_event *event;
+
+	lock(&tq->lock);
+	while (!list_empty(&tq->events)) {
+		event = list_entry(tq->events.next, struct timer_event, node);
+		if (event->expire > timer_now())
+			break;
+		list_del(&event->node);
+		event->pending = false;
+		tq->running = event;
+		/* the handler may arm timers again */
+		unlock(&tq->lock);
+		event->handler(event);
+		lock(&tq->lock);
+		tq->running = NULL;
+	}
+	timer_program(tq);
+	unlock(&tq->lock);
 }
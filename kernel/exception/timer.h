@@ -12,6 +12,62 @@
 
 #pragma once
 
+#include <common/list.h>
+#include <common/types.h>
+
+/* A one-shot timer event, expiring on the CPU which armed it */
+struct timer_event {
+	struct list_head node;
+	/* expiry, in counts of the generic timer */
+	u64 expire;
+	u32 cpuid;
+	bool pending;
+	/*
+	 * called in the timer irq of cpuid, with interrupts disabled and the
+	 * queue unlocked: see timer_del_sync to wait for it
+	 */
+	void (*handler) (struct timer_event * event);
+};
+
+extern u64 timer_freq;
+
 void timer_init(void);
 void handle_timer_irq(void);
-void plat_handle_timer_irq(void);
+
+u64 timer_now(void);
+u64 timer_us_to_cnt(u64 us);
+u64 timer_cnt_to_us(u64 cnt);
+
+void timer_event_init(struct timer_event *event,
+		      void (*handler) (struct timer_event *));
+void timer_add(struct timer_event *event, u64 expire);
+void timer_del(struct timer_event *event);
+void timer_del_sync(struct timer_event *event);
+
+void sched_tick_update(bool idle);
+
+/* Granularity of the timeouts, in microseconds */
+#define WHEEL_JIFFY_US	1000
+
+/* A timeout on the timer wheel of the CPU which armed it */
+struct timeout {
+	struct list_head node;
+	/* expiry, in jiffies */
+	u64 expire;
+	u32 cpuid;
+	bool pending;
+	/* position in the wheel */
+	u32 level;
+	u32 slot;
+	/*
+	 * called in the timer irq of cpuid with the wheel locked: it may
+	 * wake threads up but must not arm or cancel timeouts
+	 */
+	void (*handler) (struct timeout * timeout);
+};
+
+void timer_wheel_init(void);
+void timeout_init(struct timeout *timeout,
+		  void (*handler) (struct timeout *));
+void timeout_add(struct timeout *timeout, u64 us);
+bool timeout_del(struct timeout *timeout);
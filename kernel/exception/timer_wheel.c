@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Per-CPU hierarchical timer wheel for the timeouts of blocking threads.
+ *
+ * Level 0 has one slot per jiffy (WHEEL_JIFFY_US) for the next
+ * WHEEL_SLOTS jiffies, and every next level covers WHEEL_SLOTS times the
+ * range of the previous one. When the jiffies of level 0 wrap around, the
+ * current slot of level 1 is cascaded down, and so on. Adding and removing
+ * a timeout is O(1); the wheel is driven by a one-shot timer event which is
+ * only armed for the next slot with timeouts, or for the next cascade.
+ */
+
+#include <common/bitops.h>
+#include <common/kprint.h>
+#include <common/lock.h>
+#include <common/macro.h>
+#include <common/smp.h>
+#include <common/types.h>
+#include <exception/timer.h>
+
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1UL << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS	4
+/* Longest timeout, in jiffies */
+#define WHEEL_MAX_DELTA	((1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer_wheel {
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	/* bit i of pending[level] is set iff slots[level][i] is not empty */
+	u64 pending[WHEEL_LEVELS];
+	/* the next jiffy to process */
+	u64 jiffies;
+	u64 nr_timeouts;
+	struct timer_event event;
+	struct lock lock;
+} __attribute__ ((aligned(CACHELINE_SZ)));
+
+static struct timer_wheel timer_wheels[PLAT_CPU_NUM];
+
+static u64 current_jiffies(void)
+{
+	return timer_now() / timer_us_to_cnt(WHEEL_JIFFY_US);
+}
+
+/* Put `timeout` in the slot matching its expiry. Wheel lock held. */
+static void wheel_insert(struct timer_wheel *wheel, struct timeout *timeout)
+{
+	u64 expire = timeout->expire, delta;
+	int level = 0;
+	u64 idx;
+
+	if (expire < wheel->jiffies)
+		expire = wheel->jiffies;
+	delta = expire - wheel->jiffies;
+	if (delta > WHEEL_MAX_DELTA) {
+		delta = WHEEL_MAX_DELTA;
+		expire = wheel->jiffies + delta;
+	}
+	while (level < WHEEL_LEVELS - 1 &&
+	       delta >= (1UL << (WHEEL_BITS * (level + 1))))
+		level++;
+
+	idx = (expire >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	list_append(&timeout->node, &wheel->slots[level][idx]);
+	wheel->pending[level] |= 1UL << idx;
+	timeout->level = level;
+	timeout->slot = idx;
+}
+
+static void wheel_remove(struct timer_wheel *wheel, struct timeout *timeout)
+{
+	list_del(&timeout->node);
+	if (list_empty(&wheel->slots[timeout->level][timeout->slot]))
+		wheel->pending[timeout->level] &= ~(1UL << timeout->slot);
+}
+
+/* The jiffy of the next level 0 slot with timeouts, or of the next cascade */
+static u64 wheel_next_jiffy(struct timer_wheel *wheel)
+{
+	u64 idx = wheel->jiffies & WHEEL_MASK;
+	u64 pending = wheel->pending[0] >> idx;
+
+	if (pending)
+		return wheel->jiffies + ctzl(pending);
+	return (wheel->jiffies | WHEEL_MASK) + 1;
+}
+
+/* Level 0 wrapped around: move the current slots of upper levels down */
+static void wheel_cascade(struct timer_wheel *wheel)
+{
+	struct timeout *timeout, *tmp;
+	int level;
+	u64 idx;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		idx = (wheel->jiffies >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		/* they expire within this slot, so all land in lower levels */
+		for_each_in_list_safe(timeout, tmp, node,
+				      &wheel->slots[level][idx]) {
+			wheel_remove(wheel, timeout);
+			wheel_insert(wheel, timeout);
+		}
+		if (idx != 0)
+			break;
+	}
+}
+
+static void wheel_program(struct timer_wheel *wheel)
+{
+	if (wheel->nr_timeouts == 0) {
+		timer_del(&wheel->event);
+		return;
+	}
+	timer_add(&wheel->event,
+		  wheel_next_jiffy(wheel) * timer_us_to_cnt(WHEEL_JIFFY_US));
+}
+
+/*
+ * Run the timeouts up to the current jiffy. The handlers run with the wheel
+ * lock held, so that timeout_del() never returns while one is running.
+ */
+static void wheel_event_handler(struct timer_event *event)
+{
+	struct timer_wheel *wheel =
+	    container_of(event, struct timer_wheel, event);
+	struct timeout *timeout, *tmp;
+	u64 now = current_jiffies(), idx;
+
+	lock(&wheel->lock);
+	while (wheel->jiffies <= now) {
+		idx = wheel->jiffies & WHEEL_MASK;
+		if (idx == 0)
+			wheel_cascade(wheel);
+		for_each_in_list_safe(timeout, tmp, node,
+				      &wheel->slots[0][idx]) {
+			wheel_remove(wheel, timeout);
+			timeout->pending = false;
+			wheel->nr_timeouts--;
+			timeout->handler(timeout);
+		}
+		wheel->jiffies++;
+		/* skip the empty slots, but stop at every cascade */
+		wheel->jiffies = MAX(wheel->jiffies,
+				     MIN(wheel_next_jiffy(wheel), now + 1));
+	}
+	wheel_program(wheel);
+	unlock(&wheel->lock);
+}
+
+void timeout_init(struct timeout *timeout,
+		  void (*handler) (struct timeout *))
+{
+	init_list_head(&timeout->node);
+	timeout->handler = handler;
+	timeout->pending = false;
+	timeout->cpuid = 0;
+}
+
+/*
+ * Arm `timeout` on the current CPU to expire in `us` microseconds, rounded
+ * up to the next jiffy.
+ */
+void timeout_add(struct timeout *timeout, u64 us)
+{
+	struct timer_wheel *wheel;
+
+	timeout_del(timeout);
+
+	timeout->cpuid = smp_get_cpu_id();
+	wheel = &timer_wheels[timeout->cpuid];
+	lock(&wheel->lock);
+	/* an empty wheel may have stopped long ago: do not replay that time */
+	if (wheel->nr_timeouts == 0)
+		wheel->jiffies = current_jiffies();
+	timeout->expire = current_jiffies() +
+	    DIV_ROUND_UP(us, WHEEL_JIFFY_US);
+	wheel_insert(wheel, timeout);
+	timeout->pending = true;
+	wheel->nr_timeouts++;
+	wheel_program(wheel);
+	unlock(&wheel->lock);
+}
+
+/*
+ * Cancel `timeout`, which may be armed on another CPU. Return whether it
+ * was still pending: if not, its handler has already run.
+ */
+bool timeout_del(struct timeout *timeout)
+{
+	struct timer_wheel *wheel = &timer_wheels[timeout->cpuid];
+	bool pending;
+
+	if (!timeout->pending)
+		return false;
+	lock(&wheel->lock);
+	pending = timeout->pending;
+	if (pending) {
+		wheel_remove(wheel, timeout);
+		timeout->pending = false;
+		wheel->nr_timeouts--;
+	}
+	unlock(&wheel->lock);
+	return pending;
+}
+
+void timer_wheel_init(void)
+{
+	struct timer_wheel *wheel = &timer_wheels[smp_get_cpu_id()];
+	int level, idx;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (idx = 0; idx < WHEEL_SLOTS; idx++)
+			init_list_head(&wheel->slots[level][idx]);
+		wheel->pending[level] = 0;
+	}
+	wheel->nr_timeouts = 0;
+	wheel->jiffies = current_jiffies();
+	timer_event_init(&wheel->event, wheel_event_handler);
+	lock_init(&wheel->lock);
+}
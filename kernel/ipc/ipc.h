@@ -25,16 +25,41 @@ struct ipc_vm_config {
 	u64 stack_size;
 	u64 buf_base_addr;
 	u64 buf_size;
+	/* Server only: the number of workers, PLAT_CPU_NUM if 0 */
+	u64 nr_workers;
 };
 
-#define IPC_MAX_CONN_PER_SERVER 32
+#define IPC_MAX_CONN_PER_SERVER		4096
+#define IPC_MAX_WORKERS_PER_SERVER	64
+/* The largest shared buffer of a connection, which is its slot in the server */
+#define IPC_MAX_BUF_SIZE		0x1000000
+
+/* A worker thread of a server and the top of its stack */
+struct ipc_worker {
+	struct thread *thread;
+	u64 stack_top;
+};
+
+/*
+ * A server serves the calls of all its connections with a pool of worker
+ * threads: a call takes an idle worker and gives it back on return, so a
+ * connection only costs its shared buffer. The worker threads point to the
+ * config of the thread which registered the server.
+ */
 struct server_ipc_config {
 	// I dont know how to specify the maximum callback number
 	u64 callback;
 	u64 max_client;
-	/* bitmap for shared buffer and stack allocation */
+	/* bitmap for shared buffer allocation */
 	unsigned long *conn_bmp;
 	struct ipc_vm_config vm_config;
+	u64 nr_workers;
+	struct ipc_worker *workers;
+	/* the indexes in workers of the idle ones, used as a stack */
+	u32 *idle_workers;
+	u32 nr_idle;
+	/* Protects conn_bmp and the idle workers */
+	struct lock pool_lock;
 };
 
 struct shared_buf {
@@ -46,19 +71,26 @@ struct shared_buf {
 struct ipc_connection {
 	/* Source Thread */
 	struct thread *source;
-	/* Target Thread */
+	/* The thread which registered the server, with its worker pool */
 	struct thread *target;
+	/* The worker serving the current call */
+	struct ipc_worker *worker;
 	/* Conn cap in server */
 	u64 server_conn_cap;
 	/* Target function */
 	u64 callback;
 
-	/* Shadow server stack top */
-	u64 server_stack_top;
-	u64 server_stack_size;
-
 	/* Shared buffer */
 	struct shared_buf buf;
+
+	/*
+	 * Held from the call of a client until the server returns, so that
+	 * the shared buffer serves one call at a time
+	 */
+	struct lock ownership;
+	/* The current call is a register call, taken by the fast path */
+	bool reg_call;
+	bool fast_call;
 };
 
 typedef struct ipc_msg {
@@ -75,3 +107,13 @@ u32 sys_register_client(u32 server_cap, u64 vm_config_ptr);
 u64 sys_ipc_call(u32 conn_cap, ipc_msg_t * ipc_msg);
 u64 sys_ipc_reg_call(u32 conn_cap, u64 arg);
 void sys_ipc_return(u64 ret);
+
+/* The fast paths of sync_el0_64, see exception_table.S */
+u64 ipc_fast_call(u32 conn_cap, u64 arg);
+u64 ipc_fast_return(u64 ret);
+
+void ipc_copy_regs(struct thread *dst, struct thread *src, int first);
+
+struct ipc_worker *ipc_worker_get(struct server_ipc_config *config);
+void ipc_worker_put(struct server_ipc_config *config,
+		    struct ipc_worker *worker);
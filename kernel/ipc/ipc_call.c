@@ -13,8 +13,11 @@
 #include <common/errno.h>
 #include <common/kmalloc.h>
 #include <common/kprint.h>
+#include <common/lock.h>
 #include <common/macro.h>
 #include <common/mm.h>
+#include <common/rcu.h>
+#include <common/sync.h>
 #include <common/uaccess.h>
 #include <common/util.h>
 #include <exception/exception.h>
@@ -57,17 +60,21 @@ int ipc_send_cap(struct ipc_connection *conn, ipc_msg_t *ipc_msg) {
         goto out;
     }
 
+    i = 0;
     r = copy_from_user((char *)cap_buf, (char *)ipc_msg + cap_slots_offset,
                        sizeof(*cap_buf) * cap_slot_number);
-    if (r < 0) goto out;
+    if (r < 0) goto out_free_cap;
 
     for (i = 0; i < cap_slot_number; i++) {
-        u64 dest_cap;
+        int dest_cap;
 
         kdebug("[IPC] send cap:%d\n", cap_buf[i]);
         dest_cap = cap_copy(current_process, conn->target->process, cap_buf[i],
                             false, 0);
-        if (dest_cap < 0) goto out_free_cap;
+        if (dest_cap < 0) {
+            r = dest_cap;
+            goto out_free_cap;
+        }
         cap_buf[i] = dest_cap;
     }
 
@@ -85,6 +92,47 @@ out:
     return r;
 }
 
+/*
+ * Take the ownership of @conn and an idle worker of the server for a call.
+ * Another client thread may be using the same connection, or all the
+ * workers may be serving other calls: return -EBUSY, which no server
+ * returns, and let the caller retry instead of spinning while the server
+ * runs. The previous call of the worker may still be returning on another
+ * CPU, on its kernel stack; wait for that CPU to leave it.
+ */
+static int ipc_conn_acquire(struct ipc_connection *conn) {
+    struct ipc_worker *worker;
+
+    if (try_lock(&conn->ownership) != 0) return -EBUSY;
+    worker = ipc_worker_get(conn->target->server_ipc_config);
+    if (!worker) {
+        unlock(&conn->ownership);
+        return -EBUSY;
+    }
+    conn->worker = worker;
+    while (sched_stack_in_use(worker->thread)) COMPILER_BARRIER();
+    return 0;
+}
+
+/*
+ * A register call carries its message in x1-x7 of the client. The worker
+ * gets x1 in its x0 and x2-x7 as they are, its own x1 being the size of the
+ * shared buffer, 0 here. The reply comes back in x0-x7 of the worker. Copy
+ * the saved registers from @first to x7 of @src into @dst.
+ */
+void ipc_copy_regs(struct thread *dst, struct thread *src, int first) {
+    int i;
+
+    for (i = first; i <= X7; i++)
+        dst->thread_ctx->ec.reg[i] = src->thread_ctx->ec.reg[i];
+}
+
+static void ipc_conn_release(struct ipc_connection *conn) {
+    ipc_worker_put(conn->target->server_ipc_config, conn->worker);
+    conn->worker = NULL;
+    unlock(&conn->ownership);
+}
+
 /**
  * Lab4
  * Helper function
@@ -93,10 +141,14 @@ out:
  *
  * Replace the place_holder to correct value!
  */
-static u64 thread_migrate_to_server(struct ipc_connection *conn, u64 arg) {
-    struct thread *target = conn->target;
+static u64 thread_migrate_to_server(struct ipc_connection *conn, u64 arg,
+                                    u64 buf_len) {
+    struct ipc_worker *worker = conn->worker;
+    struct thread *target = worker->thread;
 
     conn->source = current_thread;
+    conn->reg_call = !buf_len;
+    conn->fast_call = false;
     target->active_conn = conn;
     current_thread->thread_ctx->state = TS_WAITING;
     obj_put(conn);
@@ -105,20 +157,28 @@ static u64 thread_migrate_to_server(struct ipc_connection *conn, u64 arg) {
      * Lab4
      * This command set the sp register, read the file to find which field
      * of the ipc_connection stores the stack of the server thread?
+     * The stack is the one of the worker taken for this call.
      * */
-    arch_set_thread_stack(target, conn->server_stack_top);
+    arch_set_thread_stack(target, worker->stack_top);
     /**
      * Lab4
      * This command set the ip register, read the file to find which field
      * of the ipc_connection stores the instruction to be called when switch
      * to the server?
      * */
-    arch_set_thread_next_ip(target, conn->target->server_ipc_config->callback);
+    arch_set_thread_next_ip(target, target->server_ipc_config->callback);
     /**
      * Lab4
      * The argument set by sys_ipc_call;
      */
     arch_set_thread_arg(target, arg);
+    /*
+     * The size of the shared buffer follows in x1, for the server to check
+     * the message against, or 0 for a register call, whose other words
+     * follow in x2-x7.
+     */
+    target->thread_ctx->ec.reg[X1] = buf_len;
+    if (!buf_len) ipc_copy_regs(target, current_thread, X2);
 
     /**
      * Passing the scheduling context of the current thread to thread of
@@ -154,16 +214,20 @@ u64 sys_ipc_call(u32 conn_cap, ipc_msg_t *ipc_msg) {
         r = -ECAPBILITY;
         goto out_fail;
     }
+    r = ipc_conn_acquire(conn);
+    if (r < 0) goto out_obj_put;
 
     /**
      * Lab4
      * Here, you need to transfer all the capabilities of client thread to
-     * capabilities in server thread in the ipc_msg.
+     * capabilities in server thread in the ipc_msg. The server may drop the
+     * caps of a message, so it never gets one whose slots are not its own.
      */
-    ipc_send_cap(conn, ipc_msg);
+    r = ipc_send_cap(conn, ipc_msg);
+    if (r < 0) goto out_release;
     r = copy_to_user((char *)&ipc_msg->server_conn_cap,
                      (char *)&conn->server_conn_cap, sizeof(u64));
-    if (r < 0) goto out_obj_put;
+    if (r < 0) goto out_release;
 
     /**
      * Lab4
@@ -171,9 +235,11 @@ u64 sys_ipc_call(u32 conn_cap, ipc_msg_t *ipc_msg) {
      * Then what value should the arg be?
      * */
     arg = conn->buf.server_user_addr;
-    thread_migrate_to_server(conn, arg);
+    thread_migrate_to_server(conn, arg, conn->buf.size);
 
     BUG("This function should never\n");
+out_release:
+    ipc_conn_release(conn);
 out_obj_put:
     obj_put(conn);
 out_fail:
@@ -194,11 +260,56 @@ u64 sys_ipc_reg_call(u32 conn_cap, u64 arg0) {
         r = -ECAPBILITY;
         goto out_fail;
     }
+    r = ipc_conn_acquire(conn);
+    if (r < 0) goto out_obj_put;
 
     arg = arg0;
-    thread_migrate_to_server(conn, arg);
+    thread_migrate_to_server(conn, arg, 0);
 
     BUG("This function should never\n");
+out_obj_put:
+    obj_put(conn);
 out_fail:
     return r;
 }
+
+/*
+ * The fast path of sync_el0_64 for ipc_reg_call, without the big kernel
+ * lock and with the context of the client saved on its kernel stack. The
+ * connection is looked up without a reference, which the slow path drops
+ * before switching anyway, and the worker is entered directly with the
+ * message in its x0 and x2-x7 and no buffer size in its x1. Return the
+ * context of the worker to eret to, or 0 before any change for the slow
+ * path to handle the call and its errors.
+ */
+u64 ipc_fast_call(u32 conn_cap, u64 arg) {
+    struct thread *client = current_thread, *target;
+    struct ipc_connection *conn;
+    arch_exec_cont_t *ec;
+
+    rcu_read_lock();
+    conn = obj_get_rcu(client->process, conn_cap, TYPE_CONNECTION);
+    if (!conn || ipc_conn_acquire(conn) < 0) {
+        rcu_read_unlock();
+        return 0;
+    }
+    rcu_read_unlock();
+
+    target = conn->worker->thread;
+    conn->source = client;
+    conn->reg_call = true;
+    conn->fast_call = true;
+    target->active_conn = conn;
+    client->thread_ctx->state = TS_WAITING;
+
+    ec = &target->thread_ctx->ec;
+    ec->reg[SP_EL0] = conn->worker->stack_top;
+    ec->reg[ELR_EL1] = target->server_ipc_config->callback;
+    ec->reg[X0] = arg;
+    ec->reg[X1] = 0;
+    ipc_copy_regs(target, client, X2);
+    target->thread_ctx->sc = client->thread_ctx->sc;
+
+    switch_to_thread(target);
+    return switch_context();
+}
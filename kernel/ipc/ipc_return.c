@@ -12,6 +12,7 @@
 
 #include <common/errno.h>
 #include <common/kprint.h>
+#include <common/lock.h>
 #include <common/macro.h>
 #include <common/util.h>
 #include <ipc/ipc.h>
@@ -34,13 +35,22 @@
 static int thread_migrate_to_client(struct ipc_connection *conn, u64 ret_value)
 {
 	struct thread *source = conn->source;
+	bool reg_call = conn->reg_call;
+
 	current_thread->active_conn = NULL;
+	/* the next caller waits until this CPU leaves the worker stack */
+	ipc_worker_put(current_thread->server_ipc_config, conn->worker);
+	conn->worker = NULL;
+	unlock(&conn->ownership);
 
 	/**
 	 * Lab4
 	 * The return value returned by server thread;
 	 */
 	arch_set_thread_return(source, ret_value);
+	/* the rest of the reply to a register call */
+	if (reg_call)
+		ipc_copy_regs(source, current_thread, X1);
 	/**
 	 * Switch to the client
 	 */
@@ -72,3 +82,32 @@ void sys_ipc_return(u64 ret)
  out:
 	return;
 }
+
+/*
+ * The fast path of sync_el0_64 for ipc_return, the counterpart of
+ * ipc_fast_call: the client gets @ret in its x0, the rest of the reply in
+ * x1-x7, and runs next. A call which came by the slow path returns by it,
+ * so that each path can be measured end to end. The worker leaves its
+ * stack to the next caller once this CPU is on the client's, in
+ * sched_finish_switch. Return the context of the client, or 0 for the slow
+ * path.
+ */
+u64 ipc_fast_return(u64 ret)
+{
+	struct thread *worker = current_thread, *source;
+	struct ipc_connection *conn = worker->active_conn;
+
+	if (conn == NULL || !conn->fast_call)
+		return 0;
+
+	source = conn->source;
+	worker->active_conn = NULL;
+	ipc_worker_put(worker->server_ipc_config, conn->worker);
+	conn->worker = NULL;
+	unlock(&conn->ownership);
+
+	source->thread_ctx->ec.reg[X0] = ret;
+	ipc_copy_regs(source, worker, X1);
+	switch_to_thread(source);
+	return switch_context();
+}
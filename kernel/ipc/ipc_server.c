@@ -17,6 +17,7 @@
 #include <ipc/ipc.h>
 #include <exception/irq.h>
 #include <common/kmalloc.h>
+#include <common/lock.h>
 #include <common/mm.h>
 #include <common/uaccess.h>
 #include <process/thread.h>
@@ -25,6 +26,91 @@
 
 #define SHADOW_THREAD_PRIO MAX_PRIO - 1
 
+/**
+ * Helper function to create a worker thread of the server @src
+ */
+static struct thread *create_server_thread(struct thread *src)
+{
+	struct thread *new;
+
+	new = kzalloc(sizeof(struct thread));
+	if (!new)
+		return NULL;
+
+	new->vmspace = obj_get(src->process, VMSPACE_OBJ_ID, TYPE_VMSPACE);
+	BUG_ON(!new->vmspace);
+
+	// Init the thread ctx
+	new->thread_ctx = create_thread_ctx();
+	if (!new->thread_ctx)
+		goto out_fail;
+	memcpy((char *)&(new->thread_ctx->ec),
+	       (const char *)&(src->thread_ctx->ec), sizeof(arch_exec_cont_t));
+	new->thread_ctx->prio = SHADOW_THREAD_PRIO;
+	new->thread_ctx->state = TS_INIT;
+	new->thread_ctx->affinity = NO_AFF;
+	new->thread_ctx->sc = NULL;
+	new->thread_ctx->type = TYPE_SHADOW;
+	new->fpsimd = NULL;
+	sched_stat_init(new);
+
+	// The workers share the server ipc config
+	new->server_ipc_config = src->server_ipc_config;
+	new->process = src->process;
+
+	obj_put(new->vmspace);
+	return new;
+
+ out_fail:
+	obj_put(new->vmspace);
+	kfree(new);
+	return NULL;
+}
+
+/**
+ * Create the worker @idx of the server and its stack.
+ */
+static int create_worker(struct thread *server, u64 idx)
+{
+	struct server_ipc_config *config = server->server_ipc_config;
+	struct ipc_vm_config *vm_config = &config->vm_config;
+	struct ipc_worker *worker = &config->workers[idx];
+	struct pmobject *stack_pmo;
+	u64 stack_base;
+	int r;
+
+	worker->thread = create_server_thread(server);
+	if (!worker->thread)
+		return -ENOMEM;
+
+	stack_base = vm_config->stack_base_addr + idx * vm_config->stack_size;
+	stack_pmo = kmalloc(sizeof(struct pmobject));
+	if (!stack_pmo) {
+		r = -ENOMEM;
+		goto out_destroy_thread;
+	}
+	r = pmo_init(stack_pmo, PMO_DATA, vm_config->stack_size, 0);
+	if (r < 0)
+		goto out_free_stack_pmo;
+	r = vmspace_map_range(server->vmspace, stack_base,
+			      vm_config->stack_size, VMR_READ | VMR_WRITE,
+			      stack_pmo);
+	if (r < 0)
+		goto out_deinit_stack_pmo;
+	worker->stack_top = stack_base + vm_config->stack_size;
+	return 0;
+
+ out_deinit_stack_pmo:
+	pmo_deinit(stack_pmo);
+ out_free_stack_pmo:
+	kfree(stack_pmo);
+ out_destroy_thread:
+	destroy_thread_ctx(worker->thread);
+	kfree(worker->thread);
+	worker->thread = NULL;
+	return r;
+}
+
 /**
  * The core function for registering the server
  */
@@ -32,21 +118,24 @@ static int register_server(struct thread *server, u64 callback, u64 max_client,
 			   u64 vm_config_ptr)
 {
 	int r;
+	u64 i;
 	struct server_ipc_config *server_ipc_config;
 	struct ipc_vm_config *vm_config;
 	BUG_ON(server == NULL);
 
+	if (server->server_ipc_config)
+		return -EINVAL;
+
 	// Create the server ipc_config
-	server_ipc_config = kmalloc(sizeof(struct server_ipc_config));
+	server_ipc_config = kzalloc(sizeof(struct server_ipc_config));
 	if (!server_ipc_config) {
 		r = -ENOMEM;
 		goto out_fail;
 	}
-	server->server_ipc_config = server_ipc_config;
 
 	// Init the server ipc_config
 	server_ipc_config->callback = callback;
-	if (max_client > IPC_MAX_CONN_PER_SERVER) {
+	if (max_client == 0 || max_client > IPC_MAX_CONN_PER_SERVER) {
 		r = -EINVAL;
 		goto out_free_server_ipc_config;
 	}
@@ -57,16 +146,23 @@ static int register_server(struct thread *server, u64 callback, u64 max_client,
 		r = -ENOMEM;
 		goto out_free_server_ipc_config;
 	}
+	lock_init(&server_ipc_config->pool_lock);
 	// Get and check the parameter vm_config
 	vm_config = &server_ipc_config->vm_config;
 	r = copy_from_user((char *)vm_config, (char *)vm_config_ptr,
 			   sizeof(*vm_config));
 	if (r < 0)
 		goto out_free_conn_bmp;
-	if (!is_user_addr_range(vm_config->stack_base_addr,
-				vm_config->stack_size) ||
+	if (vm_config->nr_workers == 0)
+		vm_config->nr_workers = PLAT_CPU_NUM;
+	if (vm_config->nr_workers > IPC_MAX_WORKERS_PER_SERVER ||
+	    vm_config->buf_size == 0 ||
+	    vm_config->buf_size > IPC_MAX_BUF_SIZE ||
+	    !is_user_addr_range(vm_config->stack_base_addr,
+				vm_config->stack_size *
+				vm_config->nr_workers) ||
 	    !is_user_addr_range(vm_config->buf_base_addr,
-				vm_config->buf_size) ||
+				vm_config->buf_size * max_client) ||
 	    !IS_ALIGNED(vm_config->stack_base_addr, PAGE_SIZE) ||
 	    !IS_ALIGNED(vm_config->stack_size, PAGE_SIZE) ||
 	    !IS_ALIGNED(vm_config->buf_base_addr, PAGE_SIZE) ||
@@ -74,9 +170,37 @@ static int register_server(struct thread *server, u64 callback, u64 max_client,
 		r = -EINVAL;
 		goto out_free_conn_bmp;
 	}
+
+	// Create the worker pool
+	server_ipc_config->workers = kzalloc(vm_config->nr_workers *
+					     sizeof(struct ipc_worker));
+	server_ipc_config->idle_workers = kmalloc(vm_config->nr_workers *
+						  sizeof(u32));
+	if (!server_ipc_config->workers || !server_ipc_config->idle_workers) {
+		r = -ENOMEM;
+		goto out_free_workers;
+	}
+	server->server_ipc_config = server_ipc_config;
+	for (i = 0; i < vm_config->nr_workers; i++) {
+		r = create_worker(server, i);
+		if (r < 0)
+			break;
+		server_ipc_config->idle_workers[i] = i;
+	}
+	/* the pool is only smaller if some workers could be created */
+	if (i == 0)
+		goto out_unregister;
+	server_ipc_config->nr_workers = i;
+	server_ipc_config->nr_idle = i;
+
 	kinfo("register done\n");
-	return r;
+	return 0;
 
+ out_unregister:
+	server->server_ipc_config = NULL;
+ out_free_workers:
+	kfree(server_ipc_config->idle_workers);
+	kfree(server_ipc_config->workers);
  out_free_conn_bmp:
 	kfree(server_ipc_config->conn_bmp);
  out_free_server_ipc_config:
@@ -90,3 +214,28 @@ u64 sys_register_server(u64 callback, u64 max_client, u64 vm_config_ptr)
 	return register_server(current_thread, callback, max_client,
 			       vm_config_ptr);
 }
+
+/**
+ * Take an idle worker of the server, or return NULL if they are all busy.
+ */
+struct ipc_worker *ipc_worker_get(struct server_ipc_config *config)
+{
+	struct ipc_worker *worker = NULL;
+	u32 idx;
+
+	lock(&config->pool_lock);
+	if (config->nr_idle > 0) {
+		idx = config->idle_workers[--config->nr_idle];
+		worker = &config->workers[idx];
+	}
+	unlock(&config->pool_lock);
+	return worker;
+}
+
+void ipc_worker_put(struct server_ipc_config *config,
+		    struct ipc_worker *worker)
+{
+	lock(&config->pool_lock);
+	config->idle_workers[config->nr_idle++] = worker - config->workers;
+	unlock(&config->pool_lock);
+}
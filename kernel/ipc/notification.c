@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Notifications
+ *
+ * A waiter blocks until a signal is delivered to it, its timeout expires or
+ * the last capability to the notification is freed. Signals can be sent
+ * from syscalls and from interrupt handlers.
+ *
+ * The notifications are protected by a small table of locks hashed by their
+ * address rather than by a lock of their own: the timeout handler of a
+ * thread which was woken up meanwhile may race with the free of the
+ * notification, and must check the thread still waits on it before
+ * touching it.
+ */
+#include <common/errno.h>
+#include <common/kprint.h>
+#include <common/list.h>
+#include <common/lock.h>
+#include <common/util.h>
+#include <exception/exception.h>
+#include <exception/timer.h>
+#include <ipc/notification.h>
+#include <process/capability.h>
+#include <process/process.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+#define NOTIFC_LOCK_NUM 16
+
+static struct lock notifc_locks[NOTIFC_LOCK_NUM];
+
+static inline struct lock *notifc_lock_of(struct notification *notifc) {
+    return &notifc_locks[((vaddr_t)notifc / sizeof(struct notification)) %
+                         NOTIFC_LOCK_NUM];
+}
+
+void notification_init(void) {
+    int i;
+
+    for (i = 0; i < NOTIFC_LOCK_NUM; i++) lock_init(&notifc_locks[i]);
+}
+
+/*
+ * Lock the notification `thread` waits on and return it, or NULL if the
+ * thread waits on none. thread->notification is only changed under the
+ * lock of the notification, so check it again once locked.
+ */
+static struct notification *notifc_lock_waiter(struct thread *thread) {
+    struct notification *notifc;
+
+    while (1) {
+        notifc = *(struct notification *volatile *)&thread->notification;
+        if (!notifc) return NULL;
+        lock(notifc_lock_of(notifc));
+        if (thread->notification == notifc) return notifc;
+        unlock(notifc_lock_of(notifc));
+    }
+}
+
+/* Remove `thread` from the queue of `notifc`, whose lock is held */
+static void __notifc_dequeue(struct notification *notifc,
+                             struct thread *thread) {
+    list_del(&thread->notification_queue_node);
+    notifc->waiting_threads_count--;
+    thread->notification = NULL;
+}
+
+/* Wake up the first waiter of `notifc`, whose lock is held */
+static void notifc_wake_one(struct notification *notifc, int ret) {
+    struct thread *thread;
+
+    thread = list_entry(notifc->waiting_threads.next, struct thread,
+                        notification_queue_node);
+    __notifc_dequeue(notifc, thread);
+    arch_set_thread_return(thread, ret);
+    /* its pending timeout finds it waiting on nothing and does nothing */
+    BUG_ON(sched_enqueue(thread));
+}
+
+/* Runs with the wheel lock held: wheel -> notification -> run queue */
+static void notifc_timeout_handler(struct timeout *timeout) {
+    struct thread *thread = container_of(timeout, struct thread, timeout);
+    struct notification *notifc;
+
+    notifc = notifc_lock_waiter(thread);
+    if (!notifc) return;
+    __notifc_dequeue(notifc, thread);
+    arch_set_thread_return(thread, -ETIME);
+    BUG_ON(sched_enqueue(thread));
+    unlock(notifc_lock_of(notifc));
+}
+
+void signal_notific(struct notification *notifc) {
+    lock(notifc_lock_of(notifc));
+    if (notifc->waiting_threads_count > 0)
+        notifc_wake_one(notifc, 0);
+    else
+        notifc->not_delivered_notifc_count++;
+    unlock(notifc_lock_of(notifc));
+}
+
+/* Called when the last capability is freed: nobody can signal it any more */
+void notification_deinit(void *ptr) {
+    struct notification *notifc = ptr;
+
+    lock(notifc_lock_of(notifc));
+    while (notifc->waiting_threads_count > 0)
+        notifc_wake_one(notifc, -ECAPBILITY);
+    unlock(notifc_lock_of(notifc));
+}
+
+void notification_cancel(struct thread *thread) {
+    struct notification *notifc;
+
+    notifc = notifc_lock_waiter(thread);
+    if (!notifc) return;
+    __notifc_dequeue(notifc, thread);
+    unlock(notifc_lock_of(notifc));
+}
+
+int sys_create_notifc(void) {
+    struct notification *notifc;
+    int cap, r;
+
+    notifc = obj_alloc(TYPE_NOTIFICATION, sizeof(*notifc));
+    if (!notifc) {
+        r = -ENOMEM;
+        goto out_fail;
+    }
+    notifc->not_delivered_notifc_count = 0;
+    notifc->waiting_threads_count = 0;
+    init_list_head(&notifc->waiting_threads);
+    cap = cap_alloc(current_process, notifc, 0);
+    if (cap < 0) {
+        r = cap;
+        goto out_free_obj;
+    }
+
+    return cap;
+out_free_obj:
+    obj_free(notifc);
+out_fail:
+    return r;
+}
+
+/*
+ * Consume one signal of the notification. If there is none, return -EAGAIN
+ * if !is_block, or block until one is delivered or, if `timeout_us` is not
+ * 0, until the timeout expires with -ETIME.
+ */
+int sys_wait(u32 notifc_cap, bool is_block, u64 timeout_us) {
+    struct thread *thread = current_thread;
+    struct notification *notifc;
+    int ret;
+
+    notifc = obj_get(current_process, notifc_cap, TYPE_NOTIFICATION);
+    if (!notifc) return -ECAPBILITY;
+
+    /*
+     * The timeout is armed before taking the notification lock, which its
+     * handler takes under the wheel lock. It can only fire on this CPU, once
+     * the thread has left it.
+     */
+    timeout_del(&thread->timeout);
+    if (is_block && timeout_us) {
+        thread->timeout.handler = notifc_timeout_handler;
+        timeout_add(&thread->timeout, timeout_us);
+    }
+
+    lock(notifc_lock_of(notifc));
+    if (notifc->not_delivered_notifc_count > 0) {
+        notifc->not_delivered_notifc_count--;
+        ret = 0;
+    } else if (!is_block) {
+        ret = -EAGAIN;
+    } else {
+        list_append(&thread->notification_queue_node,
+                    &notifc->waiting_threads);
+        notifc->waiting_threads_count++;
+        thread->notification = notifc;
+        arch_set_thread_return(thread, 0);
+        thread->thread_ctx->state = TS_WAITING;
+        thread->thread_ctx->sc->budget = 0;
+        unlock(notifc_lock_of(notifc));
+        /*
+         * The waiter holds no reference: syscalls run under the big kernel
+         * lock, so the notification is only freed through
+         * notification_deinit, which wakes it up.
+         */
+        obj_put(notifc);
+
+        sched();
+        eret_to_thread(switch_context());
+        /* never returns */
+    }
+    unlock(notifc_lock_of(notifc));
+    if (timeout_us) timeout_del(&thread->timeout);
+    obj_put(notifc);
+    return ret;
+}
+
+int sys_notify(u32 notifc_cap) {
+    struct notification *notifc;
+
+    notifc = obj_get(current_process, notifc_cap, TYPE_NOTIFICATION);
+    if (!notifc) return -ECAPBILITY;
+    signal_notific(notifc);
+    obj_put(notifc);
+    return 0;
+}
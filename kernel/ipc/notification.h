@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS), Shanghai Jiao Tong University (SJTU)
+ * OS-Lab-2020 (i.e., ChCore) is licensed under the Mulan PSL v1.
+ * You can use this software according to the terms and conditions of the Mulan PSL v1.
+ * You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND, EITHER EXPRESS OR
+ *   IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR
+ *   PURPOSE.
+ *   See the Mulan PSL v1 for more details.
+ */
+
+/* This file defines ds and interfaces related with notifications (asynchronous IPC) */
+#pragma once
+#include <common/list.h>
+#include <common/types.h>
+
+struct thread;
+
+/*
+ * A notification is a counting semaphore: signals which find no waiting
+ * thread are kept in not_delivered_notifc_count for the next waits.
+ * Its fields are protected by notifc_lock_of(notifc), see notification.c.
+ */
+struct notification {
+	u32 not_delivered_notifc_count;
+	u32 waiting_threads_count;
+	struct list_head waiting_threads;
+};
+
+void notification_init(void);
+void notification_deinit(void *ptr);
+/* Remove an exiting thread from the notification it waits on, if any */
+void notification_cancel(struct thread *thread);
+/*
+ * Signal `notifc` from the kernel, e.g. from an interrupt handler. The
+ * caller must hold a reference to the notification object.
+ */
+void signal_notific(struct notification *notifc);
+
+/* syscall related to notifications */
+int sys_create_notifc(void);
+int sys_wait(u32 notifc_cap, bool is_block, u64 timeout_us);
+int sys_notify(u32 notifc_cap);
@@ -20,11 +20,18 @@
 #include <common/uart.h>
 #include <common/vars.h>
 #include <exception/exception.h>
+#include <exception/ipi.h>
 #include <ipc/ipc.h>
+#include <ipc/notification.h>
 #include <process/thread.h>
 #include <sched/sched.h>
 #include <tests/tests.h>
 
+/* Scheduling policy, chosen at build time with SCHED=xxx (see sched.h) */
+#ifndef SCHED
+#define SCHED rr
+#endif
+
 ALIGN(STACK_ALIGNMENT)
 char kernel_stack[PLAT_CPU_NUM][KERNEL_STACK_SIZE];
 
@@ -41,6 +48,9 @@ __attribute__((optimize("O1"))) void stack_test(long x) {
 }
 
 void main(void *addr) {
+    /* Before anything calls smp_get_cpu_id */
+    percpu_init(0);
+
     /* Init uart */
     uart_init();
     kinfo("[ChCore] uart init finished\n");
@@ -84,8 +94,10 @@ void main(void *addr) {
     lock_kernel();
 
     /* Init scheduler with specified policy. */
-    sched_init(&rr);
+    sched_init(&SCHED);
     kinfo("[ChCore] sched init finished\n");
+    futex_init();
+    notification_init();
 
 #ifndef TEST
     init_test();
@@ -110,6 +122,7 @@ void main(void *addr) {
      * Where the pimary CPU first returns to the user mode
      * Leave the scheduler to do its job
      */
+    ipi_init_per_cpu();
     sched();
 
     eret_to_thread(switch_context());
@@ -118,7 +131,8 @@ void main(void *addr) {
     BUG("[FATAL] Should never be here!\n");
 }
 
-void secondary_start(void) {
+void secondary_start(u32 cpuid) {
+    percpu_init(cpuid);
     kinfo("AP %u is activated!\n", smp_get_cpu_id());
     exception_init_per_cpu();
 
@@ -139,6 +153,7 @@ void secondary_start(void) {
      */
     lock_kernel();
     /* Where the AP first returns to the user mode */
+    ipi_init_per_cpu();
     sched();
     eret_to_thread(switch_context());
 
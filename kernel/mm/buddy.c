@@ -2,9 +2,43 @@
 
 #include <common/kmalloc.h>
 #include <common/kprint.h>
+#include <common/lock.h>
 #include <common/macro.h>
 #include <common/util.h>
 
+static struct page *pageblock_head(struct phys_mem_pool *pool,
+                                   struct page *page) {
+    u64 page_idx = page - pool->page_metadata;
+
+    return pool->page_metadata + ROUND_DOWN(page_idx, PAGEBLOCK_PAGES);
+}
+
+int get_pageblock_migratetype(struct phys_mem_pool *pool, struct page *page) {
+    return pageblock_head(pool, page)->migratetype;
+}
+
+static void set_pageblock_migratetype(struct phys_mem_pool *pool,
+                                      struct page *page, int migratetype) {
+    pageblock_head(pool, page)->migratetype = migratetype;
+}
+
+/* A free chunk goes to the list of the pageblock it starts in. */
+static void add_to_free_list(struct phys_mem_pool *pool, struct page *page,
+                             int order) {
+    struct free_list *list = &pool->free_lists[order];
+    int migratetype = get_pageblock_migratetype(pool, page);
+
+    list_add(&page->node, &list->free_list[migratetype]);
+    list->nr_free++;
+}
+
+static void del_from_free_list(struct phys_mem_pool *pool, struct page *page) {
+    list_del(&page->node);
+    pool->free_lists[page->order].nr_free--;
+}
+
+static void __buddy_free_pages(struct phys_mem_pool *pool, struct page *page);
+
 /*
  * The layout of a phys_mem_pool:
  * | page_metadata are (an array of struct page) | alignment pad | usable memory
@@ -14,7 +48,7 @@
  */
 void init_buddy(struct phys_mem_pool *pool, struct page *start_page,
                 vaddr_t start_addr, u64 page_num) {
-    int order;
+    int order, migratetype;
     u64 page_idx;
     struct page *page;
 
@@ -24,11 +58,13 @@ void init_buddy(struct phys_mem_pool *pool, struct page *start_page,
     pool->pool_mem_size = page_num * BUDDY_PAGE_SIZE;
     /* This field is for unit test only. */
     pool->pool_phys_page_num = page_num;
+    lock_init(&pool->buddy_lock);
 
     /* Init the free lists */
     for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
         pool->free_lists[order].nr_free = 0;
-        init_list_head(&(pool->free_lists[order].free_list));
+        for (migratetype = 0; migratetype < MIGRATE_TYPES; ++migratetype)
+            init_list_head(&(pool->free_lists[order].free_list[migratetype]));
     }
 
     /* Clear the page_metadata area. */
@@ -41,10 +77,17 @@ void init_buddy(struct phys_mem_pool *pool, struct page *start_page,
         page->order = 0;
     }
 
+    /*
+     * All pageblocks start as movable. Unmovable allocations claim whole
+     * pageblocks from them on demand (see steal_free_chunk).
+     */
+    for (page_idx = 0; page_idx < page_num; page_idx += PAGEBLOCK_PAGES)
+        start_page[page_idx].migratetype = MIGRATE_MOVABLE;
+
     /* Put each physical memory page into the free lists. */
     for (page_idx = 0; page_idx < page_num; ++page_idx) {
         page = start_page + page_idx;
-        buddy_free_pages(pool, page);
+        __buddy_free_pages(pool, page);
     }
 }
 
@@ -98,11 +141,8 @@ static struct page *split_page(struct phys_mem_pool *pool, u64 target_order,
                                struct page *page) {
     if (page->order == target_order) return page;
     struct page *splitted = NULL;
-    struct free_list *list = &pool->free_lists[page->order];
-    list->nr_free--;
-    list_del(&page->node);
+    del_from_free_list(pool, page);
     int small_order = page->order - 1;
-    struct free_list *small_list = &pool->free_lists[small_order];
     struct page *sub_page1 = page;
     struct page *sub_page2 = page + (1 << small_order);
     struct page *pages[] = {sub_page1, sub_page2};
@@ -110,38 +150,119 @@ static struct page *split_page(struct phys_mem_pool *pool, u64 target_order,
         struct page *p = pages[i];
         p->order = small_order;
         p->allocated = 0;
-        list_add(&p->node, &small_list->free_list);
+        add_to_free_list(pool, p, small_order);
     }
-    small_list->nr_free += 2;
     splitted = sub_page1;
     return split_page(pool, target_order, splitted);
 }
 
+static struct page *find_free_chunk(struct phys_mem_pool *pool, u64 order,
+                                   int migratetype) {
+    struct list_head *list;
+
+    for (; order < BUDDY_MAX_ORDER; order++) {
+        list = &pool->free_lists[order].free_list[migratetype];
+        if (!list_empty(list)) return list_entry(list->prev, struct page, node);
+    }
+    return NULL;
+}
+
+/*
+ * Fall back to a free chunk of another migrate type. Take the largest one so
+ * that a whole pageblock can be claimed instead of mixing the two types in
+ * one pageblock; the rest of a chunk larger than a pageblock keeps its type.
+ */
+static struct page *steal_free_chunk(struct phys_mem_pool *pool, u64 order,
+                                     int migratetype) {
+    struct list_head *list;
+    struct page *page;
+    int fallback;
+    s64 cur;
+
+    for (cur = BUDDY_MAX_ORDER - 1; cur >= (s64)order; cur--) {
+        for (fallback = 0; fallback < MIGRATE_TYPES; fallback++) {
+            if (fallback == migratetype) continue;
+            list = &pool->free_lists[cur].free_list[fallback];
+            if (list_empty(list)) continue;
+            page = list_entry(list->prev, struct page, node);
+            if (cur >= PAGEBLOCK_ORDER)
+                set_pageblock_migratetype(pool, page, migratetype);
+            return page;
+        }
+    }
+    return NULL;
+}
+
 /**
- * buddy_get_pages: get free page from buddy system.
+ * buddy_get_pages_migratetype: get free page from buddy system.
  * @param pool physical memory structure reserved in the kernel
  * @param order get the (1<<order) continuous pages from the buddy system
+ * @param migratetype MIGRATE_UNMOVABLE or MIGRATE_MOVABLE
  *
  */
-struct page *buddy_get_pages(struct phys_mem_pool *pool, u64 order) {
+struct page *buddy_get_pages_migratetype(struct phys_mem_pool *pool, u64 order,
+                                         int migratetype) {
     //  Hints: Find the corresponding free_list which can allocate 1<<order
     //  continuous pages and don't forget to split the list node after
     //  allocation
     struct page *page = NULL;
-    if (order < 0 || order > BUDDY_MAX_ORDER) return NULL;
-    struct free_list *list = &pool->free_lists[order];
-    // find an order that can satisfy the request
-    int order_it = order;
-    while (list->nr_free == 0) {
-        if (order_it >= BUDDY_MAX_ORDER) return NULL;
-        list = &pool->free_lists[++order_it];
+    if (order >= BUDDY_MAX_ORDER) return NULL;
+    lock(&pool->buddy_lock);
+    page = find_free_chunk(pool, order, migratetype);
+    if (!page) page = steal_free_chunk(pool, order, migratetype);
+    if (page) {
+        page = split_page(pool, order, page);
+        del_from_free_list(pool, page);
+        page->allocated = 1;
     }
-    void *node_ptr = list->free_list.prev;
-    page = node_ptr - offsetof(struct page, node);
-    page = split_page(pool, order, page);
-    pool->free_lists[page->order].nr_free--;
-    list_del(node_ptr);
-    page->allocated = 1;
+    unlock(&pool->buddy_lock);
+    return page;
+}
+
+/* Kernel allocations are unmovable. */
+struct page *buddy_get_pages(struct phys_mem_pool *pool, u64 order) {
+    return buddy_get_pages_migratetype(pool, order, MIGRATE_UNMOVABLE);
+}
+
+/*
+ * Whether @page heads a free chunk, i.e. is on a free list of its order. A
+ * free page merged into the chunk of its buddy keeps its stale metadata,
+ * so only the lists tell. Called with the buddy lock held.
+ */
+static bool is_free_chunk_head(struct phys_mem_pool *pool, struct page *page) {
+    struct free_list *list;
+    struct page *head;
+    int migratetype;
+
+    if (page->allocated || page->order < 0 || page->order >= BUDDY_MAX_ORDER)
+        return false;
+    list = &pool->free_lists[page->order];
+    for (migratetype = 0; migratetype < MIGRATE_TYPES; ++migratetype) {
+        for_each_in_list(head, struct page, node,
+                         &list->free_list[migratetype]) {
+            if (head == page) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * buddy_isolate_free_page: take the first page of the free chunk headed by
+ * @page as an order-0 allocation. The rest of the chunk stays free.
+ * Used by compaction to pick migration targets at given locations.
+ * Returns NULL if the chunk was allocated or merged into another meanwhile.
+ */
+struct page *buddy_isolate_free_page(struct phys_mem_pool *pool,
+                                     struct page *page) {
+    lock(&pool->buddy_lock);
+    if (!is_free_chunk_head(pool, page)) {
+        page = NULL;
+    } else {
+        page = split_page(pool, 0, page);
+        del_from_free_list(pool, page);
+        page->allocated = 1;
+    }
+    unlock(&pool->buddy_lock);
     return page;
 }
 
@@ -166,13 +287,11 @@ static struct page *merge_page(struct phys_mem_pool *pool, struct page *page) {
         // buddy is not allocated, merge
         int new_order = order + 1;
         // update free_list: remove old pages from its freelist, add to new list
-        list_del(&page->node);
-        list_del(&buddy_page->node);
-        list_add(&merged->node, &pool->free_lists[new_order].free_list);
+        del_from_free_list(pool, page);
+        del_from_free_list(pool, buddy_page);
         merged->allocated = 0;
         merged->order = new_order;
-        pool->free_lists[order].nr_free -= 2;
-        pool->free_lists[new_order].nr_free += 1;
+        add_to_free_list(pool, merged, new_order);
     } else {
         return page;
     }
@@ -185,20 +304,24 @@ static struct page *merge_page(struct phys_mem_pool *pool, struct page *page) {
  * @param page free page structure
  * Hints: you can invoke merge_page.
  */
-void buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
+static void __buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
     if (!page->allocated) return;
     page->allocated = 0;
+    page->pmo = NULL;
     // put to list
     int order = page->order;
-    if (order < 0 || order > BUDDY_MAX_ORDER) return;
-    struct free_list *freelists = pool->free_lists;
-    struct free_list *list = &freelists[order];
-    list_add(&page->node, &list->free_list);
-    list->nr_free++;
+    if (order < 0 || order >= BUDDY_MAX_ORDER) return;
+    add_to_free_list(pool, page, order);
     // merge
     merge_page(pool, page);
 }
 
+void buddy_free_pages(struct phys_mem_pool *pool, struct page *page) {
+    lock(&pool->buddy_lock);
+    __buddy_free_pages(pool, page);
+    unlock(&pool->buddy_lock);
+}
+
 void *page_to_virt(struct phys_mem_pool *pool, struct page *page) {
     u64 addr;
 
@@ -222,6 +345,7 @@ u64 get_free_mem_size_from_buddy(struct phys_mem_pool *pool) {
     u64 current_order_size;
     u64 total_size = 0;
 
+    lock(&pool->buddy_lock);
     for (order = 0; order < BUDDY_MAX_ORDER; order++) {
         /* 2^order * 4K */
         current_order_size = BUDDY_PAGE_SIZE * (1 << order);
@@ -232,5 +356,31 @@ u64 get_free_mem_size_from_buddy(struct phys_mem_pool *pool) {
         kdebug("buddy memory chunk order: %d, size: 0x%lx, num: %d\n", order,
                current_order_size, list->nr_free);
     }
+    unlock(&pool->buddy_lock);
     return total_size;
 }
+
+/**
+ * buddy_fragmentation_index: tell why an allocation of @order would fail.
+ * The index is in thousandths: values towards 0 mean the failure is due to
+ * lack of memory, values towards 1000 mean it is due to fragmentation.
+ * -1000 means an allocation of @order would succeed.
+ */
+int buddy_fragmentation_index(struct phys_mem_pool *pool, u64 order) {
+    u64 free_pages = 0, free_blocks = 0, suitable_blocks = 0;
+    u64 nr_free;
+    int cur;
+
+    lock(&pool->buddy_lock);
+    for (cur = 0; cur < BUDDY_MAX_ORDER; cur++) {
+        nr_free = pool->free_lists[cur].nr_free;
+        free_blocks += nr_free;
+        free_pages += nr_free << cur;
+        if (cur >= order) suitable_blocks += nr_free;
+    }
+    unlock(&pool->buddy_lock);
+
+    if (free_blocks == 0) return 0;
+    if (suitable_blocks != 0) return -1000;
+    return 1000 - (1000 + free_pages * 1000 / (1UL << order)) / free_blocks;
+}
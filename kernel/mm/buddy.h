@@ -2,6 +2,7 @@
 
 #include <common/types.h>
 #include <common/list.h>
+#include <common/lock.h>
 
 /*
  * Supported Order: [0, BUDDY_MAX_ORDER).
@@ -11,6 +12,23 @@
 #define BUDDY_PAGE_SIZE     (0x1000)
 #define BUDDY_MAX_ORDER     (14UL)
 
+/*
+ * Physical memory is grouped into pageblocks of 2^PAGEBLOCK_ORDER pages
+ * (2M, i.e., one L2 block). Every pageblock has a migrate type, and a free
+ * chunk sits on the free list of the type of the pageblock it starts in.
+ * Unmovable (kernel) and movable (anonymous user) allocations are therefore
+ * kept in separate pageblocks as long as possible, which lets compaction
+ * rebuild high-order blocks by migrating the movable pages away.
+ */
+#define PAGEBLOCK_ORDER (9UL)
+#define PAGEBLOCK_PAGES (1UL << PAGEBLOCK_ORDER)
+
+#define MIGRATE_UNMOVABLE 0
+#define MIGRATE_MOVABLE   1
+#define MIGRATE_TYPES     2
+
+struct pmobject;
+
 /* `struct page` is the metadata of one physical 4k page. */
 struct page {
 	/* Free list */
@@ -21,10 +39,15 @@ struct page {
 	int order;
 	/* Used for ChCore slab allocator. */
 	void *slab;
+	/* Migrate type of the pageblock (only valid in its first page). */
+	int migratetype;
+	/* Owner of a movable page: the PMO and the page index in the PMO. */
+	struct pmobject *pmo;
+	u64 pmo_index;
 };
 
 struct free_list {
-	struct list_head free_list;
+	struct list_head free_list[MIGRATE_TYPES];
 	u64 nr_free;
 };
 
@@ -51,6 +74,9 @@ struct phys_mem_pool {
 
 	/* The free list of different free-memory-chunk orders. */
 	struct free_list free_lists[BUDDY_MAX_ORDER];
+
+	/* Protects the free lists and the metadata of the pages. */
+	struct lock buddy_lock;
 };
 
 /* Currently, ChCore only uses one physical memory pool. */
@@ -60,7 +86,14 @@ void init_buddy(struct phys_mem_pool *zone, struct page *start_page,
 		vaddr_t start_addr, u64 page_num);
 
 struct page *buddy_get_pages(struct phys_mem_pool *, u64 order);
+struct page *buddy_get_pages_migratetype(struct phys_mem_pool *, u64 order,
+					 int migratetype);
 void buddy_free_pages(struct phys_mem_pool *, struct page *page);
+struct page *buddy_isolate_free_page(struct phys_mem_pool *,
+				     struct page *page);
+
+int get_pageblock_migratetype(struct phys_mem_pool *, struct page *page);
+int buddy_fragmentation_index(struct phys_mem_pool *, u64 order);
 
 void *page_to_virt(struct phys_mem_pool *, struct page *page);
 struct page *virt_to_page(struct phys_mem_pool *, void *ptr);
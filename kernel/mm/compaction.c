@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Memory compaction: migrate movable (anonymous user) pages from the low
+ * movable pageblocks into free pages of the high movable pageblocks, so that
+ * the buddy allocator can merge the evacuated pageblocks into high-order
+ * chunks again.
+ *
+ * A migrate scanner walks the pageblocks upwards and a free scanner walks
+ * them downwards; compaction stops when they meet.
+ *
+ * The scanners read the page metadata without the buddy lock, so a page may
+ * change under them: the migration takes the locks of the pmo and of its
+ * mappers with try_lock, checks that the page still belongs to the pmo, and
+ * skips the page otherwise. PMOs are only destroyed with the big kernel lock
+ * held, as compaction is, so page->pmo stays valid meanwhile.
+ */
+
+#include <common/kmalloc.h>
+#include <common/kprint.h>
+#include <common/macro.h>
+#include <common/mm.h>
+#include <common/mmu.h>
+#include <common/types.h>
+#include <common/util.h>
+#include <mm/vmspace.h>
+
+#include "buddy.h"
+
+extern void flush_tlb(void);
+
+struct compact_control {
+    struct phys_mem_pool *pool;
+    /* whether the pageblock is split into chunks smaller than a pageblock */
+    bool *split_blocks;
+    u64 nr_blocks;
+    /* pageblock scanned by the migrate scanner */
+    u64 migrate_blk;
+    /* pageblock and position of the free scanner */
+    u64 free_blk;
+    struct page *free_cursor;
+};
+
+static struct page *block_first_page(struct compact_control *cc, u64 blk) {
+    return cc->pool->page_metadata + blk * PAGEBLOCK_PAGES;
+}
+
+/*
+ * The metadata of the first page of every chunk (free or allocated) is kept
+ * up to date, so the chunks can be walked from the start of the pool. Only
+ * the pageblocks made of chunks smaller than a pageblock are worth scanning.
+ */
+static void find_split_blocks(struct compact_control *cc) {
+    struct page *page;
+    u64 page_idx;
+
+    memset(cc->split_blocks, 0, cc->nr_blocks * sizeof(bool));
+    page_idx = 0;
+    while (page_idx < cc->nr_blocks * PAGEBLOCK_PAGES) {
+        page = cc->pool->page_metadata + page_idx;
+        if (page->order < PAGEBLOCK_ORDER)
+            cc->split_blocks[page_idx / PAGEBLOCK_PAGES] = true;
+        page_idx += 1UL << page->order;
+    }
+}
+
+static bool is_movable_page(struct page *page) {
+    return page->allocated && page->order == 0 && page->slab == NULL &&
+           page->pmo != NULL && page->pmo->type == PMO_ANONYM;
+}
+
+static bool is_compaction_block(struct compact_control *cc, u64 blk) {
+    return cc->split_blocks[blk] &&
+           get_pageblock_migratetype(cc->pool, block_first_page(cc, blk)) ==
+               MIGRATE_MOVABLE;
+}
+
+/* A pageblock can only be freed up if every allocated page is movable. */
+static bool is_evacuable_block(struct compact_control *cc, u64 blk) {
+    struct page *page, *end;
+    bool has_movable = false;
+
+    page = block_first_page(cc, blk);
+    end = page + PAGEBLOCK_PAGES;
+    for (; page < end; page += 1UL << page->order) {
+        if (!page->allocated) continue;
+        if (!is_movable_page(page)) return false;
+        has_movable = true;
+    }
+    return has_movable;
+}
+
+/*
+ * Take a free page from the highest movable pageblock above the migrate
+ * scanner. Splitting the free chunk keeps the page after the isolated one
+ * a chunk head, so the cursor can go on from there.
+ */
+static struct page *isolate_free_target(struct compact_control *cc) {
+    struct page *end;
+
+    while (cc->free_blk > cc->migrate_blk) {
+        if (!is_compaction_block(cc, cc->free_blk)) {
+            cc->free_blk--;
+            cc->free_cursor = NULL;
+            continue;
+        }
+        if (!cc->free_cursor)
+            cc->free_cursor = block_first_page(cc, cc->free_blk);
+        end = block_first_page(cc, cc->free_blk) + PAGEBLOCK_PAGES;
+        while (cc->free_cursor < end) {
+            if (!cc->free_cursor->allocated) {
+                struct page *target;
+
+                target = buddy_isolate_free_page(cc->pool, cc->free_cursor);
+                if (!target) {
+                    /* allocated since it was read: go on with the walk */
+                    cc->free_cursor++;
+                    continue;
+                }
+                cc->free_cursor = target + 1;
+                return target;
+            }
+            cc->free_cursor += 1UL << cc->free_cursor->order;
+        }
+        cc->free_blk--;
+        cc->free_cursor = NULL;
+    }
+    return NULL;
+}
+
+/* Whether a vmregion before @vmr in the mappings of @pmo has its vmspace */
+static bool vmspace_seen_before(struct pmobject *pmo, struct vmregion *vmr) {
+    struct vmregion *prev;
+
+    for_each_in_list(prev, struct vmregion, mapping_node, &pmo->mapping_list) {
+        if (prev == vmr) return false;
+        if (prev->vmspace == vmr->vmspace) return true;
+    }
+    return false;
+}
+
+/* Lock the vmspaces mapping @pmo, or none of them if one is busy */
+static bool try_lock_mappers(struct pmobject *pmo) {
+    struct vmregion *vmr, *locked;
+
+    for_each_in_list(vmr, struct vmregion, mapping_node, &pmo->mapping_list) {
+        if (vmspace_seen_before(pmo, vmr)) continue;
+        if (try_lock(&vmr->vmspace->vmspace_lock) == 0) continue;
+        for_each_in_list(locked, struct vmregion, mapping_node,
+                         &pmo->mapping_list) {
+            if (locked == vmr) break;
+            if (!vmspace_seen_before(pmo, locked))
+                unlock(&locked->vmspace->vmspace_lock);
+        }
+        return false;
+    }
+    return true;
+}
+
+static void unlock_mappers(struct pmobject *pmo) {
+    struct vmregion *vmr;
+
+    for_each_in_list(vmr, struct vmregion, mapping_node, &pmo->mapping_list) {
+        if (!vmspace_seen_before(pmo, vmr))
+            unlock(&vmr->vmspace->vmspace_lock);
+    }
+}
+
+/*
+ * Move the content of @page to @target and switch the PMO radix and every
+ * mapping of the page over to @target. The mappings are invalidated before
+ * the copy so that user threads on other cores cannot write to the old page
+ * meanwhile; they fault, wait for the vmspace lock, then find the new page
+ * in the radix.
+ *
+ * Returns false, leaving @page alone, if it is busy or no longer movable.
+ */
+static bool migrate_page(struct compact_control *cc, struct page *page,
+                         struct page *target) {
+    struct pmobject *pmo = page->pmo;
+    struct vmregion *vmr;
+    paddr_t old_pa, new_pa, pa;
+    pte_t *pte;
+    vaddr_t va;
+
+    old_pa = virt_to_phys(page_to_virt(cc->pool, page));
+    new_pa = virt_to_phys(page_to_virt(cc->pool, target));
+
+    if (!pmo || try_lock(&pmo->pmo_lock) != 0) return false;
+    if (page->pmo != pmo || get_page_from_pmo(pmo, page->pmo_index) != old_pa) {
+        unlock(&pmo->pmo_lock);
+        return false;
+    }
+    if (!try_lock_mappers(pmo)) {
+        unlock(&pmo->pmo_lock);
+        return false;
+    }
+
+    for_each_in_list(vmr, struct vmregion, mapping_node, &pmo->mapping_list) {
+        va = vmr->start + page->pmo_index * PAGE_SIZE;
+        if (va >= vmr->start + vmr->size) continue;
+        if (query_in_pgtbl(vmr->vmspace->pgtbl, va, &pa, &pte) != 0) continue;
+        if (pte->l3_page.pfn == old_pa >> PAGE_SHIFT)
+            pte->l3_page.is_valid = 0;
+    }
+    flush_tlb();
+
+    memcpy((void *)phys_to_virt(new_pa), (void *)phys_to_virt(old_pa),
+           PAGE_SIZE);
+    target->pmo = pmo;
+    target->pmo_index = page->pmo_index;
+    commit_page_to_pmo(pmo, page->pmo_index, new_pa);
+
+    /* remapping eagerly is fine: the page is the pmo's page for this va */
+    for_each_in_list(vmr, struct vmregion, mapping_node, &pmo->mapping_list) {
+        va = vmr->start + page->pmo_index * PAGE_SIZE;
+        if (va >= vmr->start + vmr->size) continue;
+        map_range_in_pgtbl(vmr->vmspace->pgtbl, va, new_pa, PAGE_SIZE,
+                           vmr->perm);
+    }
+
+    unlock_mappers(pmo);
+    unlock(&pmo->pmo_lock);
+    buddy_free_pages(cc->pool, page);
+    return true;
+}
+
+static u64 compact_block(struct compact_control *cc) {
+    struct page *page, *end, *next, *target;
+    u64 nr_migrated = 0;
+
+    page = block_first_page(cc, cc->migrate_blk);
+    end = page + PAGEBLOCK_PAGES;
+    while (page < end) {
+        /*
+         * Freeing a migrated page may merge it with the following chunks,
+         * but the stale metadata of those chunks still describes a valid
+         * split of the pageblock, so the walk goes on safely.
+         */
+        next = page + (1UL << page->order);
+        if (is_movable_page(page)) {
+            target = isolate_free_target(cc);
+            if (!target) break;
+            if (migrate_page(cc, page, target))
+                nr_migrated++;
+            else
+                buddy_free_pages(cc->pool, target);
+        }
+        page = next;
+    }
+    return nr_migrated;
+}
+
+/*
+ * compact_memory: try to rebuild free chunks of at least @order and report
+ * the fragmentation index of @order before and after.
+ *
+ * Returns the number of migrated pages.
+ */
+u64 compact_memory(u64 order) {
+    struct compact_control cc;
+    u64 nr_migrated = 0;
+    int before, after;
+
+    cc.pool = &global_mem;
+    cc.nr_blocks = cc.pool->pool_phys_page_num / PAGEBLOCK_PAGES;
+    if (cc.nr_blocks < 2) return 0;
+    cc.split_blocks = kmalloc(cc.nr_blocks * sizeof(bool));
+    if (!cc.split_blocks) return 0;
+    find_split_blocks(&cc);
+
+    before = buddy_fragmentation_index(cc.pool, order);
+
+    cc.free_blk = cc.nr_blocks - 1;
+    cc.free_cursor = NULL;
+    for (cc.migrate_blk = 0; cc.migrate_blk < cc.free_blk; cc.migrate_blk++) {
+        if (!is_compaction_block(&cc, cc.migrate_blk) ||
+            !is_evacuable_block(&cc, cc.migrate_blk))
+            continue;
+        nr_migrated += compact_block(&cc);
+    }
+
+    after = buddy_fragmentation_index(cc.pool, order);
+    kinfo("compaction: order %lu, migrated %lu pages, fragmentation index "
+          "%d -> %d\n",
+          order, nr_migrated, before, after);
+
+    kfree(cc.split_blocks);
+    return nr_migrated;
+}
@@ -14,12 +14,27 @@
 #include <common/macro.h>
 #include <common/util.h>
 #include <common/errno.h>
+#include <common/kmalloc.h>
 
 #include "slab.h"
 #include "buddy.h"
 
 #define _SIZE (1UL << SLAB_MAX_ORDER)
 
+/*
+ * When no high-order chunk is left, compact the memory once and retry
+ * before giving up.
+ */
+static struct page *get_pages_compact(u64 order)
+{
+	struct page *p_page;
+
+	p_page = buddy_get_pages(&global_mem, order);
+	if (p_page == NULL && order > 0 && compact_memory(order) > 0)
+		p_page = buddy_get_pages(&global_mem, order);
+	return p_page;
+}
+
 u64 size_to_page_order(u64 size)
 {
 	u64 order;
@@ -55,7 +70,9 @@ void *kmalloc(size_t size)
 	else
 		order = size_to_page_order(size);
 
-	p_page = buddy_get_pages(&global_mem, order);
+	p_page = get_pages_compact(order);
+	if (p_page == NULL)
+		return NULL;
 	return page_to_virt(&global_mem, p_page);
 }
 
@@ -88,7 +105,9 @@ void *get_pages(int order)
 {
 	struct page *p_page;
 
-	p_page = buddy_get_pages(&global_mem, order);
+	p_page = get_pages_compact(order);
+	if (p_page == NULL)
+		return NULL;
 	return page_to_virt(&global_mem, p_page);
 }
 
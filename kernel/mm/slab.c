@@ -13,12 +13,15 @@
 #include <common/macro.h>
 #include <common/types.h>
 #include <common/kprint.h>
+#include <common/lock.h>
 
 #include "slab.h"
 #include "buddy.h"
 
 /* local variables */
 slab_header_t *slabs[SLAB_MAX_ORDER + 1];
+/* each class has its own lock, protecting its slabs and their free lists */
+static struct lock slabs_locks[SLAB_MAX_ORDER + 1];
 
 /* local functions */
 static inline u64 size_to_order(u64 size)
@@ -131,11 +134,13 @@ static void *_alloc_in_slab_nolock(slab_header_t * slab_header, int order)
 	return _alloc_in_slab_nolock(new_slab, order);
 }
 
-static void *_alloc_in_slab(slab_header_t * slab_header, int order)
+static void *_alloc_in_slab(int order)
 {
 	void *free_slot;
 
-	free_slot = _alloc_in_slab_nolock(slab_header, order);
+	lock(&slabs_locks[order]);
+	free_slot = _alloc_in_slab_nolock(slabs[order], order);
+	unlock(&slabs_locks[order]);
 
 	return free_slot;
 }
@@ -150,6 +155,7 @@ void init_slab()
 
 	/* slab obj size: 32, 64, 128, 256, 512, 1024, 2048 */
 	for (order = SLAB_MIN_ORDER; order <= SLAB_MAX_ORDER; order++) {
+		lock_init(&slabs_locks[order]);
 		slabs[order] = init_slab_cache(order, SLAB_INIT_SIZE);
 	}
 	kdebug("mm: finish initing slab allocators\n");
@@ -165,7 +171,7 @@ void *alloc_in_slab(u64 size)
 	if (order < SLAB_MIN_ORDER)
 		order = SLAB_MIN_ORDER;
 
-	return _alloc_in_slab(slabs[order], order);
+	return _alloc_in_slab(order);
 }
 
 void free_in_slab(void *addr)
@@ -179,6 +185,8 @@ void free_in_slab(void *addr)
 	BUG_ON(page == NULL);
 
 	slab = page->slab;
+	lock(&slabs_locks[slab->order]);
 	slot->next_free = slab->free_list_head;
 	slab->free_list_head = slot;
+	unlock(&slabs_locks[slab->order]);
 }
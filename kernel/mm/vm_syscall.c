@@ -11,6 +11,7 @@
  */
 
 #include <common/kmalloc.h>
+#include <common/lock.h>
 #include <common/mm.h>
 #include <common/uaccess.h>
 #include <mm/vmspace.h>
@@ -51,14 +52,17 @@ int sys_create_pmo(u64 size, u64 type) {
         r = -ENOMEM;
         goto out_fail;
     }
-    pmo_init(pmo, type, size, 0);
+    r = pmo_init(pmo, type, size, 0);
+    if (r < 0) goto out_free_obj;
     cap = cap_alloc(current_process, pmo, 0);
     if (cap < 0) {
         r = cap;
-        goto out_free_obj;
+        goto out_deinit_pmo;
     }
 
     return cap;
+out_deinit_pmo:
+    pmo_deinit(pmo);
 out_free_obj:
     obj_free(pmo);
 out_fail:
@@ -114,6 +118,9 @@ int sys_create_pmos(u64 user_buf, u64 cnt) {
 static int read_write_pmo(u64 pmo_cap, u64 offset, u64 user_buf, u64 size,
                           u64 type) {
     struct pmobject *pmo;
+    u64 chunk;
+    paddr_t pa;
+    char *kva;
     int r = 0;
 
     /* caller should have the pmo_cap */
@@ -134,14 +141,28 @@ static int read_write_pmo(u64 pmo_cap, u64 offset, u64 user_buf, u64 size,
         goto out_obj_put;
     }
 
-    if (type == WRITE_PMO)
-        r = copy_from_user((char *)phys_to_virt(pmo->start) + offset,
-                           (char *)user_buf, size);
-    else if (type == READ_PMO)
-        r = copy_to_user((char *)user_buf,
-                         (char *)phys_to_virt(pmo->start) + offset, size);
-    else
-        BUG("read write pmo invalid type\n");
+    /* the backing pages of a PMO_DATA are not contiguous: copy per page */
+    while (size > 0) {
+        chunk = MIN(size, PAGE_SIZE - offset % PAGE_SIZE);
+        pa = get_page_from_pmo(pmo, offset / PAGE_SIZE);
+        if (!pa) {
+            r = -EINVAL;
+            goto out_obj_put;
+        }
+        kva = (char *)phys_to_virt(pa) + offset % PAGE_SIZE;
+
+        if (type == WRITE_PMO)
+            r = copy_from_user(kva, (char *)user_buf, chunk);
+        else if (type == READ_PMO)
+            r = copy_to_user((char *)user_buf, kva, chunk);
+        else
+            BUG("read write pmo invalid type\n");
+        if (r < 0) goto out_obj_put;
+
+        offset += chunk;
+        user_buf += chunk;
+        size -= chunk;
+    }
 
 out_obj_put:
     obj_put(pmo);
@@ -350,10 +371,12 @@ u64 sys_handle_brk(u64 addr) {
         retval = vmr->start + vmr->size;
         kdebug("sys_handle_brk: init %lu\n", retval);
     } else if (addr > (vmspace->heap_vmr->start + vmspace->heap_vmr->size)) {
-        // update
+        // update, racing with the page faults on the heap
+        lock(&vmspace->vmspace_lock);
         vmspace->heap_vmr->size = (addr - vmspace->heap_vmr->start);
         vmspace->heap_vmr->pmo->size = vmspace->heap_vmr->size;
         retval = vmspace->heap_vmr->start + vmspace->heap_vmr->size;
+        unlock(&vmspace->vmspace_lock);
         kdebug("sys_handle_brk: [+] %lu\n", retval);
     } else if (addr < (vmspace->heap_vmr->start + vmspace->heap_vmr->size)) {
         retval = -EINVAL;
@@ -16,9 +16,12 @@
 #include <common/errno.h>
 #include <common/kprint.h>
 #include <mm/vmspace.h>
+#include <mm/buddy.h>
 #include <common/kmalloc.h>
 #include <common/mm.h>
 #include <common/mmu.h>
+#include <common/rcu.h>
+#include <process/capability.h>
 
 /* local functions */
 
@@ -35,6 +38,11 @@ static void free_vmregion(struct vmregion *vmr)
 	kfree((void *)vmr);
 }
 
+static void free_vmregion_rcu(struct rcu_head *head)
+{
+	free_vmregion(container_of(head, struct vmregion, rcu));
+}
+
 /*
  * Returns 0 when no intersection detected.
  */
@@ -75,23 +83,48 @@ static int add_vmr_to_vmspace(struct vmspace *vmspace, struct vmregion *vmr)
 		printk("warning: vmr overlap\n");
 		return -EINVAL;
 	}
-	list_add(&(vmr->node), &(vmspace->vmr_list));
+	vmr->vmspace = vmspace;
+	list_add_rcu(&(vmr->node), &(vmspace->vmr_list));
+	lock(&vmr->pmo->pmo_lock);
+	list_add(&(vmr->mapping_node), &(vmr->pmo->mapping_list));
+	unlock(&vmr->pmo->pmo_lock);
 	return 0;
 }
 
 static void del_vmr_from_vmspace(struct vmspace *vmspace, struct vmregion *vmr)
 {
-	if (is_vmr_in_vmspace(vmspace, vmr))
+	struct pmobject *pmo = vmr->pmo;
+	bool free_pmo;
+
+	if (is_vmr_in_vmspace(vmspace, vmr)) {
 		list_del(&(vmr->node));
+		lock(&pmo->pmo_lock);
+		list_del(&(vmr->mapping_node));
+		free_pmo = pmo->orphan && list_empty(&pmo->mapping_list);
+		unlock(&pmo->pmo_lock);
+		/* find_vmr_for_va may be walking through it */
+		call_rcu(&vmr->rcu, free_vmregion_rcu);
+		if (free_pmo) {
+			pmo_deinit(pmo);
+			obj_put(pmo);
+		}
+		return;
+	}
 	free_vmregion(vmr);
 }
 
+/*
+ * The caller holds vmspace->vmspace_lock, or is in an RCU read-side
+ * section and checks the result again under the lock before using it to
+ * change the mappings.
+ */
 struct vmregion *find_vmr_for_va(struct vmspace *vmspace, vaddr_t addr)
 {
 	struct vmregion *vmr;
 	vaddr_t start, end;
 
-	for_each_in_list(vmr, struct vmregion, node, &(vmspace->vmr_list)) {
+	for_each_in_list_rcu(vmr, struct vmregion, node,
+			     &(vmspace->vmr_list)) {
 		start = vmr->start;
 		end = start + vmr->size;
 		if (addr >= start && addr < end)
@@ -100,20 +133,47 @@ struct vmregion *find_vmr_for_va(struct vmspace *vmspace, vaddr_t addr)
 	return NULL;
 }
 
+/*
+ * A PMO_DATA is backed by individually allocated pages which are not
+ * necessarily physically contiguous. Walk the pages in order and map each
+ * physically contiguous run with a single map_range_in_pgtbl call.
+ */
 static int fill_page_table(struct vmspace *vmspace, struct vmregion *vmr)
 {
-	size_t pm_size;
-	paddr_t pa;
-	vaddr_t va;
+	struct pmobject *pmo = vmr->pmo;
+	u64 index, nr_pages;
+	paddr_t pa, run_pa;
+	vaddr_t run_va;
+	size_t run_size;
 	int ret;
 
-	pm_size = vmr->pmo->size;
-	pa = vmr->pmo->start;
-	va = vmr->start;
-
-	ret = map_range_in_pgtbl(vmspace->pgtbl, va, pa, pm_size, vmr->perm);
+	nr_pages = ROUND_UP(pmo->size, PAGE_SIZE) / PAGE_SIZE;
+	run_va = vmr->start;
+	run_pa = 0;
+	run_size = 0;
+
+	for (index = 0; index < nr_pages; index++) {
+		pa = get_page_from_pmo(pmo, index);
+		BUG_ON(pa == 0);
+		if (run_size != 0 && pa == run_pa + run_size) {
+			run_size += PAGE_SIZE;
+			continue;
+		}
+		if (run_size != 0) {
+			ret = map_range_in_pgtbl(vmspace->pgtbl, run_va, run_pa,
+						 run_size, vmr->perm);
+			if (ret < 0)
+				return ret;
+			run_va += run_size;
+		}
+		run_pa = pa;
+		run_size = PAGE_SIZE;
+	}
 
-	return ret;
+	if (run_size != 0)
+		return map_range_in_pgtbl(vmspace->pgtbl, run_va, run_pa,
+					  run_size, vmr->perm);
+	return 0;
 }
 
 int vmspace_map_range(struct vmspace *vmspace, vaddr_t va, size_t len,
@@ -136,18 +196,21 @@ int vmspace_map_range(struct vmspace *vmspace, vaddr_t va, size_t len,
 	vmr->perm = flags;
 	vmr->pmo = pmo;
 
+	lock(&vmspace->vmspace_lock);
 	ret = add_vmr_to_vmspace(vmspace, vmr);
 
 	if (ret < 0)
-		goto out_free_vmr;
+		goto out_unlock;
 	BUG_ON((pmo->type != PMO_DATA) &&
 	       (pmo->type != PMO_ANONYM) &&
 	       (pmo->type != PMO_DEVICE) && (pmo->type != PMO_SHM));
 	/* on-demand mapping for anonymous mapping */
 	if (pmo->type == PMO_DATA)
 		fill_page_table(vmspace, vmr);
+	unlock(&vmspace->vmspace_lock);
 	return 0;
- out_free_vmr:
+ out_unlock:
+	unlock(&vmspace->vmspace_lock);
 	free_vmregion(vmr);
  out_fail:
 	return ret;
@@ -169,7 +232,9 @@ struct vmregion *init_heap_vmr(struct vmspace *vmspace, vaddr_t va,
 	vmr->perm = VMR_READ | VMR_WRITE;
 	vmr->pmo = pmo;
 
+	lock(&vmspace->vmspace_lock);
 	ret = add_vmr_to_vmspace(vmspace, vmr);
+	unlock(&vmspace->vmspace_lock);
 
 	if (ret < 0)
 		goto out_free_vmr;
@@ -188,9 +253,12 @@ int vmspace_unmap_range(struct vmspace *vmspace, vaddr_t va, size_t len)
 	vaddr_t start;
 	size_t size;
 
+	lock(&vmspace->vmspace_lock);
 	vmr = find_vmr_for_va(vmspace, va);
-	if (!vmr)
+	if (!vmr) {
+		unlock(&vmspace->vmspace_lock);
 		return -1;
+	}
 	start = vmr->start;
 	size = vmr->size;
 
@@ -202,6 +270,7 @@ int vmspace_unmap_range(struct vmspace *vmspace, vaddr_t va, size_t len)
 	del_vmr_from_vmspace(vmspace, vmr);
 
 	unmap_range_in_pgtbl(vmspace->pgtbl, va, len);
+	unlock(&vmspace->vmspace_lock);
 
 	return 0;
 }
@@ -211,6 +280,7 @@ int vmspace_unmap_range(struct vmspace *vmspace, vaddr_t va, size_t len)
 int vmspace_init(struct vmspace *vmspace)
 {
 	init_list_head(&vmspace->vmr_list);
+	lock_init(&vmspace->vmspace_lock);
 	/* alloc the root page table page */
 	vmspace->pgtbl = get_pages(0);
 	BUG_ON(vmspace->pgtbl == NULL);
@@ -226,54 +296,137 @@ int vmspace_init(struct vmspace *vmspace)
 int destroy_vmspace(struct vmspace *vmspace)
 {
 	// unmap each vmregion in vmspace->vmr_list
-	struct vmregion *vmr;
+	struct vmregion *vmr, *tmp;
 	vaddr_t start;
 	size_t size;
 
-	for_each_in_list(vmr, struct vmregion, node, &(vmspace->vmr_list)) {
+	/* compaction may still reach the vmspace through a pmo until then */
+	lock(&vmspace->vmspace_lock);
+	for_each_in_list_safe(vmr, tmp, node, &(vmspace->vmr_list)) {
 		start = vmr->start;
 		size = vmr->size;
 		del_vmr_from_vmspace(vmspace, vmr);
 		unmap_range_in_pgtbl(vmspace->pgtbl, start, size);
 	}
+	unlock(&vmspace->vmspace_lock);
 
 	kfree(vmspace);
 	return 0;
 }
 
+/* The value deleter of pmo->radix: each value is the paddr of a page */
+static void pmo_free_page(void *pa)
+{
+	free_pages((void *)phys_to_virt((paddr_t) pa));
+}
+
+/*
+ * PMO_DATA is allocated page by page: each page is zeroed and recorded in
+ * pmo->radix, so the PMO takes its size rounded up to pages instead of a
+ * power-of-two contiguous chunk.
+ */
+static int pmo_alloc_pages(struct pmobject *pmo)
+{
+	u64 index, nr_pages;
+	void *page;
+	int ret;
+
+	nr_pages = ROUND_UP(pmo->size, PAGE_SIZE) / PAGE_SIZE;
+	for (index = 0; index < nr_pages; index++) {
+		page = get_pages(0);
+		if (!page)
+			return -ENOMEM;
+		memset(page, 0, PAGE_SIZE);
+		ret = radix_add(pmo->radix, index, (void *)virt_to_phys(page));
+		if (ret < 0) {
+			free_pages(page);
+			return ret;
+		}
+	}
+	return 0;
+}
+
 /*
  * @paddr is only useful when @type == PMO_DEVICE.
  */
 /* init an allocated pmobject */
-void pmo_init(struct pmobject *pmo, pmo_type_t type, size_t len, paddr_t paddr)
+int pmo_init(struct pmobject *pmo, pmo_type_t type, size_t len, paddr_t paddr)
 {
+	int ret;
+
 	memset((void *)pmo, 0, sizeof(*pmo));
 
 	len = ROUND_UP(len, PAGE_SIZE);
 	pmo->size = len;
 	pmo->type = type;
+	init_list_head(&pmo->mapping_list);
+	lock_init(&pmo->pmo_lock);
+
+	if (type == PMO_DEVICE) {
+		pmo->start = paddr;
+		return 0;
+	}
+
+	pmo->radix = new_radix();
+	if (!pmo->radix)
+		return -ENOMEM;
+	init_radix_w_deleter(pmo->radix, pmo_free_page);
 
 	/* for a PMO_DATA, the user will use it soon (we expect) */
 	if (type == PMO_DATA) {
-		/* kmalloc(>2048) returns continous physical pages */
-		pmo->start = (paddr_t) virt_to_phys(kmalloc(len));
-	} else if (type == PMO_DEVICE) {
-		pmo->start = paddr;
-	} else {
-		/*
-		 * for stack, heap, we do not allocate the physical memory at
-		 * once
-		 */
-		pmo->radix = new_radix();
-		init_radix(pmo->radix);
+		ret = pmo_alloc_pages(pmo);
+		if (ret < 0)
+			pmo_deinit(pmo);
+		return ret;
+	}
+
+	/*
+	 * for stack, heap, we do not allocate the physical memory at
+	 * once
+	 */
+	return 0;
+}
+
+/*
+ * Free the pages and the radix of a PMO which is mapped nowhere, e.g. on
+ * the failure of its first mapping: radix_free hands every page recorded
+ * so far to pmo_free_page. The pmobject is left to the caller.
+ */
+void pmo_deinit(struct pmobject *pmo)
+{
+	if (!pmo->radix)
+		return;
+	radix_free(pmo->radix);
+	kfree(pmo->radix);
+	pmo->radix = NULL;
+}
+
+/*
+ * The deinit of a TYPE_PMO, once its last cap is freed. The mappings do not
+ * hold references, so a PMO which is still mapped takes a reference back
+ * and is freed by its last unmapping instead, in del_vmr_from_vmspace.
+ */
+void pmo_obj_deinit(void *pmo_ptr)
+{
+	struct pmobject *pmo = pmo_ptr;
+	struct object *object = container_of(pmo_ptr, struct object, opaque);
+
+	lock(&pmo->pmo_lock);
+	if (!list_empty(&pmo->mapping_list)) {
+		object->refcount = 1;
+		pmo->orphan = true;
+		unlock(&pmo->pmo_lock);
+		return;
 	}
+	unlock(&pmo->pmo_lock);
+	pmo_deinit(pmo);
 }
 
 void commit_page_to_pmo(struct pmobject *pmo, u64 index, paddr_t pa)
 {
 	int ret;
 
-	BUG_ON(pmo->type != PMO_ANONYM);
+	BUG_ON(pmo->type != PMO_ANONYM && pmo->type != PMO_DATA);
 	ret = radix_add(pmo->radix, index, (void *)pa);
 	BUG_ON(ret != 0);
 }
@@ -287,6 +440,54 @@ paddr_t get_page_from_pmo(struct pmobject *pmo, u64 index)
 	return pa;
 }
 
+/*
+ * Allocate a zeroed page for @index of an anonymous PMO. The page comes from
+ * a movable pageblock and remembers its owner, so that compaction can
+ * migrate it later. The caller holds pmo->pmo_lock.
+ */
+paddr_t pmo_alloc_anon_page(struct pmobject *pmo, u64 index)
+{
+	struct page *page;
+	void *va;
+
+	page = buddy_get_pages_migratetype(&global_mem, 0, MIGRATE_MOVABLE);
+	if (!page)
+		return 0;
+	va = page_to_virt(&global_mem, page);
+	memset(va, 0, PAGE_SIZE);
+	page->pmo = pmo;
+	page->pmo_index = index;
+	commit_page_to_pmo(pmo, index, virt_to_phys(va));
+
+	return virt_to_phys(va);
+}
+
+/*
+ * Copy @len bytes from a kernel buffer into a PMO_DATA at @offset.
+ * The backing pages may be discontiguous, so copy one page at a time.
+ */
+int pmo_write(struct pmobject *pmo, u64 offset, const void *buf, size_t len)
+{
+	const char *src = buf;
+	size_t chunk;
+	paddr_t pa;
+
+	BUG_ON(pmo->type != PMO_DATA);
+	if (offset + len < offset || offset + len > pmo->size)
+		return -EINVAL;
+
+	while (len > 0) {
+		chunk = MIN(len, PAGE_SIZE - offset % PAGE_SIZE);
+		pa = get_page_from_pmo(pmo, offset / PAGE_SIZE);
+		BUG_ON(pa == 0);
+		memcpy((char *)phys_to_virt(pa) + offset % PAGE_SIZE, src, chunk);
+		src += chunk;
+		offset += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
 /* switch vmspace */
 void switch_vmspace_to(struct vmspace *vmspace)
 {
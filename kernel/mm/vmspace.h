@@ -13,7 +13,9 @@
 #pragma once
 
 #include <common/list.h>
+#include <common/lock.h>
 #include <common/mmu.h>
+#include <common/rcu.h>
 
 #include <common/radix.h>
 
@@ -26,6 +28,10 @@ struct vmregion {
 	size_t size;
 	vmr_prop_t perm;
 	struct pmobject *pmo;
+	/* reverse mapping: all the vmregions mapping the same pmo */
+	struct list_head mapping_node;	// pmo->mapping_list
+	struct vmspace *vmspace;
+	struct rcu_head rcu;
 };
 
 struct vmspace {
@@ -36,6 +42,12 @@ struct vmspace {
 
 	struct vmregion *heap_vmr;
 	vaddr_t user_current_heap;
+
+	/*
+	 * Protects the updates of vmr_list, the vmregions and pgtbl.
+	 * find_vmr_for_va may also walk vmr_list under RCU.
+	 */
+	struct lock vmspace_lock;
 };
 
 typedef u64 pmo_type_t;
@@ -52,6 +64,12 @@ struct pmobject {
 	size_t size;
 	pmo_type_t type;
 	atomic_cnt refcnt;
+	/* vmregions which map this pmo, used when migrating its pages */
+	struct list_head mapping_list;
+	/* Protects mapping_list and the radix of an anonymous pmo */
+	struct lock pmo_lock;
+	/* its last cap is freed: the last unmapping frees it */
+	bool orphan;
 
 	// if type == PMO_BACKED
 	struct file_cap *file;
@@ -59,7 +77,9 @@ struct pmobject {
 };
 
 int vmspace_init(struct vmspace *vmspace);
-void pmo_init(struct pmobject *pmo, pmo_type_t type, size_t len, paddr_t paddr);
+int pmo_init(struct pmobject *pmo, pmo_type_t type, size_t len, paddr_t paddr);
+void pmo_deinit(struct pmobject *pmo);
+void pmo_obj_deinit(void *pmo_ptr);
 
 int vmspace_map_range(struct vmspace *vmspace, vaddr_t va, size_t len,
 		      vmr_prop_t flags, struct pmobject *pmo);
@@ -71,6 +91,8 @@ void switch_vmspace_to(struct vmspace *);
 
 void commit_page_to_pmo(struct pmobject *pmo, u64 index, paddr_t pa);
 paddr_t get_page_from_pmo(struct pmobject *pmo, u64 index);
+int pmo_write(struct pmobject *pmo, u64 offset, const void *buf, size_t len);
+paddr_t pmo_alloc_anon_page(struct pmobject *pmo, u64 index);
 
 struct vmregion *init_heap_vmr(struct vmspace *vmspace, vaddr_t va,
 			       struct pmobject *pmo);
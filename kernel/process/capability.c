@@ -13,43 +13,91 @@
 #include <process/capability.h>
 #include <process/process.h>
 #include <process/thread.h>
+#include <ipc/notification.h>
+#include <mm/vmspace.h>
+#include <sched/sched.h>
 #include <common/kmalloc.h>
+#include <common/lock.h>
+#include <common/rcu.h>
 #include <common/uaccess.h>
 #include <common/printk.h>
 
 const obj_deinit_func obj_deinit_tbl[TYPE_NR] = {
 	[0 ... TYPE_NR - 1] = NULL,
 	[TYPE_THREAD] = thread_deinit,
+	[TYPE_NOTIFICATION] = notification_deinit,
+	[TYPE_PMO] = pmo_obj_deinit,
+	[TYPE_SCHED_CONT] = sched_cont_deinit,
 };
 
 /* local object operation methods */
-static void *get_opaque(struct process *process, int slot_id,
-			bool type_valid, int type)
+
+/* Take a reference on an object, unless its last one is already dropped */
+static bool object_get_unless_zero(struct object *object)
+{
+	u64 refcount;
+
+	do {
+		refcount = object->refcount;
+		if (refcount == 0)
+			return false;
+	} while (atomic_compare_exchange_64(&object->refcount, refcount,
+					    refcount + 1) != refcount);
+	return true;
+}
+
+static void object_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct object, rcu));
+}
+
+static void slot_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct object_slot, rcu));
+}
+
+/*
+ * Lock-free: the slots, their array and the objects are only freed after a
+ * grace period, and an object being freed has no reference left. Called
+ * under rcu_read_lock.
+ */
+static struct object *lookup_object(struct process *process, int slot_id,
+				    bool type_valid, int type)
 {
 	struct slot_table *slot_table = &process->slot_table;
-	struct object_slot *slot;
-	void *obj;
+	struct object_slot **slots, *slot;
+	struct object *object;
+	unsigned int size;
 
-	if (!is_valid_slot_id(slot_table, slot_id)) {
-		obj = NULL;
-		goto out_unlock_table;
-	}
+	size = rcu_dereference(slot_table->slots_size);
+	smp_rmb();
+	slots = rcu_dereference(slot_table->slots);
+	if (slot_id < 0 || slot_id >= size)
+		return NULL;
 
-	slot = get_slot(process, slot_id);
-	BUG_ON(slot->isvalid == false);
-	BUG_ON(slot->object == NULL);
-
-	if (!type_valid || slot->object->type == type) {
-		obj = slot->object->opaque;
-	} else {
-		obj = NULL;
-		goto out_unlock_slot;
-	}
+	slot = rcu_dereference(slots[slot_id]);
+	if (!slot || !slot->isvalid)
+		return NULL;
+	object = rcu_dereference(slot->object);
+	if (!object)
+		return NULL;
 
-	atomic_fetch_add_64(&slot->object->refcount, 1);
+	if (type_valid && object->type != type)
+		return NULL;
+	return object;
+}
 
- out_unlock_slot:
- out_unlock_table:
+static void *get_opaque(struct process *process, int slot_id,
+			bool type_valid, int type)
+{
+	struct object *object;
+	void *obj = NULL;
+
+	rcu_read_lock();
+	object = lookup_object(process, slot_id, type_valid, type);
+	if (object && object_get_unless_zero(object))
+		obj = object->opaque;
+	rcu_read_unlock();
 	return obj;
 }
 
@@ -68,7 +116,7 @@ static void __object_put(struct object *object)
 	u64 old_refcount;
 	old_refcount = atomic_fetch_sub_64(&object->refcount, 1);
 	if (old_refcount == 1)
-		kfree(object);
+		call_rcu(&object->rcu, object_free_rcu);
 }
 
 /* object refenrence */
@@ -77,6 +125,20 @@ void *obj_get(struct process *process, int slot_id, int type)
 	return get_opaque(process, slot_id, true, type);
 }
 
+/*
+ * Look up an object without taking a reference, under rcu_read_lock: it is
+ * only valid until the current CPU switches threads.
+ */
+void *obj_get_rcu(struct process *process, int slot_id, int type)
+{
+	struct object *object;
+
+	object = lookup_object(process, slot_id, true, type);
+	if (!object || object->refcount == 0)
+		return NULL;
+	return object->opaque;
+}
+
 void obj_put(void *obj)
 {
 	struct object *object = container_of(obj, struct object, opaque);
@@ -146,6 +208,7 @@ int cap_alloc(struct process *process, void *obj, u64 rights)
 
 	object = container_of(obj, struct object, opaque);
 
+	lock(&process->slot_table.table_guard);
 	slot_id = alloc_slot_id(process);
 	if (slot_id < 0) {
 		r = -ENOMEM;
@@ -168,11 +231,13 @@ int cap_alloc(struct process *process, void *obj, u64 rights)
 	object->refcount = 1;
 
 	install_slot(process, slot_id, slot);
+	unlock(&process->slot_table.table_guard);
 
 	return slot_id;
  out_free_slot_id:
 	free_slot_id(process, slot_id);
  out_unlock_table:
+	unlock(&process->slot_table.table_guard);
 	return r;
 }
 
@@ -184,6 +249,7 @@ int cap_free(struct process *process, int slot_id)
 	u64 old_refcount;
 	obj_deinit_func func;
 
+	lock(&process->slot_table.table_guard);
 	slot = get_slot(process, slot_id);
 	if (!slot || slot->isvalid == false) {
 		r = -ECAPBILITY;
@@ -191,7 +257,8 @@ int cap_free(struct process *process, int slot_id)
 	}
 
 	free_slot_id(process, slot_id);
-	/* no need to get slot_guard as it can not be accessed */
+	unlock(&process->slot_table.table_guard);
+	/* the lookups which still see the slot are done in a grace period */
 
 	object = slot->object;
 	old_refcount = atomic_fetch_sub_64(&object->refcount, 1);
@@ -200,16 +267,17 @@ int cap_free(struct process *process, int slot_id)
 		if (func)
 			func(object->opaque);
 		if (object->refcount == 0)
-			kfree(object);
+			call_rcu(&object->rcu, object_free_rcu);
 	}
 
 	slot->isvalid = false;
 	slot->object = NULL;
 	list_del(&slot->copies);
-	kfree(slot);
+	call_rcu(&slot->rcu, slot_free_rcu);
 
 	return r;
  out_unlock_table:
+	unlock(&process->slot_table.table_guard);
 	return r;
 }
 
@@ -219,39 +287,48 @@ int cap_copy(struct process *src_process, struct process *dest_process,
 	struct object_slot *src_slot, *dest_slot;
 	int r, dest_slot_id;
 
+	/* the two tables are never locked together */
+	lock(&src_process->slot_table.table_guard);
 	src_slot = get_slot(src_process, src_slot_id);
 	if (!src_slot || src_slot->isvalid == false) {
+		unlock(&src_process->slot_table.table_guard);
 		r = -ECAPBILITY;
-		goto out_unlock;
+		goto out;
 	}
+	atomic_fetch_add_64(&src_slot->object->refcount, 1);
+	unlock(&src_process->slot_table.table_guard);
 
-	dest_slot_id = alloc_slot_id(dest_process);
-	if (dest_slot_id == -1) {
+	dest_slot = kmalloc(sizeof(*dest_slot));
+	if (!dest_slot) {
 		r = -ENOMEM;
-		goto out_unlock;
+		goto out_put_object;
 	}
 
-	dest_slot = kmalloc(sizeof(*dest_slot));
-	if (!dest_slot) {
+	lock(&dest_process->slot_table.table_guard);
+	dest_slot_id = alloc_slot_id(dest_process);
+	if (dest_slot_id < 0) {
 		r = -ENOMEM;
-		goto out_free_slot_id;
+		goto out_unlock_dest;
 	}
-	src_slot = get_slot(src_process, src_slot_id);
-	atomic_fetch_add_64(&src_slot->object->refcount, 1);
 
 	dest_slot->slot_id = dest_slot_id;
 	dest_slot->process = dest_process;
 	dest_slot->isvalid = true;
 	dest_slot->object = src_slot->object;
 	dest_slot->rights = new_rights_valid ? new_rights : src_slot->rights;
+	/* the copies of an object are still protected by the kernel lock */
 	list_add(&dest_slot->copies, &src_slot->copies);
 
 	install_slot(dest_process, dest_slot_id, dest_slot);
+	unlock(&dest_process->slot_table.table_guard);
 
 	return dest_slot_id;
- out_free_slot_id:
-	free_slot_id(dest_process, dest_slot_id);
- out_unlock:
+ out_unlock_dest:
+	unlock(&dest_process->slot_table.table_guard);
+	kfree(dest_slot);
+ out_put_object:
+	atomic_fetch_sub_64(&src_slot->object->refcount, 1);
+ out:
 	return r;
 }
 
@@ -320,6 +397,28 @@ int sys_cap_copy_from(u64 src_process_cap, u64 src_slot_id)
 	return r;
 }
 
+/*
+ * Drop the cap @slot_id of the current process, e.g. one received in an IPC
+ * message which it does not keep. Only PMOs and notifications may be
+ * dropped: their deinit copes with the mappings and the waiters left, while
+ * the kernel uses the other objects, e.g. the vmspace or a connection being
+ * served, without holding references.
+ */
+int sys_cap_free(u64 slot_id)
+{
+	struct object *object;
+	int type;
+
+	object = __object_get(current_process, slot_id);
+	if (!object)
+		return -ECAPBILITY;
+	type = object->type;
+	__object_put(object);
+	if (type != TYPE_PMO && type != TYPE_NOTIFICATION)
+		return -EINVAL;
+	return cap_free(current_process, slot_id);
+}
+
 int sys_transfer_caps(u64 dest_group_cap, u64 src_caps_buf, int nr_caps,
 		      u64 dst_caps_buf)
 {
@@ -378,6 +477,7 @@ int sys_get_all_caps(u64 process_cap)
 	printk("thread %p cap:\n", current_thread);
 
 	slot_table = &process->slot_table;
+	lock(&slot_table->table_guard);
 	for (i = 0; i < slot_table->slots_size; i++) {
 		struct object_slot *slot = get_slot(process, i);
 		if (!slot)
@@ -386,6 +486,7 @@ int sys_get_all_caps(u64 process_cap)
 		printk("slot_id:%d type:%d\n", i,
 		       slot_table->slots[i]->object->type);
 	}
+	unlock(&slot_table->table_guard);
 
 	obj_put(process);
 	return 0;
@@ -15,6 +15,7 @@
 #include <common/types.h>
 #include <common/errno.h>
 #include <common/list.h>
+#include <common/rcu.h>
 
 struct object {
 	u64 type;
@@ -26,6 +27,8 @@ struct object {
 	 * called. Object is freed when it reaches 0.
 	 */
 	u64 refcount;
+	/* the lookups may still read it for a grace period once freed */
+	struct rcu_head rcu;
 	u64 opaque[];
 };
 
@@ -36,6 +39,7 @@ enum object_type {
 	TYPE_NOTIFICATION,
 	TYPE_PMO,
 	TYPE_VMSPACE,
+	TYPE_SCHED_CONT,
 	TYPE_NR,
 };
 
@@ -45,6 +49,7 @@ typedef void (*obj_deinit_func) (void *);
 extern const obj_deinit_func obj_deinit_tbl[TYPE_NR];
 
 void *obj_get(struct process *process, int slot_id, int type);
+void *obj_get_rcu(struct process *process, int slot_id, int type);
 void obj_put(void *obj);
 void *obj_alloc(u64 type, u64 size);
 void obj_free(void *obj);
@@ -16,6 +16,7 @@
 #include <common/util.h>
 #include <common/bitops.h>
 #include <common/kmalloc.h>
+#include <common/rcu.h>
 #include <mm/vmspace.h>
 #include <common/printk.h>
 #include <common/cpio.h>
@@ -23,7 +24,7 @@
 /* tool functions */
 bool is_valid_slot_id(struct slot_table * slot_table, int slot_id)
 {
-	if (slot_id < 0 && slot_id >= slot_table->slots_size)
+	if (slot_id < 0 || slot_id >= slot_table->slots_size)
 		return false;
 	if (!get_bit(slot_id, slot_table->slots_bmp))
 		return false;
@@ -68,10 +69,37 @@ static int slot_table_init(struct slot_table *slot_table, unsigned int size)
 	return r;
 }
 
+static void slot_table_free(struct slot_table *slot_table)
+{
+	kfree(slot_table->full_slots_bmp);
+	kfree(slot_table->slots_bmp);
+	kfree(slot_table->slots);
+}
+
+/* The arrays replaced by expand_slot_table, freed after a grace period */
+struct old_slot_table {
+	struct rcu_head rcu;
+	struct object_slot **slots;
+	unsigned long *slots_bmp;
+	unsigned long *full_slots_bmp;
+};
+
+static void old_slot_table_free(struct rcu_head *head)
+{
+	struct old_slot_table *old;
+
+	old = container_of(head, struct old_slot_table, rcu);
+	kfree(old->full_slots_bmp);
+	kfree(old->slots_bmp);
+	kfree(old->slots);
+	kfree(old);
+}
+
 static int expand_slot_table(struct slot_table *slot_table)
 {
 	unsigned int new_size, old_size;
 	struct slot_table new_slot_table;
+	struct old_slot_table *old;
 	int r;
 
 	old_size = slot_table->slots_size;
@@ -86,11 +114,24 @@ static int expand_slot_table(struct slot_table *slot_table)
 	       BITS_TO_LONGS(old_size) * sizeof(unsigned long));
 	memcpy(new_slot_table.full_slots_bmp, slot_table->full_slots_bmp,
 	       BITS_TO_LONGS(BITS_TO_LONGS(old_size)) * sizeof(unsigned long));
+
+	old = kmalloc(sizeof(*old));
+	if (!old) {
+		slot_table_free(&new_slot_table);
+		return -ENOMEM;
+	}
+	old->slots = slot_table->slots;
+	old->slots_bmp = slot_table->slots_bmp;
+	old->full_slots_bmp = slot_table->full_slots_bmp;
+
+	/* a lookup which sees the new size also sees the new slots */
+	rcu_assign_pointer(slot_table->slots, new_slot_table.slots);
+	smp_wmb();
 	slot_table->slots_size = new_size;
-	slot_table->slots = new_slot_table.slots;
 	slot_table->slots_bmp = new_slot_table.slots_bmp;
 	slot_table->full_slots_bmp = new_slot_table.full_slots_bmp;
 
+	call_rcu(&old->rcu, old_slot_table_free);
 	return 0;
 }
 
@@ -140,6 +181,7 @@ static int process_init(struct process *process, unsigned int size)
 	struct slot_table *slot_table = &process->slot_table;
 
 	BUG_ON(slot_table_init(slot_table, size));
+	lock_init(&slot_table->table_guard);
 	init_list_head(&process->thread_list);
 
 	return 0;
@@ -14,6 +14,7 @@
 
 #include <process/capability.h>
 #include <common/list.h>
+#include <common/lock.h>
 #include <common/types.h>
 #include <common/bitops.h>
 #include <common/kprint.h>
@@ -28,6 +29,7 @@ struct object_slot {
 	struct object *object;
 	/* link copied slots pointing to the same object */
 	struct list_head copies;
+	struct rcu_head rcu;
 };
 
 #define BASE_OBJECT_NUM		BITS_PER_LONG
@@ -44,6 +46,11 @@ struct slot_table {
 	 */
 	unsigned long *full_slots_bmp;
 	unsigned long *slots_bmp;
+	/*
+	 * Serializes the updates of the slots and the bitmaps, which
+	 * expanding reallocates. The lookups read the slots under RCU.
+	 */
+	struct lock table_guard;
 };
 
 struct process {
@@ -80,7 +87,7 @@ static inline void install_slot(struct process *process, int slot_id,
 				struct object_slot *slot)
 {
 	BUG_ON(!get_bit(slot_id, process->slot_table.slots_bmp));
-	process->slot_table.slots[slot_id] = slot;
+	rcu_assign_pointer(process->slot_table.slots[slot_id], slot);
 }
 
 bool is_valid_slot_id(struct slot_table *slot_table, int slot_id);
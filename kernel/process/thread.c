@@ -22,6 +22,7 @@
 #include <common/uaccess.h>
 #include <common/util.h>
 #include <exception/exception.h>
+#include <ipc/notification.h>
 #include <process/thread.h>
 #include <sched/context.h>
 
@@ -37,6 +38,9 @@ static int thread_init(struct thread *thread, struct process *process,
     thread->thread_ctx = create_thread_ctx();
     if (!thread->thread_ctx) return -ENOMEM;
     init_thread_ctx(thread, stack, pc, prio, type, aff);
+    timeout_init(&thread->timeout, NULL);
+    init_list_head(&thread->futex_node);
+    thread->notification = NULL;
     /* add to process */
     list_add(&thread->node, &process->thread_list);
     kdebug("thread_init: stack=0x%lx, pc=0x%lx thread_addr=%p\n", stack, pc, thread);
@@ -70,6 +74,11 @@ void thread_deinit(void *thread_ptr) {
             sched_dequeue(thread);
             /* fall through */
         default:
+            /* a waiting thread may have a pending timeout */
+            timeout_del(&thread->timeout);
+            futex_cancel(thread);
+            notification_cancel(thread);
+            sched_cont_unbind(thread);
             process = thread->process;
             list_del(&thread->node);
             if (list_empty(&process->thread_list)) exit_process = true;
@@ -178,32 +187,27 @@ static u64 load_binary(struct process *process, struct vmspace *vmspace,
                 r = -ENOMEM;
                 goto out_free_cap;
             }
-            pmo_init(pmo, PMO_DATA, seg_map_sz, 0);
+            r = pmo_init(pmo, PMO_DATA, seg_map_sz, 0);
+            if (r < 0) goto out_free_obj;
             pmo_cap[i] = cap_alloc(process, pmo, 0);
             if (pmo_cap[i] < 0) {
                 r = pmo_cap[i];
-                goto out_free_obj;
+                goto out_deinit_pmo;
             }
 
             /*
              * Lab3: Your code here
              * You should copy data from the elf into the physical memory in
-             * pmo. The physical address of a pmo can be get from pmo->start.
+             * pmo. The pages of a PMO_DATA are not physically contiguous, so
+             * the copy goes through pmo_write.
              */
 
-            paddr_t start_addr = pmo->start;
-            vaddr_t v_start_addr = phys_to_virt(start_addr);
-            kdebug(
-                "(p)start_addr: %lx, v_start_addr: %lx, bin: %lx, off: %lx, "
-                "filesz: %lx\n",
-                start_addr, v_start_addr, bin, elf->p_headers[i].p_offset,
-                elf->p_headers[i].p_filesz);
-            kdebug("cpy %lx <- %lx\n", v_start_addr + (p_vaddr & OFFSET_MASK),
-                   bin + elf->p_headers[i].p_offset);
-            kdebug("pmo start=0x%lx\n", pmo->start);
-            memcpy((char *)(v_start_addr + (p_vaddr & OFFSET_MASK)),
-                   bin + elf->p_headers[i].p_offset,
-                   elf->p_headers[i].p_filesz);
+            kdebug("bin: %lx, off: %lx, filesz: %lx\n", bin,
+                   elf->p_headers[i].p_offset, elf->p_headers[i].p_filesz);
+            ret = pmo_write(pmo, p_vaddr & OFFSET_MASK,
+                            bin + elf->p_headers[i].p_offset,
+                            elf->p_headers[i].p_filesz);
+            BUG_ON(ret != 0);
             flags = PFLAGS2VMRFLAGS(elf->p_headers[i].p_flags);
 
             ret = vmspace_map_range(vmspace, ROUND_DOWN(p_vaddr, PAGE_SIZE),
@@ -226,6 +230,8 @@ static u64 load_binary(struct process *process, struct vmspace *vmspace,
 
     /* PC: the entry point */
     return elf->header.e_entry;
+out_deinit_pmo:
+    pmo_deinit(pmo);
 out_free_obj:
     obj_free(pmo);
 out_free_cap:
@@ -266,11 +272,12 @@ int thread_create_main(struct process *process, u64 stack_base, u64 stack_size,
         ret = -ENOMEM;
         goto out_fail;
     }
-    pmo_init(stack_pmo, PMO_DATA, stack_size, 0);
+    ret = pmo_init(stack_pmo, PMO_DATA, stack_size, 0);
+    if (ret < 0) goto out_free_obj_pmo;
     stack_pmo_cap = cap_alloc(process, stack_pmo, 0);
     if (stack_pmo_cap < 0) {
         ret = stack_pmo_cap;
-        goto out_free_obj_pmo;
+        goto out_deinit_pmo;
     }
 
     ret = vmspace_map_range(init_vmspace, stack_base, stack_size,
@@ -289,8 +296,12 @@ int thread_create_main(struct process *process, u64 stack_base, u64 stack_size,
 
     pc = load_binary(process, init_vmspace, bin_start, &meta);
 
-    prepare_env((char *)phys_to_virt(stack_pmo->start) + stack_size, stack,
-                &meta, bin_name);
+    /* the env occupies exactly the last page of the stack */
+    BUG_ON(ENV_SIZE_ON_STACK != PAGE_SIZE);
+    prepare_env((char *)phys_to_virt(get_page_from_pmo(
+                    stack_pmo, stack_size / PAGE_SIZE - 1)) +
+                    PAGE_SIZE,
+                stack, &meta, bin_name);
     stack -= ENV_SIZE_ON_STACK;
 
     ret = thread_init(thread, process, stack, pc, prio, type, aff);
@@ -311,7 +322,9 @@ out_free_obj_thread:
     obj_free(thread);
 out_free_cap_pmo:
     cap_free(process, stack_pmo_cap);
-    stack_pmo = NULL;
+    return ret;
+out_deinit_pmo:
+    pmo_deinit(stack_pmo);
 out_free_obj_pmo:
     obj_free(stack_pmo);
 out_fail:
@@ -331,8 +344,7 @@ void switch_thread_vmspace_to(struct thread *thread) {
 
 /* Exit the current running thread */
 void sys_exit(int ret) {
-    int cpuid = smp_get_cpu_id();
-    struct thread *target = current_threads[cpuid];
+    struct thread *target = current_thread;
 
     // kinfo("sys_exit with value %d\n", ret);
     /* Set thread state */
@@ -340,9 +352,9 @@ void sys_exit(int ret) {
     obj_free(target);
 
     /* Set current running thread to NULL */
-    current_threads[cpuid] = NULL;
+    current_thread = NULL;
     /* Reschedule */
-    cur_sched_ops->sched();
+    sched();
     eret_to_thread(switch_context());
 }
 
@@ -373,7 +385,7 @@ int sys_set_affinity(u64 thread_cap, s32 aff) {
 
     /* currently, we use -1 to represent the current thread */
     if (thread_cap == -1) {
-        thread = current_threads[cpuid];
+        thread = per_cpu(cpuid, curr_thread);
         BUG_ON(!thread);
     } else {
         thread = obj_get(current_process, thread_cap, TYPE_THREAD);
@@ -396,7 +408,7 @@ int sys_get_affinity(u64 thread_cap) {
 
     /* currently, we use -1 to represent the current thread */
     if (thread_cap == -1) {
-        thread = current_threads[cpuid];
+        thread = per_cpu(cpuid, curr_thread);
         BUG_ON(!thread);
     } else {
         thread = obj_get(current_process, thread_cap, TYPE_THREAD);
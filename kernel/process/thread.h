@@ -13,14 +13,15 @@
 #pragma once
 
 #include <common/list.h>
+#include <common/rbtree.h>
 #include <mm/vmspace.h>
 #include <sched/sched.h>
 #include <process/process.h>
 #include <common/smp.h>
+#include <exception/timer.h>
 #include <ipc/ipc.h>
 
-extern struct thread *current_threads[PLAT_CPU_NUM];
-#define current_thread (current_threads[smp_get_cpu_id()])
+#define current_thread (this_cpu()->curr_thread)
 #define DEFAULT_KERNEL_STACK_SZ		(0x1000)
 
 /* Arguments for the inital thread */
@@ -28,14 +29,30 @@ extern struct thread *current_threads[PLAT_CPU_NUM];
 #define ROOT_THREAD_STACK_SIZE		(0x10000)
 #define ROOT_THREAD_PRIO		MAX_PRIO - 1
 
+/*
+ * A futex is the word at @offset of the PMO which holds it, so processes
+ * sharing the PMO use the same futex wherever they map it, and it stays the
+ * same when its page is migrated.
+ */
+struct futex_key {
+	struct pmobject *pmo;
+	u64 offset;
+};
+
 #define INVALID_AFF(aff) ((aff < 0 && aff != NO_AFF) || aff >= PLAT_CPU_NUM)
 
 struct thread {
 	struct list_head node;	// link threads in a same process
 	struct list_head ready_queue_node;	// link threads in a ready queue
+	struct rb_node ready_tree_node;	// link threads in a ready tree (fair)
 	struct list_head notification_queue_node;	// link threads in a notification waiting queue
+	struct notification *notification;	// notification waited on, if any
+	struct timeout timeout;	// timeout of a blocking wait (TS_WAITING)
+	struct list_head futex_node;	// link threads waiting on a futex
+	struct futex_key futex_key;	// the futex waited on
 	struct thread_ctx *thread_ctx;	// thread control block
 	struct vmspace *vmspace;	// memory mapping
+	struct fpsimd_state *fpsimd;	// FP/SIMD registers, allocated on first use
 
 	struct process *process;
 
@@ -43,6 +60,7 @@ struct thread {
 	struct server_ipc_config *server_ipc_config;
 };
 
+
 void switch_thread_vmspace_to(struct thread *);
 void thread_deinit(void *thread_ptr);
 int thread_create_main(struct process *process, u64 stack_base,
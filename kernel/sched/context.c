@@ -15,6 +15,7 @@
 #include <common/registers.h>
 #include <common/smp.h>
 #include <common/util.h>
+#include <exception/fpsimd.h>
 #include <process/thread.h>
 #include <sched/sched.h>
 
@@ -32,6 +33,8 @@ struct thread_ctx *create_thread_ctx(void) {
 void destroy_thread_ctx(struct thread *thread) {
     void *kernel_stack;
     BUG_ON(!thread->thread_ctx);
+    sched_stat_exit(thread);
+    fpsimd_release(thread);
     kernel_stack = (void *)thread->thread_ctx - DEFAULT_KERNEL_STACK_SZ +
                    sizeof(struct thread_ctx);
     kfree(kernel_stack);
@@ -73,6 +76,11 @@ void init_thread_ctx(struct thread *thread, u64 stack, u64 func, u32 prio,
     /* Set the budget of the thread */
     thread->thread_ctx->sc = kmalloc(sizeof(sched_cont_t));
     thread->thread_ctx->sc->budget = DEFAULT_BUDGET;
+    thread->thread_ctx->sc->vruntime = 0;
+    thread->thread_ctx->sc->exec_start = 0;
+
+    thread->fpsimd = NULL;
+    sched_stat_init(thread);
 }
 
 u64 arch_get_thread_stack(struct thread *thread) {
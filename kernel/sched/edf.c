@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Real-time scheduling contexts
+ *
+ * A scheduling context created through sys_create_sched_cont is a CPU
+ * reservation of `budget` every `period`, admitted on one CPU. The thread
+ * bound to it, and the servers it calls through IPC, which run on the
+ * donated context, are scheduled on that CPU by earliest deadline first,
+ * before the threads of the policy: the policy only runs when no real-time
+ * thread of the CPU is ready with budget left.
+ *
+ * The budget is enforced by a per-CPU timer armed when a real-time thread is
+ * switched to. A context out of budget is throttled until its deadline, when
+ * a timer replenishes it and postpones its deadline by one period (constant
+ * bandwidth server). A context woken up past its deadline, or with more
+ * budget left than its bandwidth allows until the deadline, starts a new
+ * period instead: blocking never lets it exceed its reservation.
+ */
+#include <common/errno.h>
+#include <common/kmalloc.h>
+#include <common/kprint.h>
+#include <common/lock.h>
+#include <common/machine.h>
+#include <common/macro.h>
+#include <common/rbtree.h>
+#include <common/smp.h>
+#include <common/sync.h>
+#include <common/util.h>
+#include <exception/exception.h>
+#include <exception/ipi.h>
+#include <exception/timer.h>
+#include <process/capability.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+/* Bandwidth of a CPU which may be reserved, in parts per million */
+#define EDF_MAX_UTIL 900000
+#define EDF_MIN_BUDGET_US 100
+#define EDF_MAX_PERIOD_US 10000000
+
+/*
+ * Per-CPU ready tree, ordered by absolute deadline, in cache lines of its
+ * own. A real-time thread is never in the queues of the policy, so it
+ * reuses ready_tree_node.
+ */
+struct edf_rq {
+    /* Protects the tree and the state of the contexts admitted on the CPU */
+    struct lock lock;
+    struct rb_root tree;
+    /* Ends the budget of the real-time thread running on the CPU */
+    struct timer_event budget_timer;
+    /* Bandwidth reserved on the CPU, in parts per million */
+    u64 util;
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct edf_rq edf_rqs[PLAT_CPU_NUM];
+static struct lock edf_admit_lock;
+
+/* Share of a CPU reserved by `sc`, in parts per million */
+static inline u64 edf_util_of(sched_cont_t *sc) {
+    return DIV_ROUND_UP(sc->rt_budget * 1000000, sc->period);
+}
+
+bool sched_is_realtime(struct thread *thread) {
+    return thread && thread->thread_ctx && thread->thread_ctx->sc &&
+           thread->thread_ctx->sc->period != 0;
+}
+
+static inline u64 edf_deadline(struct thread *thread) {
+    return thread->thread_ctx->sc->deadline;
+}
+
+/* Link `thread` in the tree of `cpu`, whose lock is held */
+static void __edf_enqueue(struct thread *thread, u32 cpu) {
+    struct rb_node **link = &edf_rqs[cpu].tree.node, *parent = NULL;
+    u64 deadline = edf_deadline(thread);
+
+    while (*link) {
+        parent = *link;
+        if (deadline < edf_deadline(
+                           rb_entry(parent, struct thread, ready_tree_node)))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_link_node(&thread->ready_tree_node, parent, link);
+    rb_insert_color(&thread->ready_tree_node, &edf_rqs[cpu].tree);
+    thread->thread_ctx->cpuid = cpu;
+    thread->thread_ctx->state = TS_READY;
+}
+
+/*
+ * Park `thread`, whose context is out of budget, until the deadline of the
+ * context. It stays TS_READY, but out of the tree. The tree lock is held.
+ */
+static void edf_throttle(struct thread *thread, u32 cpu) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+
+    sc->throttled = thread;
+    thread->thread_ctx->cpuid = cpu;
+    thread->thread_ctx->state = TS_READY;
+    timer_add(&sc->replenish, sc->deadline);
+}
+
+/*
+ * Make `cpu` reschedule if `thread`, just made ready there, has an earlier
+ * deadline than the thread it runs. A best-effort thread is always preempted.
+ */
+static void edf_kick(u32 cpu, struct thread *thread) {
+    struct thread *running = per_cpu(cpu, curr_thread);
+
+    if (sched_is_realtime(running) &&
+        edf_deadline(running) <= edf_deadline(thread))
+        return;
+    ipi_send(cpu, IPI_RESCHED);
+}
+
+/* Start a new period of the context at its deadline */
+static void edf_replenish(struct timer_event *event) {
+    sched_cont_t *sc = container_of(event, sched_cont_t, replenish);
+    u32 cpu = sc->cpuid;
+    struct thread *thread;
+    u64 now = timer_now();
+
+    lock(&edf_rqs[cpu].lock);
+    sc->remaining = sc->rt_budget;
+    sc->deadline += sc->period;
+    if (sc->deadline <= now) sc->deadline = now + sc->period;
+    thread = sc->throttled;
+    sc->throttled = NULL;
+    if (thread) __edf_enqueue(thread, cpu);
+    unlock(&edf_rqs[cpu].lock);
+    if (thread) edf_kick(cpu, thread);
+}
+
+/* Nothing to do: the interrupt reschedules, which charges the thread */
+static void edf_budget_expired(struct timer_event *event) {}
+
+/* Charge the time `thread` ran since its exec_start to its context */
+static void edf_charge(struct thread *thread) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+    u64 now = timer_now();
+    u64 delta = now - sc->exec_start;
+
+    sc->remaining = delta < sc->remaining ? sc->remaining - delta : 0;
+    sc->exec_start = now;
+}
+
+/*
+ * Put a real-time thread woken up or created on the CPU of its context. If
+ * the context cannot finish its budget before its deadline without
+ * exceeding its bandwidth, it starts a new period now.
+ */
+int edf_sched_enqueue(struct thread *thread) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+    u32 cpu = sc->cpuid;
+    bool throttled = false;
+    u64 now;
+
+    if (thread->thread_ctx->state == TS_READY) return -2;
+    if (thread->thread_ctx->type == TYPE_IDLE) return 0;
+
+    lock(&edf_rqs[cpu].lock);
+    now = timer_now();
+    if (now >= sc->deadline ||
+        sc->remaining * sc->period > (sc->deadline - now) * sc->rt_budget) {
+        sc->deadline = now + sc->period;
+        sc->remaining = sc->rt_budget;
+    }
+    if (sc->remaining == 0) {
+        edf_throttle(thread, cpu);
+        throttled = true;
+    } else {
+        __edf_enqueue(thread, cpu);
+    }
+    unlock(&edf_rqs[cpu].lock);
+    if (!throttled) edf_kick(cpu, thread);
+    return 0;
+}
+
+/*
+ * Remove `thread` from the tree of its context, or from its throttling. In
+ * the latter case, a replenishment which already fired on another CPU may
+ * wait for the lock to find nothing to do: wait for it to return, as the
+ * context may be freed once the thread is dequeued.
+ */
+int edf_sched_dequeue(struct thread *thread) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+    u32 cpu = sc->cpuid;
+    bool throttled;
+
+    lock(&edf_rqs[cpu].lock);
+    if (thread->thread_ctx->state != TS_READY) {
+        unlock(&edf_rqs[cpu].lock);
+        return -3;
+    }
+    throttled = sc->throttled == thread;
+    if (throttled) {
+        timer_del(&sc->replenish);
+        sc->throttled = NULL;
+    } else {
+        rb_erase(&thread->ready_tree_node, &edf_rqs[cpu].tree);
+    }
+    thread->thread_ctx->state = TS_INTER;
+    unlock(&edf_rqs[cpu].lock);
+    if (throttled) timer_del_sync(&sc->replenish);
+    return 0;
+}
+
+/*
+ * The ready thread with the earliest deadline on `cpu` which no other CPU
+ * still runs on the stack of, or NULL. The tree lock is held.
+ */
+static struct thread *edf_first_runnable(u32 cpu) {
+    struct rb_node *node;
+    struct thread *thread;
+
+    for (node = rb_first(&edf_rqs[cpu].tree); node; node = rb_next(node)) {
+        thread = rb_entry(node, struct thread, ready_tree_node);
+        if (!sched_stack_in_use(thread)) return thread;
+    }
+    return NULL;
+}
+
+/*
+ * Charge the real-time thread `prev`, which stops running on `cpu`, and put
+ * it back on the CPU of its context unless it waits. It only ran elsewhere
+ * if it bound itself to a context admitted on another CPU, which it joins
+ * here: the tree and the lock are always the ones of the context's CPU.
+ */
+static void edf_put_prev(struct thread *prev, u32 cpu) {
+    sched_cont_t *sc = prev->thread_ctx->sc;
+    u32 home = sc->cpuid;
+    bool queued = false;
+
+    timer_del(&edf_rqs[cpu].budget_timer);
+    lock(&edf_rqs[home].lock);
+    edf_charge(prev);
+    if (prev->thread_ctx->state != TS_WAITING) {
+        if (sc->remaining == 0) {
+            edf_throttle(prev, home);
+        } else {
+            __edf_enqueue(prev, home);
+            queued = true;
+        }
+    }
+    unlock(&edf_rqs[home].lock);
+    if (queued && home != cpu) edf_kick(home, prev);
+}
+
+/*
+ * Run the real-time thread with the earliest deadline, preempting a
+ * best-effort thread. Return -1 to leave the CPU to the policy if there is
+ * none: a real-time thread which ran is then replaced by the idle thread, so
+ * that the policy never sees it.
+ */
+int edf_sched(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *current = per_cpu(cpu, curr_thread);
+    struct thread *target;
+    bool current_rt = sched_is_realtime(current);
+
+    if (!current_rt && rb_empty(&edf_rqs[cpu].tree)) return -1;
+
+    if (current_rt) edf_put_prev(current, cpu);
+    lock(&edf_rqs[cpu].lock);
+    target = edf_first_runnable(cpu);
+    if (target) {
+        rb_erase(&target->ready_tree_node, &edf_rqs[cpu].tree);
+        target->thread_ctx->state = TS_INTER;
+    }
+    unlock(&edf_rqs[cpu].lock);
+
+    if (!target) {
+        if (current_rt) switch_to_thread(per_cpu(cpu, idle_thread));
+        return -1;
+    }
+    /* a preempted best-effort thread goes back to the policy */
+    if (current && !current_rt && current != per_cpu(cpu, idle_thread) &&
+        current->thread_ctx->state != TS_WAITING)
+        cur_sched_ops->sched_enqueue(current);
+
+    target->thread_ctx->sc->exec_start = timer_now();
+    timer_add(&edf_rqs[cpu].budget_timer, target->thread_ctx->sc->exec_start +
+                                          target->thread_ctx->sc->remaining);
+    switch_to_thread(target);
+    return 0;
+}
+
+void edf_sched_init(void) {
+    int i = 0;
+
+    for (i = 0; i < PLAT_CPU_NUM; i++) {
+        init_rb_root(&edf_rqs[i].tree);
+        lock_init(&edf_rqs[i].lock);
+        timer_event_init(&edf_rqs[i].budget_timer, edf_budget_expired);
+    }
+}
+
+/*
+ * Create a context reserving `budget_us` every `period_us` on the CPU with
+ * the most bandwidth left, if one can take it.
+ */
+sched_cont_t *sched_cont_create(u64 budget_us, u64 period_us) {
+    sched_cont_t *sc;
+    u64 util;
+    u32 cpu, best = 0;
+
+    if (budget_us < EDF_MIN_BUDGET_US || budget_us > period_us ||
+        period_us > EDF_MAX_PERIOD_US)
+        return ERR_PTR(-EINVAL);
+
+    sc = obj_alloc(TYPE_SCHED_CONT, sizeof(*sc));
+    if (!sc) return ERR_PTR(-ENOMEM);
+    sc->period = timer_us_to_cnt(period_us);
+    sc->rt_budget = timer_us_to_cnt(budget_us);
+    util = edf_util_of(sc);
+
+    lock(&edf_admit_lock);
+    for (cpu = 1; cpu < PLAT_CPU_NUM; cpu++) {
+        if (edf_rqs[cpu].util < edf_rqs[best].util) best = cpu;
+    }
+    if (edf_rqs[best].util + util > EDF_MAX_UTIL) {
+        unlock(&edf_admit_lock);
+        obj_free(sc);
+        return ERR_PTR(-ENOSPC);
+    }
+    edf_rqs[best].util += util;
+    unlock(&edf_admit_lock);
+
+    sc->vruntime = 0;
+    sc->exec_start = 0;
+    sc->budget = DEFAULT_BUDGET;
+    sc->cpuid = best;
+    sc->remaining = 0;
+    sc->deadline = 0;
+    sc->owner = NULL;
+    sc->throttled = NULL;
+    timer_event_init(&sc->replenish, edf_replenish);
+    return sc;
+}
+
+/* Give back the bandwidth of a context nobody refers to anymore */
+void sched_cont_deinit(void *ptr) {
+    sched_cont_t *sc = ptr;
+    u64 util = edf_util_of(sc);
+
+    BUG_ON(sc->owner || sc->throttled);
+    lock(&edf_admit_lock);
+    edf_rqs[sc->cpuid].util -= MIN(util, edf_rqs[sc->cpuid].util);
+    unlock(&edf_admit_lock);
+}
+
+/* Drop the reference of the thread bound to `sc` */
+static void sched_cont_put(sched_cont_t *sc) {
+    struct object *object = container_of((void *)sc, struct object, opaque);
+
+    if (atomic_fetch_sub_64(&object->refcount, 1) == 1) {
+        sched_cont_deinit(sc);
+        kfree(object);
+    }
+}
+
+/*
+ * Bind `thread`, which is not running elsewhere nor waiting, to `sc`, whose
+ * reference the caller passes to the thread. The context the thread had is
+ * released. The thread then runs on the CPU of the context.
+ */
+int sched_cont_bind(struct thread *thread, sched_cont_t *sc) {
+    sched_cont_t *old = thread->thread_ctx->sc;
+    bool ready = thread->thread_ctx->state == TS_READY;
+
+    if (thread->thread_ctx->type != TYPE_USER &&
+        thread->thread_ctx->type != TYPE_ROOT &&
+        thread->thread_ctx->type != TYPE_TESTS)
+        return -EINVAL;
+    if (thread != current_thread && !ready &&
+        thread->thread_ctx->state != TS_INIT)
+        return -EBUSY;
+    if (sc->owner) return -EBUSY;
+
+    if (ready) sched_dequeue(thread);
+    sched_cont_unbind(thread);
+    if (!sched_is_realtime(thread)) kfree(old);
+    sc->owner = thread;
+    thread->thread_ctx->sc = sc;
+    if (thread == current_thread) {
+        /* it runs at once, in a new period */
+        sc->exec_start = timer_now();
+        sc->deadline = sc->exec_start + sc->period;
+        sc->remaining = sc->rt_budget;
+    } else if (ready) {
+        sched_enqueue(thread);
+    }
+    return 0;
+}
+
+/* Release the context `thread` is bound to, if any */
+void sched_cont_unbind(struct thread *thread) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+
+    if (!sched_is_realtime(thread) || sc->owner != thread) return;
+    sc->owner = NULL;
+    sched_cont_put(sc);
+}
+
+/*
+ * Create a scheduling context reserving `budget_us` of CPU time every
+ * `period_us`, and return its capability
+ */
+int sys_create_sched_cont(u64 budget_us, u64 period_us) {
+    sched_cont_t *sc;
+    int cap;
+
+    sc = sched_cont_create(budget_us, period_us);
+    if (IS_ERR(sc)) return PTR_ERR(sc);
+    cap = cap_alloc(current_process, sc, 0);
+    if (cap < 0) {
+        sched_cont_deinit(sc);
+        obj_free(sc);
+    }
+    return cap;
+}
+
+/*
+ * Bind the thread `thread_cap` (-1 for the current one) to the scheduling
+ * context `sc_cap`. The current thread is rescheduled at once.
+ */
+int sys_bind_sched_cont(u64 thread_cap, u32 sc_cap) {
+    struct thread *thread;
+    sched_cont_t *sc;
+    int r;
+
+    sc = obj_get(current_process, sc_cap, TYPE_SCHED_CONT);
+    if (!sc) return -ECAPBILITY;
+    if (thread_cap == -1) {
+        thread = current_thread;
+    } else {
+        thread = obj_get(current_process, thread_cap, TYPE_THREAD);
+        if (!thread) {
+            obj_put(sc);
+            return -ECAPBILITY;
+        }
+    }
+    /* on success, the thread keeps the reference to sc */
+    r = sched_cont_bind(thread, sc);
+    if (r < 0) obj_put(sc);
+    if (thread != current_thread) {
+        obj_put(thread);
+    } else if (r == 0) {
+        arch_set_thread_return(thread, 0);
+        sched();
+        eret_to_thread(switch_context());
+    }
+    return r;
+}
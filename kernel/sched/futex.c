@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Fast user-space mutexes (futex)
+ *
+ * A futex is a 32-bit word in user memory. User space only enters the kernel
+ * when the word says there is contention: futex_wait blocks the caller if the
+ * word still holds the value it expects, and futex_wake wakes the threads
+ * blocked on the word.
+ *
+ * The waiters are kept in a hash table keyed by the PMO and the offset of
+ * the word in it, so that processes sharing the page through a PMO use the
+ * same futex wherever they map it. The physical address would not do:
+ * compaction migrates the pages of anonymous PMOs.
+ */
+#include <common/errno.h>
+#include <common/kprint.h>
+#include <common/list.h>
+#include <common/lock.h>
+#include <common/mm.h>
+#include <common/uaccess.h>
+#include <common/util.h>
+#include <exception/exception.h>
+#include <exception/timer.h>
+#include <mm/vmspace.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+
+struct futex_bucket {
+    struct lock lock;
+    struct list_head waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASH_SIZE];
+
+static inline struct futex_bucket *futex_bucket_of(struct futex_key *key) {
+    /* the low two bits of a futex offset are always 0 */
+    return &futex_table[(((u64)key->pmo >> 6) + (key->offset >> 2)) %
+                        FUTEX_HASH_SIZE];
+}
+
+static inline bool futex_key_equal(struct futex_key *a, struct futex_key *b) {
+    return a->pmo == b->pmo && a->offset == b->offset;
+}
+
+void futex_init(void) {
+    int i;
+
+    for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+        lock_init(&futex_table[i].lock);
+        init_list_head(&futex_table[i].waiters);
+    }
+}
+
+/*
+ * The key of the futex at `uaddr` of the current thread: a region maps its
+ * PMO from offset 0. The word itself is only read later, which faults its
+ * page in if needed.
+ */
+static int futex_key_of(u64 uaddr, struct futex_key *key) {
+    struct vmspace *vmspace = current_thread->vmspace;
+    struct vmregion *vmr;
+    int r = 0;
+
+    if (uaddr & (sizeof(u32) - 1)) return -EINVAL;
+    if (!is_user_addr_range(uaddr, sizeof(u32))) return -EINVAL;
+    lock(&vmspace->vmspace_lock);
+    vmr = find_vmr_for_va(vmspace, uaddr);
+    if (vmr) {
+        key->pmo = vmr->pmo;
+        key->offset = uaddr - vmr->start;
+    } else {
+        r = -EFAULT;
+    }
+    unlock(&vmspace->vmspace_lock);
+    return r;
+}
+
+/* Runs with the wheel lock held: wheel -> bucket -> run queue */
+static void futex_timeout_handler(struct timeout *timeout) {
+    struct thread *thread = container_of(timeout, struct thread, timeout);
+    struct futex_bucket *bucket = futex_bucket_of(&thread->futex_key);
+
+    lock(&bucket->lock);
+    /* a thread which has been woken up is not in the bucket any more */
+    if (!list_empty(&thread->futex_node)) {
+        list_del(&thread->futex_node);
+        init_list_head(&thread->futex_node);
+        arch_set_thread_return(thread, -ETIME);
+        BUG_ON(sched_enqueue(thread));
+    }
+    unlock(&bucket->lock);
+}
+
+/*
+ * Block the current thread on the futex at `uaddr` if it holds `val`, until
+ * futex_wake or, if `timeout_us` is not 0, until the timeout expires.
+ * Return 0 once woken up, -ETIME on timeout, or -EAGAIN at once if the futex
+ * does not hold `val` any more.
+ */
+int sys_futex_wait(u64 uaddr, u32 val, u64 timeout_us) {
+    struct thread *thread = current_thread;
+    struct futex_bucket *bucket;
+    struct futex_key key;
+    u32 cur;
+    int ret;
+
+    ret = futex_key_of(uaddr, &key);
+    if (ret < 0) return ret;
+    bucket = futex_bucket_of(&key);
+
+    /*
+     * Wakers leave the timeout pending, so cancel the one of a previous wait.
+     * Arm the new one before the thread is visible to wakers: it can only
+     * fire on this CPU, once the thread has left it.
+     */
+    timeout_del(&thread->timeout);
+    if (timeout_us) {
+        thread->timeout.handler = futex_timeout_handler;
+        timeout_add(&thread->timeout, timeout_us);
+    }
+
+    lock(&bucket->lock);
+    copy_from_user((char *)&cur, (char *)uaddr, sizeof(cur));
+    if (cur != val) {
+        unlock(&bucket->lock);
+        if (timeout_us) timeout_del(&thread->timeout);
+        return -EAGAIN;
+    }
+    thread->futex_key = key;
+    list_append(&thread->futex_node, &bucket->waiters);
+    arch_set_thread_return(thread, 0);
+    thread->thread_ctx->state = TS_WAITING;
+    thread->thread_ctx->sc->budget = 0;
+    unlock(&bucket->lock);
+
+    sched();
+    eret_to_thread(switch_context());
+    /* never returns */
+    return 0;
+}
+
+/*
+ * Wake up at most `nr` threads blocked on the futex at `uaddr`, in FIFO
+ * order. Return the number of threads woken up.
+ */
+int sys_futex_wake(u64 uaddr, u32 nr) {
+    struct futex_bucket *bucket;
+    struct thread *thread, *tmp;
+    struct futex_key key;
+    int ret, woken = 0;
+
+    ret = futex_key_of(uaddr, &key);
+    if (ret < 0) return ret;
+    bucket = futex_bucket_of(&key);
+
+    lock(&bucket->lock);
+    for_each_in_list_safe(thread, tmp, futex_node, &bucket->waiters) {
+        if ((u32)woken >= nr) break;
+        if (!futex_key_equal(&thread->futex_key, &key)) continue;
+        list_del(&thread->futex_node);
+        init_list_head(&thread->futex_node);
+        /*
+         * The state goes from TS_WAITING to TS_READY directly, since the
+         * thread may still be leaving its CPU. Its pending timeout finds it
+         * out of the bucket and does nothing.
+         */
+        BUG_ON(sched_enqueue(thread));
+        woken++;
+    }
+    unlock(&bucket->lock);
+    return woken;
+}
+
+/* Remove an exiting thread from the futex it waits on, if any */
+void futex_cancel(struct thread *thread) {
+    struct futex_bucket *bucket = futex_bucket_of(&thread->futex_key);
+
+    lock(&bucket->lock);
+    if (!list_empty(&thread->futex_node)) {
+        list_del(&thread->futex_node);
+        init_list_head(&thread->futex_node);
+    }
+    unlock(&bucket->lock);
+}
@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Fair share scheduling (fair)
+ *
+ * Each thread accumulates a virtual runtime: the time it ran, in counts of
+ * the generic timer, scaled down by its weight, prio + 1. The thread with the
+ * smallest virtual runtime runs next, taken from a per-CPU red-black tree,
+ * so CPU time is shared in proportion to the weights.
+ *
+ * Each CPU keeps a monotonic min_vruntime. A thread woken up after blocking
+ * (on IPC, a futex, a notification or a sleep) is placed at most
+ * FAIR_SLEEP_CREDIT_US before it: it runs soon, but cannot monopolize the
+ * CPU with the time it did not use. A thread moved to another CPU keeps its
+ * virtual runtime relative to the min_vruntime of its CPU.
+ */
+#include <common/errno.h>
+#include <common/kprint.h>
+#include <common/lock.h>
+#include <common/machine.h>
+#include <common/macro.h>
+#include <common/rbtree.h>
+#include <common/smp.h>
+#include <common/util.h>
+#include <exception/timer.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+/* Latency credit of a thread woken up, in microseconds */
+#define FAIR_SLEEP_CREDIT_US (TICK_US * DEFAULT_BUDGET / 2)
+/* Lead in virtual runtime for a ready thread to preempt the current one */
+#define FAIR_WAKEUP_GRAN_US TICK_US
+
+/*
+ * Per-CPU ready tree, ordered by virtual runtime, in cache lines of its own.
+ * The number of threads in it is the nr_ready of the per-CPU area.
+ */
+struct fair_rq {
+    /* Protects the tree, min_vruntime and nr_ready of the CPU */
+    struct lock lock;
+    struct rb_root tree;
+    u64 min_vruntime;
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct fair_rq fair_rqs[PLAT_CPU_NUM];
+
+static inline u64 fair_vruntime(struct thread *thread) {
+    return thread->thread_ctx->sc->vruntime;
+}
+
+static inline struct thread *fair_first(u32 cpu) {
+    struct rb_node *node = rb_first(&fair_rqs[cpu].tree);
+
+    return node ? rb_entry(node, struct thread, ready_tree_node) : NULL;
+}
+
+/*
+ * Charge the time `thread` ran since its exec_start. A thread which ran a
+ * whole tick was charged by the tick, so a longer delta comes from a thread
+ * switched to outside of the policy (e.g. by IPC) and is capped.
+ */
+static void fair_update_curr(struct thread *thread) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+    u64 now = timer_now();
+    u64 delta = sc->exec_start ? now - sc->exec_start : 0;
+    u64 max_delta = timer_us_to_cnt(TICK_US);
+
+    if (delta > max_delta) delta = max_delta;
+    sc->vruntime += delta * PRIO_NUM / (thread->thread_ctx->prio + 1);
+    sc->exec_start = now;
+}
+
+/* Raise min_vruntime of `cpu` to `vruntime`. The tree lock is held. */
+static inline void fair_update_min_vruntime(u32 cpu, u64 vruntime) {
+    if (vruntime > fair_rqs[cpu].min_vruntime)
+        fair_rqs[cpu].min_vruntime = vruntime;
+}
+
+/*
+ * Move the virtual runtime of `thread` from the timeline of `from` to the one
+ * of `to`, giving it at most FAIR_SLEEP_CREDIT_US of lead
+ */
+static void fair_place(struct thread *thread, u32 from, u32 to) {
+    sched_cont_t *sc = thread->thread_ctx->sc;
+    s64 credit = timer_us_to_cnt(FAIR_SLEEP_CREDIT_US);
+    s64 rel = (s64)(sc->vruntime - fair_rqs[from].min_vruntime);
+
+    if (rel < -credit) rel = -credit;
+    if (rel < 0 && (u64)-rel > fair_rqs[to].min_vruntime)
+        sc->vruntime = 0;
+    else
+        sc->vruntime = fair_rqs[to].min_vruntime + rel;
+}
+
+/* Link `thread` in the tree of `cpu`, whose lock is held */
+static void __fair_enqueue(struct thread *thread, u32 cpu) {
+    struct rb_node **link = &fair_rqs[cpu].tree.node, *parent = NULL;
+    u64 vruntime = fair_vruntime(thread);
+
+    while (*link) {
+        parent = *link;
+        /* equal keys go right: FIFO among equals */
+        if (vruntime < fair_vruntime(
+                           rb_entry(parent, struct thread, ready_tree_node)))
+            link = &parent->left;
+        else
+            link = &parent->right;
+    }
+    rb_link_node(&thread->ready_tree_node, parent, link);
+    rb_insert_color(&thread->ready_tree_node, &fair_rqs[cpu].tree);
+    per_cpu(cpu, nr_ready)++;
+    thread->thread_ctx->cpuid = cpu;
+    thread->thread_ctx->state = TS_READY;
+}
+
+/* Remove `thread` from its tree, whose lock is held */
+static void __fair_dequeue(struct thread *thread) {
+    u32 cpu = thread->thread_ctx->cpuid;
+
+    rb_erase(&thread->ready_tree_node, &fair_rqs[cpu].tree);
+    per_cpu(cpu, nr_ready)--;
+    thread->thread_ctx->state = TS_INTER;
+}
+
+/*
+ * Put `thread` in the tree of its `affinity`. If affinity = NO_AFF, assign
+ * the core to the current cpu, except for a new thread which goes to the
+ * least loaded cpu. A new thread starts at the min_vruntime of its CPU.
+ */
+int fair_sched_enqueue(struct thread *thread) {
+    if (thread == NULL || thread->thread_ctx == NULL) return -1;
+    if (thread->thread_ctx->type == TYPE_IDLE) return 0;
+    if (thread->thread_ctx->state == TS_READY) return -2;
+    if (thread == this_cpu_read(idle_thread)) return -3;
+    s32 aff = thread->thread_ctx->affinity;
+    if (INVALID_AFF(aff)) return -4;
+    u32 self = smp_get_cpu_id();
+    u32 cpu = aff;
+    if (aff == NO_AFF) {
+        if (thread->thread_ctx->state == TS_INIT && sched_can_migrate(thread))
+            cpu = sched_least_loaded_cpu();
+        else
+            cpu = self;
+    }
+    struct thread *current = per_cpu(self, curr_thread);
+    bool preempt = false;
+
+    /* a running thread may be preempted by a real-time one */
+    if (thread->thread_ctx->state == TS_RUNNING) fair_update_curr(thread);
+    lock(&fair_rqs[cpu].lock);
+    bool was_empty = per_cpu(cpu, nr_ready) == 0;
+    if (thread->thread_ctx->state == TS_INIT)
+        thread->thread_ctx->sc->vruntime = fair_rqs[cpu].min_vruntime;
+    else
+        fair_place(thread, thread->thread_ctx->cpuid, cpu);
+    __fair_enqueue(thread, cpu);
+    /* a thread woken up with a lead preempts the current one */
+    if (cpu == self && current && current != thread &&
+        current != per_cpu(self, idle_thread) &&
+        fair_vruntime(thread) + timer_us_to_cnt(FAIR_WAKEUP_GRAN_US) <
+            fair_vruntime(current))
+        preempt = true;
+    unlock(&fair_rqs[cpu].lock);
+    if (preempt) current->thread_ctx->sc->budget = 0;
+    sched_kick_cpu(cpu, thread, was_empty);
+    return 0;
+}
+
+/*
+ * Remove `thread` from the tree it was put in. The thread may be migrated
+ * while waiting for the lock of its tree.
+ */
+int fair_sched_dequeue(struct thread *thread) {
+    if (thread == NULL || thread->thread_ctx == NULL) return -1;
+    if (thread == this_cpu_read(idle_thread)) return -2;
+    u32 cpu;
+    while (1) {
+        cpu = thread->thread_ctx->cpuid;
+        lock(&fair_rqs[cpu].lock);
+        if (thread->thread_ctx->cpuid == cpu) break;
+        unlock(&fair_rqs[cpu].lock);
+    }
+    if (thread->thread_ctx->state != TS_READY) {
+        unlock(&fair_rqs[cpu].lock);
+        return -3;
+    }
+    __fair_dequeue(thread);
+    unlock(&fair_rqs[cpu].lock);
+    return 0;
+}
+
+/*
+ * The thread with the smallest virtual runtime on `cpu` which no other CPU
+ * still runs on the stack of, or NULL. The tree lock is held.
+ */
+static struct thread *fair_first_runnable(u32 cpu, bool migrate) {
+    struct rb_node *node;
+    struct thread *thread;
+
+    for (node = rb_first(&fair_rqs[cpu].tree); node; node = rb_next(node)) {
+        thread = rb_entry(node, struct thread, ready_tree_node);
+        if (migrate ? sched_can_migrate(thread) : !sched_stack_in_use(thread))
+            return thread;
+    }
+    return NULL;
+}
+
+/*
+ * Take the migratable thread with the smallest virtual runtime out of the
+ * busiest cpu's tree, if the load is unbalanced. It keeps the virtual
+ * runtime of that cpu until it is enqueued or run here.
+ */
+static struct thread *fair_steal_thread(void) {
+    int busiest = sched_busiest_cpu();
+    struct thread *thread;
+
+    if (busiest < 0) return NULL;
+    lock(&fair_rqs[busiest].lock);
+    thread = fair_first_runnable(busiest, true);
+    if (thread) __fair_dequeue(thread);
+    unlock(&fair_rqs[busiest].lock);
+    return thread;
+}
+
+/*
+ * Choose the thread with the smallest virtual runtime and dequeue it. If
+ * there is no ready thread on the current CPU, steal one from a busy CPU, or
+ * choose the idle thread.
+ */
+struct thread *fair_sched_choose_thread(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *target;
+
+    lock(&fair_rqs[cpu].lock);
+    target = fair_first_runnable(cpu, false);
+    if (target) {
+        __fair_dequeue(target);
+        fair_update_min_vruntime(cpu, fair_vruntime(target));
+    }
+    unlock(&fair_rqs[cpu].lock);
+    if (!target) target = fair_steal_thread();
+    if (!target) target = per_cpu(cpu, idle_thread);
+    return target;
+}
+
+/*
+ * Schedule a thread to execute. The current thread keeps the CPU until its
+ * budget runs out, which the tick and the wakeups end early when another
+ * thread is far enough behind it.
+ */
+int fair_sched(void) {
+    struct thread *current = current_thread;
+    u32 cpu = smp_get_cpu_id();
+
+    if (current && current->thread_ctx &&
+        current->thread_ctx->type != TYPE_IDLE &&
+        current->thread_ctx->sc->budget > 0) {
+        return -1;
+    }
+    if (current && current != per_cpu(cpu, idle_thread)) {
+        fair_update_curr(current);
+        if (current->thread_ctx->state != TS_WAITING)
+            fair_sched_enqueue(current);
+    }
+    struct thread *target_thread = fair_sched_choose_thread();
+    if (target_thread != per_cpu(cpu, idle_thread)) {
+        /* a stolen thread is still on the timeline of its old cpu */
+        if (target_thread->thread_ctx->cpuid != cpu) {
+            fair_place(target_thread, target_thread->thread_ctx->cpuid, cpu);
+            target_thread->thread_ctx->cpuid = cpu;
+        }
+        target_thread->thread_ctx->sc->exec_start = timer_now();
+    }
+    target_thread->thread_ctx->sc->budget = DEFAULT_BUDGET;
+    switch_to_thread(target_thread);
+    return 0;
+}
+
+int fair_sched_init(void) {
+    int i = 0;
+
+    for (i = 0; i < PLAT_CPU_NUM; i++) {
+        per_cpu(i, curr_thread) = NULL;
+        init_rb_root(&fair_rqs[i].tree);
+        fair_rqs[i].min_vruntime = 0;
+        per_cpu(i, nr_ready) = 0;
+        per_cpu(i, balance_ticks) = 0;
+        lock_init(&fair_rqs[i].lock);
+    }
+    sched_init_idle_threads();
+    kdebug("fair scheduler initialized.\n");
+
+    return 0;
+}
+
+/*
+ * Charge the current thread, and end its budget if a ready thread is behind
+ * it by more than FAIR_WAKEUP_GRAN_US. Every BALANCE_TICKS ticks, pull a
+ * thread from the busiest cpu.
+ */
+void fair_sched_handle_timer_irq(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *current = current_thread;
+    struct thread *first;
+    u64 vruntime;
+
+    if (current && current != per_cpu(cpu, idle_thread)) {
+        fair_update_curr(current);
+        if (current->thread_ctx->sc->budget > 0)
+            current->thread_ctx->sc->budget--;
+        vruntime = fair_vruntime(current);
+        lock(&fair_rqs[cpu].lock);
+        first = fair_first(cpu);
+        if (first && fair_vruntime(first) < vruntime)
+            vruntime = fair_vruntime(first);
+        fair_update_min_vruntime(cpu, vruntime);
+        if (first && fair_vruntime(first) +
+                             timer_us_to_cnt(FAIR_WAKEUP_GRAN_US) <
+                         fair_vruntime(current))
+            current->thread_ctx->sc->budget = 0;
+        unlock(&fair_rqs[cpu].lock);
+    }
+    if (++per_cpu(cpu, balance_ticks) >= BALANCE_TICKS) {
+        per_cpu(cpu, balance_ticks) = 0;
+        /* a stolen thread without affinity is enqueued on this cpu */
+        struct thread *stolen = fair_steal_thread();
+        if (stolen) fair_sched_enqueue(stolen);
+    }
+}
+
+void fair_top(void) {
+    u32 cpuid = smp_get_cpu_id();
+    struct thread *thread;
+    struct rb_node *node;
+
+    printk("Current CPU %d\n", cpuid);
+    for (cpuid = 0; cpuid < PLAT_CPU_NUM; cpuid++) {
+        printk("===== CPU %d min_vruntime %lu =====\n", cpuid,
+               fair_rqs[cpuid].min_vruntime);
+        thread = per_cpu(cpuid, curr_thread);
+        if (thread != NULL) print_thread(thread);
+        for (node = rb_first(&fair_rqs[cpuid].tree); node;
+             node = rb_next(node)) {
+            thread = rb_entry(node, struct thread, ready_tree_node);
+            print_thread(thread);
+        }
+        if (per_cpu(cpuid, curr_thread) != per_cpu(cpuid, idle_thread))
+            print_thread(per_cpu(cpuid, idle_thread));
+    }
+}
+
+struct sched_ops fair = {.sched_init = fair_sched_init,
+                         .sched = fair_sched,
+                         .sched_enqueue = fair_sched_enqueue,
+                         .sched_dequeue = fair_sched_dequeue,
+                         .sched_choose_thread = fair_sched_choose_thread,
+                         .sched_handle_timer_irq = fair_sched_handle_timer_irq,
+                         .sched_top = fair_top};
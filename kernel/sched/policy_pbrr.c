@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Priority-based Round Robin (pbrr)
+ *
+ * Each CPU has one ready queue per priority and a two-level bitmap of the
+ * non-empty queues, so the highest ready priority is found with two clz.
+ * Threads of the same priority are scheduled round robin, and a thread is
+ * preempted as soon as a higher priority thread is ready on its CPU.
+ */
+#include <common/bitops.h>
+#include <common/errno.h>
+#include <common/kprint.h>
+#include <common/list.h>
+#include <common/lock.h>
+#include <common/machine.h>
+#include <common/macro.h>
+#include <common/smp.h>
+#include <common/util.h>
+#include <exception/ipi.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+#define PRIO_BMP_WORDS (PRIO_NUM / BITS_PER_LONG)
+
+/* Bit i of summary is set iff words[i] is not zero */
+struct prio_bitmap {
+    unsigned long summary;
+    unsigned long words[PRIO_BMP_WORDS];
+};
+
+/*
+ * The per-priority ready queues of a CPU, in cache lines of their own. The
+ * number of ready threads is the nr_ready of the per-CPU area.
+ */
+struct pbrr_rq {
+    /* Protects the ready queues, the bitmap and nr_ready of the CPU */
+    struct lock lock;
+    struct prio_bitmap bitmap;
+    /* Priority of the thread the CPU runs, -1 for the idle thread */
+    volatile s32 running_prio;
+    struct list_head queues[PRIO_NUM];
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct pbrr_rq pbrr_rqs[PLAT_CPU_NUM];
+
+static inline void prio_bitmap_set(struct prio_bitmap *bmp, u32 prio) {
+    set_bit(prio, bmp->words);
+    set_bit(prio / BITS_PER_LONG, &bmp->summary);
+}
+
+static inline void prio_bitmap_clear(struct prio_bitmap *bmp, u32 prio) {
+    clear_bit(prio, bmp->words);
+    if (bmp->words[prio / BITS_PER_LONG] == 0)
+        clear_bit(prio / BITS_PER_LONG, &bmp->summary);
+}
+
+/*
+ * Return the highest priority below `limit` with ready threads, or -1 if
+ * there is none: one clz in the word of limit - 1, else one in the summary
+ * and one in the word it points to.
+ */
+static inline int prio_bitmap_highest_below(struct prio_bitmap *bmp,
+                                            int limit) {
+    unsigned long bits;
+    int word;
+
+    if (limit <= MIN_PRIO) return -1;
+    word = (limit - 1) / BITS_PER_LONG;
+    bits = bmp->words[word] &
+           (~0UL >> (BITS_PER_LONG - 1 - (limit - 1) % BITS_PER_LONG));
+    if (bits == 0) {
+        bits = bmp->summary & ((1UL << word) - 1);
+        if (bits == 0) return -1;
+        word = BITS_PER_LONG - 1 - clzl(bits);
+        bits = bmp->words[word];
+    }
+    return word * BITS_PER_LONG + BITS_PER_LONG - 1 - clzl(bits);
+}
+
+/* Return the highest priority with ready threads, or -1 if there is none */
+static inline int prio_bitmap_highest(struct prio_bitmap *bmp) {
+    return prio_bitmap_highest_below(bmp, PRIO_NUM);
+}
+
+/*
+ * Put `thread` at the end of the ready queue of its priority on the assigned
+ * `affinity`. If affinity = NO_AFF, assign the core to the current cpu, except
+ * for a new thread which goes to the least loaded cpu.
+ */
+int pbrr_sched_enqueue(struct thread *thread) {
+    if (thread == NULL || thread->thread_ctx == NULL) return -1;
+    if (thread->thread_ctx->type == TYPE_IDLE) return 0;
+    if (thread->thread_ctx->state == TS_READY) return -2;
+    if (thread == this_cpu_read(idle_thread)) return -3;
+    s32 aff = thread->thread_ctx->affinity;
+    if (INVALID_AFF(aff)) return -4;
+    u32 prio = thread->thread_ctx->prio;
+    if (prio > MAX_PRIO) return -5;
+    u32 cpu = aff;
+    if (aff == NO_AFF) {
+        if (thread->thread_ctx->state == TS_INIT && sched_can_migrate(thread))
+            cpu = sched_least_loaded_cpu();
+        else
+            cpu = smp_get_cpu_id();
+    }
+    lock(&pbrr_rqs[cpu].lock);
+    bool was_empty = per_cpu(cpu, nr_ready) == 0;
+    list_append(&thread->ready_queue_node, &pbrr_rqs[cpu].queues[prio]);
+    prio_bitmap_set(&pbrr_rqs[cpu].bitmap, prio);
+    per_cpu(cpu, nr_ready)++;
+    thread->thread_ctx->cpuid = cpu;
+    thread->thread_ctx->state = TS_READY;
+    unlock(&pbrr_rqs[cpu].lock);
+    /* preempt a lower priority thread running on another cpu at once */
+    if (cpu != smp_get_cpu_id() && (s32)prio > pbrr_rqs[cpu].running_prio)
+        ipi_send(cpu, IPI_RESCHED);
+    else
+        sched_kick_cpu(cpu, thread, was_empty);
+    return 0;
+}
+
+/* Remove `thread` from its ready queue, whose lock is held */
+static void __pbrr_sched_dequeue(struct thread *thread) {
+    u32 cpu = thread->thread_ctx->cpuid;
+    u32 prio = thread->thread_ctx->prio;
+
+    list_del(&thread->ready_queue_node);
+    if (list_empty(&pbrr_rqs[cpu].queues[prio]))
+        prio_bitmap_clear(&pbrr_rqs[cpu].bitmap, prio);
+    per_cpu(cpu, nr_ready)--;
+    thread->thread_ctx->state = TS_INTER;
+}
+
+/*
+ * Remove `thread` from the ready queue it was put in. The thread may be
+ * migrated while waiting for the lock of its queue.
+ */
+int pbrr_sched_dequeue(struct thread *thread) {
+    if (thread == NULL || thread->thread_ctx == NULL) return -1;
+    if (thread == this_cpu_read(idle_thread)) return -2;
+    u32 cpu;
+    while (1) {
+        cpu = thread->thread_ctx->cpuid;
+        lock(&pbrr_rqs[cpu].lock);
+        if (thread->thread_ctx->cpuid == cpu) break;
+        unlock(&pbrr_rqs[cpu].lock);
+    }
+    if (thread->thread_ctx->state != TS_READY) {
+        unlock(&pbrr_rqs[cpu].lock);
+        return -3;
+    }
+    __pbrr_sched_dequeue(thread);
+    unlock(&pbrr_rqs[cpu].lock);
+    return 0;
+}
+
+/*
+ * The first thread of the highest priority on `cpu` which no other CPU
+ * still runs on the stack of, or NULL. Only the non-empty queues are
+ * visited, found through the bitmap. The queue lock is held.
+ */
+static struct thread *pbrr_first_runnable(u32 cpu, bool migrate) {
+    struct prio_bitmap *bmp = &pbrr_rqs[cpu].bitmap;
+    struct thread *thread;
+    int prio;
+
+    for (prio = prio_bitmap_highest(bmp); prio >= MIN_PRIO;
+         prio = prio_bitmap_highest_below(bmp, prio)) {
+        for_each_in_list(thread, struct thread, ready_queue_node,
+                         &pbrr_rqs[cpu].queues[prio]) {
+            if (migrate ? sched_can_migrate(thread)
+                        : !sched_stack_in_use(thread))
+                return thread;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Take the highest priority migratable thread out of the busiest cpu's
+ * queues, if the load is unbalanced.
+ */
+static struct thread *pbrr_steal_thread(void) {
+    int busiest = sched_busiest_cpu();
+    struct thread *thread;
+
+    if (busiest < 0) return NULL;
+    lock(&pbrr_rqs[busiest].lock);
+    thread = pbrr_first_runnable(busiest, true);
+    if (thread) __pbrr_sched_dequeue(thread);
+    unlock(&pbrr_rqs[busiest].lock);
+    return thread;
+}
+
+/*
+ * Choose the first thread of the highest non-empty priority and dequeue it.
+ * If there is no ready thread on the current CPU, steal one from a busy CPU,
+ * or choose the idle thread.
+ */
+struct thread *pbrr_sched_choose_thread(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *target;
+
+    lock(&pbrr_rqs[cpu].lock);
+    target = pbrr_first_runnable(cpu, false);
+    if (target) __pbrr_sched_dequeue(target);
+    unlock(&pbrr_rqs[cpu].lock);
+    if (!target) target = pbrr_steal_thread();
+    if (!target) target = per_cpu(cpu, idle_thread);
+    return target;
+}
+
+/*
+ * Whether a thread ready on this CPU should run before the current one. The
+ * idle thread always gives up the CPU, which may steal a thread.
+ */
+static bool pbrr_should_preempt(struct thread *current) {
+    u32 cpu = smp_get_cpu_id();
+    int prio = prio_bitmap_highest(&pbrr_rqs[cpu].bitmap);
+    if (current == per_cpu(cpu, idle_thread)) return true;
+    if (prio < 0) return false;
+    return (u32)prio > current->thread_ctx->prio;
+}
+
+/*
+ * Schedule a thread to execute. The current thread keeps the CPU until its
+ * budget runs out, unless a higher priority thread is ready.
+ */
+int pbrr_sched(void) {
+    struct thread *current = current_thread;
+
+    if (current && current->thread_ctx && current->thread_ctx->sc->budget > 0 &&
+        !pbrr_should_preempt(current)) {
+        return -1;
+    }
+    if (current && current != this_cpu_read(idle_thread) &&
+        current->thread_ctx->state != TS_WAITING) {
+        /* Put it at the end of its priority: round robin in a level */
+        pbrr_sched_enqueue(current);
+    }
+    struct thread *target_thread = pbrr_sched_choose_thread();
+    target_thread->thread_ctx->sc->budget = DEFAULT_BUDGET;
+    pbrr_rqs[smp_get_cpu_id()].running_prio =
+        target_thread->thread_ctx->type == TYPE_IDLE
+            ? -1
+            : (s32)target_thread->thread_ctx->prio;
+    switch_to_thread(target_thread);
+    return 0;
+}
+
+int pbrr_sched_init(void) {
+    int i = 0, prio = 0;
+
+    for (i = 0; i < PLAT_CPU_NUM; i++) {
+        per_cpu(i, curr_thread) = NULL;
+        for (prio = 0; prio < PRIO_NUM; prio++)
+            init_list_head(&pbrr_rqs[i].queues[prio]);
+        memset(&pbrr_rqs[i].bitmap, 0, sizeof(pbrr_rqs[i].bitmap));
+        per_cpu(i, nr_ready) = 0;
+        per_cpu(i, balance_ticks) = 0;
+        lock_init(&pbrr_rqs[i].lock);
+        pbrr_rqs[i].running_prio = -1;
+    }
+    sched_init_idle_threads();
+    kdebug("pbrr scheduler initialized.\n");
+
+    return 0;
+}
+
+/* Every BALANCE_TICKS ticks, pull a thread from the busiest cpu */
+void pbrr_sched_handle_timer_irq(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *current = current_thread;
+    if (current) {
+        if (current->thread_ctx->sc->budget > 0)
+            current->thread_ctx->sc->budget--;
+    }
+    if (++per_cpu(cpu, balance_ticks) >= BALANCE_TICKS) {
+        per_cpu(cpu, balance_ticks) = 0;
+        /* a stolen thread without affinity is enqueued on this cpu */
+        struct thread *stolen = pbrr_steal_thread();
+        if (stolen) pbrr_sched_enqueue(stolen);
+    }
+}
+
+void pbrr_top(void) {
+    u32 cpuid = smp_get_cpu_id();
+    struct thread *thread;
+    int prio;
+
+    printk("Current CPU %d\n", cpuid);
+    for (cpuid = 0; cpuid < PLAT_CPU_NUM; cpuid++) {
+        printk("===== CPU %d =====\n", cpuid);
+        thread = per_cpu(cpuid, curr_thread);
+        if (thread != NULL) print_thread(thread);
+        for (prio = MAX_PRIO; prio >= MIN_PRIO; prio--) {
+            for_each_in_list(thread, struct thread, ready_queue_node,
+                             &pbrr_rqs[cpuid].queues[prio]) {
+                print_thread(thread);
+            }
+        }
+        if (per_cpu(cpuid, curr_thread) != per_cpu(cpuid, idle_thread))
+            print_thread(per_cpu(cpuid, idle_thread));
+    }
+}
+
+struct sched_ops pbrr = {.sched_init = pbrr_sched_init,
+                         .sched = pbrr_sched,
+                         .sched_enqueue = pbrr_sched_enqueue,
+                         .sched_dequeue = pbrr_sched_dequeue,
+                         .sched_choose_thread = pbrr_sched_choose_thread,
+                         .sched_handle_timer_irq = pbrr_sched_handle_timer_irq,
+                         .sched_top = pbrr_top};
@@ -24,28 +24,53 @@
 #include <sched/context.h>
 #include <sched/sched.h>
 
-/* in arch/sched/idle.S */
-void idle_thread_routine(void);
-
 /*
- * rr_ready_queue
- * Per-CPU ready queue for ready tasks.
+ * rr_queues
+ * Per-CPU ready queue for ready tasks, in cache lines of its own. Its
+ * length is the nr_ready of the per-CPU area.
  */
-struct list_head rr_ready_queue[PLAT_CPU_NUM];
+struct rr_queue {
+    /* Protects the queue and the nr_ready of its CPU */
+    struct lock lock;
+    struct list_head head;
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct rr_queue rr_queues[PLAT_CPU_NUM];
+
+/* The ready queue of `cpu`, for the tests */
+struct list_head *rr_ready_queue(u32 cpu) {
+    return &rr_queues[cpu].head;
+}
 
 /*
- * RR policy also has idle threads.
- * When no active user threads in ready queue,
- * we will choose the idle thread to execute.
- * Idle thread will **NOT** be in the RQ.
+ * Lock the ready queue `thread` is in and return its cpu. The thread may
+ * be migrated while waiting for the lock, so check it is still there.
  */
-struct thread idle_threads[PLAT_CPU_NUM];
+static u32 rr_lock_queue_of(struct thread *thread) {
+    u32 cpu;
+
+    while (1) {
+        cpu = thread->thread_ctx->cpuid;
+        lock(&rr_queues[cpu].lock);
+        if (thread->thread_ctx->cpuid == cpu) return cpu;
+        unlock(&rr_queues[cpu].lock);
+    }
+}
+
+/* Remove `thread` from its ready queue, whose lock is held */
+static void __rr_sched_dequeue(struct thread *thread) {
+    list_del(&thread->ready_queue_node);
+    if (thread->thread_ctx->state == TS_READY)
+        per_cpu(thread->thread_ctx->cpuid, nr_ready)--;
+    thread->thread_ctx->state = TS_INTER;
+}
 
 /*
  * Lab4
  * Sched_enqueue
  * Put `thread` at the end of ready queue of assigned `affinity`.
- * If affinity = NO_AFF, assign the core to the current cpu.
+ * If affinity = NO_AFF, assign the core to the current cpu, except for a new
+ * thread which goes to the least loaded cpu.
  * If the thread is IDLE thread, do nothing!
  * Do not forget to check if the affinity is valid!
  */
@@ -54,14 +79,25 @@ int rr_sched_enqueue(struct thread *thread) {
     if (thread->thread_ctx->type == TYPE_IDLE) return 0;
     // if thread state is TS_READY, return error
     if (thread->thread_ctx->state == TS_READY) return -2;
-    if (thread == &idle_threads[smp_get_cpu_id()]) return -3;
+    if (thread == this_cpu_read(idle_thread)) return -3;
     u32 cpu_id = smp_get_cpu_id();
     s32 aff = thread->thread_ctx->affinity;
     if (INVALID_AFF(aff)) return -4;
-    s32 cpu = (aff == NO_AFF) ? cpu_id : aff;
-    list_append(&thread->ready_queue_node, &rr_ready_queue[cpu]);
+    s32 cpu = aff;
+    if (aff == NO_AFF) {
+        if (thread->thread_ctx->state == TS_INIT && sched_can_migrate(thread))
+            cpu = sched_least_loaded_cpu();
+        else
+            cpu = cpu_id;
+    }
+    lock(&rr_queues[cpu].lock);
+    bool was_empty = list_empty(&rr_queues[cpu].head);
+    list_append(&thread->ready_queue_node, &rr_queues[cpu].head);
+    per_cpu(cpu, nr_ready)++;
     thread->thread_ctx->cpuid = cpu;
     thread->thread_ctx->state = TS_READY;
+    unlock(&rr_queues[cpu].lock);
+    sched_kick_cpu(cpu, thread, was_empty);
     // kdebug("rr: enqueue %lx\n", thread);
     return 0;
 }
@@ -74,38 +110,68 @@ int rr_sched_enqueue(struct thread *thread) {
  */
 int rr_sched_dequeue(struct thread *thread) {
     if (thread == NULL || thread->thread_ctx == NULL) return -1;
-    if (thread == &idle_threads[smp_get_cpu_id()]) return -2;
+    if (thread == this_cpu_read(idle_thread)) return -2;
     if (thread->thread_ctx->state == TS_RUNNING) return -3;
     if (INVALID_AFF(thread->thread_ctx->affinity)) return -4;
     // Remove the thread and set its state to TS_INTER
-    list_del(&thread->ready_queue_node);
-    thread->thread_ctx->state = TS_INTER;
+    u32 cpu = rr_lock_queue_of(thread);
+    __rr_sched_dequeue(thread);
+    unlock(&rr_queues[cpu].lock);
     return 0;
 }
 
+/*
+ * Take one migratable thread out of the busiest cpu's queue, if the load is
+ * unbalanced. The thread is taken from the tail of the remote queue: it is
+ * the one which would have waited the longest there.
+ */
+static struct thread *rr_steal_thread(void) {
+    int busiest = sched_busiest_cpu();
+    struct list_head *head, *node;
+    struct thread *thread, *stolen = NULL;
+
+    if (busiest < 0) return NULL;
+    head = &rr_queues[busiest].head;
+    lock(&rr_queues[busiest].lock);
+    for (node = head->prev; node != head; node = node->prev) {
+        thread = list_entry(node, struct thread, ready_queue_node);
+        if (!sched_can_migrate(thread)) continue;
+        __rr_sched_dequeue(thread);
+        stolen = thread;
+        break;
+    }
+    unlock(&rr_queues[busiest].lock);
+    return stolen;
+}
+
 /*
  * Lab4
  * The helper function
  * Choose an appropriate thread and dequeue from ready queue
  *
  * If there is no ready thread in the current CPU's ready queue,
- * choose the idle thread of the CPU.
+ * steal one from a busy CPU, or choose the idle thread of the CPU.
  *
  * Do not forget to check the type and
  * state of the chosen thread
  */
 struct thread *rr_sched_choose_thread(void) {
     u32 cpu = smp_get_cpu_id();
-    if (list_empty(&rr_ready_queue[cpu])) {
-        // if the ready queue is empty, return the idle thread
-        return &idle_threads[cpu];
-    }
-    struct thread *target =
-        container_of(rr_ready_queue[cpu].next, struct thread, ready_queue_node);
-    int err = rr_sched_dequeue(target);
-    if (err != 0 && err != -2) {
-        kwarn("rr_sched_dequeue returns non-zero in rr_sched_choose_thread\n");
+    struct thread *thread, *target = NULL;
+
+    lock(&rr_queues[cpu].lock);
+    for_each_in_list(thread, struct thread, ready_queue_node,
+                     &rr_queues[cpu].head) {
+        // skip a thread whose previous cpu has not left its stack yet
+        if (sched_stack_in_use(thread)) continue;
+        __rr_sched_dequeue(thread);
+        target = thread;
+        break;
     }
+    unlock(&rr_queues[cpu].lock);
+    if (!target) target = rr_steal_thread();
+    // if nothing can be stolen, return the idle thread
+    if (!target) target = per_cpu(cpu, idle_thread);
     return target;
 }
 
@@ -117,7 +183,7 @@ static inline void rr_sched_refill_budget(struct thread *target, u32 budget) {
  * Lab4
  * Schedule a thread to execute.
  * This function will suspend current running thread, if any, and schedule
- * another thread from `rr_ready_queue[cpu_id]`.
+ * another thread from `rr_ready_queue(cpu_id)`.
  *
  * Hints:
  * Macro DEFAULT_BUDGET defines the value for resetting thread's budget.
@@ -126,14 +192,17 @@ static inline void rr_sched_refill_budget(struct thread *target, u32 budget) {
  * Then ChCore can call eret_to_thread() to return to user mode.
  */
 int rr_sched(void) {
+    /* The idle thread gives up the cpu as soon as there is work */
     if (current_thread && current_thread->thread_ctx &&
+        current_thread->thread_ctx->type != TYPE_IDLE &&
         current_thread->thread_ctx->sc->budget > 0) {
         // kinfo("no schedule: budget=%u\n",
         //       current_thread->thread_ctx->sc->budget);
         return -1;
     }
-    // check if cpu is running some thread
-    if (current_thread && current_thread != &idle_threads[smp_get_cpu_id()]) {
+    // check if cpu is running some thread, which is not blocked
+    if (current_thread && current_thread != this_cpu_read(idle_thread) &&
+        current_thread->thread_ctx->state != TS_WAITING) {
         // Some thread is running, add it to queue
         rr_sched_enqueue(current_thread);
         current_thread->thread_ctx->state = TS_READY;
@@ -154,22 +223,15 @@ int rr_sched_init(void) {
 
     /* Initialize global variables */
     for (i = 0; i < PLAT_CPU_NUM; i++) {
-        current_threads[i] = NULL;
-        init_list_head(&rr_ready_queue[i]);
+        per_cpu(i, curr_thread) = NULL;
+        init_list_head(&rr_queues[i].head);
+        per_cpu(i, nr_ready) = 0;
+        per_cpu(i, balance_ticks) = 0;
+        lock_init(&rr_queues[i].lock);
     }
 
-    /* Initialize one idle thread for each core and insert into the RQ */
-    for (i = 0; i < PLAT_CPU_NUM; i++) {
-        /* Set the thread context of the idle threads */
-        BUG_ON(!(idle_threads[i].thread_ctx = create_thread_ctx()));
-        /* We will set the stack and func ptr in arch_idle_ctx_init */
-        init_thread_ctx(&idle_threads[i], 0, 0, MIN_PRIO, TYPE_IDLE, i);
-        /* Call arch-dependent function to fill the context of the idle
-         * threads */
-        arch_idle_ctx_init(idle_threads[i].thread_ctx, idle_thread_routine);
-        /* Idle thread is kernel thread which do not have vmspace */
-        idle_threads[i].vmspace = NULL;
-    }
+    /* Initialize one idle thread for each core */
+    sched_init_idle_threads();
     kdebug("Scheduler initialized. Create %d idle threads.\n", i);
 
     return 0;
@@ -179,13 +241,21 @@ int rr_sched_init(void) {
  * Lab4
  * Handler called each time a timer interrupt is handled
  * Do not forget to call sched_handle_timer_irq() in proper code location.
+ * Every BALANCE_TICKS ticks, pull a thread from the busiest cpu.
  */
 void rr_sched_handle_timer_irq(void) {
+    u32 cpu = smp_get_cpu_id();
     struct thread *current = current_thread;
     if (current) {
         if (current->thread_ctx->sc->budget > 0)
             current->thread_ctx->sc->budget--;
     }
+    if (++per_cpu(cpu, balance_ticks) >= BALANCE_TICKS) {
+        per_cpu(cpu, balance_ticks) = 0;
+        // a stolen thread without affinity is enqueued on this cpu
+        struct thread *stolen = rr_steal_thread();
+        if (stolen) rr_sched_enqueue(stolen);
+    }
 }
 
 void rr_top(void) {
@@ -198,20 +268,20 @@ void rr_top(void) {
     for (cpuid = 0; cpuid < PLAT_CPU_NUM; cpuid++) {
         bool print_idle = false;
         printk("===== CPU %d =====\n", cpuid);
-        thread = current_threads[cpuid];
+        thread = per_cpu(cpuid, curr_thread);
         if (thread != NULL) {
             print_thread(thread);
             if (thread->thread_ctx->type == TYPE_IDLE) print_idle = true;
         }
-        if (!list_empty(&rr_ready_queue[cpuid])) {
+        if (!list_empty(&rr_queues[cpuid].head)) {
             for_each_in_list(thread, struct thread, ready_queue_node,
-                             &rr_ready_queue[cpuid]) {
+                             &rr_queues[cpuid].head) {
                 print_thread(thread);
                 if (thread->thread_ctx->type == TYPE_IDLE) print_idle = true;
             }
         }
         if (!print_idle) {
-            print_thread(&idle_threads[cpuid]);
+            print_thread(per_cpu(cpuid, idle_thread));
         }
     }
     // unlock_kernel();
@@ -16,18 +16,43 @@
 #include <common/list.h>
 #include <common/machine.h>
 #include <common/macro.h>
+#include <common/rcu.h>
 #include <common/smp.h>
+#include <common/sync.h>
 #include <common/util.h>
 #include <exception/exception.h>
+#include <exception/fpsimd.h>
+#include <exception/ipi.h>
+#include <exception/timer.h>
 #include <process/thread.h>
 #include <sched/context.h>
 #include <sched/sched.h>
 
-struct thread *current_threads[PLAT_CPU_NUM];
+/* in arch/sched/idle.S */
+void idle_thread_routine(void);
+
+/*
+ * Every policy has idle threads.
+ * When no active user threads in ready queue,
+ * we will choose the idle thread to execute.
+ * Idle thread will **NOT** be in the RQ.
+ * Each one is in cache lines of its own, as its CPU updates it at every
+ * switch, and is reached through per_cpu(cpu, idle_thread).
+ */
+static struct idle_thread {
+    struct thread thread;
+} __attribute__((aligned(CACHELINE_SZ))) idle_threads[PLAT_CPU_NUM];
 
 /* Chosen Scheduling Policies */
 struct sched_ops *cur_sched_ops;
 
+/*
+ * The thread whose kernel stack each CPU runs on. A thread put back in a
+ * ready queue is still on the stack of its CPU until that CPU has switched
+ * to the next thread, so no other CPU may run it meanwhile.
+ */
+static struct thread *volatile kernel_stack_owner[PLAT_CPU_NUM];
+
 char thread_type[][TYPE_STR_LEN] = {"IDLE  ", "ROOT  ", "USER  ",
                                     "SHADOW", "KERNEL", "TESTS "};
 
@@ -75,10 +100,13 @@ int switch_to_thread(struct thread *target) {
     BUG_ON(!target->thread_ctx);
     BUG_ON((target->thread_ctx->state == TS_READY));
 
+    sched_stat_switch(current_thread, target);
+    fpsimd_switch(current_thread, target);
     target->thread_ctx->cpuid = smp_get_cpu_id();
     target->thread_ctx->state = TS_RUNNING;
     smp_wmb();
     current_thread = target;
+    rcu_quiescent();
 
     return 0;
 }
@@ -118,6 +146,66 @@ u64 switch_context(void) {
     return (u64)target_ctx;
 }
 
+/*
+ * Called by eret_to_thread once the stack pointer is on the new thread. If
+ * the previous thread is ready on another CPU, that CPU may have skipped it
+ * while its stack was in use here and gone idle: kick it.
+ */
+void sched_finish_switch(void) {
+    u32 cpu = smp_get_cpu_id();
+    struct thread *prev = kernel_stack_owner[cpu];
+    s32 prev_cpu = -1;
+
+    /* the context of prev lives on its stack: read it before releasing it */
+    if (prev && prev != current_thread && prev->thread_ctx &&
+        prev->thread_ctx->state == TS_READY &&
+        prev->thread_ctx->cpuid != cpu)
+        prev_cpu = prev->thread_ctx->cpuid;
+    /* previous accesses to the old stack complete before it is released */
+    smp_mb();
+    kernel_stack_owner[cpu] = current_thread;
+    if (prev_cpu >= 0 && cpu_is_idle(prev_cpu))
+        ipi_send(prev_cpu, IPI_RESCHED);
+    sched_tick_update(current_thread->thread_ctx->type == TYPE_IDLE);
+}
+
+/*
+ * Called by the policies after enqueueing `thread` on `cpu`, whose queue was
+ * empty before if `was_empty`. An idle CPU has no tick, so it is woken up by
+ * an IPI: `cpu` itself if it may be idle, or else another idle CPU, which
+ * will steal a thread from the busy queue of `cpu`.
+ */
+void sched_kick_cpu(u32 cpu, struct thread *thread, bool was_empty) {
+    u32 i, self = smp_get_cpu_id();
+
+    /*
+     * A CPU which found its queue empty may not be running its idle
+     * thread yet, but then it has not seen the thread either.
+     */
+    if (cpu != self &&
+        (was_empty || cpu_is_idle(cpu))) {
+        ipi_send(cpu, IPI_RESCHED);
+        return;
+    }
+    if (was_empty || !sched_can_migrate(thread)) return;
+    for (i = 0; i < PLAT_CPU_NUM; i++) {
+        if (i != self && i != cpu && cpu_is_idle(i)) {
+            ipi_send(i, IPI_RESCHED);
+            return;
+        }
+    }
+}
+
+/* Whether another CPU still runs on the kernel stack of `thread` */
+bool sched_stack_in_use(struct thread *thread) {
+    u32 cpu, self = smp_get_cpu_id();
+
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        if (cpu != self && kernel_stack_owner[cpu] == thread) return true;
+    }
+    return false;
+}
+
 /* SYSCALL functions */
 
 /**
@@ -127,6 +215,36 @@ u64 switch_context(void) {
 void sys_yield(void) {
     // reset budget so that the thread can be scheduled
     ((struct thread *)current_thread)->thread_ctx->sc->budget = 0;
+    current_thread->thread_ctx->stat.yielded = true;
+    sched();
+    eret_to_thread(switch_context());
+}
+
+static void sleep_timeout_handler(struct timeout *timeout) {
+    struct thread *thread = container_of(timeout, struct thread, timeout);
+
+    BUG_ON(thread->thread_ctx->state != TS_WAITING);
+    thread->thread_ctx->state = TS_INTER;
+    BUG_ON(sched_enqueue(thread));
+}
+
+/*
+ * Block the current thread in TS_WAITING for `ns` nanoseconds, rounded up
+ * to the granularity of the timer wheel, and run other threads meanwhile.
+ * Return 0 to the thread once it is woken up.
+ */
+void sys_nanosleep(u64 ns) {
+    struct thread *thread = current_thread;
+
+    arch_set_thread_return(thread, 0);
+    if (ns == 0) sys_yield();
+
+    thread->thread_ctx->state = TS_WAITING;
+    thread->thread_ctx->sc->budget = 0;
+    /* a futex wait may have left its timeout pending */
+    timeout_del(&thread->timeout);
+    thread->timeout.handler = sleep_timeout_handler;
+    timeout_add(&thread->timeout, DIV_ROUND_UP(ns, 1000));
     sched();
     eret_to_thread(switch_context());
 }
@@ -135,10 +253,96 @@ void sys_top(void) {
     cur_sched_ops->sched_top();
 }
 
+/*
+ * Create the idle thread of each core. The idle threads are shared by all
+ * the policies, so they are only created once.
+ */
+void sched_init_idle_threads(void) {
+    struct thread *idle;
+    int i = 0;
+
+    for (i = 0; i < PLAT_CPU_NUM; i++) {
+        idle = &idle_threads[i].thread;
+        per_cpu(i, idle_thread) = idle;
+        if (idle->thread_ctx) continue;
+        /* Set the thread context of the idle threads */
+        BUG_ON(!(idle->thread_ctx = create_thread_ctx()));
+        /* We will set the stack and func ptr in arch_idle_ctx_init */
+        init_thread_ctx(idle, 0, 0, MIN_PRIO, TYPE_IDLE, i);
+        /* Call arch-dependent function to fill the context of the idle
+         * threads */
+        arch_idle_ctx_init(idle->thread_ctx, idle_thread_routine);
+        /* Idle thread is kernel thread which do not have vmspace */
+        idle->vmspace = NULL;
+    }
+}
+
+/*
+ * Only threads without affinity are moved between CPUs. The kernel test
+ * threads never run and are checked against the queue they were put in.
+ */
+bool sched_can_migrate(struct thread *thread) {
+    return thread->thread_ctx->affinity == NO_AFF &&
+           thread->thread_ctx->type != TYPE_TESTS &&
+           !sched_stack_in_use(thread);
+}
+
+/*
+ * The load of a CPU is its number of ready threads, kept by the policy in
+ * its per-CPU `nr_ready`, plus the thread it is running if that one is not
+ * idle.
+ */
+static u32 cpu_load(u32 cpu) {
+    struct thread *running = per_cpu(cpu, curr_thread);
+    u32 load = per_cpu(cpu, nr_ready);
+
+    if (running && running->thread_ctx &&
+        running->thread_ctx->type != TYPE_IDLE)
+        load++;
+    return load;
+}
+
+/* The least loaded CPU, the current one winning ties */
+u32 sched_least_loaded_cpu(void) {
+    u32 cpu, best = smp_get_cpu_id();
+    u32 load, best_load = cpu_load(best);
+
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        load = cpu_load(cpu);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/*
+ * The most loaded CPU if moving one of its ready threads to the current CPU
+ * reduces the imbalance, i.e. its load exceeds ours by at least two.
+ * Return -1 if the load is balanced.
+ */
+int sched_busiest_cpu(void) {
+    u32 cpu, self = smp_get_cpu_id();
+    u32 load, max_load = cpu_load(self) + 1;
+    int busiest = -1;
+
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        if (cpu == self || per_cpu(cpu, nr_ready) == 0) continue;
+        load = cpu_load(cpu);
+        if (load > max_load) {
+            busiest = cpu;
+            max_load = load;
+        }
+    }
+    return busiest;
+}
+
 int sched_init(struct sched_ops *sched_ops) {
     BUG_ON(sched_ops == NULL);
 
     cur_sched_ops = sched_ops;
     cur_sched_ops->sched_init();
+    edf_sched_init();
     return 0;
 }
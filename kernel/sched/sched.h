@@ -18,12 +18,19 @@
 #include <common/kprint.h>
 
 #include <common/machine.h>
+#include <common/smp.h>
+#include <exception/timer.h>
 
 struct thread;
 
+/* Length of a scheduler tick, in microseconds */
+#ifndef TICK_US
+#define TICK_US		10000
+#endif
 /* BUDGET represents the number of TICKs */
 #define DEFAULT_BUDGET	2
-#define TICK_MS		500
+/* Interval of the periodic load balancing, in ticks */
+#define BALANCE_TICKS	2
 
 #define MAX_PRIO	255
 #define MIN_PRIO	0
@@ -59,10 +66,51 @@ enum thread_type {
 };
 
 typedef struct sched_cont {
+	/* fair: weighted running time, and start of the current run */
+	u64 vruntime;
+	u64 exec_start;
 	u32 budget;
-	char pad[pad_to_cache_line(sizeof(u32))];
+	/*
+	 * edf: a CPU reservation of rt_budget every period, in timer counts,
+	 * admitted on cpuid. Only contexts created as capabilities have one.
+	 */
+	u32 cpuid;
+	u64 period;
+	u64 rt_budget;
+	/* budget left until the absolute deadline */
+	u64 remaining;
+	u64 deadline;
+	/* the thread the context is bound to, and the one throttled on it */
+	struct thread *owner;
+	struct thread *throttled;
+	struct timer_event replenish;
+	char pad[pad_to_cache_line(6 * sizeof(u64) + 2 * sizeof(u32) +
+				   2 * sizeof(void *) +
+				   sizeof(struct timer_event))];
 } sched_cont_t;
 
+/* Buckets of the run-queue length histograms: 0, 1, 2, 3, 4-7, 8-15, 16+ */
+#define RQ_HIST_NUM	7
+
+/* Scheduling statistics of a thread, in timer counts */
+struct sched_stat {
+	/* link all the threads, for sys_get_sched_info */
+	struct list_head node;
+	struct thread *thread;
+	u32 tid;
+	/* -1 before the first run */
+	s32 last_cpu;
+	u64 runtime;
+	u64 wait_time;
+	/* start of the current run, or of the current wait if queued */
+	u64 last_ts;
+	u64 nr_voluntary;
+	u64 nr_involuntary;
+	u64 nr_migrations;
+	bool queued;
+	bool yielded;
+};
+
 /* size in registers.h (to be used in asm) */
 typedef struct arch_exec_cont {
 	u64 reg[REG_NUM];
@@ -89,6 +137,42 @@ struct thread_ctx {
 
 	/* Current Assigned CPU */
 	u32 cpuid;
+
+	/* Statistics */
+	struct sched_stat stat;
+};
+
+/*
+ * Returned by sys_get_sched_info, with times in microseconds. The layout is
+ * shared with user/lib/syscall.h.
+ */
+struct cpu_sched_info {
+	u64 idle_time;
+	u64 nr_switches;
+	u64 rq_hist[RQ_HIST_NUM];
+};
+
+struct thread_sched_info {
+	u32 tid;
+	u32 type;
+	u32 state;
+	u32 prio;
+	s32 affinity;
+	s32 last_cpu;
+	u64 runtime;
+	u64 wait_time;
+	u64 nr_voluntary;
+	u64 nr_involuntary;
+	u64 nr_migrations;
+};
+
+struct sched_info {
+	u64 uptime;
+	u32 nr_cpus;
+	/* number of threads, which may be more than the ones returned */
+	u32 nr_threads;
+	struct cpu_sched_info cpus[PLAT_CPU_NUM];
+	struct thread_sched_info threads[];
 };
 
 /* Debug functions */
@@ -103,9 +187,36 @@ int sched_is_runnable(struct thread *target);
 int sched_is_running(struct thread *target);
 int switch_to_thread(struct thread *target);
 
-/* Global-shared kernel data */
-extern struct list_head ready_queue[PLAT_CPU_NUM][PRIO_NUM];
-extern struct thread *current_threads[PLAT_CPU_NUM];
+void sched_init_idle_threads(void);
+void sched_finish_switch(void);
+bool sched_stack_in_use(struct thread *thread);
+void sched_kick_cpu(u32 cpu, struct thread *thread, bool was_empty);
+
+/* Statistics */
+void sched_stat_init(struct thread *thread);
+void sched_stat_exit(struct thread *thread);
+void sched_stat_ready(struct thread *thread);
+void sched_stat_switch(struct thread *prev, struct thread *next);
+
+/* Load balancing helpers shared by the policies */
+bool sched_can_migrate(struct thread *thread);
+u32 sched_least_loaded_cpu(void);
+int sched_busiest_cpu(void);
+
+/* Real-time scheduling contexts, scheduled before the policy */
+void edf_sched_init(void);
+bool sched_is_realtime(struct thread *thread);
+int edf_sched(void);
+int edf_sched_enqueue(struct thread *thread);
+int edf_sched_dequeue(struct thread *thread);
+sched_cont_t *sched_cont_create(u64 budget_us, u64 period_us);
+void sched_cont_deinit(void *sc);
+int sched_cont_bind(struct thread *thread, sched_cont_t *sc);
+void sched_cont_unbind(struct thread *thread);
+
+/* Futexes */
+void futex_init(void);
+void futex_cancel(struct thread *thread);
 
 /* Indirect function call may downgrade performance */
 struct sched_ops {
@@ -121,24 +232,34 @@ struct sched_ops {
 
 /* Provided Scheduling Policies */
 extern struct sched_ops rr;	/* Simple Round Robin */
+extern struct sched_ops pbrr;	/* Priority-based Round Robin */
+extern struct sched_ops fair;	/* Fair share, weighted by priority */
 
 /* Chosen Scheduling Policies */
 extern struct sched_ops *cur_sched_ops;
 
 int sched_init(struct sched_ops *sched_ops);
 
+/* The policy only runs when no real-time thread is ready */
 static inline int sched(void)
 {
+	if (edf_sched() == 0)
+		return 0;
 	return cur_sched_ops->sched();
 }
 
 static inline int sched_enqueue(struct thread *thread)
 {
+	sched_stat_ready(thread);
+	if (sched_is_realtime(thread))
+		return edf_sched_enqueue(thread);
 	return cur_sched_ops->sched_enqueue(thread);
 }
 
 static inline int sched_dequeue(struct thread *thread)
 {
+	if (sched_is_realtime(thread))
+		return edf_sched_dequeue(thread);
 	return cur_sched_ops->sched_dequeue(thread);
 }
 
@@ -147,7 +268,9 @@ static inline struct thread *sched_choose_thread(void)
 	return cur_sched_ops->sched_choose_thread();
 }
 
+/* A real-time thread is not ticked: its budget has its own timer */
 static inline void sched_handle_timer_irq(void)
 {
-	cur_sched_ops->sched_handle_timer_irq();
+	if (!sched_is_realtime(this_cpu_read(curr_thread)))
+		cur_sched_ops->sched_handle_timer_irq();
 }
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2020 Institute of Parallel And Distributed Systems (IPADS),
+ * Shanghai Jiao Tong University (SJTU) OS-Lab-2020 (i.e., ChCore) is licensed
+ * under the Mulan PSL v1. You can use this software according to the terms and
+ * conditions of the Mulan PSL v1. You may obtain a copy of Mulan PSL v1 at:
+ *   http://license.coscl.org.cn/MulanPSL
+ *   THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY
+ * KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+ * NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE. See the
+ * Mulan PSL v1 for more details.
+ */
+
+/*
+ * Scheduling statistics
+ *
+ * Every switch goes through switch_to_thread, which charges the running time
+ * of the previous thread and the queueing time of the next one, read from
+ * the generic timer. A thread is queued from the time it is made ready until
+ * it runs; a server switched to through IPC was not queued. The idle time of
+ * a CPU is the running time of its idle thread.
+ *
+ * The statistics of a thread are only written by the CPU running it or
+ * making it ready, and read without synchronization by sys_get_sched_info.
+ */
+#include <common/errno.h>
+#include <common/kmalloc.h>
+#include <common/kprint.h>
+#include <common/list.h>
+#include <common/lock.h>
+#include <common/macro.h>
+#include <common/smp.h>
+#include <common/sync.h>
+#include <common/uaccess.h>
+#include <common/util.h>
+#include <exception/timer.h>
+#include <process/thread.h>
+#include <sched/context.h>
+#include <sched/sched.h>
+
+struct cpu_sched_stat {
+    u64 nr_switches;
+    /* ready queue length of the policy at each switch */
+    u64 rq_hist[RQ_HIST_NUM];
+} __attribute__((aligned(CACHELINE_SZ)));
+
+static struct cpu_sched_stat cpu_stat[PLAT_CPU_NUM];
+
+/* All the threads, with their statistics */
+static struct list_head sched_stat_list = {&sched_stat_list, &sched_stat_list};
+static struct lock sched_stat_lock;
+static u32 sched_stat_nr_threads;
+static u32 next_tid;
+
+void sched_stat_init(struct thread *thread) {
+    struct sched_stat *stat = &thread->thread_ctx->stat;
+
+    memset(stat, 0, sizeof(*stat));
+    stat->thread = thread;
+    stat->tid = atomic_fetch_add_32(&next_tid, 1);
+    stat->last_cpu = -1;
+    lock(&sched_stat_lock);
+    list_add(&stat->node, &sched_stat_list);
+    sched_stat_nr_threads++;
+    unlock(&sched_stat_lock);
+}
+
+void sched_stat_exit(struct thread *thread) {
+    struct sched_stat *stat = &thread->thread_ctx->stat;
+
+    /* the context of a thread may be destroyed before it was set up */
+    if (!stat->thread) return;
+    lock(&sched_stat_lock);
+    list_del(&stat->node);
+    sched_stat_nr_threads--;
+    unlock(&sched_stat_lock);
+    stat->thread = NULL;
+}
+
+/* Called when `thread` is made ready: it waits from now on */
+void sched_stat_ready(struct thread *thread) {
+    struct sched_stat *stat;
+
+    if (!thread || !thread->thread_ctx ||
+        thread->thread_ctx->state == TS_READY)
+        return;
+    stat = &thread->thread_ctx->stat;
+    stat->last_ts = timer_now();
+    stat->queued = true;
+}
+
+static inline u32 rq_hist_bucket(u32 len) {
+    u32 bucket = 2;
+
+    if (len < 4) return len;
+    while (len >= 8 && bucket < RQ_HIST_NUM - 3) {
+        len >>= 1;
+        bucket++;
+    }
+    return bucket + 2;
+}
+
+/*
+ * Account the switch from `prev`, which may be NULL, to `next` on the
+ * current CPU. A thread leaving the CPU while still ready was preempted,
+ * unless it yielded.
+ */
+void sched_stat_switch(struct thread *prev, struct thread *next) {
+    u32 cpu = smp_get_cpu_id();
+    struct sched_stat *stat;
+    u64 now = timer_now();
+
+    if (prev == next) return;
+    cpu_stat[cpu].nr_switches++;
+    cpu_stat[cpu].rq_hist[rq_hist_bucket(this_cpu_read(nr_ready))]++;
+
+    if (prev && prev->thread_ctx) {
+        stat = &prev->thread_ctx->stat;
+        stat->runtime += now - stat->last_ts;
+        stat->last_ts = now;
+        if (prev->thread_ctx->type != TYPE_IDLE) {
+            if (prev->thread_ctx->state == TS_READY && !stat->yielded) {
+                stat->nr_involuntary++;
+            } else {
+                stat->nr_voluntary++;
+            }
+            stat->queued = prev->thread_ctx->state == TS_READY;
+        }
+        stat->yielded = false;
+    }
+
+    stat = &next->thread_ctx->stat;
+    if (stat->queued) stat->wait_time += now - stat->last_ts;
+    stat->queued = false;
+    if (stat->last_cpu >= 0 && stat->last_cpu != cpu) stat->nr_migrations++;
+    stat->last_cpu = cpu;
+    stat->last_ts = now;
+}
+
+/* Fill `info` for `thread`, whose current run or wait is counted too */
+static void sched_stat_fill(struct thread_sched_info *info,
+                            struct thread *thread, u64 now) {
+    struct thread_ctx *ctx = thread->thread_ctx;
+    struct sched_stat *stat = &ctx->stat;
+    u64 runtime = stat->runtime, wait_time = stat->wait_time;
+    u64 last_ts = stat->last_ts;
+
+    if (stat->last_cpu >= 0 &&
+        per_cpu(stat->last_cpu, curr_thread) == thread && now > last_ts)
+        runtime += now - last_ts;
+    else if (stat->queued && now > last_ts)
+        wait_time += now - last_ts;
+
+    info->tid = stat->tid;
+    info->type = ctx->type;
+    info->state = ctx->state;
+    info->prio = ctx->prio;
+    info->affinity = ctx->affinity;
+    info->last_cpu = stat->last_cpu;
+    info->runtime = timer_cnt_to_us(runtime);
+    info->wait_time = timer_cnt_to_us(wait_time);
+    info->nr_voluntary = stat->nr_voluntary;
+    info->nr_involuntary = stat->nr_involuntary;
+    info->nr_migrations = stat->nr_migrations;
+}
+
+/*
+ * Copy the statistics of the CPUs, then of as many threads as fit, into
+ * the struct sched_info of `len` bytes at `buf`. Return the number of
+ * threads, which may be more than the ones copied.
+ */
+int sys_get_sched_info(u64 buf, u64 len) {
+    struct sched_info *info;
+    struct sched_stat *stat;
+    u64 now, size, nr = 0, max_nr;
+    u32 cpu, nr_threads;
+    int r;
+
+    if (len < sizeof(*info)) return -EINVAL;
+    max_nr = (len - sizeof(*info)) / sizeof(struct thread_sched_info);
+
+    lock(&sched_stat_lock);
+    nr_threads = sched_stat_nr_threads;
+    max_nr = MIN(max_nr, nr_threads);
+    size = sizeof(*info) + max_nr * sizeof(struct thread_sched_info);
+    info = kmalloc(size);
+    if (!info) {
+        unlock(&sched_stat_lock);
+        return -ENOMEM;
+    }
+    now = timer_now();
+    info->uptime = timer_cnt_to_us(now);
+    info->nr_cpus = PLAT_CPU_NUM;
+    info->nr_threads = nr_threads;
+    for (cpu = 0; cpu < PLAT_CPU_NUM; cpu++) {
+        struct thread_sched_info idle;
+
+        sched_stat_fill(&idle, per_cpu(cpu, idle_thread), now);
+        info->cpus[cpu].idle_time = idle.runtime;
+        info->cpus[cpu].nr_switches = cpu_stat[cpu].nr_switches;
+        memcpy((char *)info->cpus[cpu].rq_hist, (char *)cpu_stat[cpu].rq_hist,
+               sizeof(cpu_stat[cpu].rq_hist));
+    }
+    for_each_in_list(stat, struct sched_stat, node, &sched_stat_list) {
+        if (nr == max_nr) break;
+        sched_stat_fill(&info->threads[nr++], stat->thread, now);
+    }
+    unlock(&sched_stat_lock);
+
+    r = copy_to_user((char *)buf, (char *)info, size);
+    kfree(info);
+    return r < 0 ? r : nr_threads;
+}
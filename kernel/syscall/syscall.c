@@ -17,6 +17,7 @@
 #include <common/kmalloc.h>
 #include <common/kprint.h>
 #include <common/fs.h>
+#include <common/lock.h>
 #include <common/mm.h>
 #include <common/types.h>
 #include <common/uaccess.h>
@@ -70,9 +71,18 @@ const void *syscall_table[NR_SYSCALL] = {
 	[SYS_register_client] = sys_register_client,
 	[SYS_ipc_call] = sys_ipc_call,
 	[SYS_ipc_return] = sys_ipc_return,
+	[SYS_create_notifc] = sys_create_notifc,
+	[SYS_wait] = sys_wait,
+	[SYS_notify] = sys_notify,
+	[SYS_create_sched_cont] = sys_create_sched_cont,
+	[SYS_bind_sched_cont] = sys_bind_sched_cont,
+	[SYS_get_sched_info] = sys_get_sched_info,
+	[SYS_get_lock_stat] = sys_get_lock_stat,
 	[SYS_ipc_reg_call] = sys_ipc_reg_call,
+	[SYS_ipc_reg_call_slow] = sys_ipc_reg_call,
 	[SYS_cap_copy_to] = sys_cap_copy_to,
 	[SYS_cap_copy_from] = sys_cap_copy_from,
+	[SYS_cap_free] = sys_cap_free,
 	[SYS_set_affinity] = sys_set_affinity,
 	[SYS_get_affinity] = sys_get_affinity,
 	/* 
@@ -94,10 +104,47 @@ const void *syscall_table[NR_SYSCALL] = {
 	[SYS_debug] = sys_debug,
     [SYS_putc] = sys_putc,
     [SYS_exit] = sys_exit,
-    [SYS_sleep] = sys_debug,
+    [SYS_sleep] = sys_nanosleep,
+    [SYS_futex_wait] = sys_futex_wait,
+    [SYS_futex_wake] = sys_futex_wake,
     [SYS_create_pmo] = sys_create_pmo,
     [SYS_map_pmo] = sys_map_pmo,
     [SYS_get_conn_stack] = sys_debug,
 	[SYS_handle_brk] = sys_handle_brk,
     /* lab3 syscalls finished */
 };
+
+/*
+ * Syscalls which neither block, switch threads nor need the big kernel
+ * lock take the fast path of sync_el0_64, which saves only the registers
+ * the handler may clobber. They run concurrently on all the CPUs.
+ * The fast path keeps IRQs masked, so sys_getc, which busy-waits in
+ * uart_recv, must stay on the slow one.
+ */
+const bool syscall_fast[NR_SYSCALL] = {
+	[SYS_putc] = true,
+	[SYS_get_cpu_id] = true,
+};
+
+/*
+ * Syscalls which only touch per-CPU data, the run queues or the futex
+ * table, which have their own locks, do not take the big kernel lock.
+ */
+static const bool syscall_lock_free[NR_SYSCALL] = {
+	[SYS_yield] = true,
+	[SYS_sleep] = true,
+	[SYS_futex_wait] = true,
+	[SYS_futex_wake] = true,
+	[SYS_get_cpu_id] = true,
+	/* the connection is owned by the caller through the call */
+	[SYS_ipc_reg_call] = true,
+	[SYS_ipc_reg_call_slow] = true,
+	[SYS_ipc_return] = true,
+};
+
+/* Called from el0_syscall before dispatching syscall number nr */
+void lock_kernel_for_syscall(u64 nr)
+{
+	if (nr >= NR_SYSCALL || !syscall_lock_free[nr])
+		lock_kernel();
+}
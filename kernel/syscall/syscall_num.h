@@ -14,6 +14,7 @@
 
 #define NR_SYSCALL   256
 
+#ifndef __ASM__
 void sys_exit(void);
 void sys_create_pmo(void);
 void sys_map_pmo(void);
@@ -21,11 +22,15 @@ void sys_handle_brk(void);
 /* lab3 syscalls finished */
 
 void sys_yield(void);
+void sys_nanosleep(void);
+void sys_futex_wait(void);
+void sys_futex_wake(void);
 void sys_create_device_pmo(void);
 void sys_create_thread(void);
 void sys_create_process(void);
 void sys_cap_copy_to(void);
 void sys_cap_copy_from(void);
+void sys_cap_free(void);
 void sys_unmap_pmo(void);
 void sys_set_affinity(void);
 void sys_get_affinity(void);
@@ -41,8 +46,16 @@ void sys_register_client(void);
 void sys_ipc_call(void);
 void sys_ipc_reg_call(void);
 void sys_ipc_return(void);
+void sys_create_notifc(void);
+void sys_wait(void);
+void sys_notify(void);
+void sys_create_sched_cont(void);
+void sys_bind_sched_cont(void);
+void sys_get_sched_info(void);
+void sys_get_lock_stat(void);
 
 void sys_top(void);
+#endif				/* __ASM__ */
 
 #define SYS_putc				0
 #define SYS_getc				1
@@ -64,10 +77,22 @@ void sys_top(void);
 #define SYS_set_affinity                        18
 #define SYS_get_affinity                        19
 #define SYS_create_device_pmo			20
+#define SYS_futex_wait				21
+#define SYS_futex_wake				22
+#define SYS_create_notifc			23
+#define SYS_wait				24
+#define SYS_notify				25
+#define SYS_create_sched_cont			26
+#define SYS_bind_sched_cont			27
+#define SYS_get_sched_info			28
+#define SYS_get_lock_stat			29
+#define SYS_cap_free				30
 
 /* Lab4 specfic */
 #define SYS_get_cpu_id                          50
 #define SYS_ipc_reg_call                        51
+/* ipc_reg_call through the generic syscall path, for comparisons */
+#define SYS_ipc_reg_call_slow                   52
 
 #define SYS_create_pmos                         101
 #define SYS_map_pmos                            102
@@ -2,6 +2,7 @@
 #include <common/kprint.h>
 #include <common/macro.h>
 #include <common/kmalloc.h>
+#include <sched/sched.h>
 #include <tests/tests.h>
 
 void init_test(void)
@@ -11,6 +12,10 @@ void init_test(void)
 	global_barrier_init();
 	ret = lock_init(&test_lock);
 	BUG_ON(ret != 0);
+	ret = mcs_lock_init(&test_mcs_lock);
+	BUG_ON(ret != 0);
+	ret = rwlock_init(&test_rwlock);
+	BUG_ON(ret != 0);
 }
 
 void run_test(bool is_bsp)
@@ -21,10 +26,18 @@ void run_test(bool is_bsp)
 	tst_mutex(is_bsp);
 	tst_big_lock(is_bsp);
 
-	tst_sched_cooperative(is_bsp);
-	tst_sched_preemptive(is_bsp);
-	tst_sched_affinity(is_bsp);
-	tst_sched(is_bsp);
+	/* these scheduler tests check the FIFO order of rr */
+	if (cur_sched_ops == &rr) {
+		tst_sched_cooperative(is_bsp);
+		tst_sched_preemptive(is_bsp);
+		tst_sched_affinity(is_bsp);
+		tst_sched(is_bsp);
+	}
+	tst_sched_priority(is_bsp);
+	tst_sched_fair(is_bsp);
+	tst_sched_edf(is_bsp);
+	tst_sched_edf_remote(is_bsp);
+	tst_sched_scalability(is_bsp);
 
 	if (is_bsp) {
 		kinfo("[ChCore] pass all kernel tests\n");
@@ -4,6 +4,8 @@
 #include <tests/barrier.h>
 
 extern struct lock test_lock;
+extern struct mcs_lock test_mcs_lock;
+extern struct rwlock test_rwlock;
 
 void init_test(void);
 void run_test(bool);
@@ -21,3 +23,8 @@ void tst_sched_cooperative(bool);
 void tst_sched_preemptive(bool);
 void tst_sched_affinity(bool);
 void tst_sched(bool);
+void tst_sched_priority(bool);
+void tst_sched_fair(bool);
+void tst_sched_edf(bool);
+void tst_sched_edf_remote(bool);
+void tst_sched_scalability(bool);
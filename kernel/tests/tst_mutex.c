@@ -6,12 +6,122 @@
 #include <tests/tests.h>
 
 #define LOCK_TEST_NUM 100000
+#define LOCK_BENCH_NUM 100000
 
 /* Mutex test count */
 struct lock test_lock;
+struct mcs_lock test_mcs_lock;
+struct rwlock test_rwlock;
 unsigned long mutex_test_count = 0;
+unsigned long mcs_test_count = 0;
+unsigned long rwlock_test_count = 0;
 unsigned long big_lock_test_count = 0;
 
+static volatile u64 lock_bench_cycles[PLAT_CPU_NUM];
+static volatile unsigned long lock_bench_count;
+
+static inline u64 read_cntvct(void)
+{
+	u64 cnt;
+
+	asm volatile ("isb\n mrs %0, cntvct_el0":"=r" (cnt));
+	return cnt;
+}
+
+static void ticket_acquire(void)
+{
+	lock(&test_lock);
+	lock_bench_count++;
+}
+
+static void ticket_release(void)
+{
+	unlock(&test_lock);
+}
+
+static void mcs_acquire(void)
+{
+	mcs_lock(&test_mcs_lock);
+	lock_bench_count++;
+}
+
+static void mcs_release(void)
+{
+	mcs_unlock(&test_mcs_lock);
+}
+
+static void write_acquire(void)
+{
+	write_lock(&test_rwlock);
+	lock_bench_count++;
+}
+
+static void write_release(void)
+{
+	write_unlock(&test_rwlock);
+}
+
+static void read_acquire(void)
+{
+	read_lock(&test_rwlock);
+	(void)lock_bench_count;
+}
+
+static void read_release(void)
+{
+	read_unlock(&test_rwlock);
+}
+
+static const struct lock_bench {
+	const char *name;
+	void (*acquire)(void);
+	void (*release)(void);
+} lock_benches[] = {
+	{"ticket", ticket_acquire, ticket_release},
+	{"mcs", mcs_acquire, mcs_release},
+	{"rwlock write", write_acquire, write_release},
+	{"rwlock read", read_acquire, read_release},
+};
+
+/*
+ * Lock throughput with 1 to PLAT_CPU_NUM cores taking the same lock, with a
+ * critical section of one shared counter increment. The waiters of the
+ * ticket lock all spin on its owner word, the ones of the MCS lock on their
+ * own node.
+ */
+static void bench_mutex(bool is_bsp)
+{
+	u32 cpuid = smp_get_cpu_id();
+	const struct lock_bench *bench;
+	u64 start, freq, cycles;
+	int i, b, ncpu;
+
+	asm volatile ("mrs %0, cntfrq_el0":"=r" (freq));
+	for (b = 0; b < sizeof(lock_benches) / sizeof(lock_benches[0]); b++) {
+		bench = &lock_benches[b];
+		for (ncpu = 1; ncpu <= PLAT_CPU_NUM; ncpu++) {
+			global_barrier(is_bsp);
+			if (cpuid < ncpu) {
+				start = read_cntvct();
+				for (i = 0; i < LOCK_BENCH_NUM; i++) {
+					bench->acquire();
+					bench->release();
+				}
+				lock_bench_cycles[cpuid] = read_cntvct() - start;
+			}
+			global_barrier(is_bsp);
+			if (is_bsp) {
+				cycles = 0;
+				for (i = 0; i < ncpu; i++)
+					cycles = MAX(cycles, lock_bench_cycles[i]);
+				printk("tst_mutex: %s, %d cores, "
+				       "%lu acquisitions/s\n", bench->name, ncpu,
+				       ncpu * LOCK_BENCH_NUM * freq / cycles);
+			}
+		}
+	}
+}
+
 void tst_mutex(bool is_bsp)
 {
 	global_barrier(is_bsp);
@@ -27,12 +137,41 @@ void tst_mutex(bool is_bsp)
 		unlock(&test_lock);
 	}
 
+	/* MCS Lock */
+	for (int i = 0; i < LOCK_TEST_NUM; i++) {
+		if (i % 2)
+			while (mcs_try_lock(&test_mcs_lock) != 0) ;
+		else
+			mcs_lock(&test_mcs_lock);
+		mcs_test_count++;
+		mcs_unlock(&test_mcs_lock);
+	}
+
+	/* Reader-writer lock: the readers never see a half done update */
+	for (int i = 0; i < LOCK_TEST_NUM; i++) {
+		if (i % 2) {
+			read_lock(&test_rwlock);
+			BUG_ON(rwlock_test_count % 2);
+			read_unlock(&test_rwlock);
+		} else {
+			write_lock(&test_rwlock);
+			rwlock_test_count++;
+			rwlock_test_count++;
+			write_unlock(&test_rwlock);
+		}
+	}
+
 	global_barrier(is_bsp);
 	BUG_ON(mutex_test_count != PLAT_CPU_NUM * LOCK_TEST_NUM);
+	BUG_ON(mcs_test_count != PLAT_CPU_NUM * LOCK_TEST_NUM);
+	BUG_ON(rwlock_test_count != PLAT_CPU_NUM * LOCK_TEST_NUM);
 	global_barrier(is_bsp);
 	if (is_bsp) {
 		printk("pass tst_mutex\n");
 	}
+
+	bench_mutex(is_bsp);
+	global_barrier(is_bsp);
 }
 
 void tst_big_lock(bool is_bsp)
@@ -41,7 +180,7 @@ void tst_big_lock(bool is_bsp)
 
 	if (is_bsp) {
 		big_lock_test_count = 0;
-		BUG_ON(!is_locked(&big_kernel_lock));
+		BUG_ON(!mcs_is_locked(&big_kernel_lock));
 		unlock_kernel();
 	}
 	// kinfo("CPU%u 1-1\n", cpu_id);
@@ -49,7 +188,7 @@ void tst_big_lock(bool is_bsp)
 
 	for (i = 0; i < LOCK_TEST_NUM; ++i) {
 		if (i % 2)
-			while (try_lock(&big_kernel_lock) != 0) ;
+			while (mcs_try_lock(&big_kernel_lock) != 0) ;
 		else
 			lock_kernel();
 		big_lock_test_count += 1;
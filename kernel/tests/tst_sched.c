@@ -1,7 +1,9 @@
+#include <common/errno.h>
 #include <common/smp.h>
 #include <common/kprint.h>
 #include <common/macro.h>
 #include <common/kmalloc.h>
+#include <exception/timer.h>
 #include <process/thread.h>
 #include <sched/context.h>
 #include <sched/sched.h>
@@ -9,11 +11,12 @@
 
 #define TEST_NUM 1
 #define THREAD_NUM 8
+#define YIELD_BENCH_NUM 100000
 
 volatile int sched_start_flag = 0;
 volatile int sched_finish_flag = 0;
 
-extern struct list_head rr_ready_queue[PLAT_CPU_NUM];
+struct list_head *rr_ready_queue(u32 cpu);
 
 static void atomic_sched(void)
 {
@@ -107,7 +110,7 @@ void tst_sched_param(bool is_bsp)
 			BUG_ON(!sched_enqueue(threads[0]));
 			threads[0]->thread_ctx = thread_ctx;
 
-			BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+			BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 		}
 		{
 			threads[0]->thread_ctx->state = TS_READY;
@@ -146,7 +149,7 @@ void tst_sched_param(bool is_bsp)
 				       TS_INTER);
 			}
 
-			BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+			BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 		}
 	}
 
@@ -155,9 +158,9 @@ void tst_sched_param(bool is_bsp)
 		BUG_ON(idle_thread->thread_ctx->type != TYPE_IDLE);
 
 		{
-			BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+			BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 			BUG_ON(sched_enqueue(idle_thread));
-			BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+			BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 		}
 
 		{
@@ -167,7 +170,7 @@ void tst_sched_param(bool is_bsp)
 			thread = sched_choose_thread();
 			BUG_ON(thread != threads[0]);
 
-			BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+			BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 		}
 
 		{
@@ -223,7 +226,7 @@ void tst_sched_param(bool is_bsp)
 		BUG_ON(current_thread != threads[3]);
 		current_thread = NULL;
 
-		BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+		BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 	}
 
 	for (i = 0; i < local_thread_num; i++) {
@@ -399,7 +402,7 @@ void tst_sched_aff_param(bool is_bsp)
 	BUG_ON(idle_thread->thread_ctx->type != TYPE_IDLE);
 
 	free_test_thread(thread);
-	BUG_ON(!list_empty(&rr_ready_queue[cpuid]));
+	BUG_ON(!list_empty(rr_ready_queue(cpuid)));
 
 	global_barrier(is_bsp);
 }
@@ -424,7 +427,7 @@ void tst_sched_aff(bool is_bsp)
 		}
 		for (i = 0; i < PLAT_CPU_NUM; i++) {
 			if (i != cpuid)
-				BUG_ON(!list_empty(&rr_ready_queue[i]));
+				BUG_ON(!list_empty(rr_ready_queue(i)));
 		}
 
 		threads[0]->thread_ctx->sc->budget = 0;
@@ -535,3 +538,297 @@ void tst_sched(bool is_bsp)
 		printk("pass tst_sched\n");
 	}
 }
+
+void tst_sched_priority(bool is_bsp)
+{
+	int i = 0;
+	struct sched_ops *old_sched_ops = cur_sched_ops;
+	struct thread *threads[4];
+	struct thread *thread = NULL;
+
+	if (is_bsp) {
+		sched_init(&pbrr);
+
+		threads[0] = create_test_thread(1, NO_AFF);
+		threads[1] = create_test_thread(200, NO_AFF);
+		threads[2] = create_test_thread(50, NO_AFF);
+		threads[3] = create_test_thread(200, NO_AFF);
+
+		/* highest priority first, FIFO within a priority */
+		for (i = 0; i < 4; i++)
+			BUG_ON(sched_enqueue(threads[i]));
+		BUG_ON(sched_choose_thread() != threads[1]);
+		BUG_ON(sched_choose_thread() != threads[3]);
+		BUG_ON(sched_choose_thread() != threads[2]);
+		BUG_ON(sched_choose_thread() != threads[0]);
+		thread = sched_choose_thread();
+		BUG_ON(thread->thread_ctx->type != TYPE_IDLE);
+
+		/* round robin within a priority, the lower one waits */
+		BUG_ON(sched_enqueue(threads[0]));
+		BUG_ON(sched_enqueue(threads[1]));
+		BUG_ON(sched_enqueue(threads[3]));
+		sched();
+		BUG_ON(current_thread != threads[1]);
+		current_thread->thread_ctx->sc->budget = 0;
+		sched();
+		BUG_ON(current_thread != threads[3]);
+		current_thread->thread_ctx->sc->budget = 0;
+		sched();
+		BUG_ON(current_thread != threads[1]);
+
+		/* a higher priority thread preempts before the budget ends */
+		threads[2]->thread_ctx->prio = 250;
+		BUG_ON(sched_enqueue(threads[2]));
+		BUG_ON(current_thread->thread_ctx->sc->budget == 0);
+		sched();
+		BUG_ON(current_thread != threads[2]);
+		current_thread = NULL;
+
+		BUG_ON(sched_dequeue(threads[3]));
+		BUG_ON(sched_dequeue(threads[1]));
+		BUG_ON(sched_dequeue(threads[0]));
+		thread = sched_choose_thread();
+		BUG_ON(thread->thread_ctx->type != TYPE_IDLE);
+
+		for (i = 0; i < 4; i++)
+			free_test_thread(threads[i]);
+
+		sched_init(old_sched_ops);
+		printk("pass tst_sched_priority\n");
+	}
+
+	global_barrier(is_bsp);
+}
+
+void tst_sched_fair(bool is_bsp)
+{
+	int i = 0;
+	struct sched_ops *old_sched_ops = cur_sched_ops;
+	struct thread *threads[3];
+	struct thread *thread = NULL;
+	/* far more than the latency credit of a woken thread */
+	u64 unit = timer_us_to_cnt(TICK_US) * 100;
+
+	if (is_bsp) {
+		sched_init(&fair);
+
+		for (i = 0; i < 3; i++)
+			threads[i] = create_test_thread(MAX_PRIO, NO_AFF);
+
+		/* new threads start at the same virtual runtime: FIFO */
+		for (i = 0; i < 3; i++)
+			BUG_ON(sched_enqueue(threads[i]));
+		for (i = 0; i < 3; i++)
+			BUG_ON(sched_choose_thread() != threads[i]);
+		thread = sched_choose_thread();
+		BUG_ON(thread->thread_ctx->type != TYPE_IDLE);
+
+		/* the smallest virtual runtime runs first */
+		threads[0]->thread_ctx->sc->vruntime = 3 * unit;
+		threads[1]->thread_ctx->sc->vruntime = 1 * unit;
+		threads[2]->thread_ctx->sc->vruntime = 2 * unit;
+		for (i = 0; i < 3; i++)
+			BUG_ON(sched_enqueue(threads[i]));
+		BUG_ON(sched_choose_thread() != threads[1]);
+		BUG_ON(sched_choose_thread() != threads[2]);
+		BUG_ON(sched_choose_thread() != threads[0]);
+
+		/*
+		 * threads[0] moved min_vruntime to 3 units: a thread which was
+		 * blocked for long only gets a bounded lead on it
+		 */
+		threads[1]->thread_ctx->sc->vruntime = 0;
+		BUG_ON(sched_enqueue(threads[1]));
+		BUG_ON(threads[1]->thread_ctx->sc->vruntime < 2 * unit);
+		BUG_ON(threads[1]->thread_ctx->sc->vruntime > 3 * unit);
+		BUG_ON(sched_choose_thread() != threads[1]);
+		thread = sched_choose_thread();
+		BUG_ON(thread->thread_ctx->type != TYPE_IDLE);
+
+		for (i = 0; i < 3; i++)
+			free_test_thread(threads[i]);
+
+		sched_init(old_sched_ops);
+		printk("pass tst_sched_fair\n");
+	}
+
+	global_barrier(is_bsp);
+}
+
+void tst_sched_edf(bool is_bsp)
+{
+	int i = 0;
+	struct sched_ops *old_sched_ops = cur_sched_ops;
+	struct thread *threads[3];
+	sched_cont_t *sc[2];
+	u32 cpuid = smp_get_cpu_id(), sc_cpuid[2];
+
+	if (is_bsp) {
+		sched_init(&rr);
+
+		for (i = 0; i < 3; i++)
+			threads[i] = create_test_thread(MAX_PRIO, NO_AFF);
+
+		/* admission control */
+		BUG_ON(!IS_ERR(sched_cont_create(1000, 1000)));
+		BUG_ON(!IS_ERR(sched_cont_create(10, 1000)));
+		sc[0] = sched_cont_create(1000, 2 * TICK_US);
+		sc[1] = sched_cont_create(1000, TICK_US);
+		BUG_ON(IS_ERR(sc[0]) || IS_ERR(sc[1]));
+		for (i = 0; i < 2; i++) {
+			/* both reservations on this cpu */
+			sc_cpuid[i] = sc[i]->cpuid;
+			sc[i]->cpuid = cpuid;
+			BUG_ON(sched_cont_bind(threads[i], sc[i]));
+		}
+		BUG_ON(sched_cont_bind(threads[2], sc[0]) != -EBUSY);
+
+		/* the earliest deadline runs first, before the policy */
+		for (i = 0; i < 3; i++)
+			BUG_ON(sched_enqueue(threads[i]));
+		current_thread = NULL;
+		BUG_ON(sched());
+		BUG_ON(current_thread != threads[1]);
+		current_thread->thread_ctx->state = TS_WAITING;
+		BUG_ON(sched());
+		BUG_ON(current_thread != threads[0]);
+
+		/* out of budget: throttled until its deadline */
+		sc[0]->remaining = 0;
+		BUG_ON(sched());
+		BUG_ON(current_thread != threads[2]);
+		BUG_ON(threads[0]->thread_ctx->state != TS_READY);
+		BUG_ON(sc[0]->throttled != threads[0]);
+		BUG_ON(sched_dequeue(threads[0]));
+		BUG_ON(sc[0]->throttled);
+
+		current_thread = NULL;
+		for (i = 0; i < 2; i++) {
+			/* the test holds no reference to the contexts */
+			sc[i]->owner = NULL;
+			sc[i]->cpuid = sc_cpuid[i];
+			threads[i]->thread_ctx->sc = NULL;
+			sched_cont_deinit(sc[i]);
+			obj_free(sc[i]);
+		}
+		for (i = 0; i < 3; i++)
+			free_test_thread(threads[i]);
+
+		sched_init(old_sched_ops);
+		printk("pass tst_sched_edf\n");
+	}
+
+	global_barrier(is_bsp);
+}
+
+/*
+ * A thread binding itself to a context admitted on another CPU moves there
+ * at its next schedule, into the tree which dequeue then uses.
+ */
+void tst_sched_edf_remote(bool is_bsp)
+{
+	int i = 0;
+	struct sched_ops *old_sched_ops = cur_sched_ops;
+	struct thread *thread, *old_current = current_thread;
+	sched_cont_t *sc[2], *remote = NULL;
+	u32 cpuid = smp_get_cpu_id();
+
+	if (is_bsp && PLAT_CPU_NUM > 1) {
+		sched_init(&rr);
+		thread = create_test_thread(MAX_PRIO, NO_AFF);
+
+		/* the second reservation goes to the CPU with the most left */
+		sc[0] = sched_cont_create(1000, 10 * TICK_US);
+		sc[1] = sched_cont_create(1000, 10 * TICK_US);
+		BUG_ON(IS_ERR(sc[0]) || IS_ERR(sc[1]));
+		BUG_ON(sc[0]->cpuid == sc[1]->cpuid);
+		remote = sc[0]->cpuid != cpuid ? sc[0] : sc[1];
+
+		/* as sys_bind_sched_cont(-1, ...) does */
+		thread->thread_ctx->state = TS_RUNNING;
+		current_thread = thread;
+		BUG_ON(sched_cont_bind(thread, remote));
+		BUG_ON(sched());
+		BUG_ON(current_thread == thread);
+		BUG_ON(thread->thread_ctx->state != TS_READY);
+		BUG_ON(thread->thread_ctx->cpuid != remote->cpuid);
+		/* the CPU of the context spins in the barrier: still queued */
+		BUG_ON(sched_dequeue(thread));
+
+		current_thread = old_current;
+		remote->owner = NULL;
+		thread->thread_ctx->sc = NULL;
+		for (i = 0; i < 2; i++) {
+			sched_cont_deinit(sc[i]);
+			obj_free(sc[i]);
+		}
+		free_test_thread(thread);
+
+		sched_init(old_sched_ops);
+		printk("pass tst_sched_edf_remote\n");
+	}
+
+	global_barrier(is_bsp);
+}
+
+static volatile u64 yield_bench_cycles[PLAT_CPU_NUM];
+
+static inline u64 read_cntvct(void)
+{
+	u64 cnt;
+
+	asm volatile ("isb\n mrs %0, cntvct_el0":"=r" (cnt));
+	return cnt;
+}
+
+/*
+ * Yield throughput with 1 to PLAT_CPU_NUM cores yielding at the same time,
+ * each between two threads of its own ready queue. As the run queues have
+ * their own locks, the yields of different cores do not serialize and the
+ * total throughput should grow with the number of cores.
+ */
+void tst_sched_scalability(bool is_bsp)
+{
+	int i = 0, ncpu = 0;
+	u32 cpuid = smp_get_cpu_id();
+	struct thread *threads[2];
+	u64 start, freq, cycles;
+
+	for (i = 0; i < 2; i++) {
+		threads[i] = create_test_thread(1, NO_AFF);
+		BUG_ON(sched_enqueue(threads[i]));
+	}
+	current_thread = NULL;
+	asm volatile ("mrs %0, cntfrq_el0":"=r" (freq));
+
+	for (ncpu = 1; ncpu <= PLAT_CPU_NUM; ncpu++) {
+		global_barrier(is_bsp);
+		if (cpuid < ncpu) {
+			start = read_cntvct();
+			for (i = 0; i < YIELD_BENCH_NUM; i++) {
+				if (current_thread)
+					current_thread->thread_ctx->sc->budget = 0;
+				sched();
+			}
+			yield_bench_cycles[cpuid] = read_cntvct() - start;
+		}
+		global_barrier(is_bsp);
+		if (is_bsp) {
+			cycles = 0;
+			for (i = 0; i < ncpu; i++)
+				cycles = MAX(cycles, yield_bench_cycles[i]);
+			printk("tst_sched_scalability: %d cores, %lu yields/s\n",
+			       ncpu, ncpu * YIELD_BENCH_NUM * freq / cycles);
+		}
+	}
+
+	current_thread = NULL;
+	for (i = 0; i < 2; i++) {
+		if (threads[i]->thread_ctx->state == TS_READY)
+			BUG_ON(sched_dequeue(threads[i]));
+		free_test_thread(threads[i]);
+	}
+
+	global_barrier(is_bsp);
+}
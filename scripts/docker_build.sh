@@ -3,9 +3,9 @@
 rm -rf ./build
 
 if [ $# == 0 ]; then
-    docker run --rm -u $(id -u ${USER}):$(id -g ${USER}) -v $(pwd):/chos -w /chos ipads/chcore_builder:v1.0 ./scripts/build.sh 
+    docker run --rm -u $(id -u ${USER}):$(id -g ${USER}) -v $(pwd):/chos -w /chos ipads/chcore_builder:v1.0 ./scripts/build.sh ${SCHED:+-DSCHED=$SCHED} ${LOCKSTAT:+-DLOCKSTAT=$LOCKSTAT}
 else
-    docker run --rm -u $(id -u ${USER}):$(id -g ${USER}) -v $(pwd):/chos -w /chos ipads/chcore_builder:v1.0 ./scripts/build.sh -DTEST=\"/$1.bin\"
+    docker run --rm -u $(id -u ${USER}):$(id -g ${USER}) -v $(pwd):/chos -w /chos ipads/chcore_builder:v1.0 ./scripts/build.sh ${SCHED:+-DSCHED=$SCHED} ${LOCKSTAT:+-DLOCKSTAT=$LOCKSTAT} -DTEST=\"/$1.bin\"
 fi
 
 
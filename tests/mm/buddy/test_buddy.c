@@ -9,6 +9,8 @@
 /* kernel/mm/xxx */
 #include "buddy.h"
 #include "slab.h"
+#include "vmspace.h"
+#include <common/kmalloc.h>
 
 #define ROUND 1000
 #define NPAGES (128 * 1000)
@@ -24,6 +26,69 @@ void printk(const char *fmt, ...)
 	va_end(va);
 }
 
+/* the test is single threaded */
+int lock_init(struct lock *lock)
+{
+	return 0;
+}
+
+void lock(struct lock *lock)
+{
+}
+
+void unlock(struct lock *lock)
+{
+}
+
+int try_lock(struct lock *lock)
+{
+	return 0;
+}
+
+void *kmalloc(size_t size)
+{
+	return malloc(size);
+}
+
+void kfree(void *ptr)
+{
+	free(ptr);
+}
+
+/*
+ * Compaction migrates the pages of one anonymous PMO, mapped nowhere: its
+ * radix is a plain array here.
+ */
+#define TEST_PMO_PAGES (128 * 0x1000)
+
+static struct pmobject test_pmo = {.type = PMO_ANONYM };
+static paddr_t test_pmo_radix[TEST_PMO_PAGES];
+
+void commit_page_to_pmo(struct pmobject *pmo, u64 index, paddr_t pa)
+{
+	test_pmo_radix[index] = pa;
+}
+
+paddr_t get_page_from_pmo(struct pmobject *pmo, u64 index)
+{
+	return test_pmo_radix[index];
+}
+
+int query_in_pgtbl(vaddr_t * pgtbl, vaddr_t va, paddr_t * pa, pte_t ** entry)
+{
+	return -1;
+}
+
+int map_range_in_pgtbl(vaddr_t * pgtbl, vaddr_t va, paddr_t pa, size_t len,
+		       vmr_prop_t flags)
+{
+	return 0;
+}
+
+void flush_tlb(void)
+{
+}
+
 struct phys_mem_pool global_mem;
 
 /* test buddy allocator */
@@ -181,9 +246,171 @@ void test_buddy(void)
 	mu_check(nget == ncheck);
 }
 
+static unsigned long pageblock_idx(struct phys_mem_pool *zone,
+				   struct page *page)
+{
+	return get_page_idx(zone, page) / PAGEBLOCK_PAGES;
+}
+
+/* test pageblock grouping of migrate types (runs after test_buddy) */
+void test_migratetype(void)
+{
+	struct page *unmovable, *movable, *page;
+	unsigned long npages;
+	long i;
+
+	npages = global_mem.pool_phys_page_num;
+	init_buddy(&global_mem, global_mem.page_metadata,
+		   global_mem.pool_start_addr, npages);
+
+	/* every pageblock starts as movable */
+	for (i = 0; i < npages; i += PAGEBLOCK_PAGES) {
+		page = global_mem.page_metadata + i;
+		mu_check(get_pageblock_migratetype(&global_mem, page)
+			 == MIGRATE_MOVABLE);
+	}
+
+	/* an unmovable allocation claims a whole pageblock */
+	unmovable = buddy_get_pages(&global_mem, 0);
+	mu_check(unmovable != NULL);
+	mu_check(get_pageblock_migratetype(&global_mem, unmovable)
+		 == MIGRATE_UNMOVABLE);
+
+	/* unmovable allocations are grouped in that pageblock */
+	for (i = 1; i < PAGEBLOCK_PAGES; ++i) {
+		page = buddy_get_pages(&global_mem, 0);
+		mu_check(page != NULL);
+		mu_check(pageblock_idx(&global_mem, page)
+			 == pageblock_idx(&global_mem, unmovable));
+	}
+
+	/* movable allocations never go to the unmovable pageblock */
+	movable = buddy_get_pages_migratetype(&global_mem, 0, MIGRATE_MOVABLE);
+	mu_check(movable != NULL);
+	mu_check(get_pageblock_migratetype(&global_mem, movable)
+		 == MIGRATE_MOVABLE);
+	mu_check(pageblock_idx(&global_mem, movable)
+		 != pageblock_idx(&global_mem, unmovable));
+
+	/* the whole pool can still be allocated */
+	test_alloc(&global_mem, npages - PAGEBLOCK_PAGES - 1, 0);
+	mu_check(buddy_num_free_page(&global_mem) == 0);
+}
+
+/* test the fragmentation index (runs after test_migratetype) */
+void test_fragmentation_index(void)
+{
+	struct page *page;
+	unsigned long npages;
+	long i;
+
+	npages = global_mem.pool_phys_page_num;
+	init_buddy(&global_mem, global_mem.page_metadata,
+		   global_mem.pool_start_addr, npages);
+
+	/* nothing is fragmented */
+	mu_check(buddy_fragmentation_index(&global_mem, 0) == -1000);
+	mu_check(buddy_fragmentation_index(&global_mem, BUDDY_MAX_ORDER - 1)
+		 == -1000);
+
+	/* no free memory at all */
+	test_alloc(&global_mem, npages, 0);
+	mu_check(buddy_fragmentation_index(&global_mem, 0) == 0);
+
+	/* free every other page: half of the memory is free but unusable */
+	for (i = 0; i < npages; i += 2) {
+		page = global_mem.page_metadata + i;
+		buddy_free_pages(&global_mem, page);
+	}
+	mu_check(buddy_fragmentation_index(&global_mem, 0) == -1000);
+	mu_check(buddy_fragmentation_index(&global_mem, 1) == 500);
+	mu_check(buddy_fragmentation_index(&global_mem, 2) == 750);
+}
+
+/* a page merged into its buddy's chunk is no longer a free chunk head */
+void test_isolate_merged_page(void)
+{
+	struct page *page, *buddy;
+
+	init_buddy(&global_mem, global_mem.page_metadata,
+		   global_mem.pool_start_addr, global_mem.pool_phys_page_num);
+
+	page = buddy_get_pages_migratetype(&global_mem, 1, MIGRATE_MOVABLE);
+	mu_check(page != NULL);
+	buddy_free_pages(&global_mem, page);
+	page = buddy_get_pages_migratetype(&global_mem, 0, MIGRATE_MOVABLE);
+	buddy = buddy_get_pages_migratetype(&global_mem, 0, MIGRATE_MOVABLE);
+	mu_check(page != NULL && buddy == page + 1);
+
+	buddy_free_pages(&global_mem, buddy);
+	buddy_free_pages(&global_mem, page);
+	/* buddy still reads free with order 0, but page heads the chunk */
+	mu_check(!buddy->allocated && buddy->order == 0);
+	mu_check(buddy_isolate_free_page(&global_mem, buddy) == NULL);
+
+	page = buddy_isolate_free_page(&global_mem, page);
+	mu_check(page != NULL && page->allocated && page->order == 0);
+	buddy_free_pages(&global_mem, page);
+}
+
+/*
+ * Fill the pool with pages of the test PMO, free every other one so that
+ * no pageblock-sized chunk is left, then compact: the lower pageblocks are
+ * evacuated into the upper ones, and a pageblock can be allocated again.
+ */
+void test_compaction(void)
+{
+	struct page *page;
+	unsigned long npages;
+	long i;
+
+	npages = global_mem.pool_phys_page_num;
+	init_buddy(&global_mem, global_mem.page_metadata,
+		   global_mem.pool_start_addr, npages);
+	init_list_head(&test_pmo.mapping_list);
+
+	for (i = 0; i < npages; ++i) {
+		page = buddy_get_pages_migratetype(&global_mem, 0,
+						   MIGRATE_MOVABLE);
+		mu_check(page != NULL);
+		page->pmo = &test_pmo;
+		page->pmo_index = i;
+		test_pmo_radix[i] =
+		    virt_to_phys(page_to_virt(&global_mem, page));
+		*(long *)page_to_virt(&global_mem, page) = i;
+	}
+	for (i = 0; i < npages; i += 2) {
+		page = global_mem.page_metadata + i;
+		buddy_free_pages(&global_mem, page);
+		test_pmo_radix[i] = 0;
+	}
+	mu_check(buddy_get_pages_migratetype(&global_mem, PAGEBLOCK_ORDER,
+					     MIGRATE_MOVABLE) == NULL);
+
+	mu_check(compact_memory(PAGEBLOCK_ORDER) == npages / 4);
+
+	/* every page kept its content at its new place */
+	for (i = 1; i < npages; i += 2) {
+		mu_check(test_pmo_radix[i] != 0);
+		mu_check(*(long *)phys_to_virt(test_pmo_radix[i]) == i);
+		page = virt_to_page(&global_mem,
+				    (void *)phys_to_virt(test_pmo_radix[i]));
+		mu_check(page->allocated && page->pmo == &test_pmo);
+		mu_check(page->pmo_index == i);
+	}
+	mu_check(buddy_fragmentation_index(&global_mem, PAGEBLOCK_ORDER) < 0);
+	page = buddy_get_pages_migratetype(&global_mem, PAGEBLOCK_ORDER,
+					   MIGRATE_MOVABLE);
+	mu_check(page != NULL);
+}
+
 MU_TEST_SUITE(test_suite)
 {
 	MU_RUN_TEST(test_buddy);
+	MU_RUN_TEST(test_migratetype);
+	MU_RUN_TEST(test_fragmentation_index);
+	MU_RUN_TEST(test_isolate_merged_page);
+	MU_RUN_TEST(test_compaction);
 }
 
 int main(int argc, char *argv[])
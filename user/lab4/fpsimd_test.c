@@ -0,0 +1,106 @@
+#include <lib/print.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define PRIO		255
+#define THREAD_NUM	2
+#define CPU_NUM		4
+#define ITER_NUM	32
+#define SPIN_NUM	0x100000
+#define NR_VREGS	32
+
+/*
+ * Check that the lazy FP/SIMD switch keeps the registers of each thread:
+ * two threads fill q0-q31, yield and spin long enough to be preempted,
+ * then read them back. On even iterations they share CPU 0, so the owner
+ * of its registers changes under them; on odd ones each thread moves to
+ * another CPU, so its registers must follow it.
+ */
+volatile int done[THREAD_NUM];
+volatile int errors[THREAD_NUM];
+
+u64 patterns[THREAD_NUM][NR_VREGS * 2] __attribute__((aligned(16)));
+u64 results[THREAD_NUM][NR_VREGS * 2] __attribute__((aligned(16)));
+
+/* Fill q0-q31 from pattern, yield, spin and store them to result */
+static void fpsimd_round(u64 *pattern, u64 *result)
+{
+	asm volatile ("mov x10, %0\n"
+		      "ld1 {v0.2d-v3.2d}, [x10], #64\n"
+		      "ld1 {v4.2d-v7.2d}, [x10], #64\n"
+		      "ld1 {v8.2d-v11.2d}, [x10], #64\n"
+		      "ld1 {v12.2d-v15.2d}, [x10], #64\n"
+		      "ld1 {v16.2d-v19.2d}, [x10], #64\n"
+		      "ld1 {v20.2d-v23.2d}, [x10], #64\n"
+		      "ld1 {v24.2d-v27.2d}, [x10], #64\n"
+		      "ld1 {v28.2d-v31.2d}, [x10], #64\n"
+		      "mov x8, %2\n"
+		      "svc #0\n"
+		      "mov x9, %3\n"
+		      "1: subs x9, x9, #1\n"
+		      "b.ne 1b\n"
+		      "mov x10, %1\n"
+		      "st1 {v0.2d-v3.2d}, [x10], #64\n"
+		      "st1 {v4.2d-v7.2d}, [x10], #64\n"
+		      "st1 {v8.2d-v11.2d}, [x10], #64\n"
+		      "st1 {v12.2d-v15.2d}, [x10], #64\n"
+		      "st1 {v16.2d-v19.2d}, [x10], #64\n"
+		      "st1 {v20.2d-v23.2d}, [x10], #64\n"
+		      "st1 {v24.2d-v27.2d}, [x10], #64\n"
+		      "st1 {v28.2d-v31.2d}, [x10], #64\n"
+		      :
+		      : "r" (pattern), "r" (result), "r" ((u64) SYS_yield),
+		        "r" ((u64) SPIN_NUM)
+		      : "x0", "x8", "x9", "x10", "memory",
+		        "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+		        "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15",
+		        "v16", "v17", "v18", "v19", "v20", "v21", "v22", "v23",
+		        "v24", "v25", "v26", "v27", "v28", "v29", "v30", "v31");
+}
+
+void *fpsimd_routine(void *arg)
+{
+	u64 tid = (u64) arg;
+	u64 *pattern = patterns[tid], *result = results[tid];
+	int i, j;
+
+	for (i = 0; i < ITER_NUM; i++) {
+		usys_set_affinity(-1, i % 2 ? (tid + i) % CPU_NUM : 0);
+		for (j = 0; j < NR_VREGS * 2; j++)
+			pattern[j] = (tid + 1) << 48 | (u64) i << 16 | j;
+		fpsimd_round(pattern, result);
+		for (j = 0; j < NR_VREGS * 2; j++)
+			if (result[j] != pattern[j])
+				errors[tid]++;
+	}
+
+	done[tid] = 1;
+	usys_exit(0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret, nr_errors;
+
+	for (i = 0; i < THREAD_NUM; i++) {
+		ret = create_thread(fpsimd_routine, i, PRIO, 0);
+		if (ret < 0) {
+			printf("fpsimd_test: create_thread returns %d\n", ret);
+			return 0;
+		}
+	}
+
+	nr_errors = 0;
+	for (i = 0; i < THREAD_NUM; i++) {
+		while (!done[i])
+			usys_yield();
+		nr_errors += errors[i];
+	}
+
+	if (nr_errors)
+		printf("fpsimd_test: %d registers changed\n", nr_errors);
+	else
+		printf("fpsimd_test: passed\n");
+	return 0;
+}
@@ -0,0 +1,64 @@
+#include <lib/print.h>
+#include <lib/sync.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define PRIO 255
+
+#define THREAD_NUM 4
+#define ITER_NUM 10000
+
+struct mutex counter_lock = MUTEX_INITIALIZER;
+struct cond all_done = COND_INITIALIZER;
+struct semaphore items;
+
+volatile u64 counter;
+volatile u32 done_threads;
+
+void *thread_routine(void *arg)
+{
+	int i;
+
+	for (i = 0; i < ITER_NUM; i++) {
+		mutex_lock(&counter_lock);
+		counter++;
+		mutex_unlock(&counter_lock);
+	}
+	/* each thread produces one item for main */
+	sem_post(&items);
+
+	mutex_lock(&counter_lock);
+	done_threads++;
+	cond_signal(&all_done);
+	mutex_unlock(&counter_lock);
+
+	usys_exit(0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int child_thread_cap;
+	u64 thread_i;
+
+	sem_init(&items, 0);
+	for (thread_i = 0; thread_i < THREAD_NUM; ++thread_i) {
+		child_thread_cap =
+		    create_thread(thread_routine, thread_i, PRIO, thread_i % 4);
+		if (child_thread_cap < 0)
+			printf("Create thread failed, return %d\n",
+			       child_thread_cap);
+	}
+
+	for (thread_i = 0; thread_i < THREAD_NUM; ++thread_i)
+		sem_wait(&items);
+
+	mutex_lock(&counter_lock);
+	while (done_threads < THREAD_NUM)
+		cond_wait(&all_done, &counter_lock);
+	printf("counter %lu, expected %lu\n", counter,
+	       (u64) THREAD_NUM * ITER_NUM);
+	mutex_unlock(&counter_lock);
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+
+#include <lib/bug.h>
+#include <lib/defs.h>
+#include <lib/ipc.h>
+#include <lib/print.h>
+#include <lib/proc.h>
+#include <lib/spawn.h>
+#include <lib/syscall.h>
+
+#define CHILD_INFO_VADDR 0xb0000000
+
+#define WARMUP_NUM 1000
+#define ITER_NUM 100000
+
+static inline u64 read_cntvct(void)
+{
+	u64 cnt;
+
+	asm volatile ("isb\n mrs %0, cntvct_el0":"=r" (cnt));
+	return cnt;
+}
+
+static inline u64 read_cntfrq(void)
+{
+	u64 freq;
+
+	asm volatile ("mrs %0, cntfrq_el0":"=r" (freq));
+	return freq;
+}
+
+/*
+ * Counts of the generic timer for ITER_NUM round trips of a register call
+ * of IPC_REG_WORDS words, by the fast path or the generic one
+ */
+static u64 bench_reg_call(ipc_struct_t * icb, bool slow)
+{
+	u64 regs[IPC_REG_WORDS] = { 0 };
+	u64 start = 0;
+	int i;
+
+	for (i = 0; i < WARMUP_NUM + ITER_NUM; i++) {
+		if (i == WARMUP_NUM)
+			start = read_cntvct();
+		if (slow)
+			usys_ipc_reg_call_slow(icb->conn_cap, regs);
+		else
+			usys_ipc_reg_call_regs(icb->conn_cap, regs);
+	}
+	return read_cntvct() - start;
+}
+
+/* Both paths carry the words there and back */
+static void check_reg_call(ipc_struct_t * icb, bool slow)
+{
+	u64 regs[IPC_REG_WORDS];
+	int i, ret;
+
+	for (i = 0; i < IPC_REG_WORDS; i++)
+		regs[i] = 526 + i;
+	if (slow)
+		ret = usys_ipc_reg_call_slow(icb->conn_cap, regs);
+	else
+		ret = usys_ipc_reg_call_regs(icb->conn_cap, regs);
+	fail_cond(ret != 526, "ipc_reg_call returns %d\n", ret);
+	for (i = 0; i < IPC_REG_WORDS; i++)
+		fail_cond(regs[i] != 526 + i, "word %d is %lu\n", i, regs[i]);
+}
+
+static u64 bench_call(ipc_struct_t * icb)
+{
+	ipc_msg_t *ipc_msg = ipc_create_msg(icb, 0, 0);
+	u64 start;
+	int i;
+
+	for (i = 0; i < WARMUP_NUM; i++)
+		ipc_call(icb, ipc_msg);
+	start = read_cntvct();
+	for (i = 0; i < ITER_NUM; i++)
+		ipc_call(icb, ipc_msg);
+	return read_cntvct() - start;
+}
+
+static void print_latency(char *name, u64 cnt, u64 freq)
+{
+	printf("ipc_bench: %s %lu ns, %lu timer counts per 1000 round trips\n",
+	       name, cnt * 1000000000 / freq / ITER_NUM,
+	       cnt * 1000 / ITER_NUM);
+}
+
+/*
+ * Round trips to a server which returns at once: a register call passes its
+ * message in registers and takes the fast path of the kernel, or the
+ * generic syscall path with SYS_ipc_reg_call_slow, while ipc_call always
+ * takes the generic path and copies the server's connection cap into the
+ * message.
+ */
+int main(int argc, char *argv[], char *envp[])
+{
+	int ret = 0;
+	int info_pmo_cap;
+	int new_process_cap, new_thread_cap;
+	ipc_struct_t client_ipc_struct;
+	struct info_page *info_page;
+	struct pmo_map_request pmo_map_reqs[1];
+	u64 freq = read_cntfrq();
+
+	usys_fs_load_cpio(CPIO_BIN);
+
+	info_pmo_cap = usys_create_pmo(PAGE_SIZE, PMO_DATA);
+	fail_cond(info_pmo_cap < 0, "usys_create_ret ret %d\n", info_pmo_cap);
+
+	ret = usys_map_pmo(SELF_CAP, info_pmo_cap, CHILD_INFO_VADDR,
+			   VM_READ | VM_WRITE);
+	fail_cond(ret < 0, "usys_map_pmo ret %d\n", ret);
+
+	info_page = (void *)CHILD_INFO_VADDR;
+	info_page->ready_flag = 0;
+	info_page->exit_flag = 0;
+	info_page->nr_args = 0;
+
+	pmo_map_reqs[0].pmo_cap = info_pmo_cap;
+	pmo_map_reqs[0].addr = 0x100000000;
+	pmo_map_reqs[0].perm = VM_READ | VM_WRITE;
+
+	/* the server returns the argument of ipc_reg_call */
+	ret = spawn("/ipc_reg_server.bin", &new_process_cap, &new_thread_cap,
+		    pmo_map_reqs, 1, NULL, 0, 1);
+	fail_cond(ret < 0, "create_process returns %d\n", ret);
+
+	while (info_page->ready_flag != 1)
+		usys_yield();
+
+	ret = ipc_register_client(new_thread_cap, &client_ipc_struct);
+	fail_cond(ret < 0, "ipc_register_client failed\n");
+
+	check_reg_call(&client_ipc_struct, false);
+	check_reg_call(&client_ipc_struct, true);
+
+	print_latency("reg_call", bench_reg_call(&client_ipc_struct, false),
+		      freq);
+	print_latency("reg_call_slow",
+		      bench_reg_call(&client_ipc_struct, true), freq);
+	print_latency("call", bench_call(&client_ipc_struct), freq);
+
+	info_page->exit_flag = 1;
+	printf("ipc_bench: done\n");
+
+	return 0;
+}
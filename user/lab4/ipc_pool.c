@@ -0,0 +1,112 @@
+
+#include <lib/bug.h>
+#include <lib/defs.h>
+#include <lib/ipc.h>
+#include <lib/print.h>
+#include <lib/proc.h>
+#include <lib/spawn.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define CHILD_INFO_VADDR 0xb0000000
+#define CONN_BUF_VADDR	0x50000000
+
+#define PRIO		255
+#define THREAD_NUM	4
+/* more than the 32 connections a server used to be limited to */
+#define CONN_NUM	64
+#define ITER_NUM	64
+
+/*
+ * Open many connections to one server, then call through all of them from
+ * all the cores together: the calls share the worker pool of the server.
+ */
+ipc_struct_t conns[CONN_NUM];
+
+volatile int done[THREAD_NUM];
+volatile int errors[THREAD_NUM];
+
+void *worker_routine(void *arg)
+{
+	u64 tid = (u64) arg;
+	int i, c, ret;
+
+	for (i = 0; i < ITER_NUM; i++) {
+		for (c = tid; c < CONN_NUM; c += THREAD_NUM) {
+			/* the server returns its argument */
+			ret = ipc_reg_call(&conns[c], c * ITER_NUM + i);
+			if (ret != c * ITER_NUM + i)
+				errors[tid]++;
+		}
+	}
+
+	done[tid] = 1;
+	usys_exit(0);
+	return 0;
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+	int ret = 0;
+	int info_pmo_cap;
+	int server_process_cap, server_thread_cap;
+	struct info_page *info_page;
+	struct pmo_map_request pmo_map_reqs[1];
+	struct ipc_vm_config vm_config;
+	int i, nr_errors;
+
+	usys_fs_load_cpio(CPIO_BIN);
+
+	info_pmo_cap = usys_create_pmo(PAGE_SIZE, PMO_DATA);
+	fail_cond(info_pmo_cap < 0, "usys_create_pmo ret %d\n", info_pmo_cap);
+	ret = usys_map_pmo(SELF_CAP, info_pmo_cap, CHILD_INFO_VADDR,
+			   VM_READ | VM_WRITE);
+	fail_cond(ret < 0, "usys_map_pmo ret %d\n", ret);
+
+	info_page = (void *)CHILD_INFO_VADDR;
+	info_page->ready_flag = 0;
+	info_page->exit_flag = 0;
+	info_page->nr_args = 0;
+
+	pmo_map_reqs[0].pmo_cap = info_pmo_cap;
+	pmo_map_reqs[0].addr = 0x100000000;
+	pmo_map_reqs[0].perm = VM_READ | VM_WRITE;
+
+	ret = spawn("/ipc_reg_server.bin", &server_process_cap,
+		    &server_thread_cap, pmo_map_reqs, 1, NULL, 0, 1);
+	fail_cond(ret < 0, "spawn returns %d\n", ret);
+
+	while (info_page->ready_flag != 1)
+		usys_yield();
+
+	/* each connection has its own shared buffer in this process */
+	for (i = 0; i < CONN_NUM; i++) {
+		vm_config.buf_base_addr = CONN_BUF_VADDR + i * PAGE_SIZE;
+		vm_config.buf_size = PAGE_SIZE;
+		ret = usys_register_client(server_thread_cap, (u64) & vm_config);
+		fail_cond(ret < 0, "register client %d returns %d\n", i, ret);
+		conns[i].conn_cap = ret;
+		conns[i].shared_buf = vm_config.buf_base_addr;
+		conns[i].shared_buf_len = vm_config.buf_size;
+	}
+
+	for (i = 0; i < THREAD_NUM; i++) {
+		ret = create_thread(worker_routine, i, PRIO, i);
+		fail_cond(ret < 0, "create_thread returns %d\n", ret);
+	}
+
+	nr_errors = 0;
+	for (i = 0; i < THREAD_NUM; i++) {
+		while (!done[i])
+			usys_yield();
+		nr_errors += errors[i];
+	}
+
+	info_page->exit_flag = 1;
+	if (nr_errors)
+		printf("ipc_pool: %d errors\n", nr_errors);
+	else
+		printf("ipc_pool: passed\n");
+
+	return 0;
+}
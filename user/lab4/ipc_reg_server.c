@@ -9,6 +9,12 @@ void ipc_dispatcher(ipc_msg_t * ipc_msg)
 	ipc_return((u64) ipc_msg);
 }
 
+/* Echo the words of a register call, the first as the return value */
+void ipc_reg_dispatcher(u64 * regs)
+{
+	ipc_return_regs(regs[0], regs);
+}
+
 int main(int argc, char *argv[], char *envp[])
 {
 	int ret;
@@ -18,7 +24,7 @@ int main(int argc, char *argv[], char *envp[])
 	info_page_addr = (void *)(envp[0]);
 	fail_cond(info_page_addr == NULL, "[Server] no info received.\n");
 
-	ret = ipc_register_server(ipc_dispatcher);
+	ret = ipc_register_server_regs(ipc_dispatcher, ipc_reg_dispatcher);
 	fail_cond(ret < 0, "[IPC Server] register server failed\n", ret);
 
 	info_page = (struct info_page *)info_page_addr;
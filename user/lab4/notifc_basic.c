@@ -0,0 +1,48 @@
+#include <lib/errno.h>
+#include <lib/print.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define PRIO 255
+#define SIGNAL_NUM 3
+
+int notifc_cap;
+
+void *thread_routine(void *arg)
+{
+	int i;
+
+	for (i = 0; i < SIGNAL_NUM; i++) {
+		usys_nanosleep(1000000);
+		usys_notify(notifc_cap);
+	}
+	usys_exit(0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int i, ret;
+
+	notifc_cap = usys_create_notifc();
+	if (notifc_cap < 0) {
+		printf("Create notification failed, return %d\n", notifc_cap);
+		return 0;
+	}
+	ret = create_thread(thread_routine, 0, PRIO, 1);
+	if (ret < 0)
+		printf("Create thread failed, return %d\n", ret);
+
+	for (i = 0; i < SIGNAL_NUM; i++) {
+		ret = usys_wait(notifc_cap, true, 0);
+		printf("Wait %d returns %d\n", i, ret);
+	}
+	ret = usys_wait(notifc_cap, false, 0);
+	printf("Non-blocking wait returns %s\n",
+	       ret == -EAGAIN ? "EAGAIN" : "wrong value");
+	ret = usys_wait(notifc_cap, true, 10000);
+	printf("Timed wait returns %s\n",
+	       ret == -ETIME ? "ETIME" : "wrong value");
+
+	return 0;
+}
@@ -0,0 +1,141 @@
+
+#include <lib/bug.h>
+#include <lib/defs.h>
+#include <lib/ipc.h>
+#include <lib/print.h>
+#include <lib/proc.h>
+#include <lib/spawn.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define CHILD_INFO_VADDR 0xb0000000
+#define WORKER_VADDR	0x40000000
+#define WORKER_VSIZE	0x1000000
+
+#define PRIO		255
+#define THREAD_NUM	4
+#define ITER_NUM	128
+#define PMO_PAGES	2
+#define SPAWN_NUM	4
+
+/*
+ * Run the paths which no longer take the big kernel lock from all the cores
+ * together: page faults on fresh anonymous memory, capability allocation and
+ * register IPC through one connection shared by all the workers, while the
+ * main thread spawns processes under the big kernel lock.
+ */
+ipc_struct_t client_ipc_struct;
+
+volatile int done[THREAD_NUM];
+volatile int errors[THREAD_NUM];
+
+void *worker_routine(void *arg)
+{
+	u64 tid = (u64) arg;
+	u64 vaddr = WORKER_VADDR + tid * WORKER_VSIZE;
+	int i, j, pmo_cap, ret;
+	volatile u64 *word;
+
+	for (i = 0; i < ITER_NUM; i++) {
+		pmo_cap = usys_create_pmo(PMO_PAGES * PAGE_SIZE, PMO_ANONYM);
+		if (pmo_cap < 0) {
+			errors[tid]++;
+			break;
+		}
+		ret = usys_map_pmo(SELF_CAP, pmo_cap, vaddr,
+				   VM_READ | VM_WRITE);
+		if (ret < 0) {
+			errors[tid]++;
+			break;
+		}
+
+		/* fault the pages in and check that they are not shared */
+		for (j = 0; j < PMO_PAGES; j++) {
+			word = (u64 *) (vaddr + j * PAGE_SIZE);
+			if (*word != 0)
+				errors[tid]++;
+			*word = (tid << 32) | i;
+		}
+		for (j = 0; j < PMO_PAGES; j++) {
+			word = (u64 *) (vaddr + j * PAGE_SIZE);
+			if (*word != ((tid << 32) | i))
+				errors[tid]++;
+		}
+
+		/* the server returns its argument */
+		ret = ipc_reg_call(&client_ipc_struct, tid * ITER_NUM + i);
+		if (ret != tid * ITER_NUM + i)
+			errors[tid]++;
+
+		ret = usys_unmap_pmo(SELF_CAP, pmo_cap, vaddr);
+		if (ret < 0)
+			errors[tid]++;
+	}
+
+	done[tid] = 1;
+	usys_exit(0);
+	return 0;
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+	int ret = 0;
+	int info_pmo_cap;
+	int server_process_cap, server_thread_cap;
+	struct info_page *info_page;
+	struct pmo_map_request pmo_map_reqs[1];
+	int i, nr_errors;
+
+	usys_fs_load_cpio(CPIO_BIN);
+
+	info_pmo_cap = usys_create_pmo(PAGE_SIZE, PMO_DATA);
+	fail_cond(info_pmo_cap < 0, "usys_create_pmo ret %d\n", info_pmo_cap);
+	ret = usys_map_pmo(SELF_CAP, info_pmo_cap, CHILD_INFO_VADDR,
+			   VM_READ | VM_WRITE);
+	fail_cond(ret < 0, "usys_map_pmo ret %d\n", ret);
+
+	info_page = (void *)CHILD_INFO_VADDR;
+	info_page->ready_flag = 0;
+	info_page->exit_flag = 0;
+	info_page->nr_args = 0;
+
+	pmo_map_reqs[0].pmo_cap = info_pmo_cap;
+	pmo_map_reqs[0].addr = 0x100000000;
+	pmo_map_reqs[0].perm = VM_READ | VM_WRITE;
+
+	ret = spawn("/ipc_reg_server.bin", &server_process_cap,
+		    &server_thread_cap, pmo_map_reqs, 1, NULL, 0, 1);
+	fail_cond(ret < 0, "spawn returns %d\n", ret);
+
+	while (info_page->ready_flag != 1)
+		usys_yield();
+
+	ret = ipc_register_client(server_thread_cap, &client_ipc_struct);
+	fail_cond(ret < 0, "ipc_register_client failed\n");
+
+	for (i = 0; i < THREAD_NUM; i++) {
+		ret = create_thread(worker_routine, i, PRIO, i);
+		fail_cond(ret < 0, "create_thread returns %d\n", ret);
+	}
+
+	for (i = 0; i < SPAWN_NUM; i++) {
+		ret = spawn("/spawn_child.bin", NULL, NULL, NULL, 0, NULL, 0,
+			    i % THREAD_NUM);
+		fail_cond(ret < 0, "spawn returns %d\n", ret);
+	}
+
+	nr_errors = 0;
+	for (i = 0; i < THREAD_NUM; i++) {
+		while (!done[i])
+			usys_yield();
+		nr_errors += errors[i];
+	}
+
+	info_page->exit_flag = 1;
+	if (nr_errors)
+		printf("stress_smp: %d errors\n", nr_errors);
+	else
+		printf("stress_smp: passed\n");
+
+	return 0;
+}
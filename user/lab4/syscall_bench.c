@@ -0,0 +1,109 @@
+#include <lib/print.h>
+#include <lib/sync.h>
+#include <lib/syscall.h>
+#include <lib/thread.h>
+
+#define PRIO 255
+
+#define CPU_NUM 4
+#define ITER_NUM 100000
+
+struct semaphore done;
+volatile u64 bench_cycles[CPU_NUM];
+
+static inline u64 read_cntvct(void)
+{
+	u64 cnt;
+
+	asm volatile ("isb\n mrs %0, cntvct_el0":"=r" (cnt));
+	return cnt;
+}
+
+static inline u64 read_cntfrq(void)
+{
+	u64 freq;
+
+	asm volatile ("mrs %0, cntfrq_el0":"=r" (freq));
+	return freq;
+}
+
+/* Cycles of the generic timer for ITER_NUM calls of usys_get_cpu_id */
+static u64 bench_get_cpu_id(void)
+{
+	u64 start = read_cntvct();
+	int i;
+
+	for (i = 0; i < ITER_NUM; i++)
+		usys_get_cpu_id();
+	return read_cntvct() - start;
+}
+
+static u64 bench_get_affinity(void)
+{
+	u64 start = read_cntvct();
+	int i;
+
+	for (i = 0; i < ITER_NUM; i++)
+		usys_get_affinity(-1);
+	return read_cntvct() - start;
+}
+
+static u64 bench_yield(void)
+{
+	u64 start = read_cntvct();
+	int i;
+
+	for (i = 0; i < ITER_NUM; i++)
+		usys_yield();
+	return read_cntvct() - start;
+}
+
+void *bench_routine(void *arg)
+{
+	u64 cpu = (u64) arg;
+
+	bench_cycles[cpu] = bench_get_cpu_id();
+	sem_post(&done);
+	usys_exit(0);
+	return 0;
+}
+
+static void print_latency(char *name, u64 cycles, u64 freq)
+{
+	printf("syscall_bench: %s %lu ns/call\n", name,
+	       cycles * 1000000000 / freq / ITER_NUM);
+}
+
+/*
+ * Latency of a syscall on the fast path (get_cpu_id), of one taking the
+ * big kernel lock (get_affinity) and of one saving the whole context
+ * without the lock (yield), then the throughput of get_cpu_id on 1 to
+ * CPU_NUM cores at the same time, which should scale with the cores.
+ */
+int main(int argc, char *argv[])
+{
+	u64 freq = read_cntfrq(), cycles;
+	int ncpu, i;
+
+	print_latency("get_cpu_id", bench_get_cpu_id(), freq);
+	print_latency("get_affinity", bench_get_affinity(), freq);
+	print_latency("yield", bench_yield(), freq);
+
+	sem_init(&done, 0);
+	for (ncpu = 1; ncpu <= CPU_NUM; ncpu++) {
+		for (i = 0; i < ncpu; i++)
+			if (create_thread(bench_routine, i, PRIO, i) < 0)
+				printf("Create thread failed\n");
+		for (i = 0; i < ncpu; i++)
+			sem_wait(&done);
+		cycles = 0;
+		for (i = 0; i < ncpu; i++)
+			if (bench_cycles[i] > cycles)
+				cycles = bench_cycles[i];
+		printf("syscall_bench: %d cores, %lu get_cpu_id/s\n", ncpu,
+		       ncpu * ITER_NUM * freq / cycles);
+	}
+	printf("syscall_bench: done\n");
+
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <bug.h>
 #include <defs.h>
+#include <errno.h>
 #include <fs_defs.h>
 #include <ipc.h>
 #include <launcher.h>
@@ -14,6 +15,10 @@
 extern ipc_struct_t *tmpfs_ipc_struct;
 static ipc_struct_t ipc_struct;
 static int tmpfs_scan_pmo_cap;
+/* The scan buffer is granted to tmpfs once, and referred to by this number */
+static int tmpfs_scan_grant;
+/* The asynchronous channel to tmpfs, for batches of requests */
+static ipc_ring_t fs_ring;
 
 /* fs_server_cap in current process; can be copied to others */
 int fs_server_cap;
@@ -29,6 +34,27 @@ static const char *cwd() {
     return cwd_buf;
 }
 
+/*
+ * Register the PMO `pmo_cap` of `size` bytes with tmpfs, which keeps it
+ * mapped: the requests then refer to it by the returned grant number, and
+ * carry no cap.
+ */
+static int fs_grant(int pmo_cap, u64 size) {
+    struct fs_request req;
+    ipc_msg_t *msg;
+    int ret;
+
+    memset(&req, 0, sizeof(req));
+    req.req = FS_REQ_GRANT;
+    req.count = size;
+    msg = ipc_create_msg(tmpfs_ipc_struct, sizeof(req), 1);
+    ipc_set_msg_cap(msg, 0, pmo_cap);
+    ipc_set_msg_data(msg, (char *)&req, 0, sizeof(req));
+    ret = ipc_call(tmpfs_ipc_struct, msg);
+    ipc_destroy_msg(msg);
+    return ret;
+}
+
 static int do_complement(char *buf, char *complement, int complement_time) {
     int r = -1;
     // TODO: your code here
@@ -42,8 +68,9 @@ static int do_complement(char *buf, char *complement, int complement_time) {
     req.req = FS_REQ_SCAN;
     req.offset = 0;
     req.count = PAGE_SIZE;
-    ipc_msg_t *msg = ipc_create_msg(tmpfs_ipc_struct, sizeof(req), 1);
-    ipc_set_msg_cap(msg, 0, tmpfs_scan_pmo_cap);
+    req.grant = tmpfs_scan_grant;
+    req.buff = 0;
+    ipc_msg_t *msg = ipc_create_msg(tmpfs_ipc_struct, sizeof(req), 0);
     ipc_set_msg_data(msg, &req, 0, sizeof(req));
     int cnt = ipc_call(tmpfs_ipc_struct, msg);
     // printf("ipc call return cnt=%d\n", cnt);
@@ -120,12 +147,6 @@ int do_cd(char *cmdline) {
     return 0;
 }
 
-int do_top() {
-    // TODO: your code here
-    usys_top();
-    return 0;
-}
-
 void fs_scan(char *path) {
     // TODO: your code here
     printf("fs_scan: \n");
@@ -146,8 +167,9 @@ void fs_scan(char *path) {
     req.req = FS_REQ_SCAN;
     req.offset = 0;
     req.count = PAGE_SIZE;
-    ipc_msg_t *msg = ipc_create_msg(tmpfs_ipc_struct, sizeof(req), 1);
-    ipc_set_msg_cap(msg, 0, tmpfs_scan_pmo_cap);
+    req.grant = tmpfs_scan_grant;
+    req.buff = 0;
+    ipc_msg_t *msg = ipc_create_msg(tmpfs_ipc_struct, sizeof(req), 0);
     ipc_set_msg_data(msg, &req, 0, sizeof(req));
     int cnt = ipc_call(tmpfs_ipc_struct, msg);
     printf("ipc call return cnt=%d\n", cnt);
@@ -199,6 +221,199 @@ void do_clear(void) {
     usys_putc('J');
 }
 
+#define TOP_MAX_THREADS 64
+#define TOP_DEFAULT_ROUNDS 5
+#define TOP_INTERVAL_NS 1000000000UL
+
+static const char *top_type_str[] = {"IDLE", "ROOT", "USER",
+                                     "SHADOW", "KERNEL", "TESTS"};
+static const char *top_state_str[] = {"INIT", "READY", "INTER", "RUN",
+                                      "EXIT", "WAIT", "EXITING"};
+
+static u64 top_buf[(sizeof(struct sched_info) +
+                    TOP_MAX_THREADS * sizeof(struct thread_sched_info)) /
+                   sizeof(u64)];
+/* The previous sample, to show the load over the last interval */
+static struct cpu_sched_info top_prev_cpus[SCHED_INFO_CPU_NUM];
+static struct {
+    u32 tid;
+    u64 runtime;
+} top_prev_threads[TOP_MAX_THREADS];
+static int top_prev_nr;
+static u64 top_prev_uptime;
+
+static u64 top_prev_runtime(u32 tid) {
+    int i;
+
+    for (i = 0; i < top_prev_nr; i++) {
+        if (top_prev_threads[i].tid == tid) return top_prev_threads[i].runtime;
+    }
+    return 0;
+}
+
+static void top_print(struct sched_info *info, int nr) {
+    struct thread_sched_info *t;
+    u64 interval = info->uptime - top_prev_uptime;
+    u64 busy;
+    int i, j;
+
+    if (interval == 0) interval = 1;
+    printf("top - up %lu ms, %u threads\n", info->uptime / 1000,
+           info->nr_threads);
+    printf("CPU  BUSY%%  SWITCHES  RQ 0/1/2/3/4-7/8-15/16+\n");
+    for (i = 0; i < info->nr_cpus && i < SCHED_INFO_CPU_NUM; i++) {
+        busy = info->cpus[i].idle_time - top_prev_cpus[i].idle_time;
+        busy = busy > interval ? 0 : 100 - busy * 100 / interval;
+        printf("%3d  %4lu%%  %8lu  ", i, busy, info->cpus[i].nr_switches);
+        for (j = 0; j < RQ_HIST_NUM; j++)
+            printf("%lu%c", info->cpus[i].rq_hist[j],
+                   j == RQ_HIST_NUM - 1 ? '\n' : '/');
+        top_prev_cpus[i] = info->cpus[i];
+    }
+    printf("\n  TID TYPE    STATE   CPU PRIO  %%CPU   RUN(ms)  WAIT(ms)"
+           "     VOL   INVOL  MIGR\n");
+    for (i = 0; i < nr; i++) {
+        t = &info->threads[i];
+        if (t->type == THREAD_IDLE) continue;
+        printf("%5u %-7s %-7s %3d %4u  %3lu%% %9lu %9lu %7lu %7lu %5lu\n",
+               t->tid, top_type_str[t->type], top_state_str[t->state],
+               t->last_cpu, t->prio,
+               (t->runtime - top_prev_runtime(t->tid)) * 100 / interval,
+               t->runtime / 1000, t->wait_time / 1000, t->nr_voluntary,
+               t->nr_involuntary, t->nr_migrations);
+    }
+    for (i = 0; i < nr; i++) {
+        top_prev_threads[i].tid = info->threads[i].tid;
+        top_prev_threads[i].runtime = info->threads[i].runtime;
+    }
+    top_prev_nr = nr;
+    top_prev_uptime = info->uptime;
+}
+
+/* top [rounds]: refresh the scheduling statistics every second */
+int do_top(char *cmdline) {
+    struct sched_info *info = (struct sched_info *)top_buf;
+    int rounds = 0, round, nr;
+
+    cmdline += 3;
+    while (*cmdline == ' ') cmdline++;
+    while (*cmdline >= '0' && *cmdline <= '9')
+        rounds = rounds * 10 + *cmdline++ - '0';
+    if (rounds == 0) rounds = TOP_DEFAULT_ROUNDS;
+
+    top_prev_nr = 0;
+    top_prev_uptime = 0;
+    for (round = 0; round < rounds; round++) {
+        if (round) usys_nanosleep(TOP_INTERVAL_NS);
+        nr = usys_get_sched_info(info, sizeof(top_buf));
+        if (nr < 0) return nr;
+        if (nr > TOP_MAX_THREADS) nr = TOP_MAX_THREADS;
+        do_clear();
+        top_print(info, nr);
+    }
+    return 0;
+}
+
+#define LOCKSTAT_TOP 12
+
+static u64 lockstat_buf[(sizeof(struct lock_stat_info) +
+                         LOCKSTAT_TOP * sizeof(struct lock_class_info)) /
+                        sizeof(u64)];
+
+/* lockstat [reset]: show the lock classes which waited the longest */
+int do_lockstat(char *cmdline) {
+    struct lock_stat_info *info = (struct lock_stat_info *)lockstat_buf;
+    struct lock_class_info *c;
+    u64 flags = 0, freq;
+    int nr, i;
+
+    cmdline += 8;
+    while (*cmdline == ' ') cmdline++;
+    if (!strcmp(cmdline, "reset")) flags |= LOCKSTAT_RESET;
+
+    nr = usys_get_lock_stat(info, sizeof(lockstat_buf), flags);
+    if (nr == -ENOSYS) {
+        printf("lockstat: the kernel is built without LOCKSTAT\n");
+        return 0;
+    }
+    if (nr < 0) return nr;
+    if (nr > LOCKSTAT_TOP) nr = LOCKSTAT_TOP;
+
+    /* in microseconds */
+    freq = info->freq / 1000000;
+    if (freq == 0) freq = 1;
+    printf("%u lock classes\n", info->nr_classes);
+    printf("%-32s %10s %10s %10s %8s %10s %8s\n", "CLASS", "ACQUIRED",
+           "CONTENDED", "WAIT(us)", "MAX(us)", "HOLD(us)", "MAX(us)");
+    for (i = 0; i < nr; i++) {
+        c = &info->classes[i];
+        printf("%-32s %10lu %10lu %10lu %8lu %10lu %8lu\n", c->name,
+               c->nr_acquired, c->nr_contended, c->wait_time / freq,
+               c->max_wait / freq, c->hold_time / freq, c->max_hold / freq);
+    }
+    return 0;
+}
+
+/* Reap the results of the requests of fs_ring, and count the successes */
+static int fs_ring_reap_all(int *done, int nr) {
+    struct ipc_cqe cqes[IPC_RING_ENTRIES];
+    int ok = 0, n, i;
+
+    while (*done < nr) {
+        n = ipc_ring_reap(&fs_ring, cqes, IPC_RING_ENTRIES, true);
+        for (i = 0; i < n; i++) {
+            if (cqes[i].ret < 0)
+                printf("touch: request %lu failed %ld\n", cqes[i].user_data,
+                       cqes[i].ret);
+            else
+                ok++;
+        }
+        *done += n;
+    }
+    return ok;
+}
+
+/*
+ * touch path...: create the files, as one batch on the channel to tmpfs
+ * rather than with a call each
+ */
+int do_touch(char *cmdline) {
+    struct fs_request *req;
+    char *path;
+    int nr = 0, done = 0, created = 0, len;
+
+    cmdline += 5;
+    while (1) {
+        while (*cmdline == ' ') cmdline++;
+        if (*cmdline == '\0') break;
+        path = cmdline;
+        while (*cmdline != ' ' && *cmdline != '\0') cmdline++;
+        len = cmdline - path;
+        if (len + strlen(cwd()) + 2 > FS_REQ_PATH_LEN) {
+            printf("touch: path too long\n");
+            continue;
+        }
+
+        /* the ring is full: send what is queued and make room */
+        while (!(req = ipc_ring_get_sqe(&fs_ring, nr))) {
+            ipc_ring_submit(&fs_ring);
+            created += fs_ring_reap_all(&done, done + 1);
+        }
+        memset(req, 0, sizeof(*req));
+        req->req = FS_REQ_CREAT;
+        if (*path != '/') {
+            strcpy(req->path, cwd());
+            strcat(req->path, "/");
+        }
+        memcpy(req->path + strlen(req->path), path, len);
+        nr++;
+    }
+    ipc_ring_submit(&fs_ring);
+    created += fs_ring_reap_all(&done, nr);
+    printf("touch: %d of %d created\n", created, nr);
+    return 0;
+}
+
 int builtin_cmd(char *cmdline) {
     int ret, i;
     char cmd[BUFLEN];
@@ -228,7 +443,15 @@ int builtin_cmd(char *cmdline) {
         return 1;
     }
     if (!strcmp(cmd, "top")) {
-        ret = do_top();
+        ret = do_top(cmdline);
+        return !ret ? 1 : -1;
+    }
+    if (!strcmp(cmd, "lockstat")) {
+        ret = do_lockstat(cmdline);
+        return !ret ? 1 : -1;
+    }
+    if (!strcmp(cmd, "touch")) {
+        ret = do_touch(cmdline);
         return !ret ? 1 : -1;
     }
     return 0;
@@ -320,9 +543,13 @@ void boot_fs(void) {
 
     /* register IPC client */
     tmpfs_ipc_struct = &ipc_struct;
-    ret = ipc_register_client(tmpfs_main_thread_cap, tmpfs_ipc_struct);
+    ret = ipc_register_client_buf(tmpfs_main_thread_cap, tmpfs_ipc_struct,
+                                  TMPFS_IPC_BUF_SIZE);
     fail_cond(ret < 0, "ipc_register_client failed\n");
 
+    ret = ipc_ring_create(tmpfs_ipc_struct, &fs_ring, TMPFS_RING_VADDR);
+    fail_cond(ret < 0, "ipc_ring_create ret %d\n", ret);
+
     tmpfs_scan_pmo_cap = usys_create_pmo(PAGE_SIZE, PMO_DATA);
     fail_cond(tmpfs_scan_pmo_cap < 0, "usys create_ret ret %d\n",
               tmpfs_scan_pmo_cap);
@@ -331,5 +558,8 @@ void boot_fs(void) {
                        VM_READ | VM_WRITE);
     fail_cond(ret < 0, "usys_map_pmo ret %d\n", ret);
 
+    tmpfs_scan_grant = fs_grant(tmpfs_scan_pmo_cap, PAGE_SIZE);
+    fail_cond(tmpfs_scan_grant < 0, "fs_grant ret %d\n", tmpfs_scan_grant);
+
     printf("fs is UP.\n");
 }
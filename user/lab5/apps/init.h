@@ -6,7 +6,7 @@ void boot_fs(void);
 // put the commond in `buf` and return `buf`
 char *readline(const char *prompt);
 
-// run `ls`, `echo`, `cat`, `cd`, `top`
+// run `ls`, `echo`, `cat`, `cd`, `top`, `touch`
 // return true if `cmdline` is a builtin command
 int builtin_cmd(char *cmdline);
 
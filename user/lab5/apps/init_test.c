@@ -52,6 +52,9 @@ int main()
 	builtin_cmd("ls");
 	printf("=== TEST LS TAR ===\n");
 	builtin_cmd("ls tar");
+	printf("=== TEST TOUCH ===\n");
+	builtin_cmd("touch batch0 batch1 batch2 batch3 "
+		    "batch4 batch5 batch6 batch7");
 	printf("=== TEST CAT ===\n");
 	builtin_cmd("cat tar/cat_test.txt");
 	test_readline();
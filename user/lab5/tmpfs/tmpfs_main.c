@@ -1,87 +1,350 @@
+#include <errno.h>
 #include <launcher.h>
+#include <sync.h>
 #include <syscall.h>
+#include <thread.h>
 
 #include "tmpfs_server.h"
 
 #define server_ready_flag_offset 0x0
 #define server_exit_flag_offset  0x4
 
+/* The file system and the buffer mappings are used by one thread at a time */
+static struct mutex fs_lock = MUTEX_INITIALIZER;
+
+#define TMPFS_MAX_RINGS 16
+
+struct fs_ring {
+    struct ipc_ring_shared *shared;
+    int pmo_cap;
+    u32 sq_notifc_cap;
+    u32 cq_notifc_cap;
+};
+
+static struct fs_ring fs_rings[TMPFS_MAX_RINGS];
+static int fs_nr_rings;
+
+#define TMPFS_MAX_GRANTS 16
+/* So that a client which never revokes its grants cannot take them all */
+#define TMPFS_MAX_GRANTS_PER_CONN 4
+
+/*
+ * A buffer which a client registered once, and which stays mapped at
+ * TMPFS_GRANT_VADDR + number * TMPFS_GRANT_MAX_SIZE until revoked. Only the
+ * connection which granted it may use it.
+ */
+struct fs_grant {
+    bool used;
+    u64 conn_cap;
+    int pmo_cap;
+    u64 size;
+};
+
+static struct fs_grant fs_grants[TMPFS_MAX_GRANTS];
+
+/*
+ * Whether tmpfs keeps `cap` for a grant or a channel. The cap slots of a
+ * message are in the shared buffer, where the client may change them, so
+ * such a cap is neither taken again nor dropped as a cap of a message.
+ * Called under fs_lock.
+ */
+static bool fs_cap_kept(int cap) {
+    int i;
+
+    for (i = 0; i < TMPFS_MAX_GRANTS; i++)
+        if (fs_grants[i].used && fs_grants[i].pmo_cap == cap) return true;
+    for (i = 0; i < fs_nr_rings; i++)
+        if (fs_rings[i].pmo_cap == cap || fs_rings[i].sq_notifc_cap == cap ||
+            fs_rings[i].cq_notifc_cap == cap)
+            return true;
+    return false;
+}
+
+/*
+ * Drop the caps which the kernel gave tmpfs with a message, unless tmpfs
+ * keeps them, so that they do not fill its cap table. Called under fs_lock.
+ */
+static void fs_put_msg_caps(ipc_msg_t *ipc_msg) {
+    int cap;
+    u64 i;
+
+    for (i = 0; i < ipc_msg->cap_slot_number; i++) {
+        cap = ipc_get_msg_cap(ipc_msg, i);
+        if (!fs_cap_kept(cap)) usys_cap_free(cap);
+    }
+}
+
+/* Serve `fr`, whose SCAN, READ or WRITE buffer is at `buf`, under fs_lock */
+static int fs_handle(struct fs_request *fr, void *buf) {
+    switch (fr->req) {
+        case FS_REQ_SCAN:
+            return fs_server_scan(fr->path, fr->offset, buf, fr->count);
+        case FS_REQ_MKDIR:
+            return fs_server_mkdir(fr->path);
+        case FS_REQ_RMDIR:
+            return fs_server_rmdir(fr->path);
+        case FS_REQ_CREAT:
+            return fs_server_creat(fr->path);
+        case FS_REQ_UNLINK:
+            return fs_server_unlink(fr->path);
+        case FS_REQ_WRITE:
+            return fs_server_write(fr->path, fr->offset, buf, fr->count);
+        case FS_REQ_READ:
+            return fs_server_read(fr->path, fr->offset, buf, fr->count);
+        case FS_REQ_GET_SIZE:
+            return fs_server_get_size(fr->path);
+        default:
+            return -EINVAL;
+    }
+}
+
+/*
+ * A request of a channel carries the offset of its buffer in the data area
+ * of the channel in `buff`. The client may change the request meanwhile, so
+ * it is copied first, then checked and served from the copy only.
+ */
+static s64 fs_ring_handle(struct fs_request *sqe_req, char *data) {
+    struct fs_request req = *sqe_req, *fr = &req;
+    u64 offset = (u64)fr->buff;
+    void *buf = NULL;
+    int ret;
+
+    fr->path[FS_REQ_PATH_LEN - 1] = '\0';
+    if (fr->path[0] != '/') return -EINVAL;
+    if (fr->req == FS_REQ_SCAN || fr->req == FS_REQ_READ ||
+        fr->req == FS_REQ_WRITE) {
+        if (offset > IPC_RING_DATA_SIZE || fr->count < 0 ||
+            fr->count > IPC_RING_DATA_SIZE - offset)
+            return -EINVAL;
+        buf = data + offset;
+    }
+
+    mutex_lock(&fs_lock);
+    ret = fs_handle(fr, buf);
+    mutex_unlock(&fs_lock);
+    return ret;
+}
+
+static void *fs_ring_routine(void *arg) {
+    struct fs_ring *ring = arg;
+
+    ipc_ring_serve(ring->shared, ring->sq_notifc_cap, ring->cq_notifc_cap,
+                   fs_ring_handle);
+    usys_exit(0);
+    return NULL;
+}
+
+/*
+ * Map the channel of the caller, whose PMO and doorbells come in the caps
+ * of the message, and serve it with a thread of its own. Called under
+ * fs_lock.
+ */
+static int fs_ring_setup(ipc_msg_t *ipc_msg) {
+    struct fs_ring *ring;
+    int caps[3], i;
+    u64 vaddr;
+    int ret;
+
+    if (ipc_msg->cap_slot_number != 3 || fs_nr_rings == TMPFS_MAX_RINGS)
+        return -EINVAL;
+    for (i = 0; i < 3; i++) {
+        caps[i] = ipc_get_msg_cap(ipc_msg, i);
+        if (fs_cap_kept(caps[i])) return -EINVAL;
+    }
+    vaddr = TMPFS_RING_VADDR + fs_nr_rings * IPC_RING_SIZE;
+    ret = usys_map_pmo(SELF_CAP, caps[0], vaddr, VM_READ | VM_WRITE);
+    if (ret < 0) return ret;
+
+    ring = &fs_rings[fs_nr_rings];
+    ring->shared = (struct ipc_ring_shared *)vaddr;
+    ring->pmo_cap = caps[0];
+    ring->sq_notifc_cap = caps[1];
+    ring->cq_notifc_cap = caps[2];
+    ret = create_thread(fs_ring_routine, (u64)ring, CHILD_THREAD_PRIO, -1);
+    if (ret < 0) {
+        usys_unmap_pmo(SELF_CAP, caps[0], vaddr);
+        return ret;
+    }
+    fs_nr_rings++;
+    return 0;
+}
+
+/*
+ * Map the PMO in the cap of the message for the calls of the connection to
+ * come, and return its grant number. Zero-length reads tell that the PMO
+ * is a PMO_DATA of count bytes, which fits in its slot. Called under
+ * fs_lock.
+ */
+static int fs_grant(ipc_msg_t *ipc_msg, struct fs_request *fr) {
+    u64 size = fr->count;
+    int pmo_cap, i, free = -1, nr_conn = 0, ret;
+    char probe;
+
+    if (ipc_msg->cap_slot_number != 1 || fr->count <= 0 ||
+        size > TMPFS_GRANT_MAX_SIZE)
+        return -EINVAL;
+    pmo_cap = ipc_get_msg_cap(ipc_msg, 0);
+    if (fs_cap_kept(pmo_cap) || usys_read_pmo(pmo_cap, size, &probe, 0) < 0 ||
+        usys_read_pmo(pmo_cap, size + 1, &probe, 0) == 0)
+        return -EINVAL;
+
+    for (i = 0; i < TMPFS_MAX_GRANTS; i++) {
+        if (!fs_grants[i].used) {
+            if (free < 0) free = i;
+        } else if (fs_grants[i].conn_cap == ipc_msg->server_conn_cap) {
+            nr_conn++;
+        }
+    }
+    if (free < 0 || nr_conn == TMPFS_MAX_GRANTS_PER_CONN) return -ENOMEM;
+    i = free;
+    ret = usys_map_pmo(SELF_CAP, pmo_cap,
+                       TMPFS_GRANT_VADDR + i * TMPFS_GRANT_MAX_SIZE,
+                       VM_READ | VM_WRITE);
+    if (ret < 0) return ret;
+
+    fs_grants[i].used = true;
+    fs_grants[i].conn_cap = ipc_msg->server_conn_cap;
+    fs_grants[i].pmo_cap = pmo_cap;
+    fs_grants[i].size = size;
+    return i;
+}
+
+static struct fs_grant *fs_find_grant(ipc_msg_t *ipc_msg, int grant) {
+    if (grant < 0 || grant >= TMPFS_MAX_GRANTS || !fs_grants[grant].used ||
+        fs_grants[grant].conn_cap != ipc_msg->server_conn_cap)
+        return NULL;
+    return &fs_grants[grant];
+}
+
+/* Unmap the grant `i` and drop its cap. Called under fs_lock */
+static void fs_put_grant(int i) {
+    usys_unmap_pmo(SELF_CAP, fs_grants[i].pmo_cap,
+                   TMPFS_GRANT_VADDR + i * TMPFS_GRANT_MAX_SIZE);
+    usys_cap_free(fs_grants[i].pmo_cap);
+    fs_grants[i].used = false;
+}
+
+/*
+ * Revoke a grant of the connection, or all of them with FS_GRANT_ALL, e.g.
+ * before the client goes away. Called under fs_lock.
+ */
+static int fs_revoke(ipc_msg_t *ipc_msg, struct fs_request *fr) {
+    int i;
+
+    if (fr->grant == FS_GRANT_ALL) {
+        for (i = 0; i < TMPFS_MAX_GRANTS; i++)
+            if (fs_find_grant(ipc_msg, i)) fs_put_grant(i);
+        return 0;
+    }
+    if (!fs_find_grant(ipc_msg, fr->grant)) return -EINVAL;
+    fs_put_grant(fr->grant);
+    return 0;
+}
+
+/*
+ * The buffer of a SCAN, READ or WRITE call without cap: in the grant of the
+ * request, or else inline in the message data after the request. NULL if
+ * the count bytes do not fit. `ipc_msg` is the checked copy of the header
+ * given by the IPC library, so its data_len holds. Called under fs_lock.
+ */
+static void *fs_msg_buf(ipc_msg_t *ipc_msg, struct fs_request *fr) {
+    struct fs_grant *grant;
+    u64 offset = (u64)fr->buff;
+
+    if (fr->count < 0) return NULL;
+    if (fr->grant == FS_GRANT_NONE) {
+        if (fr->count > ipc_msg->data_len - sizeof(struct fs_request))
+            return NULL;
+        return ipc_get_msg_data(ipc_msg) + sizeof(struct fs_request);
+    }
+
+    grant = fs_find_grant(ipc_msg, fr->grant);
+    if (!grant || offset > grant->size || fr->count > grant->size - offset)
+        return NULL;
+    return (char *)TMPFS_GRANT_VADDR + fr->grant * TMPFS_GRANT_MAX_SIZE +
+           offset;
+}
+
+/*
+ * The buffer of SCAN, READ and WRITE comes either as a PMO in the first cap
+ * of the message, mapped for the call, or, when the call carries no cap, in
+ * a grant or inline in the message, which takes no mapping at all. The
+ * request is copied first, so the client cannot change it once checked.
+ */
 static void fs_dispatch(ipc_msg_t *ipc_msg) {
+    struct fs_request req, *fr = &req;
+    u64 buf_vaddr = 0;
+    void *buf = NULL;
+    bool keep_caps = false;
     int ret = 0;
 
     int cap = ipc_get_msg_cap(ipc_msg, 0);
-    if (ipc_msg->data_len >= 4) {
-        struct fs_request *fr = (struct fs_request *)ipc_get_msg_data(ipc_msg);
-        switch (fr->req) {
-            case FS_REQ_SCAN: {
-                // TODO: you code here
-                ret = usys_map_pmo(SELF_CAP, cap, TMPFS_SCAN_BUF_VADDR,
-                                   VM_READ | VM_WRITE);
-                if (ret) break;
-                ret = fs_server_scan(fr->path, fr->offset, TMPFS_SCAN_BUF_VADDR,
-                                     fr->count);
-                usys_unmap_pmo(SELF_CAP, cap, TMPFS_SCAN_BUF_VADDR);
-                break;
-            }
-            case FS_REQ_MKDIR:
-                ret = fs_server_mkdir(fr->path);
-                break;
-            case FS_REQ_RMDIR:
-                ret = fs_server_rmdir(fr->path);
-                break;
-            case FS_REQ_CREAT:
-                ret = fs_server_creat(fr->path);
-                break;
-            case FS_REQ_UNLINK:
-                ret = fs_server_unlink(fr->path);
-                break;
-            case FS_REQ_OPEN:
-                error("%s: %d Not impelemented yet\n", __func__,
-                      ((int *)ipc_get_msg_data(ipc_msg))[0]);
-                usys_exit(-1);
-                break;
-            case FS_REQ_CLOSE:
-                error("%s: %d Not impelemented yet\n", __func__,
-                      ((int *)ipc_get_msg_data(ipc_msg))[0]);
-                usys_exit(-1);
-                break;
-            case FS_REQ_WRITE: {
-                ret = usys_map_pmo(SELF_CAP, cap, TMPFS_WRITE_BUF_VADDR,
-                                   VM_READ | VM_WRITE);
-                if (ret) {
-                    return ret;
-                }
-                ret = fs_server_write(fr->path, fr->offset,
-                                     (void *)TMPFS_WRITE_BUF_VADDR, fr->count);
-                usys_unmap_pmo(SELF_CAP, cap, TMPFS_WRITE_BUF_VADDR);
-                break;
-            }
-            case FS_REQ_READ: {
-                ret = usys_map_pmo(SELF_CAP, cap, TMPFS_READ_BUF_VADDR,
-                                   VM_READ | VM_WRITE);
-                if (ret) {
-                    return ret;
-                }
-                ret = fs_server_read(fr->path, fr->offset,
-                                     (void *)TMPFS_READ_BUF_VADDR, fr->count);
-                usys_unmap_pmo(SELF_CAP, cap, TMPFS_READ_BUF_VADDR);
-                break;
-            }
-            case FS_REQ_GET_SIZE: {
-                ret = fs_server_get_size(fr->path);
-                break;
-            }
-            default:
-                error("%s: %d Not impelemented yet\n", __func__,
-                      ((int *)ipc_get_msg_data(ipc_msg))[0]);
-                usys_exit(-1);
-                break;
-        }
-    } else {
+    if (ipc_msg->data_len < sizeof(struct fs_request)) {
         printf("TMPFS: no operation num\n");
         usys_exit(-1);
     }
+    req = *(struct fs_request *)ipc_get_msg_data(ipc_msg);
+    req.path[FS_REQ_PATH_LEN - 1] = '\0';
+    switch (fr->req) {
+        case FS_REQ_SCAN:
+            buf_vaddr = TMPFS_SCAN_BUF_VADDR;
+            break;
+        case FS_REQ_WRITE:
+            buf_vaddr = TMPFS_WRITE_BUF_VADDR;
+            break;
+        case FS_REQ_READ:
+            buf_vaddr = TMPFS_READ_BUF_VADDR;
+            break;
+        case FS_REQ_MKDIR:
+        case FS_REQ_RMDIR:
+        case FS_REQ_CREAT:
+        case FS_REQ_UNLINK:
+        case FS_REQ_GET_SIZE:
+        case FS_REQ_RING_SETUP:
+        case FS_REQ_GRANT:
+        case FS_REQ_REVOKE:
+            break;
+        default:
+            error("%s: %d Not impelemented yet\n", __func__, fr->req);
+            usys_exit(-1);
+            break;
+    }
 
+    mutex_lock(&fs_lock);
+    switch (fr->req) {
+        case FS_REQ_RING_SETUP:
+            ret = fs_ring_setup(ipc_msg);
+            keep_caps = ret == 0;
+            goto out;
+        case FS_REQ_GRANT:
+            ret = fs_grant(ipc_msg, fr);
+            keep_caps = ret >= 0;
+            goto out;
+        case FS_REQ_REVOKE:
+            ret = fs_revoke(ipc_msg, fr);
+            goto out;
+        default:
+            break;
+    }
+    if (buf_vaddr && ipc_msg->cap_slot_number == 0) {
+        buf = fs_msg_buf(ipc_msg, fr);
+        if (!buf) {
+            ret = -EINVAL;
+            goto out;
+        }
+        buf_vaddr = 0;
+    }
+    if (buf_vaddr) {
+        ret = usys_map_pmo(SELF_CAP, cap, buf_vaddr, VM_READ | VM_WRITE);
+        if (ret) goto out;
+        buf = (void *)buf_vaddr;
+    }
+    ret = fs_handle(fr, buf);
+    if (buf_vaddr) usys_unmap_pmo(SELF_CAP, cap, buf_vaddr);
+out:
+    /* the buffer of the call, or caps which the request does not take */
+    if (!keep_caps) fs_put_msg_caps(ipc_msg);
+    mutex_unlock(&fs_lock);
     usys_ipc_return(ret);
 }
 
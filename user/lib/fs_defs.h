@@ -18,6 +18,13 @@
 #define TMPFS_SCAN_BUF_VADDR 0x20000000
 #define TMPFS_READ_BUF_VADDR 0x30000000
 #define TMPFS_WRITE_BUF_VADDR 0x40000000
+/* The asynchronous channels, IPC_RING_SIZE apart in the server */
+#define TMPFS_RING_VADDR 0x50000000
+/* The shared buffer asked for by the clients of tmpfs, for inline reads */
+#define TMPFS_IPC_BUF_SIZE 0x100000
+/* The granted buffers, TMPFS_GRANT_MAX_SIZE apart in the server */
+#define TMPFS_GRANT_VADDR 0x60000000
+#define TMPFS_GRANT_MAX_SIZE 0x100000
 
 enum FS_REQ {
 	FS_REQ_OPEN = 0,
@@ -32,15 +39,33 @@ enum FS_REQ {
 	FS_REQ_READ,
 	FS_REQ_WRITE,
 
-	FS_REQ_GET_SIZE
+	FS_REQ_GET_SIZE,
+
+	/* set up an asynchronous channel, see ipc_ring_create */
+	FS_REQ_RING_SETUP,
+
+	/* map the PMO of count bytes in the cap, return its grant number */
+	FS_REQ_GRANT,
+	/* unmap the buffer of grant, or all the ones of the connection */
+	FS_REQ_REVOKE
 };
 
+/* In grant, for a SCAN, READ or WRITE buffer inline in the message */
+#define FS_GRANT_NONE (-1)
+/* In grant of a REVOKE, for all the grants of the connection */
+#define FS_GRANT_ALL (-2)
+
 #define FS_REQ_PATH_LEN (256)
 struct fs_request {
 	enum FS_REQ req;
 
 	char *buff;
 	int flags;
+	/*
+	 * Of a call without cap: the grant holding the buffer, at offset buff,
+	 * or FS_GRANT_NONE
+	 */
+	int grant;
 	off_t offset;
 	ssize_t count;
 
@@ -1,14 +1,24 @@
 #include <lib/syscall.h>
 #include <lib/ipc.h>
 #include <lib/defs.h>
+#include <lib/errno.h>
 #include <lib/string.h>
 #include <lib/print.h>
+#include <lib/sync.h>
 
+/*
+ * The message is laid out at the start of the shared buffer, its data then
+ * its cap slots, so it takes as many pages as the connection has. Return
+ * NULL if it does not fit.
+ */
 ipc_msg_t *ipc_create_msg(ipc_struct_t * icb, u64 data_len, u64 cap_slot_number)
 {
 	ipc_msg_t *ipc_msg;
 	int i;
 
+	if (data_len > ipc_msg_max_data(icb, cap_slot_number))
+		return NULL;
+
 	ipc_msg = (ipc_msg_t *) icb->shared_buf;
 	ipc_msg->data_len = data_len;
 	ipc_msg->cap_slot_number = cap_slot_number;
@@ -22,6 +32,19 @@ ipc_msg_t *ipc_create_msg(ipc_struct_t * icb, u64 data_len, u64 cap_slot_number)
 	return ipc_msg;
 }
 
+/* The largest data of a message with @cap_slot_number caps on @icb */
+u64 ipc_msg_max_data(ipc_struct_t * icb, u64 cap_slot_number)
+{
+	u64 used = sizeof(ipc_msg_t);
+
+	if (cap_slot_number > icb->shared_buf_len / sizeof(u64))
+		return 0;
+	used += cap_slot_number * sizeof(u64);
+	if (used > icb->shared_buf_len)
+		return 0;
+	return icb->shared_buf_len - used;
+}
+
 char *ipc_get_msg_data(ipc_msg_t * ipc_msg)
 {
 	return (char *)ipc_msg + ipc_msg->data_offset;
@@ -62,37 +85,144 @@ int ipc_destroy_msg(ipc_msg_t * ipc_msg)
 	return 0;
 }
 
+/*
+ * The calls of all the clients are served by a pool of worker threads, each
+ * with its own stack, one per CPU if SERVER_WORKERS is 0. A client only
+ * takes a shared buffer in the server, in a slot of SERVER_BUF_SIZE, which
+ * bounds the size the clients may ask for.
+ */
 #define SERVER_STACK_BASE	0x7000000
 #define SERVER_STACK_SIZE	0x1000
-#define SERVER_BUF_BASE		0x7400000
-#define SERVER_BUF_SIZE		0x1000
-#define CLIENT_BUF_BASE		0x7800000
+#define SERVER_WORKERS		0
+#define SERVER_BUF_BASE		0x1000000000
+#define SERVER_BUF_SIZE		0x400000
+#define MAX_CLIENT		1024
+
+/*
+ * The buffers of the connections of a client process are laid out one after
+ * the other from CLIENT_BUF_BASE, each of the size asked for, as the kernel
+ * may only shrink it.
+ */
+#define CLIENT_BUF_BASE		0x2000000000
+#define CLIENT_BUF_END		0x2100000000
 #define CLIENT_BUF_SIZE		0x1000
-#define MAX_CLIENT		16
+
+static server_handler ipc_server_handler;
+static server_reg_handler ipc_server_reg_handler;
+
+static struct mutex client_buf_lock = MUTEX_INITIALIZER;
+static u64 client_buf_next = CLIENT_BUF_BASE;
+
+/*
+ * The header of a message is written by the client, which may change it at
+ * any time. Read each field of @ipc_msg once into @msg, and check that they
+ * describe a message within the @buf_len bytes of the buffer. The offsets
+ * of @msg are rebased on its own address, so that the accessors reach the
+ * data and the cap slots in the shared buffer through it.
+ */
+static bool ipc_msg_copy_checked(ipc_msg_t * ipc_msg, u64 buf_len,
+				 ipc_msg_t * msg)
+{
+	volatile ipc_msg_t *shared = ipc_msg;
+	u64 data_offset = shared->data_offset, data_len = shared->data_len;
+	u64 cap_slots_offset = shared->cap_slots_offset;
+	u64 cap_slot_number = shared->cap_slot_number;
+
+	if (data_offset < sizeof(*ipc_msg) || data_offset > buf_len ||
+	    data_len > buf_len - data_offset)
+		return false;
+	if (cap_slots_offset < sizeof(*ipc_msg) || cap_slots_offset > buf_len ||
+	    cap_slot_number > (buf_len - cap_slots_offset) / sizeof(u64))
+		return false;
+
+	msg->server_conn_cap = shared->server_conn_cap;
+	msg->data_len = data_len;
+	msg->cap_slot_number = cap_slot_number;
+	msg->data_offset = (u64) ipc_msg + data_offset - (u64) msg;
+	msg->cap_slots_offset = (u64) ipc_msg + cap_slots_offset - (u64) msg;
+	return true;
+}
+
+/*
+ * Entered by the workers, with the size of the shared buffer in @buf_len,
+ * or 0 when @ipc_msg is the argument of a register call, whose other words
+ * are in @x2 to @x7. The handler gets the checked copy of the header, which
+ * lives until it returns the call.
+ */
+static void ipc_server_entry(ipc_msg_t * ipc_msg, u64 buf_len, u64 x2,
+			     u64 x3, u64 x4, u64 x5, u64 x6, u64 x7)
+{
+	ipc_msg_t msg;
+
+	if (!buf_len) {
+		if (ipc_server_reg_handler) {
+			u64 regs[IPC_REG_WORDS] = { (u64) ipc_msg, x2, x3,
+				x4, x5, x6, x7
+			};
+
+			ipc_server_reg_handler(regs);
+		} else {
+			ipc_server_handler(ipc_msg);
+		}
+		return;
+	}
+	if (!ipc_msg_copy_checked(ipc_msg, buf_len, &msg))
+		ipc_return(-EINVAL);
+	ipc_server_handler(&msg);
+}
 
 int ipc_register_server(server_handler server_handler)
+{
+	return ipc_register_server_regs(server_handler, NULL);
+}
+
+/* Register calls go to @reg_handler, if any, with all their words */
+int ipc_register_server_regs(server_handler server_handler,
+			     server_reg_handler reg_handler)
 {
 	struct ipc_vm_config vm_config = {
 		.stack_base_addr = SERVER_STACK_BASE,
 		.stack_size = SERVER_STACK_SIZE,
 		.buf_base_addr = SERVER_BUF_BASE,
 		.buf_size = SERVER_BUF_SIZE,
+		.nr_workers = SERVER_WORKERS,
 	};
-	return usys_register_server((u64) server_handler, MAX_CLIENT,
+
+	ipc_server_handler = server_handler;
+	ipc_server_reg_handler = reg_handler;
+	return usys_register_server((u64) ipc_server_entry, MAX_CLIENT,
 				    (u64) & vm_config);
 }
 
-int ipc_register_client(int server_thread_cap, ipc_struct_t * ipc_struct)
+/*
+ * Connect to the server of @server_thread_cap with a shared buffer of up to
+ * @buf_size bytes, rounded up to pages. The server may grant less, which
+ * is left in the shared_buf_len of @ipc_struct. Messages up to that size go
+ * inline, while the larger ones need a PMO of their own.
+ */
+int ipc_register_client_buf(int server_thread_cap, ipc_struct_t * ipc_struct,
+			    u64 buf_size)
 {
 	int conn_cap;
+	struct ipc_vm_config vm_config = { 0 };
 
-	struct ipc_vm_config vm_config = {
-		.buf_base_addr = CLIENT_BUF_BASE,
-		.buf_size = CLIENT_BUF_SIZE,
-	};
+	buf_size = ROUND_UP(buf_size, PAGE_SIZE);
+	if (buf_size == 0)
+		return -1;
 
+	mutex_lock(&client_buf_lock);
+	if (buf_size > CLIENT_BUF_END - client_buf_next) {
+		mutex_unlock(&client_buf_lock);
+		return -1;
+	}
+	vm_config.buf_base_addr = client_buf_next;
+	vm_config.buf_size = buf_size;
 	conn_cap = usys_register_client((u32) server_thread_cap,
 					(u64) & vm_config);
+	/* the address range is taken even if the server granted less */
+	if (conn_cap >= 0)
+		client_buf_next += buf_size;
+	mutex_unlock(&client_buf_lock);
 
 	if (conn_cap < 0)
 		return -1;
@@ -103,18 +233,42 @@ int ipc_register_client(int server_thread_cap, ipc_struct_t * ipc_struct)
 	return 0;
 }
 
+int ipc_register_client(int server_thread_cap, ipc_struct_t * ipc_struct)
+{
+	return ipc_register_client_buf(server_thread_cap, ipc_struct,
+				       CLIENT_BUF_SIZE);
+}
+
+/*
+ * The kernel returns -EBUSY when another thread is calling through the same
+ * connection: wait for its call to return.
+ */
 int ipc_call(ipc_struct_t * icb, ipc_msg_t * ipc_msg)
 {
-	u64 ret = 0;
-	ret = usys_ipc_call(icb->conn_cap, (u64) ipc_msg);
+	int ret;
+
+	while ((ret = usys_ipc_call(icb->conn_cap, (u64) ipc_msg)) == -EBUSY)
+		usys_yield();
 
 	return ret;
 }
 
 int ipc_reg_call(ipc_struct_t * icb, u64 arg)
 {
-	u64 ret = 0;
-	ret = usys_ipc_reg_call(icb->conn_cap, (u64) arg);
+	int ret;
+
+	while ((ret = usys_ipc_reg_call(icb->conn_cap, (u64) arg)) == -EBUSY)
+		usys_yield();
+
+	return ret;
+}
+
+int ipc_reg_call_regs(ipc_struct_t * icb, u64 * regs)
+{
+	int ret;
+
+	while ((ret = usys_ipc_reg_call_regs(icb->conn_cap, regs)) == -EBUSY)
+		usys_yield();
 
 	return ret;
 }
@@ -123,3 +277,165 @@ void ipc_return(int ret)
 {
 	usys_ipc_return((u64) ret);
 }
+
+void ipc_return_regs(int ret, u64 * regs)
+{
+	usys_ipc_return_regs((u64) ret, regs);
+}
+
+/*
+ * The indexes of the rings are published by release stores and read by
+ * acquire loads, which are not reordered with each other: a side which sets
+ * its sleeping flag, then finds its ring empty, cannot miss the other side
+ * publishing an entry then checking the flag.
+ */
+static void ipc_ring_doorbell(volatile u32 * sleeping, u32 notifc_cap)
+{
+	if (atomic_load_32(sleeping) && atomic_xchg_32(sleeping, 0))
+		usys_notify(notifc_cap);
+}
+
+/*
+ * Map a channel to the server of @icb at @vaddr in the current process, and
+ * have the server start a thread serving it. This takes one synchronous
+ * call, which transfers the PMO and the two doorbells.
+ */
+int ipc_ring_create(ipc_struct_t * icb, ipc_ring_t * ring, u64 vaddr)
+{
+	struct fs_request req;
+	ipc_msg_t *ipc_msg;
+	int pmo_cap, ret;
+
+	pmo_cap = usys_create_pmo(IPC_RING_SIZE, PMO_DATA);
+	if (pmo_cap < 0)
+		return pmo_cap;
+	ret = usys_map_pmo(SELF_CAP, pmo_cap, vaddr, VM_READ | VM_WRITE);
+	if (ret < 0)
+		return ret;
+	ring->sq_notifc_cap = usys_create_notifc();
+	ring->cq_notifc_cap = usys_create_notifc();
+	if ((int)ring->sq_notifc_cap < 0 || (int)ring->cq_notifc_cap < 0)
+		return -ENOMEM;
+
+	ring->shared = (struct ipc_ring_shared *)vaddr;
+	ring->data = (char *)vaddr + IPC_RING_DATA_OFFSET;
+	ring->sq_tail = ring->sq_submitted = ring->cq_head = 0;
+	memset(ring->shared, 0, sizeof(*ring->shared));
+
+	memset(&req, 0, sizeof(req));
+	req.req = FS_REQ_RING_SETUP;
+	ipc_msg = ipc_create_msg(icb, sizeof(req), 3);
+	ipc_set_msg_data(ipc_msg, (char *)&req, 0, sizeof(req));
+	ipc_set_msg_cap(ipc_msg, 0, pmo_cap);
+	ipc_set_msg_cap(ipc_msg, 1, ring->sq_notifc_cap);
+	ipc_set_msg_cap(ipc_msg, 2, ring->cq_notifc_cap);
+	ret = ipc_call(icb, ipc_msg);
+	ipc_destroy_msg(ipc_msg);
+	return ret;
+}
+
+/*
+ * Queue a request, which the caller fills in, to be sent by the next
+ * ipc_ring_submit. Its result is tagged with @user_data. Return NULL when
+ * IPC_RING_ENTRIES requests are not reaped yet.
+ */
+struct fs_request *ipc_ring_get_sqe(ipc_ring_t * ring, u64 user_data)
+{
+	struct ipc_sqe *sqe;
+
+	if (ring->sq_tail - ring->cq_head >= IPC_RING_ENTRIES)
+		return NULL;
+	sqe = &ring->shared->sqes[ring->sq_tail & IPC_RING_MASK];
+	sqe->user_data = user_data;
+	ring->sq_tail++;
+	return &sqe->req;
+}
+
+/* Send the queued requests, and return their number */
+int ipc_ring_submit(ipc_ring_t * ring)
+{
+	int nr = ring->sq_tail - ring->sq_submitted;
+
+	if (nr == 0)
+		return 0;
+	atomic_store_32(&ring->shared->sq_tail, ring->sq_tail);
+	ring->sq_submitted = ring->sq_tail;
+	ipc_ring_doorbell(&ring->shared->server_sleeping,
+			  ring->sq_notifc_cap);
+	return nr;
+}
+
+/*
+ * Copy the results of at most @max requests to @cqes, and return their
+ * number. If there is none and @wait, block until one arrives, unless no
+ * request is outstanding.
+ */
+int ipc_ring_reap(ipc_ring_t * ring, struct ipc_cqe *cqes, int max,
+		  bool wait)
+{
+	struct ipc_ring_shared *shared = ring->shared;
+	u32 tail;
+	int nr = 0;
+
+	while (1) {
+		tail = atomic_load_32(&shared->cq_tail);
+		if (tail != ring->cq_head || !wait
+		    || ring->sq_submitted == ring->cq_head)
+			break;
+		atomic_xchg_32(&shared->client_sleeping, 1);
+		if (atomic_load_32(&shared->cq_tail) == ring->cq_head)
+			usys_wait(ring->cq_notifc_cap, true, 0);
+		atomic_store_32(&shared->client_sleeping, 0);
+	}
+
+	while (nr < max && ring->cq_head != tail) {
+		cqes[nr++] = shared->cqes[ring->cq_head & IPC_RING_MASK];
+		ring->cq_head++;
+	}
+	return nr;
+}
+
+/* Stop the thread serving the channel, once it served what was submitted */
+void ipc_ring_destroy(ipc_ring_t * ring)
+{
+	atomic_store_32(&ring->shared->closed, 1);
+	ipc_ring_doorbell(&ring->shared->server_sleeping,
+			  ring->sq_notifc_cap);
+}
+
+/*
+ * Run by a thread of the server: serve the requests of a channel in order,
+ * until the client closes it.
+ */
+void ipc_ring_serve(struct ipc_ring_shared *shared, u32 sq_notifc_cap,
+		    u32 cq_notifc_cap, ipc_ring_handler handler)
+{
+	char *data = (char *)shared + IPC_RING_DATA_OFFSET;
+	struct ipc_sqe *sqe;
+	struct ipc_cqe *cqe;
+	u32 head = 0, tail;
+
+	while (1) {
+		tail = atomic_load_32(&shared->sq_tail);
+		if (tail == head) {
+			if (atomic_load_32(&shared->closed))
+				return;
+			atomic_xchg_32(&shared->server_sleeping, 1);
+			if (atomic_load_32(&shared->sq_tail) == head
+			    && !atomic_load_32(&shared->closed))
+				usys_wait(sq_notifc_cap, true, 0);
+			atomic_store_32(&shared->server_sleeping, 0);
+			continue;
+		}
+
+		for (; head != tail; head++) {
+			sqe = &shared->sqes[head & IPC_RING_MASK];
+			cqe = &shared->cqes[head & IPC_RING_MASK];
+			cqe->user_data = sqe->user_data;
+			cqe->ret = handler(&sqe->req, data);
+			atomic_store_32(&shared->cq_tail, head + 1);
+			ipc_ring_doorbell(&shared->client_sleeping,
+					  cq_notifc_cap);
+		}
+	}
+}
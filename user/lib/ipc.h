@@ -1,6 +1,8 @@
 #pragma once
 
+#include <lib/fs_defs.h>
 #include <lib/type.h>
+
 typedef struct ipc_struct {
 	u64 conn_cap;
 	u64 shared_buf;
@@ -20,11 +22,16 @@ struct ipc_vm_config {
 	u64 stack_size;
 	u64 buf_base_addr;
 	u64 buf_size;
+	/* server only: the number of worker threads, one per CPU if 0 */
+	u64 nr_workers;
 };
 
 int ipc_register_client(int server_thread_cap, ipc_struct_t * ipc_struct);
+int ipc_register_client_buf(int server_thread_cap, ipc_struct_t * ipc_struct,
+			    u64 buf_size);
 ipc_msg_t *ipc_create_msg(ipc_struct_t * icb, u64 data_len,
 			  u64 cap_slot_number);
+u64 ipc_msg_max_data(ipc_struct_t * icb, u64 cap_slot_number);
 char *ipc_get_msg_data(ipc_msg_t * ipc_msg);
 u64 ipc_get_msg_cap(ipc_msg_t * ipc_msg, u64 cap_id);
 int ipc_set_msg_data(ipc_msg_t * ipc_msg, char *data, u64 offset, u64 len);
@@ -35,7 +42,90 @@ int ipc_call(ipc_struct_t * icb, ipc_msg_t * ipc_msg);
 int ipc_reg_call(ipc_struct_t * icb, u64 arg);
 void ipc_return(int ret);
 
+/*
+ * A register call with a message of IPC_REG_WORDS words in @regs, which
+ * get the reply of the server after its return value.
+ */
+int ipc_reg_call_regs(ipc_struct_t * icb, u64 * regs);
+void ipc_return_regs(int ret, u64 * regs);
+
+/*
+ * Called with a server-local copy of the message header, whose data and cap
+ * slots are checked to lie within the shared buffer, or with the argument
+ * of ipc_reg_call.
+ */
 typedef void (*server_handler) (ipc_msg_t * ipc_msg);
+/* Called with the IPC_REG_WORDS words of a register call */
+typedef void (*server_reg_handler) (u64 * regs);
 int ipc_register_server(server_handler server_handler);
+int ipc_register_server_regs(server_handler server_handler,
+			     server_reg_handler reg_handler);
+
+/*
+ * Asynchronous channel to a file system server. The client queues requests
+ * on a submission ring and reaps their results from a completion ring, both
+ * in a PMO shared with a thread of the server, so a batch of requests takes
+ * at most one kernel crossing each way. A side finding its ring empty sets
+ * its sleeping flag and waits on its doorbell, a notification which the
+ * other side only signals when it finds the flag set. A ring is used by one
+ * client thread.
+ */
+#define IPC_RING_ENTRIES	64
+#define IPC_RING_MASK		(IPC_RING_ENTRIES - 1)
+#define IPC_RING_SIZE		0x10000
+/* The buffers of SCAN, READ and WRITE, given by their offset in buff */
+#define IPC_RING_DATA_OFFSET	0x8000
+#define IPC_RING_DATA_SIZE	(IPC_RING_SIZE - IPC_RING_DATA_OFFSET)
+
+struct ipc_sqe {
+	u64 user_data;
+	struct fs_request req;
+};
+
+struct ipc_cqe {
+	u64 user_data;
+	s64 ret;
+};
+
+/* The header of the shared PMO, by the side writing each cache line */
+struct ipc_ring_shared {
+	/* client */
+	volatile u32 sq_tail;
+	volatile u32 closed;
+	/* set by the client, cleared by the server to ring its doorbell */
+	volatile u32 client_sleeping;
+	u32 pad0[13];
+	/* server */
+	volatile u32 cq_tail;
+	volatile u32 server_sleeping;
+	u32 pad1[14];
+	struct ipc_sqe sqes[IPC_RING_ENTRIES];
+	struct ipc_cqe cqes[IPC_RING_ENTRIES];
+};
+
+/* The client side of a channel */
+typedef struct ipc_ring {
+	struct ipc_ring_shared *shared;
+	char *data;
+	/* the doorbells of the server and of the client */
+	u32 sq_notifc_cap;
+	u32 cq_notifc_cap;
+	/* the requests up to sq_tail are queued, up to sq_submitted sent */
+	u32 sq_tail;
+	u32 sq_submitted;
+	u32 cq_head;
+} ipc_ring_t;
+
+int ipc_ring_create(ipc_struct_t * icb, ipc_ring_t * ring, u64 vaddr);
+struct fs_request *ipc_ring_get_sqe(ipc_ring_t * ring, u64 user_data);
+int ipc_ring_submit(ipc_ring_t * ring);
+int ipc_ring_reap(ipc_ring_t * ring, struct ipc_cqe *cqes, int max,
+		  bool wait);
+void ipc_ring_destroy(ipc_ring_t * ring);
+
+/* Serve the request @req of a channel, with its buffer in @data */
+typedef s64(*ipc_ring_handler) (struct fs_request * req, char *data);
+void ipc_ring_serve(struct ipc_ring_shared *shared, u32 sq_notifc_cap,
+		    u32 cq_notifc_cap, ipc_ring_handler handler);
 
 #define INFO_PAGE_VADDR ((void *)0x100000ll)
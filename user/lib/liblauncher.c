@@ -110,29 +110,51 @@ int readelf_from_kernel_cpio(const char *filename, struct user_elf *user_elf)
 }
 
 ipc_struct_t *tmpfs_ipc_struct;
-static int fs_read(const char *path, int *tmpfs_read_pmo_cap)
+
+/*
+ * Read the file at @path. One which fits in the shared buffer is read
+ * inline, and @buf set to its content in the message, which stays valid
+ * until the next call. A larger one is read into a new PMO in
+ * @tmpfs_read_pmo_cap, with @buf left NULL.
+ */
+static int fs_read(const char *path, int *tmpfs_read_pmo_cap, char **buf)
 {
 	ipc_msg_t *ipc_msg;
 	int ret;
 	struct fs_request fr;
+	u64 inline_max = ipc_msg_max_data(tmpfs_ipc_struct, 0);
 
-	/* IPC send cap */
 	ipc_msg = ipc_create_msg(tmpfs_ipc_struct,
-				 sizeof(struct fs_request), 1);
+				 sizeof(struct fs_request), 0);
 	fr.req = FS_REQ_GET_SIZE;
 	strcpy((void *)fr.path, path);
 	ipc_set_msg_data(ipc_msg, (char *)&fr, 0, sizeof(struct fs_request));
 	ret = ipc_call(tmpfs_ipc_struct, ipc_msg);
-
-	*tmpfs_read_pmo_cap = usys_create_pmo(ret, PMO_DATA);
+	ipc_destroy_msg(ipc_msg);
+	if (ret < 0)
+		return ret;
 
 	fr.req = FS_REQ_READ;
 	strcpy((void *)fr.path, path);
 	fr.offset = 0;
-	fr.buff = (char *)TMPFS_READ_BUF_VADDR;
 	fr.count = ret;
-	fr.req = FS_REQ_READ;
-	ipc_set_msg_cap(ipc_msg, 0, *tmpfs_read_pmo_cap);
+	*buf = NULL;
+	if (inline_max >= sizeof(struct fs_request) &&
+	    ret <= inline_max - sizeof(struct fs_request)) {
+		ipc_msg = ipc_create_msg(tmpfs_ipc_struct,
+					 sizeof(struct fs_request) + ret, 0);
+		fr.buff = NULL;
+		fr.grant = FS_GRANT_NONE;
+		*buf = ipc_get_msg_data(ipc_msg) + sizeof(struct fs_request);
+	} else {
+		*tmpfs_read_pmo_cap = usys_create_pmo(ret, PMO_DATA);
+		if (*tmpfs_read_pmo_cap < 0)
+			return *tmpfs_read_pmo_cap;
+		ipc_msg = ipc_create_msg(tmpfs_ipc_struct,
+					 sizeof(struct fs_request), 1);
+		fr.buff = (char *)TMPFS_READ_BUF_VADDR;
+		ipc_set_msg_cap(ipc_msg, 0, *tmpfs_read_pmo_cap);
+	}
 	ipc_set_msg_data(ipc_msg, (char *)&fr, 0, sizeof(struct fs_request));
 	ret = ipc_call(tmpfs_ipc_struct, ipc_msg);
 
@@ -144,18 +166,22 @@ int readelf_from_fs(const char *pathbuf, struct user_elf *user_elf)
 {
 	int ret;
 	int tmpfs_read_pmo_cap;
+	char *buf;
 
-	ret = fs_read(pathbuf, &tmpfs_read_pmo_cap);
+	ret = fs_read(pathbuf, &tmpfs_read_pmo_cap, &buf);
 	if (ret < 0) {
 		return ret;
 	}
 
+	strcpy(user_elf->path, pathbuf);
+	if (buf)
+		return parse_elf_from_binary(buf, user_elf);
+
 	ret = usys_map_pmo(SELF_CAP,
 			   tmpfs_read_pmo_cap,
 			   TMPFS_READ_BUF_VADDR, VM_READ | VM_WRITE);
 	BUG_ON(ret < 0);
 
-	strcpy(user_elf->path, pathbuf);
 	ret = parse_elf_from_binary((const char *)TMPFS_READ_BUF_VADDR,
 				    user_elf);
 
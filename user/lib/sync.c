@@ -0,0 +1,127 @@
+#include <lib/errno.h>
+#include <lib/sync.h>
+#include <lib/syscall.h>
+
+/* Wake up every waiter of a futex */
+#define FUTEX_WAKE_ALL	((u32)-1)
+
+void mutex_init(struct mutex *mutex)
+{
+	atomic_store_32(&mutex->state, 0);
+}
+
+/*
+ * Once the lock has been contended, it is taken in state 2 so that the
+ * unlock wakes up the other waiters, which went to sleep before.
+ */
+static void mutex_lock_contended(struct mutex *mutex, u32 state)
+{
+	if (state != 2)
+		state = atomic_xchg_32(&mutex->state, 2);
+	while (state != 0) {
+		usys_futex_wait((u32 *)&mutex->state, 2, 0);
+		state = atomic_xchg_32(&mutex->state, 2);
+	}
+}
+
+void mutex_lock(struct mutex *mutex)
+{
+	u32 state = atomic_cmpxchg_32(&mutex->state, 0, 1);
+
+	if (state != 0)
+		mutex_lock_contended(mutex, state);
+}
+
+bool mutex_trylock(struct mutex *mutex)
+{
+	return atomic_cmpxchg_32(&mutex->state, 0, 1) == 0;
+}
+
+void mutex_unlock(struct mutex *mutex)
+{
+	/* only enter the kernel if someone may be waiting */
+	if (atomic_fetch_sub_32(&mutex->state, 1) != 1) {
+		atomic_store_32(&mutex->state, 0);
+		usys_futex_wake((u32 *)&mutex->state, 1);
+	}
+}
+
+void cond_init(struct cond *cond)
+{
+	atomic_store_32(&cond->seq, 0);
+	atomic_store_32(&cond->waiters, 0);
+}
+
+/*
+ * The futex wait fails at once if a signal bumped seq since it was read,
+ * so a signal sent between the unlock and the wait is not lost. Waiters may
+ * wake up spuriously and must check their condition again.
+ */
+int cond_timedwait(struct cond *cond, struct mutex *mutex, u64 timeout_us)
+{
+	u32 seq = atomic_load_32(&cond->seq);
+	int ret;
+
+	atomic_fetch_add_32(&cond->waiters, 1);
+	mutex_unlock(mutex);
+	ret = usys_futex_wait((u32 *)&cond->seq, seq, timeout_us);
+	atomic_fetch_sub_32(&cond->waiters, 1);
+	/* other threads may have been woken up and wait for the mutex */
+	mutex_lock_contended(mutex, 1);
+	return ret == -ETIME ? ret : 0;
+}
+
+void cond_wait(struct cond *cond, struct mutex *mutex)
+{
+	cond_timedwait(cond, mutex, 0);
+}
+
+void cond_signal(struct cond *cond)
+{
+	atomic_fetch_add_32(&cond->seq, 1);
+	if (atomic_load_32(&cond->waiters))
+		usys_futex_wake((u32 *)&cond->seq, 1);
+}
+
+void cond_broadcast(struct cond *cond)
+{
+	atomic_fetch_add_32(&cond->seq, 1);
+	if (atomic_load_32(&cond->waiters))
+		usys_futex_wake((u32 *)&cond->seq, FUTEX_WAKE_ALL);
+}
+
+void sem_init(struct semaphore *sem, u32 count)
+{
+	atomic_store_32(&sem->count, count);
+	atomic_store_32(&sem->waiters, 0);
+}
+
+bool sem_trywait(struct semaphore *sem)
+{
+	u32 count = atomic_load_32(&sem->count);
+
+	while (count > 0) {
+		u32 old = atomic_cmpxchg_32(&sem->count, count, count - 1);
+		if (old == count)
+			return true;
+		count = old;
+	}
+	return false;
+}
+
+/* A waiter only sleeps while count is 0, which the kernel checks again */
+void sem_wait(struct semaphore *sem)
+{
+	while (!sem_trywait(sem)) {
+		atomic_fetch_add_32(&sem->waiters, 1);
+		usys_futex_wait((u32 *)&sem->count, 0, 0);
+		atomic_fetch_sub_32(&sem->waiters, 1);
+	}
+}
+
+void sem_post(struct semaphore *sem)
+{
+	atomic_fetch_add_32(&sem->count, 1);
+	if (atomic_load_32(&sem->waiters))
+		usys_futex_wake((u32 *)&sem->count, 1);
+}
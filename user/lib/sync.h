@@ -0,0 +1,105 @@
+#pragma once
+
+#include <lib/type.h>
+
+/*
+ * Synchronization primitives built on futexes. The uncontended paths are
+ * a single atomic instruction sequence and never enter the kernel.
+ */
+
+/* The atomics below are full barriers */
+static inline u32 atomic_cmpxchg_32(volatile u32 * ptr, u32 compare,
+				    u32 exchange)
+{
+	u32 oldval, ret;
+
+	asm volatile ("1: ldaxr   %w0, %2\n"
+		      "   cmp     %w0, %w3\n"
+		      "   b.ne    2f\n"
+		      "   stlxr   %w1, %w4, %2\n"
+		      "   cbnz    %w1, 1b\n"
+		      "2: dmb     ish\n"
+		      :"=&r" (oldval), "=&r"(ret), "+Q"(*ptr)
+		      :"r"(compare), "r"(exchange)
+		      :"cc", "memory");
+	return oldval;
+}
+
+static inline u32 atomic_xchg_32(volatile u32 * ptr, u32 exchange)
+{
+	u32 oldval, ret;
+
+	asm volatile ("1: ldaxr   %w0, %2\n"
+		      "   stlxr   %w1, %w3, %2\n"
+		      "   cbnz    %w1, 1b\n"
+		      "   dmb     ish\n"
+		      :"=&r" (oldval), "=&r"(ret), "+Q"(*ptr)
+		      :"r"(exchange)
+		      :"memory");
+	return oldval;
+}
+
+static inline u32 atomic_fetch_add_32(volatile u32 * ptr, u32 val)
+{
+	u32 oldval, newval, ret;
+
+	asm volatile ("1: ldaxr   %w0, %3\n"
+		      "   add     %w1, %w0, %w4\n"
+		      "   stlxr   %w2, %w1, %3\n"
+		      "   cbnz    %w2, 1b\n"
+		      "   dmb     ish\n"
+		      :"=&r" (oldval), "=&r"(newval), "=&r"(ret), "+Q"(*ptr)
+		      :"r"(val)
+		      :"memory");
+	return oldval;
+}
+
+#define atomic_fetch_sub_32(ptr, val) atomic_fetch_add_32(ptr, -(u32)(val))
+
+static inline u32 atomic_load_32(volatile u32 * ptr)
+{
+	u32 val;
+
+	asm volatile ("ldar %w0, %1":"=r" (val):"Q"(*ptr):"memory");
+	return val;
+}
+
+static inline void atomic_store_32(volatile u32 * ptr, u32 val)
+{
+	asm volatile ("stlr %w1, %0":"=Q" (*ptr):"r"(val):"memory");
+}
+
+/* 0: unlocked, 1: locked, 2: locked and there may be waiters */
+struct mutex {
+	volatile u32 state;
+};
+
+/* Bumped by every signal, so that a waiter never misses one */
+struct cond {
+	volatile u32 seq;
+	volatile u32 waiters;
+};
+
+struct semaphore {
+	volatile u32 count;
+	volatile u32 waiters;
+};
+
+#define MUTEX_INITIALIZER	{ 0 }
+#define COND_INITIALIZER	{ 0, 0 }
+
+void mutex_init(struct mutex *mutex);
+void mutex_lock(struct mutex *mutex);
+bool mutex_trylock(struct mutex *mutex);
+void mutex_unlock(struct mutex *mutex);
+
+void cond_init(struct cond *cond);
+void cond_wait(struct cond *cond, struct mutex *mutex);
+int cond_timedwait(struct cond *cond, struct mutex *mutex, u64 timeout_us);
+void cond_signal(struct cond *cond);
+void cond_broadcast(struct cond *cond);
+
+void sem_init(struct semaphore *sem, u32 count);
+void sem_wait(struct semaphore *sem);
+bool sem_trywait(struct semaphore *sem);
+void sem_post(struct semaphore *sem);
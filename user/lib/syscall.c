@@ -64,6 +64,25 @@ u64 usys_yield(void) {
     return syscall(SYS_yield, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 }
 
+/* Block the calling thread for at least ns nanoseconds */
+int usys_nanosleep(u64 ns) {
+    return syscall(SYS_sleep, ns, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Block on the futex at uaddr while it holds val, for at most timeout_us
+ * microseconds (0 waits forever)
+ */
+int usys_futex_wait(u32 *uaddr, u32 val, u64 timeout_us) {
+    return syscall(SYS_futex_wait, (u64)uaddr, val, timeout_us, 0, 0, 0, 0, 0,
+                   0);
+}
+
+/* Wake up at most nr threads blocked on the futex at uaddr */
+int usys_futex_wake(u32 *uaddr, u32 nr) {
+    return syscall(SYS_futex_wake, (u64)uaddr, nr, 0, 0, 0, 0, 0, 0, 0);
+}
+
 int usys_create_device_pmo(u64 paddr, u64 size) {
     return syscall(SYS_create_device_pmo, paddr, size, 0, 0, 0, 0, 0, 0, 0);
 }
@@ -121,6 +140,83 @@ void usys_ipc_return(u64 ret) {
     syscall(SYS_ipc_return, ret, 0, 0, 0, 0, 0, 0, 0, 0);
 }
 
+/*
+ * Register IPC with a message of IPC_REG_WORDS words: @regs goes in x1-x7
+ * and the reply comes back in x0 and @regs, which syscall() cannot return.
+ */
+static u64 ipc_reg_syscall(u64 sys_no, u64 x0_val, u64 *regs) {
+    register u64 x0 asm("x0") = x0_val;
+    register u64 x1 asm("x1") = regs[0];
+    register u64 x2 asm("x2") = regs[1];
+    register u64 x3 asm("x3") = regs[2];
+    register u64 x4 asm("x4") = regs[3];
+    register u64 x5 asm("x5") = regs[4];
+    register u64 x6 asm("x6") = regs[5];
+    register u64 x7 asm("x7") = regs[6];
+    register u64 x8 asm("x8") = sys_no;
+
+    asm volatile("svc #0\n\t"
+                 : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3), "+r"(x4), "+r"(x5),
+                   "+r"(x6), "+r"(x7)
+                 : "r"(x8)
+                 : "memory");
+    regs[0] = x1;
+    regs[1] = x2;
+    regs[2] = x3;
+    regs[3] = x4;
+    regs[4] = x5;
+    regs[5] = x6;
+    regs[6] = x7;
+    return x0;
+}
+
+u64 usys_ipc_reg_call_regs(u32 conn_cap, u64 *regs) {
+    return ipc_reg_syscall(SYS_ipc_reg_call, conn_cap, regs);
+}
+
+u64 usys_ipc_reg_call_slow(u32 conn_cap, u64 *regs) {
+    return ipc_reg_syscall(SYS_ipc_reg_call_slow, conn_cap, regs);
+}
+
+void usys_ipc_return_regs(u64 ret, u64 *regs) {
+    ipc_reg_syscall(SYS_ipc_return, ret, regs);
+}
+
+int usys_create_notifc(void) {
+    return syscall(SYS_create_notifc, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Consume a signal of the notification, blocking for at most timeout_us
+ * microseconds (0 waits forever) if is_block
+ */
+int usys_wait(u32 notifc_cap, bool is_block, u64 timeout_us) {
+    return syscall(SYS_wait, notifc_cap, is_block, timeout_us, 0, 0, 0, 0, 0,
+                   0);
+}
+
+int usys_notify(u32 notifc_cap) {
+    return syscall(SYS_notify, notifc_cap, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Create a scheduling context reserving budget_us of CPU time every
+ * period_us, scheduled by earliest deadline before the other threads
+ */
+int usys_create_sched_cont(u64 budget_us, u64 period_us) {
+    return syscall(SYS_create_sched_cont, budget_us, period_us, 0, 0, 0, 0, 0,
+                   0, 0);
+}
+
+/*
+ * Bind the thread (-1 for the current one) to the scheduling context. The
+ * servers it calls run on its reservation.
+ */
+int usys_bind_sched_cont(u64 thread_cap, u32 sc_cap) {
+    return syscall(SYS_bind_sched_cont, thread_cap, sc_cap, 0, 0, 0, 0, 0, 0,
+                   0);
+}
+
 int usys_debug(void) {
     return syscall(SYS_debug, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 }
@@ -135,6 +231,10 @@ int usys_cap_copy_from(u64 src_process_cap, u64 src_slot_id) {
                    0, 0, 0);
 }
 
+int usys_cap_free(u64 slot_id) {
+    return syscall(SYS_cap_free, slot_id, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
 int usys_fs_load_cpio(u64 vaddr) {
     return syscall(SYS_fs_load_cpio, vaddr, 0, 0, 0, 0, 0, 0, 0, 0);
 }
@@ -163,3 +263,21 @@ int usys_transfer_caps(u64 process, int *src_caps, int nr, int *dst_caps) {
 void usys_top(void) {
     syscall(SYS_top, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 }
+
+/*
+ * Fill the len bytes at info with the scheduling statistics of the CPUs
+ * and of as many threads as fit. Return the number of threads.
+ */
+int usys_get_sched_info(struct sched_info *info, u64 len) {
+    return syscall(SYS_get_sched_info, (u64)info, len, 0, 0, 0, 0, 0, 0, 0);
+}
+
+/*
+ * Fill the len bytes at info with the statistics of the most contended lock
+ * classes. Return the number of classes, or -ENOSYS if the kernel is built
+ * without LOCKSTAT.
+ */
+int usys_get_lock_stat(struct lock_stat_info *info, u64 len, u64 flags) {
+    return syscall(SYS_get_lock_stat, (u64)info, len, flags, 0, 0, 0, 0, 0,
+                   0);
+}
@@ -22,10 +22,22 @@
 #define SYS_set_affinity                        18
 #define SYS_get_affinity                        19
 #define SYS_create_device_pmo			20
+#define SYS_futex_wait				21
+#define SYS_futex_wake				22
+#define SYS_create_notifc			23
+#define SYS_wait				24
+#define SYS_notify				25
+#define SYS_create_sched_cont			26
+#define SYS_bind_sched_cont			27
+#define SYS_get_sched_info			28
+#define SYS_get_lock_stat			29
+#define SYS_cap_free				30
 
 /* Lab4 specfic */
 #define SYS_get_cpu_id                          50
 #define SYS_ipc_reg_call                        51
+/* ipc_reg_call through the generic syscall path, for comparisons */
+#define SYS_ipc_reg_call_slow                   52
 
 #define SYS_create_pmos                         101
 #define SYS_map_pmos                            102
@@ -39,6 +51,70 @@
 #define SYS_fs_load_cpio			253
 #define SYS_debug			        255
 
+/* Scheduling statistics, as in kernel/sched/sched.h */
+#define SCHED_INFO_CPU_NUM	4
+/* Buckets of the run-queue length histograms: 0, 1, 2, 3, 4-7, 8-15, 16+ */
+#define RQ_HIST_NUM		7
+
+/* Thread types and states, in the order of the kernel */
+enum { THREAD_IDLE = 0, THREAD_ROOT, THREAD_USER, THREAD_SHADOW,
+	THREAD_KERNEL, THREAD_TESTS };
+enum { THREAD_INIT = 0, THREAD_READY, THREAD_INTER, THREAD_RUNNING,
+	THREAD_EXIT, THREAD_WAITING, THREAD_EXITING };
+
+/* Times are in microseconds */
+struct cpu_sched_info {
+	u64 idle_time;
+	u64 nr_switches;
+	u64 rq_hist[RQ_HIST_NUM];
+};
+
+struct thread_sched_info {
+	u32 tid;
+	u32 type;
+	u32 state;
+	u32 prio;
+	s32 affinity;
+	s32 last_cpu;
+	u64 runtime;
+	u64 wait_time;
+	u64 nr_voluntary;
+	u64 nr_involuntary;
+	u64 nr_migrations;
+};
+
+struct sched_info {
+	u64 uptime;
+	u32 nr_cpus;
+	/* number of threads, which may be more than the ones returned */
+	u32 nr_threads;
+	struct cpu_sched_info cpus[SCHED_INFO_CPU_NUM];
+	struct thread_sched_info threads[];
+};
+
+/* Lock contention statistics, as in kernel/common/lockstat.h */
+#define LOCKSTAT_NAME_LEN	48
+#define LOCKSTAT_RESET		(1 << 0)
+
+/* Times are in counts of the generic timer */
+struct lock_class_info {
+	char name[LOCKSTAT_NAME_LEN];
+	u64 nr_acquired;
+	u64 nr_contended;
+	u64 wait_time;
+	u64 max_wait;
+	u64 hold_time;
+	u64 max_hold;
+};
+
+struct lock_stat_info {
+	u64 freq;
+	/* number of classes, which may be more than the ones returned */
+	u32 nr_classes;
+	u32 pad;
+	struct lock_class_info classes[];
+};
+
 int usys_fs_load_cpio(u64 vaddr);
 /* TEMP END */
 
@@ -51,6 +127,9 @@ u64 usys_handle_brk(u64 addr);
 
 u32 usys_getc(void);
 u64 usys_yield(void);
+int usys_nanosleep(u64 ns);
+int usys_futex_wait(u32 *uaddr, u32 val, u64 timeout_us);
+int usys_futex_wake(u32 *uaddr, u32 nr);
 int usys_create_device_pmo(u64 paddr, u64 size);
 int usys_create_thread(u64 process_cap, u64 stack, u64 pc, u64 arg, u32 prio,
 		       s32 cpuid);
@@ -60,9 +139,20 @@ u32 usys_register_client(u32 server_cap, u64 vm_config_ptr);
 u64 usys_ipc_call(u32 conn_cap, u64 arg0);
 u64 usys_ipc_reg_call(u32 conn_cap, u64 arg0);
 void usys_ipc_return(u64 ret);
+/* The words of a register call, in x1-x7 */
+#define IPC_REG_WORDS 7
+u64 usys_ipc_reg_call_regs(u32 conn_cap, u64 *regs);
+u64 usys_ipc_reg_call_slow(u32 conn_cap, u64 *regs);
+void usys_ipc_return_regs(u64 ret, u64 *regs);
+int usys_create_notifc(void);
+int usys_wait(u32 notifc_cap, bool is_block, u64 timeout_us);
+int usys_notify(u32 notifc_cap);
+int usys_create_sched_cont(u64 budget_us, u64 period_us);
+int usys_bind_sched_cont(u64 thread_cap, u32 sc_cap);
 int usys_debug(void);
 int usys_cap_copy_to(u64 dest_process_cap, u64 src_slot_id);
 int usys_cap_copy_from(u64 src_process_cap, u64 src_slot_id);
+int usys_cap_free(u64 slot_id);
 int usys_unmap_pmo(u64 process_cap, u64 pmo_cap, u64 addr);
 int usys_set_affinity(u64 thread_cap, s32 aff);
 s32 usys_get_affinity(u64 thread_cap);
@@ -75,3 +165,5 @@ int usys_read_pmo(u64 cap, u64 offset, void *buf, u64 size);
 int usys_transfer_caps(u64, int *, int, int *);
 
 void usys_top(void);
+int usys_get_sched_info(struct sched_info *info, u64 len);
+int usys_get_lock_stat(struct lock_stat_info *info, u64 len, u64 flags);